@@ -1,50 +1,305 @@
 #include "buffer/buffer_manager.h"
 
-
-/*
-This is only a dummy implementation of a buffer manager. It does not do any
-disk I/O or locking. It also does not respect the page_count and creates a new
-buffer for every fixed page and does so without using any latches so it is not
-thread-safe.
-*/
+#include <algorithm>
+#include <cstring>
+#include <utility>
 
 
 namespace buzzdb {
 
 char* BufferFrame::get_data() {
-    return data.data();
+    return data;
+}
+
+
+BufferManager::BufferManager(size_t page_size, size_t page_count)
+    : BufferManager(page_size, page_count, [](uint16_t /*segment_id*/) {
+          return File::make_temporary_file();
+      }) {
+}
+
+
+BufferManager::BufferManager(size_t page_size, size_t page_count,
+                             SegmentFileOpener open_segment_file)
+    : page_size(page_size),
+      page_count(page_count),
+      open_segment_file(std::move(open_segment_file)),
+      // The pool is not initialized, so that frames only take up memory
+      // once they are used.
+      pool(new char[page_size * page_count]),
+      frames(std::make_unique<BufferFrame[]>(page_count)) {
+    free_frames.reserve(page_count);
+    for (size_t i = page_count; i-- > 0;) {
+        frames[i].data = &pool[i * page_size];
+        free_frames.push_back(&frames[i]);
+    }
+    page_table.reserve(page_count);
+    prefetcher = std::thread([this] { run_prefetcher(); });
 }
 
 
-BufferManager::BufferManager(size_t page_size, size_t /*page_count*/) : page_size(page_size) {
+BufferManager::~BufferManager() {
+    {
+        std::unique_lock<std::mutex> guard(latch);
+        stop_prefetcher = true;
+    }
+    prefetch_queued.notify_one();
+    prefetcher.join();
+    for (auto [page_id, frame] : page_table) {
+        if (frame->is_dirty) {
+            write_page(get_segment_file(get_segment_id(page_id)), page_id,
+                       frame->data);
+        }
+    }
 }
 
 
-BufferManager::~BufferManager() = default;
+BufferFrame& BufferManager::fix_page(uint64_t page_id, bool exclusive) {
+    fix_count.fetch_add(1, std::memory_order_relaxed);
+    std::unique_lock<std::mutex> guard(latch);
+    // A page that is being written back must not be read from the file yet.
+    write_back_done.wait(guard,
+                         [&] { return evicted_pages.count(page_id) == 0; });
+    auto it = page_table.find(page_id);
+    if (it != page_table.end()) {
+        auto& frame = *it->second;
+        ++frame.fix_count;
+        frame.is_prefetched = false;
+        // A second fix promotes the page from the FIFO list to the LRU list,
+        // later fixes make it the most recently used page.
+        auto& list = frame.queue == BufferFrame::Queue::FIFO ? fifo : lru;
+        lru.splice(lru.end(), list, frame.position);
+        frame.queue = BufferFrame::Queue::LRU;
+        guard.unlock();
+        if (exclusive) {
+            frame.latch.lock();
+            frame.exclusive = true;
+        } else {
+            frame.latch.lock_shared();
+        }
+        return frame;
+    }
+
+    auto& frame = get_free_frame();
+    uint64_t evicted_page_id = frame.page_id;
+    SegmentFile* evicted_file = nullptr;
+    if (frame.is_dirty) {
+        evicted_pages.insert(evicted_page_id);
+        evicted_file = &get_segment_file(get_segment_id(evicted_page_id));
+    }
+    frame.page_id = page_id;
+    frame.fix_count = 1;
+    frame.is_dirty = false;
+    frame.is_prefetched = false;
+    frame.queue = BufferFrame::Queue::FIFO;
+    frame.position = fifo.insert(fifo.end(), &frame);
+    page_table.emplace(page_id, &frame);
+    auto& segment_file = get_segment_file(get_segment_id(page_id));
+    // The frame was unfixed, so nobody holds or waits for its latch and
+    // locking it does not block. Fixes of the same page wait until it is
+    // read.
+    frame.latch.lock();
+    guard.unlock();
+    if (evicted_file) {
+        // The frame still holds the evicted page until it is read over.
+        write_page(*evicted_file, evicted_page_id, frame.data);
+        guard.lock();
+        evicted_pages.erase(evicted_page_id);
+        guard.unlock();
+        write_back_done.notify_all();
+    }
+    read_page(segment_file, frame);
+    if (exclusive) {
+        frame.exclusive = true;
+    } else {
+        frame.latch.unlock();
+        frame.latch.lock_shared();
+    }
+    return frame;
+}
+
+
+void BufferManager::unfix_page(BufferFrame& page, bool is_dirty) {
+    // Release the latch first, so that unfixed frames are never latched.
+    if (page.exclusive) {
+        page.exclusive = false;
+        page.latch.unlock();
+    } else {
+        page.latch.unlock_shared();
+    }
+    std::unique_lock<std::mutex> guard(latch);
+    page.is_dirty |= is_dirty;
+    --page.fix_count;
+}
+
+
+void BufferManager::prefetch_pages(uint64_t first_page_id, size_t count) {
+    {
+        std::unique_lock<std::mutex> guard(latch);
+        for (uint64_t page_id = first_page_id;
+             page_id < first_page_id + count; ++page_id) {
+            prefetch_queue.push_back(page_id);
+        }
+        pending_prefetches += count;
+    }
+    prefetch_queued.notify_one();
+}
+
+
+void BufferManager::wait_for_prefetches() {
+    std::unique_lock<std::mutex> guard(latch);
+    prefetch_done.wait(guard, [&] { return pending_prefetches == 0; });
+}
 
 
-BufferFrame& BufferManager::fix_page(uint64_t page_id, bool /*exclusive*/) {
-    auto result = pages.emplace(page_id, BufferFrame{});
-    auto& page = result.first->second;
-    bool is_new = result.second;
-    if (is_new) {
-        page.data.resize(page_size, 0);
+void BufferManager::run_prefetcher() {
+    std::unique_lock<std::mutex> guard(latch);
+    while (true) {
+        prefetch_queued.wait(guard, [&] {
+            return stop_prefetcher || !prefetch_queue.empty();
+        });
+        if (stop_prefetcher) {
+            return;
+        }
+        uint64_t page_id = prefetch_queue.front();
+        prefetch_queue.pop_front();
+        prefetch_page(guard, page_id);
+        --pending_prefetches;
+        prefetch_done.notify_all();
     }
-    return page;
 }
 
 
-void BufferManager::unfix_page(BufferFrame& /*page*/, bool /*is_dirty*/) {
+void BufferManager::prefetch_page(std::unique_lock<std::mutex>& guard,
+                                  uint64_t page_id) {
+    // Evicted pages are not prefetched until they are written back.
+    if (page_table.count(page_id) != 0 || evicted_pages.count(page_id) != 0) {
+        return;
+    }
+    auto* frame = get_prefetch_frame();
+    if (!frame) {
+        return;
+    }
+    frame->page_id = page_id;
+    // The fix keeps the frame from being evicted while it is read.
+    frame->fix_count = 1;
+    frame->is_dirty = false;
+    frame->is_prefetched = true;
+    frame->queue = BufferFrame::Queue::FIFO;
+    frame->position = fifo.insert(fifo.end(), frame);
+    page_table.emplace(page_id, frame);
+    auto& segment_file = get_segment_file(get_segment_id(page_id));
+    // As in `fix_page()`, locking the unfixed frame does not block.
+    frame->latch.lock();
+    guard.unlock();
+    read_page(segment_file, *frame);
+    frame->latch.unlock();
+    guard.lock();
+    --frame->fix_count;
 }
 
 
 std::vector<uint64_t> BufferManager::get_fifo_list() const {
-    return {};
+    std::vector<uint64_t> page_ids;
+    for (auto* frame : fifo) {
+        page_ids.push_back(frame->page_id);
+    }
+    return page_ids;
 }
 
 
 std::vector<uint64_t> BufferManager::get_lru_list() const {
-    return {};
+    std::vector<uint64_t> page_ids;
+    for (auto* frame : lru) {
+        page_ids.push_back(frame->page_id);
+    }
+    return page_ids;
+}
+
+
+BufferFrame& BufferManager::get_free_frame() {
+    if (!free_frames.empty()) {
+        auto* frame = free_frames.back();
+        free_frames.pop_back();
+        return *frame;
+    }
+    auto is_unfixed = [](BufferFrame* frame) { return frame->fix_count == 0; };
+    auto victim = std::find_if(fifo.begin(), fifo.end(), is_unfixed);
+    auto* list = &fifo;
+    if (victim == fifo.end()) {
+        victim = std::find_if(lru.begin(), lru.end(), is_unfixed);
+        list = &lru;
+        if (victim == lru.end()) {
+            throw buffer_full_error{};
+        }
+    }
+    auto& frame = **victim;
+    list->erase(victim);
+    page_table.erase(frame.page_id);
+    return frame;
+}
+
+
+BufferFrame* BufferManager::get_prefetch_frame() {
+    if (!free_frames.empty()) {
+        auto* frame = free_frames.back();
+        free_frames.pop_back();
+        return frame;
+    }
+    auto victim = std::find_if(fifo.begin(), fifo.end(), [](auto* frame) {
+        return frame->fix_count == 0 && !frame->is_dirty &&
+               !frame->is_prefetched;
+    });
+    if (victim == fifo.end()) {
+        return nullptr;
+    }
+    auto* frame = *victim;
+    fifo.erase(victim);
+    page_table.erase(frame->page_id);
+    return frame;
+}
+
+
+BufferManager::SegmentFile& BufferManager::get_segment_file(
+        uint16_t segment_id) {
+    auto& segment_file = segment_files[segment_id];
+    if (!segment_file.file) {
+        segment_file.file = open_segment_file(segment_id);
+    }
+    return segment_file;
+}
+
+
+void BufferManager::read_page(SegmentFile& segment_file, BufferFrame& frame) {
+    size_t offset = get_segment_page_id(frame.page_id) * page_size;
+    std::shared_lock<std::shared_mutex> file_guard(segment_file.latch);
+    if (offset + page_size > segment_file.file->size()) {
+        std::memset(frame.data, 0, page_size);
+        return;
+    }
+    segment_file.file->read_block(offset, page_size, frame.data);
+    read_count.fetch_add(1, std::memory_order_relaxed);
+}
+
+
+void BufferManager::write_page(SegmentFile& segment_file, uint64_t page_id,
+                               const char* data) {
+    size_t offset = get_segment_page_id(page_id) * page_size;
+    write_count.fetch_add(1, std::memory_order_relaxed);
+    {
+        std::shared_lock<std::shared_mutex> file_guard(segment_file.latch);
+        if (offset + page_size <= segment_file.file->size()) {
+            segment_file.file->write_block(data, offset, page_size);
+            return;
+        }
+    }
+    // Grow the file geometrically, pages past the end are read as zeros.
+    std::unique_lock<std::shared_mutex> file_guard(segment_file.latch);
+    size_t size = segment_file.file->size();
+    if (offset + page_size > size) {
+        segment_file.file->resize(std::max(offset + page_size, 2 * size));
+    }
+    segment_file.file->write_block(data, offset, page_size);
 }
 
 }  // namespace buzzdb
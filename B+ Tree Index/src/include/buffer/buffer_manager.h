@@ -1,11 +1,23 @@
 #pragma once
 
+#include <atomic>
+#include <condition_variable>
 #include <cstddef>
 #include <cstdint>
+#include <deque>
 #include <exception>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
+#include "storage/file.h"
+
 
 namespace buzzdb {
 
@@ -13,7 +25,28 @@ class BufferFrame {
 private:
     friend class BufferManager;
 
-    std::vector<char> data;
+    /// The lists that can hold a frame.
+    enum class Queue { FREE, FIFO, LRU };
+
+    /// The page in this frame.
+    uint64_t page_id = 0;
+    /// The page data, `page_size` bytes in the pool of the buffer manager.
+    char* data = nullptr;
+    /// The number of fixes that were not unfixed yet. Frames with fixes are
+    /// never evicted.
+    size_t fix_count = 0;
+    /// Does the page differ from the page on disk?
+    bool is_dirty = false;
+    /// Is `latch` held exclusively?
+    bool exclusive = false;
+    /// Was the page prefetched and not fixed since?
+    bool is_prefetched = false;
+    /// The list that holds this frame and its position in the list.
+    Queue queue = Queue::FREE;
+    std::list<BufferFrame*>::iterator position;
+    /// Locks the page for the fixes. Loading a page holds it exclusively, so
+    /// that other fixes wait until the page is read.
+    std::shared_mutex latch;
 
 public:
     /// Returns a pointer to this page's data.
@@ -30,24 +63,129 @@ public:
 };
 
 
+/// A buffer manager with the 2Q replacement strategy. Pages that are fixed
+/// for the first time enter the FIFO list, pages that are fixed again while
+/// they are in memory move to the LRU list. Unfixed pages are evicted from
+/// the FIFO list first, so that scans do not push out the hot pages of the
+/// LRU list. Dirty pages are written back when they are evicted, without
+/// holding the latch of the buffer manager.
+/// The frames are allocated once, so references to them stay valid while
+/// they are fixed.
 class BufferManager {
+public:
+    /// Opens the file that stores the pages of the segment `segment_id`.
+    using SegmentFileOpener =
+        std::function<std::unique_ptr<File>(uint16_t segment_id)>;
+
 private:
+    /// The file of a segment.
+    struct SegmentFile {
+        std::unique_ptr<File> file;
+        /// Held exclusively while the file grows, since `File::resize()` is
+        /// not thread-safe w.r.t. reads and writes.
+        std::shared_mutex latch;
+    };
+
     size_t page_size;
-    std::unordered_map<uint64_t, BufferFrame> pages;
+    size_t page_count;
+    SegmentFileOpener open_segment_file;
+    /// Protects the page table, the lists, the segment files,
+    /// `evicted_pages`, the prefetch queue and the `fix_count`, `is_dirty`
+    /// and `is_prefetched` fields of the frames.
+    mutable std::mutex latch;
+    /// Signalled when an evicted page was written back.
+    std::condition_variable write_back_done;
+    /// The memory of all frames.
+    std::unique_ptr<char[]> pool;
+    std::unique_ptr<BufferFrame[]> frames;
+    /// The frames that do not hold a page.
+    std::vector<BufferFrame*> free_frames;
+    std::list<BufferFrame*> fifo;
+    std::list<BufferFrame*> lru;
+    /// Maps the ids of all pages in memory to their frames.
+    std::unordered_map<uint64_t, BufferFrame*> page_table;
+    /// The evicted pages that are being written back. Fixes of these pages
+    /// wait until the file holds them.
+    std::unordered_set<uint64_t> evicted_pages;
+    std::unordered_map<uint16_t, SegmentFile> segment_files;
+    /// The number of calls to `fix_page()`.
+    std::atomic<uint64_t> fix_count = 0;
+    /// The number of pages that were read from and written to the files.
+    std::atomic<uint64_t> read_count = 0;
+    std::atomic<uint64_t> write_count = 0;
+    /// The pages that `prefetch_pages()` queued for the prefetcher.
+    std::deque<uint64_t> prefetch_queue;
+    /// The number of queued pages plus the page that is being prefetched.
+    size_t pending_prefetches = 0;
+    /// Tells the prefetcher to stop.
+    bool stop_prefetcher = false;
+    /// Signalled when pages are queued or the prefetcher must stop.
+    std::condition_variable prefetch_queued;
+    /// Signalled when the prefetcher is done with a page.
+    std::condition_variable prefetch_done;
+    /// Reads the queued pages in the background.
+    std::thread prefetcher;
+
+    /// Returns a frame for a new page, evicting the first unfixed page of the
+    /// FIFO list or else of the LRU list. A dirty victim is not written back
+    /// yet: the frame keeps its page id, data and dirty flag, and the caller
+    /// writes it with `write_page()`. `latch` must be held.
+    /// Throws `buffer_full_error` when all frames are fixed.
+    BufferFrame& get_free_frame();
+
+    /// Returns a frame for a prefetched page: a free frame or else the frame
+    /// of the first unfixed clean page of the FIFO list that was not
+    /// prefetched itself. Prefetching never evicts dirty or LRU pages and
+    /// returns nullptr instead. `latch` must be
+    /// held.
+    BufferFrame* get_prefetch_frame();
+
+    /// Reads the queued pages until `stop_prefetcher` is set.
+    void run_prefetcher();
+
+    /// Reads the page `page_id` into a frame unless it is in memory or no
+    /// frame can take it. `guard` must hold `latch`, which is released while
+    /// the page is read.
+    void prefetch_page(std::unique_lock<std::mutex>& guard, uint64_t page_id);
+
+    /// Returns the file of a segment and opens it on first use. `latch` must
+    /// be held.
+    SegmentFile& get_segment_file(uint16_t segment_id);
+
+    /// Reads the page of a frame. Pages past the end of the file are zero.
+    void read_page(SegmentFile& segment_file, BufferFrame& frame);
+
+    /// Writes a page and grows the file if needed.
+    void write_page(SegmentFile& segment_file, uint64_t page_id,
+                    const char* data);
 
 public:
-    /// Constructor.
+    /// Constructor. The pages of every segment are written to a temporary
+    /// file that is deleted together with the buffer manager.
     /// @param[in] page_size  Size in bytes that all pages will have.
     /// @param[in] page_count Maximum number of pages that should reside in
     //                        memory at the same time.
     BufferManager(size_t page_size, size_t page_count);
 
-    /// Destructor. Writes all dirty pages to disk.
+    /// Constructor that reads and writes pages through the files opened by
+    /// `open_segment_file`, e.g. to keep segments across restarts.
+    /// @param[in] page_size          Size in bytes that all pages will have.
+    /// @param[in] page_count         Maximum number of pages that should
+    ///                               reside in memory at the same time.
+    /// @param[in] open_segment_file  Opens the file of a segment.
+    BufferManager(size_t page_size, size_t page_count,
+                  SegmentFileOpener open_segment_file);
+
+    /// Destructor. Drops the pages that are still queued for prefetching and
+    /// writes all dirty pages to disk.
     ~BufferManager();
 
     /// Returns size of a page
     size_t get_page_size() { return page_size; }
 
+    /// Returns the maximum number of pages in memory.
+    size_t get_page_count() const { return page_count; }
+
     /// Returns a reference to a `BufferFrame` object for a given page id. When
     /// the page is not loaded into memory, it is read from disk. Otherwise the
     /// loaded page is used.
@@ -66,6 +204,40 @@ public:
     /// written back to disk eventually.
     void unfix_page(BufferFrame& page, bool is_dirty);
 
+    /// Queues the pages `first_page_id`, ..., `first_page_id + count - 1` to
+    /// be loaded into the buffer without fixing them, and returns without
+    /// waiting for them. A background thread reads the queued pages in
+    /// order into free frames or into the frames of unfixed clean pages of
+    /// the FIFO list, and skips pages when there is no such frame. Pages
+    /// that were prefetched but not fixed yet are not replaced. Fixes of a
+    /// page that is being prefetched wait until it is read.
+    /// Is thread-safe w.r.t. other concurrent calls to `fix_page()` and
+    /// `unfix_page()`.
+    void prefetch_pages(uint64_t first_page_id, size_t count);
+
+    /// Waits until all pages that were queued by `prefetch_pages()` so far
+    /// are prefetched or skipped.
+    /// Is thread-safe.
+    void wait_for_prefetches();
+
+    /// Returns how many times pages were fixed so far.
+    /// Is thread-safe.
+    uint64_t get_fix_count() const {
+        return fix_count.load(std::memory_order_relaxed);
+    }
+
+    /// Returns how many pages were read from disk so far.
+    /// Is thread-safe.
+    uint64_t get_read_count() const {
+        return read_count.load(std::memory_order_relaxed);
+    }
+
+    /// Returns how many pages were written to disk so far.
+    /// Is thread-safe.
+    uint64_t get_write_count() const {
+        return write_count.load(std::memory_order_relaxed);
+    }
+
     /// Returns the page ids of all pages (fixed and unfixed) that are in the
     /// FIFO list in FIFO order.
     /// Is not thread-safe.
@@ -1,23 +1,92 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
 #include <cstddef>
 #include <cstring>
 #include <functional>
 #include <iostream>
+#include <iterator>
+#include <mutex>
+#include <new>
+#include <numeric>
 #include <optional>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 #include "buffer/buffer_manager.h"
 #include "common/defer.h"
 #include "common/macros.h"
+#include "index/key_search.h"
+#include "storage/fixed_page.h"
 #include "storage/segment.h"
 
 #define UNUSED(p) ((void)(p))
 
 namespace buzzdb {
 
-template <typename KeyT, typename ValueT, typename ComparatorT, size_t PageSize>
+/// A B+-Tree that is stored in the pages of a segment.
+///
+/// `lookup()`, `scan()`, `insert()` and `erase()` are thread-safe and use
+/// optimistic lock coupling: every node carries a version counter. Readers
+/// never latch, they remember the version of a node before reading it and
+/// restart the operation when the version changed afterwards. Writers
+/// upgrade the version of the nodes they modify to a write lock, which
+/// fails and restarts them if the node changed since they read it. Inserts
+/// and erases remember the path from the root to the leaf and lock only the
+/// leaf in the common case. A split propagates upward through the path to
+/// the first ancestor with room; an erase that leaves a node nearly empty
+/// merges it with a sibling, or moves entries over from the sibling, and
+/// continues upward while the parent becomes nearly empty as well.
+///
+/// Inserts of increasing keys are common, for example for timestamps or
+/// sequence numbers. When such an insert splits the rightmost nodes, most of
+/// the entries stay in the left nodes, which no further key will reach, so
+/// that they remain nearly full instead of half full. The tree also
+/// remembers the rightmost leaf, and an insert behind its last key goes
+/// there directly without descending from the root.
+///
+/// The first page of the segment holds the metadata of the tree: the height,
+/// the page allocator and the number of entries. It stays fixed while the
+/// tree is open, so that an existing tree is opened by reading just that
+/// page. The root always stays on the second page. The pages of merged nodes
+/// form a free list and are reused for new nodes.
+///
+/// With `UseFingerprints`, every leaf also stores a one-byte hash of each
+/// key. Point lookups compare the hashes of a whole leaf with a few vector
+/// instructions and only compare the keys whose hash matches, which saves
+/// most of the key comparisons of a binary search when keys are wide. The
+/// hash is taken over the bytes of a key, so keys that `ComparatorT`
+/// considers equal must have equal bytes.
+///
+/// Pages are only fixed in shared mode to pin them in the buffer; the node
+/// versions, not the buffer manager, synchronize the accesses to them. The
+/// pages of inner nodes stay pinned while the tree is open, so that lookups
+/// only fix their leaf.
+template <typename KeyT, typename ValueT, typename ComparatorT, size_t PageSize,
+          bool UseFingerprints = false, bool CountEntries = false>
 struct BTree : public Segment {
+  // Nodes move keys and values with `memmove()`.
+  static_assert(std::is_trivially_copyable_v<KeyT> &&
+                    std::is_trivially_copyable_v<ValueT>,
+                "keys and values are stored in raw pages");
+  static_assert(!UseFingerprints ||
+                    std::has_unique_object_representations_v<KeyT>,
+                "fingerprints hash the bytes of keys, which must not contain "
+                "padding");
+
   struct Node {
+    /// Set in `version` while the node is write-locked.
+    static constexpr uint64_t kLocked = 2;
+    /// Set in `version` once the node was removed from the tree.
+    static constexpr uint64_t kObsolete = 1;
+
+    /// The version of the node, which is incremented by every write.
+    std::atomic<uint64_t> version;
+
     /// The level in the tree.
     uint16_t level;
 
@@ -25,17 +94,79 @@ struct BTree : public Segment {
     uint16_t count;
 
     // Constructor
-    Node(uint16_t level, uint16_t count) : level(level), count(count) {}
+    Node(uint16_t level, uint16_t count)
+        : version(0), level(level), count(count) {}
 
     /// Is the node a leaf node?
     bool is_leaf() const { return level == 0; }
-    std::optional<uint64_t> parentPageId;
+
+    /// Wait until the node is not write-locked.
+    /// @param[out] version     The version of the node.
+    /// @return                 False if the node is obsolete.
+    bool read_lock(uint64_t &version) const {
+      version = this->version.load();
+      while (version & kLocked) {
+        std::this_thread::yield();
+        version = this->version.load();
+      }
+      return !(version & kObsolete);
+    }
+
+    /// Did the node stay unchanged since `read_lock()` returned `version`?
+    bool validate(uint64_t version) const {
+      return this->version.load() == version;
+    }
+
+    /// Write-lock the node if it did not change since `read_lock()`
+    /// returned `version`.
+    bool upgrade_to_write_lock(uint64_t version) {
+      return this->version.compare_exchange_strong(version,
+                                                   version + kLocked);
+    }
+
+    /// Write-lock the node unless it is locked or obsolete. Never waits.
+    bool try_write_lock() {
+      uint64_t version = this->version.load();
+      return !(version & (kLocked | kObsolete)) &&
+             upgrade_to_write_lock(version);
+    }
+
+    /// Release the write lock and publish the changes.
+    void write_unlock() { this->version.fetch_add(kLocked); }
+
+    /// Release the write lock and mark the node as removed from the tree.
+    void write_unlock_obsolete() {
+      this->version.fetch_add(kLocked | kObsolete);
+    }
+
+    /// Move the node to a page that was just allocated. The version of the
+    /// target is kept.
+    void copy_to(Node *target) const {
+      uint64_t version = target->version.load();
+      std::memcpy(static_cast<void *>(target), this, PageSize);
+      target->version = version;
+    }
+  };
+
+  /// The number of children of an inner node. Entry counts take another
+  /// eight bytes per child.
+  static constexpr uint32_t kInnerCapacity =
+      (PageSize - sizeof(Node)) /
+      (sizeof(KeyT) + sizeof(uint64_t) * (CountEntries ? 2 : 1));
+
+  /// The entry counts of the subtrees of an inner node. Inner nodes without
+  /// counts derive from the empty specialization, which takes no space.
+  template <bool kEnabled, typename = void>
+  struct InnerCounts {
+    /// The number of entries in the subtree of every child.
+    uint64_t counts[kInnerCapacity];
   };
+  template <typename Dummy>
+  struct InnerCounts<false, Dummy> {};
 
-  struct InnerNode : public Node {
+  struct InnerNode : public Node, public InnerCounts<CountEntries> {
     /// The capacity of a node.
-    static constexpr uint32_t kCapacity =
-        (PageSize - sizeof(Node)) / (sizeof(KeyT) + sizeof(ValueT));
+    static constexpr uint32_t kCapacity = kInnerCapacity;
 
     /// The keys.
     KeyT keys[kCapacity];
@@ -46,101 +177,199 @@ struct BTree : public Segment {
     /// Constructor.
     InnerNode() : Node(0, 0) {}
 
+    /// Get the number of separators. Never exceeds the capacity, even when
+    /// the node is read while it is modified.
+    uint32_t get_separator_count() const {
+      uint32_t count = std::min<uint32_t>(this->count, kCapacity);
+      return count > 0 ? count - 1 : 0;
+    }
+
     /// Get the index of the first key that is not less than than a provided
     /// key.
     /// @param[in] key          The key that should be searched.
-    std::pair<uint32_t, bool> lower_bound(const KeyT &key) {
-      if (this->count == 2 && !ComparatorT()(this->keys[0], key)) {
-        return std::make_pair(0, true);
-      }
-
-      int low = 0;
-      int high = this->count - 1;
-      std::optional<uint32_t> index;
+    std::pair<uint32_t, bool> lower_bound(const KeyT &key) const {
+      // An inner node with `count` children holds `count - 1` separators.
+      uint32_t separators = get_separator_count();
+      uint32_t index = key_search::lower_bound<KeyT, ComparatorT>(
+          this->keys, separators, key);
+      return std::make_pair(index < separators ? index : 0,
+                            index < separators);
+    }
 
-      while (low <= high) {
-        int mid = low + (high - low) / 2;
+    /// Copy children and their entry counts within a node or between nodes.
+    /// The ranges may overlap.
+    /// @param[in] target       The node the children are copied to.
+    /// @param[in] target_index The first child in `target`.
+    /// @param[in] source       The node the children are copied from.
+    /// @param[in] source_index The first child in `source`.
+    /// @param[in] count        The number of children.
+    static void move_children(InnerNode &target, uint32_t target_index,
+                              const InnerNode &source, uint32_t source_index,
+                              uint32_t count) {
+      std::memmove(&target.children[target_index],
+                   &source.children[source_index], count * sizeof(uint64_t));
+      if constexpr (CountEntries) {
+        std::memmove(&target.counts[target_index],
+                     &source.counts[source_index], count * sizeof(uint64_t));
+      }
+    }
 
-        if (key == this->keys[mid]) {
-          return std::make_pair(static_cast<uint32_t>(mid), true);
-        } else if (key > this->keys[mid]) {
-          low = mid + 1;
-        } else {
-          index = mid;
-          high = mid - 1;
+    /// Get the number of entries in the subtree.
+    uint64_t get_entry_count() const {
+      uint64_t entry_count = 0;
+      if constexpr (CountEntries) {
+        uint32_t count = std::min<uint32_t>(this->count, kCapacity);
+        for (uint32_t i = 0; i < count; ++i) {
+          entry_count += this->counts[i];
         }
       }
+      return entry_count;
+    }
 
-      return std::make_pair(index.has_value() ? *index : 0, index.has_value());
+    /// Get the child whose subtree contains a key.
+    /// @param[in] key          The key that should be searched.
+    uint64_t find_child(const KeyT &key) const {
+      return this->children[find_child_index(key)];
+    }
+
+    /// Get the index of the child whose subtree contains a key.
+    /// @param[in] key          The key that should be searched.
+    uint32_t find_child_index(const KeyT &key) const {
+      // Keys greater than all separators belong to the last child, which is
+      // exactly where the search ends for them.
+      return key_search::lower_bound<KeyT, ComparatorT>(
+          this->keys, get_separator_count(), key);
     }
 
-    /// Insert a key.
+    /// Insert a key. With `CountEntries`, the entry counts of the split
+    /// child and the split page must be set afterwards, see `set_counts()`.
     /// @param[in] key          The separator that should be inserted.
     /// @param[in] split_page   The id of the split page that should be
     /// inserted.
-    void insert(const KeyT &key, uint64_t split_page,
-                const std::optional<uint64_t> &leftNode) {
-      std::vector<KeyT> keyVector;
-      std::vector<uint64_t> childrenVector;
-      std::optional<int> index;
-      for (int i = 0; i < this->count - 1; i++) {
-        keyVector.push_back(this->keys[i]);
-        childrenVector.push_back(this->children[i]);
-        if (!ComparatorT()(this->keys[i], key) && !index) {
-          index = i;
-        }
-        this->keys[i] = 0;
-        this->children[i] = 0;
-      }
-      /// push the last element in the children array
-      childrenVector.push_back(this->children[this->count - 1]);
-      this->children[this->count - 1] = 0;
-      if (!index) {
-        keyVector.insert(keyVector.begin() + (this->count - 1), key);
-        childrenVector.insert(childrenVector.begin() + this->count, split_page);
-      } else {
-        keyVector.insert(keyVector.begin() + *index, key);
-        if (leftNode) {
-          index = *index + 1;
-        }
-        childrenVector.insert(childrenVector.begin() + *index, split_page);
-      }
-      for (int i = 0; i < static_cast<int>(keyVector.size()); i++) {
-        this->keys[i] = keyVector[i];
-      }
-      for (int i = 0; i < static_cast<int>(childrenVector.size()); i++) {
-        this->children[i] = childrenVector[i];
-      }
+    void insert(const KeyT &key, uint64_t split_page) {
+      // The split child keeps the keys up to the separator, the split page
+      // becomes its right neighbour.
+      uint32_t index = key_search::lower_bound<KeyT, ComparatorT>(
+          this->keys, this->count - 1, key);
+      uint32_t tail = this->count - 1 - index;
+      std::memmove(&this->keys[index + 1], &this->keys[index],
+                   tail * sizeof(KeyT));
+      move_children(*this, index + 2, *this, index + 1, tail);
+      this->keys[index] = key;
+      this->children[index + 1] = split_page;
       this->count++;
     }
 
+    /// Set the entry counts of the children on both sides of a separator.
+    /// @param[in] key          The separator.
+    /// @param[in] counts       The entry counts of the left and the right
+    ///                         child.
+    void set_counts(const KeyT &key, std::pair<uint64_t, uint64_t> counts) {
+      if constexpr (CountEntries) {
+        uint32_t index = find_child_index(key);
+        this->counts[index] = counts.first;
+        this->counts[index + 1] = counts.second;
+      }
+    }
+
     /// Split the node.
     /// @param[in] buffer       The buffer for the new page.
+    /// @param[in] left_count   The number of children that stay in the node.
     /// @return                 The separator key.
-    KeyT split(std::byte *buffer) {
-      auto mid_idx = 1 + ((this->kCapacity - 1) / 2);
-      auto newInnerNode = reinterpret_cast<InnerNode *>(buffer);
-      int startIndex = 1;
-      /// calculate a separator key
-      auto separator_key =
-          static_cast<int>((this->keys[mid_idx] + this->keys[mid_idx - 1]) / 2);
-      for (int i = mid_idx; i < static_cast<int>(this->kCapacity) + 1; i++) {
-        newInnerNode->keys[startIndex - 1] = this->keys[i - 1];
-        newInnerNode->children[startIndex] = this->children[i];
-        this->keys[i - 1] = 0;
-        this->children[i] = 0;
-        this->count--;
-        startIndex++;
-      }
-
-      newInnerNode->count = startIndex;
-      return separator_key;
+    KeyT split(std::byte *buffer, uint32_t left_count) {
+      auto new_inner_node = reinterpret_cast<InnerNode *>(buffer);
+      uint32_t right_count = this->count - left_count;
+      std::memcpy(new_inner_node->keys, &this->keys[left_count],
+                  (right_count - 1) * sizeof(KeyT));
+      move_children(*new_inner_node, 0, *this, left_count, right_count);
+      new_inner_node->count = right_count;
+      this->count = left_count;
+      // The separator of the last child that stays in this node moves up.
+      return this->keys[left_count - 1];
+    }
+
+    /// Remove a separator and the child to its right.
+    /// @param[in] index        The index of the separator.
+    void erase(uint32_t index) {
+      uint32_t tail = this->count - 2 - index;
+      std::memmove(&this->keys[index], &this->keys[index + 1],
+                   tail * sizeof(KeyT));
+      move_children(*this, index + 1, *this, index + 2, tail);
+      this->count--;
+    }
+
+    /// Append all children of the right sibling.
+    /// @param[in] separator    The separator between both nodes.
+    /// @param[in] right        The right sibling.
+    void merge(const KeyT &separator, const InnerNode &right) {
+      this->keys[this->count - 1] = separator;
+      std::memcpy(&this->keys[this->count], right.keys,
+                  (right.count - 1) * sizeof(KeyT));
+      move_children(*this, this->count, right, 0, right.count);
+      this->count += right.count;
+    }
+
+    /// Even out the number of children with the right sibling.
+    /// @param[in] separator    The separator between both nodes.
+    /// @param[in] right        The right sibling.
+    /// @return                 The new separator.
+    KeyT balance(const KeyT &separator, InnerNode &right) {
+      // The separators of both nodes and the one between them form one
+      // sorted sequence, the children are rotated through the parent.
+      uint32_t left_count = (this->count + right.count) / 2;
+      KeyT new_separator;
+      if (this->count > left_count) {
+        uint32_t moved = this->count - left_count;
+        std::memmove(&right.keys[moved], right.keys,
+                     (right.count - 1) * sizeof(KeyT));
+        move_children(right, moved, right, 0, right.count);
+        right.keys[moved - 1] = separator;
+        std::memcpy(right.keys, &this->keys[left_count],
+                    (moved - 1) * sizeof(KeyT));
+        move_children(right, 0, *this, left_count, moved);
+        new_separator = this->keys[left_count - 1];
+        right.count += moved;
+      } else {
+        uint32_t moved = left_count - this->count;
+        this->keys[this->count - 1] = separator;
+        std::memcpy(&this->keys[this->count], right.keys,
+                    (moved - 1) * sizeof(KeyT));
+        move_children(*this, this->count, right, 0, moved);
+        new_separator = right.keys[moved - 1];
+        std::memmove(right.keys, &right.keys[moved],
+                     (right.count - 1 - moved) * sizeof(KeyT));
+        move_children(right, 0, right, moved, right.count - moved);
+        right.count -= moved;
+      }
+      this->count = left_count;
+      return new_separator;
     }
   };
-  struct LeafNode : public Node {
+  /// The number of entries in a leaf. Fingerprints take one byte per entry
+  /// and may be followed by padding.
+  static constexpr uint32_t kLeafCapacity =
+      UseFingerprints
+          ? (PageSize - sizeof(Node) - sizeof(std::optional<uint64_t>) - 8) /
+                (sizeof(KeyT) + sizeof(ValueT) + 1)
+          : (PageSize - sizeof(Node) - sizeof(std::optional<uint64_t>)) /
+                (sizeof(KeyT) + sizeof(ValueT));
+
+  /// The fingerprints of the keys of a leaf. Leaves without fingerprints
+  /// derive from the empty specialization, which takes no space.
+  template <bool kEnabled, typename = void>
+  struct LeafFingerprints {
+    /// `key_search::get_fingerprint()` of every key.
+    uint8_t fingerprints[kLeafCapacity];
+  };
+  template <typename Dummy>
+  struct LeafFingerprints<false, Dummy> {};
+
+  struct LeafNode : public Node, public LeafFingerprints<UseFingerprints> {
     /// The capacity of a node.
-    static constexpr uint32_t kCapacity =
-        (PageSize / (sizeof(KeyT) + sizeof(ValueT))) - 2;
+    static constexpr uint32_t kCapacity = kLeafCapacity;
+
+    /// The right sibling, which holds the next larger keys.
+    std::optional<uint64_t> next_leaf;
 
     /// The keys.
     KeyT keys[kCapacity];
@@ -151,396 +380,1646 @@ struct BTree : public Segment {
     /// Constructor.
     LeafNode() : Node(0, 0) {}
 
-    /// Insert a key.
+    /// Get the number of keys. Never exceeds the capacity, even when the
+    /// node is read while it is modified.
+    uint32_t get_count() const {
+      return std::min<uint32_t>(this->count, kCapacity);
+    }
+
+    /// Get the index of the first key that is not less than than a provided
+    /// key, or `count` if all keys are less.
+    /// @param[in] key          The key that should be searched.
+    uint32_t lower_bound(const KeyT &key) const {
+      return key_search::lower_bound<KeyT, ComparatorT>(this->keys,
+                                                        get_count(), key);
+    }
+
+    /// Find the slot of a key.
+    /// @param[in] key          The key that should be searched.
+    /// @return                 The index of the key, if the node contains it.
+    std::optional<uint32_t> find(const KeyT &key) const {
+      uint32_t count = get_count();
+      if constexpr (UseFingerprints) {
+        ComparatorT less;
+        uint32_t index = key_search::find_fingerprint(
+            this->fingerprints, count, key_search::get_fingerprint(key),
+            [&](uint32_t i) {
+              return !less(key, this->keys[i]) && !less(this->keys[i], key);
+            });
+        if (index < count) {
+          return index;
+        }
+        return std::nullopt;
+      }
+      uint32_t index = lower_bound(key);
+      if (index < count && !ComparatorT()(key, this->keys[index])) {
+        return index;
+      }
+      return std::nullopt;
+    }
+
+    /// Store an entry in a slot.
+    /// @param[in] index        The slot.
+    /// @param[in] key          The key.
+    /// @param[in] value        The value.
+    void set(uint32_t index, const KeyT &key, const ValueT &value) {
+      this->keys[index] = key;
+      this->values[index] = value;
+      if constexpr (UseFingerprints) {
+        this->fingerprints[index] = key_search::get_fingerprint(key);
+      }
+    }
+
+    /// Copy entries within a node or between nodes. The ranges may overlap.
+    /// @param[in] target       The node the entries are copied to.
+    /// @param[in] target_index The first slot in `target`.
+    /// @param[in] source       The node the entries are copied from.
+    /// @param[in] source_index The first slot in `source`.
+    /// @param[in] count        The number of entries.
+    static void move_entries(LeafNode &target, uint32_t target_index,
+                             const LeafNode &source, uint32_t source_index,
+                             uint32_t count) {
+      std::memmove(&target.keys[target_index], &source.keys[source_index],
+                   count * sizeof(KeyT));
+      std::memmove(&target.values[target_index], &source.values[source_index],
+                   count * sizeof(ValueT));
+      if constexpr (UseFingerprints) {
+        std::memmove(&target.fingerprints[target_index],
+                     &source.fingerprints[source_index], count);
+      }
+    }
+
+    /// Insert a key. Overwrites the value if the key exists.
     /// @param[in] key          The key that should be inserted.
     /// @param[in] value        The value that should be inserted.
     void insert(const KeyT &key, const ValueT &value) {
-      if (this->count == 0) {
-        this->keys[this->count] = key;
-        this->values[this->count] = value;
-        this->count++;
+      uint32_t index = lower_bound(key);
+      if (index < this->count && !ComparatorT()(key, this->keys[index])) {
+        this->values[index] = value;
+        return;
+      }
+      insert_at(index, key, value);
+    }
+
+    /// Insert a new key at its slot.
+    /// @param[in] index        The slot, see `lower_bound()`.
+    /// @param[in] key          The key that should be inserted.
+    /// @param[in] value        The value that should be inserted.
+    void insert_at(uint32_t index, const KeyT &key, const ValueT &value) {
+      move_entries(*this, index + 1, *this, index, this->count - index);
+      set(index, key, value);
+      this->count++;
+    }
+
+    /// Erase a key.
+    /// @param[in] index        The slot of the key.
+    void erase(uint32_t index) {
+      move_entries(*this, index, *this, index + 1, this->count - index - 1);
+      this->count--;
+    }
+
+    /// Split the node.
+    /// @param[in] buffer       The buffer for the new page.
+    /// @param[in] left_count   The number of entries that stay in the node.
+    /// @return                 The separator key.
+    KeyT split(std::byte *buffer, uint32_t left_count) {
+      auto new_leaf_node = reinterpret_cast<LeafNode *>(buffer);
+      uint32_t right_count = this->count - left_count;
+      move_entries(*new_leaf_node, 0, *this, left_count, right_count);
+      new_leaf_node->count = right_count;
+      this->count = left_count;
+      return this->keys[left_count - 1];
+    }
+
+    /// Append all entries of the right sibling and take over its link.
+    /// @param[in] right        The right sibling.
+    void merge(const LeafNode &right) {
+      move_entries(*this, this->count, right, 0, right.count);
+      this->count += right.count;
+      this->next_leaf = right.next_leaf;
+    }
+
+    /// Even out the number of entries with the right sibling.
+    /// @param[in] right        The right sibling.
+    /// @return                 The new separator.
+    KeyT balance(LeafNode &right) {
+      uint32_t left_count = (this->count + right.count) / 2;
+      if (this->count > left_count) {
+        uint32_t moved = this->count - left_count;
+        move_entries(right, moved, right, 0, right.count);
+        move_entries(right, 0, *this, left_count, moved);
+        right.count += moved;
       } else {
-        std::vector<KeyT> keyVector;
-        std::vector<KeyT> valVector;
-        std::optional<int> index;
-        for (int i = 0; i < this->count; i++) {
-          keyVector.push_back(this->keys[i]);
-          valVector.push_back(this->values[i]);
-          if (!ComparatorT()(this->keys[i], key) && !index) {
-            index = i;
+        uint32_t moved = left_count - this->count;
+        move_entries(*this, this->count, right, 0, moved);
+        move_entries(right, 0, right, moved, right.count - moved);
+        right.count -= moved;
+      }
+      this->count = left_count;
+      return this->keys[left_count - 1];
+    }
+  };
+  static_assert(sizeof(LeafNode) <= PageSize, "a leaf must fit into a page");
+
+  /// The first page of the segment. Describes the tree, so that it can be
+  /// opened again without touching any other page.
+  struct Metadata {
+    /// Identifies a segment that holds a tree.
+    static constexpr uint64_t kMagic = 0x4255'5a5a'4254'5245;
+
+    /// `kMagic` once the page was initialized.
+    uint64_t magic;
+
+    /// The page size the tree was created with.
+    uint64_t page_size;
+
+    /// Is there a root yet?
+    bool has_root;
+
+    /// The level of the root. Protected by the write lock of the root.
+    uint16_t root_level;
+
+    /// The number of segment pages that were allocated so far.
+    std::atomic<uint64_t> next_page_id;
+
+    /// The first page of the free list, 0 if it is empty. Protected by
+    /// `free_pages_latch`.
+    uint64_t first_free_page;
+
+    /// The number of pages on the free list. Protected by
+    /// `free_pages_latch`.
+    uint64_t free_page_count;
+
+    /// The number of entries in the tree.
+    std::atomic<uint64_t> entry_count;
+  };
+
+  /// A page on the free list. Only the node header is kept, so that threads
+  /// that still look at the removed node see that it is obsolete.
+  struct FreeNode : public Node {
+    /// The next page of the free list, 0 at its end.
+    uint64_t next_free_page;
+  };
+
+  /// The segment page of the metadata.
+  static constexpr uint64_t kMetadataPageId = 0;
+
+  /// The segment page of the root. It never moves, so the root can be found
+  /// without the metadata.
+  static constexpr uint64_t kRootPageId = 1;
+
+  /// A page that stays fixed (shared) for the lifetime of the object, or a
+  /// page that is pinned by `PinnedPages`.
+  class FixedPage : public buzzdb::FixedPage<Node> {
+   public:
+    using buzzdb::FixedPage<Node>::FixedPage;
+
+    /// Construct a new node in the page. The version of the node is kept,
+    /// the page must be write-locked or unreachable for other threads.
+    template <typename NodeT>
+    NodeT *init_node() {
+      uint64_t version = this->get_node()->version.load();
+      auto node = new (this->get_data()) NodeT();
+      node->version = version;
+      this->mark_dirty();
+      return node;
+    }
+  };
+
+  /// The pages of the inner nodes, which stay fixed while the tree is open,
+  /// so that a descent only fixes the leaf. The top levels are read by every
+  /// operation and would otherwise cost a trip through the buffer manager
+  /// latch per level.
+  ///
+  /// Pages are pinned when a descent first reaches them and stay pinned
+  /// even when their node is merged and the page is reused: a thread that
+  /// still holds the frame then reads the new version of the same page and
+  /// restarts, just like with a fixed page. Looking up a frame takes no
+  /// latch, the frames are kept in chunks of atomic pointers indexed by the
+  /// segment page id. At most a quarter of the buffer is pinned, other pages
+  /// are fixed as usual.
+  class PinnedPages {
+   public:
+    /// The number of pages per chunk.
+    static constexpr size_t kChunkSize = 1 << 12;
+    /// The number of chunks. Pages behind them are never pinned.
+    static constexpr size_t kChunkCount = 1 << 12;
+
+    /// A pinned page.
+    struct Pin {
+      std::atomic<BufferFrame *> frame{nullptr};
+      /// Was the node changed since the page was pinned?
+      std::atomic<bool> is_dirty{false};
+    };
+
+    /// Constructor.
+    explicit PinnedPages(BufferManager &buffer_manager)
+        : buffer_manager(buffer_manager),
+          max_count(buffer_manager.get_page_count() / 4) {}
+
+    PinnedPages(const PinnedPages &) = delete;
+    PinnedPages &operator=(const PinnedPages &) = delete;
+
+    /// Destructor. Unpins all pages and writes back those whose nodes
+    /// changed.
+    ~PinnedPages() {
+      for (auto &chunk : chunks) {
+        auto pins = chunk.load();
+        if (!pins) {
+          continue;
+        }
+        for (size_t i = 0; i < kChunkSize; ++i) {
+          if (auto frame = pins[i].frame.load()) {
+            buffer_manager.unfix_page(*frame, pins[i].is_dirty.load());
           }
-          this->keys[i] = 0;
-          this->values[i] = 0;
         }
+        delete[] pins;
+      }
+    }
 
-        if (!index) {
-          index = this->count;
-          if (keyVector[*index - 1] == key) {
-            valVector[*index - 1] = value;
-          } else {
-            keyVector.insert(keyVector.begin() + *index, key);
-            valVector.insert(valVector.begin() + *index, value);
-            this->count++;
-          }
+    /// Get the pin of a page and pin the page if it is not pinned yet.
+    /// Is thread-safe.
+    /// @return             The pin, or nullptr if the page cannot be
+    ///                     pinned.
+    Pin *get(uint64_t page_id) {
+      uint64_t segment_page_id = BufferManager::get_segment_page_id(page_id);
+      if (segment_page_id >= kChunkSize * kChunkCount) {
+        return nullptr;
+      }
+      auto &chunk = chunks[segment_page_id / kChunkSize];
+      auto pins = chunk.load(std::memory_order_acquire);
+      if (pins) {
+        auto &pin = pins[segment_page_id % kChunkSize];
+        if (pin.frame.load(std::memory_order_acquire)) {
+          return &pin;
+        }
+      }
+      if (count.load() >= max_count) {
+        return nullptr;
+      }
+      if (!pins) {
+        auto new_pins = new Pin[kChunkSize];
+        if (chunk.compare_exchange_strong(pins, new_pins)) {
+          pins = new_pins;
         } else {
-          if (keyVector[*index] == key) {
-            valVector[*index] = value;
-          } else {
-            keyVector.insert(keyVector.begin() + *index, key);
-            valVector.insert(valVector.begin() + *index, value);
-            this->count++;
+          delete[] new_pins;
+        }
+      }
+      auto &pin = pins[segment_page_id % kChunkSize];
+      auto frame = &buffer_manager.fix_page(page_id, false);
+      BufferFrame *pinned_frame = nullptr;
+      if (!pin.frame.compare_exchange_strong(pinned_frame, frame)) {
+        // Another thread pinned the page first.
+        buffer_manager.unfix_page(*frame, false);
+        return &pin;
+      }
+      count.fetch_add(1);
+      return &pin;
+    }
+
+    /// Get the number of pinned pages.
+    /// Is thread-safe.
+    size_t get_count() const { return count.load(); }
+
+   private:
+    BufferManager &buffer_manager;
+    /// The maximum number of pinned pages.
+    size_t max_count;
+    std::atomic<size_t> count = 0;
+    std::atomic<Pin *> chunks[kChunkCount] = {};
+  };
+
+  /// The nodes from the root down to a leaf, each with the version with which
+  /// it was read. Writers lock nodes bottom-up through the path, only as far
+  /// up as a split or merge propagates. The locked nodes are unlocked when
+  /// the path is destroyed.
+  class Path {
+   public:
+    /// The maximum height of a tree.
+    static constexpr size_t kMaxHeight = 32;
+
+    /// Constructor.
+    Path() {}
+
+    Path(const Path &) = delete;
+    Path &operator=(const Path &) = delete;
+
+    /// Destructor. Unlocks the locked nodes, leaves first.
+    ~Path() {
+      for (size_t depth = size; depth-- > 0;) {
+        if (entries[depth].is_locked) {
+          entries[depth].page.get_node()->write_unlock();
+        }
+        entries[depth].~Entry();
+      }
+    }
+
+    /// Append a child of the last node.
+    void push(FixedPage page, uint64_t version) {
+      if (size == kMaxHeight) {
+        throw std::logic_error("the B-Tree is too high");
+      }
+      new (&entries[size]) Entry{std::move(page), version, false};
+      ++size;
+    }
+
+    /// Get the number of nodes.
+    size_t get_size() const { return size; }
+
+    /// Get the page of the node at `depth`, the root is at depth 0.
+    FixedPage &get_page(size_t depth) { return entries[depth].page; }
+
+    /// Get the node at `depth`.
+    template <typename NodeT = Node>
+    NodeT *get_node(size_t depth) const {
+      return entries[depth].page.template get_node<NodeT>();
+    }
+
+    /// Write-lock the node at `depth` if it did not change since it was read.
+    /// Succeeds right away if the node is already locked.
+    bool lock(size_t depth) {
+      auto &entry = entries[depth];
+      if (entry.is_locked) {
+        return true;
+      }
+      entry.is_locked =
+          entry.page.get_node()->upgrade_to_write_lock(entry.version);
+      return entry.is_locked;
+    }
+
+    /// Is the node at `depth` write-locked?
+    bool is_locked(size_t depth) const { return entries[depth].is_locked; }
+
+    /// Unlock the node at `depth` and mark it as removed from the tree.
+    void unlock_obsolete(size_t depth) {
+      entries[depth].page.get_node()->write_unlock_obsolete();
+      entries[depth].is_locked = false;
+    }
+
+   private:
+    struct Entry {
+      FixedPage page;
+      uint64_t version = 0;
+      bool is_locked = false;
+    };
+
+    /// Only the first `size` entries are constructed, so that a path costs
+    /// nothing beyond the height of the tree.
+    union {
+      Entry entries[kMaxHeight];
+    };
+    size_t size = 0;
+  };
+
+  /// Iterates over the entries of a key range in key order.
+  ///
+  /// Only the leaf of the current entry is fixed; leaves are visited through
+  /// their sibling links. When the iterator enters a leaf, it queues the next
+  /// leaf for prefetching, so that the buffer manager reads it in the
+  /// background while the entries of the current leaf are returned. Entries are read optimistically, when a leaf changes under the
+  /// iterator it searches the tree again for the entry after the last one
+  /// it returned. Concurrent modifications of the tree are therefore
+  /// allowed, every key is returned at most once and in order.
+  class Iterator {
+   public:
+    Iterator(const Iterator &) = delete;
+    Iterator &operator=(const Iterator &) = delete;
+    Iterator(Iterator &&other) noexcept = default;
+
+    /// Moves to the next entry. Must be called before the first entry is
+    /// accessed.
+    /// @return                 False if there are no more entries in the
+    ///                         range.
+    bool next() {
+      while (page) {
+        auto leaf_node = page.template get_node<LeafNode>();
+        if (slot < leaf_node->get_count()) {
+          KeyT key = leaf_node->keys[slot];
+          ValueT value = leaf_node->values[slot];
+          if (!leaf_node->validate(version)) {
+            seek();
+            continue;
+          }
+          if (ComparatorT()(upper, key)) {
+            page.release();
+            return false;
           }
+          current_key = key;
+          current_value = value;
+          has_current = true;
+          ++slot;
+          return true;
         }
+        if (!move_to_next_leaf()) {
+          seek();
+        }
+      }
+      return false;
+    }
 
-        for (int i = 0; i < static_cast<int>(keyVector.size()); i++) {
-          this->keys[i] = keyVector[i];
-          this->values[i] = valVector[i];
+    /// The key of the current entry.
+    const KeyT &key() const { return current_key; }
+
+    /// The value of the current entry.
+    const ValueT &value() const { return current_value; }
+
+   private:
+    friend struct BTree;
+
+    /// Constructor. Positions the iterator in front of the first entry that
+    /// is not less than `lower`.
+    Iterator(BTree &tree, const KeyT &lower, const KeyT &upper)
+        : tree(tree), upper(upper), current_key(lower) {
+      if (!tree.isTreeEmpty.load()) {
+        seek();
+      }
+    }
+
+    /// Find the first entry after the current one, or the first entry not
+    /// less than the lower bound if there is no current entry yet.
+    void seek() {
+      while (true) {
+        uint64_t leaf_version;
+        auto leaf_page = tree.find_leaf(current_key, leaf_version);
+        if (!leaf_page) {
+          continue;
+        }
+        auto leaf_node = leaf_page.template get_node<LeafNode>();
+        uint32_t index = leaf_node->lower_bound(current_key);
+        if (has_current && index < leaf_node->get_count() &&
+            !ComparatorT()(current_key, leaf_node->keys[index])) {
+          ++index;
+        }
+        if (leaf_node->validate(leaf_version)) {
+          page = std::move(leaf_page);
+          version = leaf_version;
+          slot = index;
+          prefetch_next_leaf();
+          return;
         }
       }
     }
 
-    /// Erase a key.
-    void erase(int &index) {
-      // delete add shift other elements to left
-      for (int i = index; i < this->count; ++i) {
-        this->keys[i] = this->keys[i + 1];
-        this->values[i] = this->values[i + 1];
-      }
-      this->keys[this->count] = 0;
-      this->values[this->count] = 0;
-      this->count--;
+    /// Queues the right sibling of the current leaf for prefetching. The
+    /// sibling link is read optimistically and only used if the leaf did not
+    /// change in the meantime.
+    void prefetch_next_leaf() {
+      auto leaf_node = page.template get_node<LeafNode>();
+      auto next_leaf = leaf_node->next_leaf;
+      if (next_leaf && leaf_node->validate(version)) {
+        tree.buffer_manager.prefetch_pages(*next_leaf, 1);
+      }
     }
 
-    /// Split the node.
-    /// @param[in] buffer       The buffer for the new page.
-    /// @return                 The separator key.
-    KeyT split(std::byte *buffer) {
-      auto mid_idx = (this->kCapacity + 1) / 2;
-      auto newLeafNode = reinterpret_cast<LeafNode *>(buffer);
-      int index = 0;
-      for (int i = mid_idx; i < static_cast<int>(this->kCapacity); i++) {
-        newLeafNode->keys[index] = this->keys[i];
-        newLeafNode->values[index] = this->values[i];
-        this->keys[i] = 0;
-        this->values[i] = 0;
-        this->count--;
-        index++;
-      }
-      newLeafNode->count = index + 1;
-      return this->keys[index - 1];
+    /// Fixes the right sibling before the current leaf is unfixed. Releases
+    /// the current leaf at the end of the tree.
+    /// @return                 False if the iterator must seek again.
+    bool move_to_next_leaf() {
+      auto leaf_node = page.template get_node<LeafNode>();
+      auto next_leaf = leaf_node->next_leaf;
+      if (!leaf_node->validate(version)) {
+        return false;
+      }
+      if (!next_leaf) {
+        page.release();
+        return true;
+      }
+      FixedPage next_page(tree.buffer_manager, *next_leaf);
+      uint64_t next_version;
+      // A split of the current leaf could have put a new sibling in between.
+      if (!next_page.get_node()->read_lock(next_version) ||
+          !leaf_node->validate(version)) {
+        return false;
+      }
+      page = std::move(next_page);
+      version = next_version;
+      slot = 0;
+      prefetch_next_leaf();
+      return true;
     }
+
+    BTree &tree;
+    /// The current leaf, released once the iterator is exhausted.
+    FixedPage page;
+    /// The version of the current leaf.
+    uint64_t version = 0;
+    /// The slot that `next()` moves to.
+    uint32_t slot = 0;
+    /// The largest key of the range.
+    KeyT upper;
+    /// The current entry, or the lower bound before the first entry.
+    KeyT current_key;
+    ValueT current_value{};
+    bool has_current = false;
   };
 
-  /// The root.
+  /// The metadata page, which stays fixed while the tree is open.
+  FixedPage metadata_page;
+
+  /// The metadata in `metadata_page`.
+  Metadata *metadata;
+
+  /// The pages of the inner nodes.
+  PinnedPages pinned_pages;
+
+  /// The root. Always on the page `kRootPageId` once it exists.
   std::optional<uint64_t> root;
 
-  bool isTreeEmpty;
+  /// Set once the root was created.
+  std::atomic<bool> isTreeEmpty;
+
+  /// Serializes the creation of the root.
+  std::mutex root_latch;
 
-  uint16_t rootLevel = 0;
+  /// Protects the free list.
+  std::mutex free_pages_latch;
 
-  std::map<KeyT, bool> erasedKeys;
+  /// The page of the rightmost leaf if the last insert into it appended an
+  /// entry behind all others, otherwise 0. Only a hint for `try_append()`,
+  /// the page may have been merged or reused since.
+  std::atomic<uint64_t> rightmost_leaf;
 
-  /// Next page id.
-  /// You don't need to worry about about the page allocation.
-  /// Just increment the next_page_id whenever you need a new page.
-  uint64_t next_page_id;
+  /// Distributes `count` entries evenly over as few nodes as possible with
+  /// at most `fill` entries each. Nodes may exceed `fill` where that is
+  /// needed to give every node at least `min_size` entries.
+  static std::vector<uint32_t> get_bulk_load_node_sizes(uint64_t count,
+                                                        uint32_t fill,
+                                                        uint32_t min_size) {
+    uint64_t node_count = std::clamp<uint64_t>((count + fill - 1) / fill, 1,
+                                               std::max<uint64_t>(
+                                                   count / min_size, 1));
+    std::vector<uint32_t> sizes(node_count, count / node_count);
+    for (uint64_t i = 0; i < count % node_count; ++i) {
+      ++sizes[i];
+    }
+    return sizes;
+  }
 
-  /// Constructor.
+  /// Constructor. Opens the tree in the segment, or creates an empty one if
+  /// the segment does not hold a tree yet. Only the metadata page is read.
+  /// Throws `std::logic_error` if the tree was created with another page
+  /// size.
   BTree(uint16_t segment_id, BufferManager &buffer_manager)
-      : Segment(segment_id, buffer_manager) {
-    this->isTreeEmpty = true;
+      : Segment(segment_id, buffer_manager),
+        metadata_page(buffer_manager,
+                      BufferManager::get_overall_page_id(segment_id,
+                                                         kMetadataPageId)),
+        metadata(metadata_page.template get_node<Metadata>()),
+        pinned_pages(buffer_manager),
+        isTreeEmpty(true),
+        rightmost_leaf(0) {
+    if (!open_metadata<Metadata>(metadata_page, PageSize, "B-Tree")) {
+      metadata->has_root = false;
+      metadata->root_level = 0;
+      metadata->next_page_id = kRootPageId + 1;
+      metadata->first_free_page = 0;
+      metadata->free_page_count = 0;
+      metadata->entry_count = 0;
+    }
+    if (metadata->has_root) {
+      this->root = get_page_id(kRootPageId);
+      this->isTreeEmpty = false;
+    }
+  }
+
+  /// Destructor. Writes the metadata back.
+  ~BTree() { metadata_page.mark_dirty(); }
+
+  /// Get the page id of a page of the segment.
+  uint64_t get_page_id(uint64_t segment_page_id) const {
+    return BufferManager::get_overall_page_id(this->segment_id,
+                                              segment_page_id);
+  }
+
+  /// Get the number of entries.
+  /// Is thread-safe.
+  uint64_t get_entry_count() const { return metadata->entry_count.load(); }
+
+  /// Get the number of pages of the segment that were allocated, including
+  /// the metadata page and the free pages.
+  /// Is thread-safe.
+  uint64_t get_page_count() const { return metadata->next_page_id.load(); }
+
+  /// Get the number of pages on the free list.
+  /// Is thread-safe.
+  uint64_t get_free_page_count() {
+    std::unique_lock<std::mutex> guard(free_pages_latch);
+    return metadata->free_page_count;
+  }
+
+  /// Get the number of levels, 0 for an empty tree.
+  /// Is not thread-safe.
+  uint16_t get_height() const {
+    return metadata->has_root ? metadata->root_level + 1 : 0;
+  }
+
+  /// Create an empty root leaf if the tree has none yet.
+  void create_root() {
+    std::unique_lock<std::mutex> guard(root_latch);
+    if (!this->isTreeEmpty.load()) {
+      return;
+    }
+    FixedPage root_page(this->buffer_manager, get_page_id(kRootPageId));
+    root_page.template init_node<LeafNode>();
+    metadata->has_root = true;
+    metadata->root_level = 0;
+    this->root = root_page.get_page_id();
+    this->isTreeEmpty = false;
+  }
+
+  /// Allocate a page for a new node, preferably one of the free pages. The
+  /// node is write-locked, so that threads that still know the page from
+  /// before it was freed wait until the new node is complete.
+  FixedPage allocate_page() {
+    FixedPage page;
+    {
+      std::unique_lock<std::mutex> guard(free_pages_latch);
+      if (metadata->first_free_page == 0) {
+        page = FixedPage(this->buffer_manager,
+                         get_page_id(metadata->next_page_id++));
+      } else {
+        page = FixedPage(this->buffer_manager, metadata->first_free_page);
+        metadata->first_free_page =
+            page.template get_node<FreeNode>()->next_free_page;
+        metadata->free_page_count -= 1;
+      }
+    }
+    // Threads that still look at a removed node must notice that it was
+    // reused, so its version keeps growing.
+    auto node = page.get_node();
+    node->version =
+        (node->version.load() | Node::kLocked | Node::kObsolete) + 1 +
+        Node::kLocked;
+    page.mark_dirty();
+    return page;
+  }
+
+  /// Put the page of a node that was marked as obsolete on the free list.
+  /// The list is threaded through the free pages, so that it survives
+  /// closing the tree without any extra pages.
+  void free_page(uint64_t page_id) {
+    FixedPage page(this->buffer_manager, page_id);
+    std::unique_lock<std::mutex> guard(free_pages_latch);
+    page.template get_node<FreeNode>()->next_free_page =
+        metadata->first_free_page;
+    page.mark_dirty();
+    metadata->first_free_page = page_id;
+    metadata->free_page_count += 1;
+  }
+
+  /// Put the pages of all nodes below a node on the free list.
+  /// Is not thread-safe.
+  /// @param[in] page_id      The page of the node.
+  void free_descendants(uint64_t page_id) {
+    FixedPage page(this->buffer_manager, page_id);
+    if (page.get_node()->is_leaf()) {
+      return;
+    }
+    auto inner_node = page.template get_node<InnerNode>();
+    for (uint32_t i = 0; i < inner_node->count; ++i) {
+      free_descendants(inner_node->children[i]);
+      free_page(inner_node->children[i]);
+    }
+  }
+
+  /// Fix the page of a node, or take it from the pinned pages if the node is
+  /// an inner node.
+  /// @param[in] page_id      The page of the node.
+  /// @param[in] is_inner     Was the node an inner node when its parent was
+  ///                         read? Only a hint, since the page may have been
+  ///                         reused since.
+  FixedPage fix_node(uint64_t page_id, bool is_inner) {
+    if (is_inner) {
+      if (auto pin = pinned_pages.get(page_id)) {
+        return FixedPage(*pin->frame.load(), page_id, pin->is_dirty);
+      }
+    }
+    return FixedPage(this->buffer_manager, page_id);
+  }
+
+  /// Descend optimistically to the leaf that may contain a key.
+  /// @param[in] key          The key that should be searched.
+  /// @param[out] version     The version of the leaf.
+  /// @return                 The leaf, or no page if a node changed during
+  ///                         the descent and it must be restarted.
+  FixedPage find_leaf(const KeyT &key, uint64_t &version) {
+    FixedPage page = fix_node(*this->root, true);
+    if (!page.get_node()->read_lock(version)) {
+      return {};
+    }
+    while (!page.get_node()->is_leaf()) {
+      auto inner_node = page.template get_node<InnerNode>();
+      uint64_t child_page_id = inner_node->find_child(key);
+      // The child id is only trustworthy if the node did not change.
+      if (!inner_node->validate(version)) {
+        return {};
+      }
+      FixedPage child_page = fix_node(child_page_id, inner_node->level > 1);
+      uint64_t child_version;
+      if (!child_page.get_node()->read_lock(child_version) ||
+          !inner_node->validate(version)) {
+        return {};
+      }
+      page = std::move(child_page);
+      version = child_version;
+    }
+    return page;
+  }
+
+  /// Descend optimistically to the leaf that may contain a key and remember
+  /// all nodes on the way.
+  /// @param[in] key          The key that should be searched.
+  /// @param[out] path        The nodes from the root to the leaf.
+  /// @return                 False if a node changed during the descent and
+  ///                         it must be restarted.
+  bool find_path(const KeyT &key, Path &path) {
+    FixedPage page = fix_node(*this->root, true);
+    uint64_t version;
+    if (!page.get_node()->read_lock(version)) {
+      return false;
+    }
+    while (!page.get_node()->is_leaf()) {
+      auto inner_node = page.template get_node<InnerNode>();
+      uint64_t child_page_id = inner_node->find_child(key);
+      if (!inner_node->validate(version)) {
+        return false;
+      }
+      FixedPage child_page = fix_node(child_page_id, inner_node->level > 1);
+      uint64_t child_version;
+      if (!child_page.get_node()->read_lock(child_version) ||
+          !inner_node->validate(version)) {
+        return false;
+      }
+      path.push(std::move(page), version);
+      page = std::move(child_page);
+      version = child_version;
+    }
+    path.push(std::move(page), version);
+    return true;
+  }
+
+  /// Descend optimistically to a leaf along the children that a function
+  /// chooses.
+  /// @param[out] version       The version of the leaf.
+  /// @param[in] choose_child   Gets every inner node on the way and returns
+  ///                           the index of the child to descend to. May read
+  ///                           an inconsistent node, in which case the
+  ///                           descent is restarted.
+  /// @return                   The leaf, or no page if a node changed during
+  ///                           the descent and it must be restarted.
+  template <typename ChooseChildT>
+  FixedPage descend(uint64_t &version, ChooseChildT &&choose_child) {
+    FixedPage page = fix_node(*this->root, true);
+    if (!page.get_node()->read_lock(version)) {
+      return {};
+    }
+    while (!page.get_node()->is_leaf()) {
+      auto inner_node = page.template get_node<InnerNode>();
+      uint32_t index = std::min<uint32_t>(choose_child(inner_node),
+                                          inner_node->get_separator_count());
+      uint64_t child_page_id = inner_node->children[index];
+      if (!inner_node->validate(version)) {
+        return {};
+      }
+      FixedPage child_page = fix_node(child_page_id, inner_node->level > 1);
+      uint64_t child_version;
+      if (!child_page.get_node()->read_lock(child_version) ||
+          !inner_node->validate(version)) {
+        return {};
+      }
+      page = std::move(child_page);
+      version = child_version;
+    }
+    return page;
+  }
+
+  /// Get the number of entries with keys less than a key, or not greater
+  /// than it. Requires `CountEntries`.
+  /// Is thread-safe.
+  /// @param[in] key          The key.
+  /// @param[in] is_inclusive Should an entry with the key itself be counted?
+  uint64_t get_rank(const KeyT &key, bool is_inclusive) {
+    static_assert(CountEntries, "ranks require a B-Tree with entry counts");
+    if (this->isTreeEmpty.load()) {
+      return 0;
+    }
+    while (true) {
+      // The children left of the path hold smaller keys only.
+      uint64_t rank = 0;
+      uint64_t version;
+      auto page = descend(version, [&](const InnerNode *inner_node) {
+        uint32_t index = inner_node->find_child_index(key);
+        for (uint32_t i = 0; i < index; ++i) {
+          rank += inner_node->counts[i];
+        }
+        return index;
+      });
+      if (!page) {
+        continue;
+      }
+      auto leaf_node = page.template get_node<LeafNode>();
+      uint32_t index = leaf_node->lower_bound(key);
+      if (is_inclusive && index < leaf_node->get_count() &&
+          !ComparatorT()(key, leaf_node->keys[index])) {
+        ++index;
+      }
+      if (leaf_node->validate(version)) {
+        return rank + index;
+      }
+    }
+  }
+
+  /// Count the entries with keys in the range [lower, upper]. Visits one
+  /// path per bound instead of the leaves in between. Requires
+  /// `CountEntries`.
+  /// Is thread-safe. Entries that are inserted or erased concurrently may or
+  /// may not be counted.
+  /// @param[in] lower    The smallest key of the range.
+  /// @param[in] upper    The largest key of the range.
+  uint64_t count_range(const KeyT &lower, const KeyT &upper) {
+    if (ComparatorT()(upper, lower)) {
+      return 0;
+    }
+    uint64_t upper_rank = get_rank(upper, true);
+    uint64_t lower_rank = get_rank(lower, false);
+    return upper_rank > lower_rank ? upper_rank - lower_rank : 0;
+  }
+
+  /// Get the entry at a position in key order. Requires `CountEntries`.
+  /// Is thread-safe.
+  /// @param[in] position The position, the smallest key is at 0.
+  /// @return             The key and the value, or nothing if the tree holds
+  ///                     no more than `position` entries.
+  std::optional<std::pair<KeyT, ValueT>> select(uint64_t position) {
+    static_assert(CountEntries, "select requires a B-Tree with entry counts");
+    if (this->isTreeEmpty.load()) {
+      return std::nullopt;
+    }
+    while (true) {
+      // The position within the subtree of the current node.
+      uint64_t rank = position;
+      uint64_t version;
+      auto page = descend(version, [&](const InnerNode *inner_node) {
+        uint32_t last = inner_node->get_separator_count();
+        uint32_t index = 0;
+        while (index < last && rank >= inner_node->counts[index]) {
+          rank -= inner_node->counts[index];
+          ++index;
+        }
+        return index;
+      });
+      if (!page) {
+        continue;
+      }
+      auto leaf_node = page.template get_node<LeafNode>();
+      std::optional<std::pair<KeyT, ValueT>> result;
+      if (rank < leaf_node->get_count()) {
+        result.emplace(leaf_node->keys[rank], leaf_node->values[rank]);
+      }
+      if (leaf_node->validate(version)) {
+        return result;
+      }
+    }
   }
 
   /// Lookup an entry in the tree.
+  /// Is thread-safe.
   /// @param[in] key      The key that should be searched.
   std::optional<ValueT> lookup(const KeyT &key) {
-    bool keyFound = false;
-    std::optional<ValueT> foundKey;
-    if (this->erasedKeys.find(key) != this->erasedKeys.end() || !this->root) {
-      return foundKey;
-    }
-
-    auto currPageId = *this->root;
-    int next = 0;
-    uint64_t previousParentPageId = currPageId;
-    while (!keyFound) {
-      auto &current_page = this->buffer_manager.fix_page(currPageId, false);
-      auto current_node = reinterpret_cast<Node *>(current_page.get_data());
-
-      /// If the current node is a leaf node
-      if (current_node->is_leaf()) {
-        auto leaf_node = reinterpret_cast<LeafNode *>(current_node);
-        for (int i = 0; i < leaf_node->count; i++) {
-          if (leaf_node->keys[i] == key) {
-            foundKey = leaf_node->values[i];
-            return foundKey;
-          }
+    if (this->isTreeEmpty.load()) {
+      return std::nullopt;
+    }
+
+    while (true) {
+      uint64_t version;
+      auto page = find_leaf(key, version);
+      if (!page) {
+        continue;
+      }
+      auto leaf_node = page.template get_node<LeafNode>();
+      std::optional<ValueT> result;
+      if (auto index = leaf_node->find(key)) {
+        result = leaf_node->values[*index];
+      }
+      if (leaf_node->validate(version)) {
+        return result;
+      }
+    }
+  }
+
+  /// Lookup many entries at once.
+  ///
+  /// The keys are visited in sorted order, so that neighbouring keys share
+  /// the nodes on their paths in the cache. Groups of up to
+  /// `kLookupBatchSize` keys descend together level by level: the children
+  /// of the whole group are fixed and prefetched before any of them is read,
+  /// so that their cache misses overlap instead of stalling every key at
+  /// every level. Every key of a group keeps up to two pages fixed, so the
+  /// groups are capped to fix at most an eighth of the buffer.
+  /// Is thread-safe.
+  /// @param[in] keys       The keys that should be searched.
+  /// @param[in] count      The number of keys.
+  /// @param[out] results   The `count` results, in the order of the keys.
+  void lookup_batch(const KeyT *keys, size_t count,
+                    std::optional<ValueT> *results) {
+    if (this->isTreeEmpty.load()) {
+      std::fill_n(results, count, std::nullopt);
+      return;
+    }
+    std::vector<size_t> order(count);
+    std::iota(order.begin(), order.end(), 0);
+    ComparatorT less;
+    if (!std::is_sorted(keys, keys + count, less)) {
+      std::sort(order.begin(), order.end(), [&](size_t lhs, size_t rhs) {
+        return less(keys[lhs], keys[rhs]);
+      });
+    }
+    size_t group_size = std::clamp<size_t>(
+        this->buffer_manager.get_page_count() / 16, 1, kLookupBatchSize);
+    for (size_t begin = 0; begin < count; begin += group_size) {
+      lookup_group(keys, &order[begin], std::min(group_size, count - begin),
+                   results);
+    }
+  }
+
+  /// The number of keys that descend together in `lookup_batch()`.
+  static constexpr size_t kLookupBatchSize = 16;
+
+  /// Lookup a group of at most `kLookupBatchSize` keys, see
+  /// `lookup_batch()`. Keys that run into a concurrent change are looked up
+  /// again on their own.
+  /// @param[in] keys       All keys of the batch.
+  /// @param[in] indexes    The indexes of the keys of the group.
+  /// @param[in] count      The number of keys in the group.
+  /// @param[out] results   All results of the batch.
+  void lookup_group(const KeyT *keys, const size_t *indexes, size_t count,
+                    std::optional<ValueT> *results) {
+    FixedPage pages[kLookupBatchSize];
+    uint64_t versions[kLookupBatchSize];
+    bool is_valid[kLookupBatchSize];
+    for (size_t i = 0; i < count; ++i) {
+      pages[i] = fix_node(*this->root, true);
+      is_valid[i] = pages[i].get_node()->read_lock(versions[i]);
+    }
+
+    bool has_inner_nodes = true;
+    while (has_inner_nodes) {
+      has_inner_nodes = false;
+      // Find and prefetch the children of the whole group first...
+      FixedPage child_pages[kLookupBatchSize];
+      for (size_t i = 0; i < count; ++i) {
+        if (!is_valid[i] || pages[i].get_node()->is_leaf()) {
+          continue;
+        }
+        has_inner_nodes = true;
+        auto inner_node = pages[i].template get_node<InnerNode>();
+        uint64_t child_page_id = inner_node->find_child(keys[indexes[i]]);
+        if (!inner_node->validate(versions[i])) {
+          is_valid[i] = false;
+          continue;
+        }
+        child_pages[i] = fix_node(child_page_id, inner_node->level > 1);
+        prefetch_node(child_pages[i]);
+      }
+      // ...then move every key down once its child arrived.
+      for (size_t i = 0; i < count; ++i) {
+        if (!child_pages[i]) {
+          continue;
+        }
+        uint64_t child_version;
+        if (!child_pages[i].get_node()->read_lock(child_version) ||
+            !pages[i].get_node()->validate(versions[i])) {
+          is_valid[i] = false;
+          continue;
         }
+        pages[i] = std::move(child_pages[i]);
+        versions[i] = child_version;
+      }
+    }
 
-        /// Check the children of parent node
-        currPageId = previousParentPageId;
-        next++;
-      } else
-      /// If the current node is an internal node
-      {
-        auto inner_node = reinterpret_cast<InnerNode *>(current_node);
-        if (current_node->parentPageId) {
-          previousParentPageId = *current_node->parentPageId;
+    for (size_t i = 0; i < count; ++i) {
+      const KeyT &key = keys[indexes[i]];
+      if (is_valid[i]) {
+        auto leaf_node = pages[i].template get_node<LeafNode>();
+        std::optional<ValueT> result;
+        if (auto index = leaf_node->find(key)) {
+          result = leaf_node->values[*index];
         }
-        /// move to next node
-        std::pair<uint32_t, bool> lower_bound = inner_node->lower_bound(key);
-        if (lower_bound.second) {
-          if (inner_node->count < next) {
-            return foundKey;
-          } else {
-            currPageId = inner_node->children[lower_bound.first + next];
-            next = 0;
-          }
-        } else {
-          currPageId = inner_node->children[inner_node->count - 1];
+        if (leaf_node->validate(versions[i])) {
+          results[indexes[i]] = result;
+          continue;
         }
       }
-      this->buffer_manager.unfix_page(current_page, false);
+      results[indexes[i]] = lookup(key);
+    }
+  }
+
+  /// Prefetch the parts of a node that a search reads: every few cache lines
+  /// of the first half of the page, which holds the header and the keys.
+  static void prefetch_node(const FixedPage &page) {
+    auto data = reinterpret_cast<const char *>(page.get_node());
+    for (size_t offset = 0; offset < PageSize / 2; offset += PageSize / 16) {
+      __builtin_prefetch(data + offset);
     }
-    return foundKey;
+  }
+
+  /// Scan all entries with keys in the range [lower, upper].
+  /// Is thread-safe.
+  /// @param[in] lower    The smallest key of the range.
+  /// @param[in] upper    The largest key of the range.
+  Iterator scan(const KeyT &lower, const KeyT &upper) {
+    return Iterator(*this, lower, upper);
   }
 
   /// Erase an entry in the tree.
+  /// Is thread-safe.
   /// @param[in] key      The key that should be searched.
   void erase(const KeyT &key) {
+    if (this->isTreeEmpty.load()) {
+      return;
+    }
+    while (!try_erase(key)) {
+    }
+  }
+
+  /// Tries to erase an entry, see `erase()`.
+  /// @return             False if the erase must be restarted.
+  bool try_erase(const KeyT &key) {
+    Path path;
+    if (!find_path(key, path)) {
+      return false;
+    }
+    size_t leaf_depth = path.get_size() - 1;
+    if (!path.lock(leaf_depth)) {
+      return false;
+    }
+    auto leaf_node = path.template get_node<LeafNode>(leaf_depth);
+    auto index = leaf_node->find(key);
+    if (!index) {
+      return true;
+    }
+    if constexpr (CountEntries) {
+      if (!add_to_counts(key, path, -1)) {
+        return false;
+      }
+    }
+    leaf_node->erase(*index);
+    path.get_page(leaf_depth).mark_dirty();
+    metadata->entry_count.fetch_sub(1, std::memory_order_relaxed);
+
+    // Merge underfull nodes upward for as long as their parents did not
+    // change. Nodes that stay underfull are merged by a later erase.
+    size_t depth = leaf_depth;
+    while (depth > 0 && is_underfull(path.get_node(depth)) &&
+           path.lock(depth - 1) && merge_or_balance(key, path, depth)) {
+      --depth;
+    }
+    if (depth == 0 && !path.get_node(0)->is_leaf() &&
+        path.get_node(0)->count == 1) {
+      collapse_root(path);
+    }
+    return true;
+  }
+
+  /// Write-lock all ancestors of the leaf of a path and add to the entry
+  /// counts of the children on the path. Requires `CountEntries`.
+  /// @param[in] key      The key that led to the leaf.
+  /// @param[in] path     The path to the leaf, which is write-locked.
+  /// @param[in] delta    The change of the number of entries in the leaf.
+  /// @return             False if an ancestor changed since it was read and
+  ///                     nothing was updated.
+  static bool add_to_counts(const KeyT &key, Path &path, int64_t delta) {
+    // Every count is only correct together with all counts above it, so
+    // the whole path is locked before anything changes.
+    size_t leaf_depth = path.get_size() - 1;
+    for (size_t depth = leaf_depth; depth-- > 0;) {
+      if (!path.lock(depth)) {
+        return false;
+      }
+    }
+    for (size_t depth = 0; depth < leaf_depth; ++depth) {
+      auto inner_node = path.template get_node<InnerNode>(depth);
+      inner_node->counts[inner_node->find_child_index(key)] += delta;
+      path.get_page(depth).mark_dirty();
+    }
+    return true;
+  }
+
+  /// Get the number of entries in the subtree of a node.
+  static uint64_t get_subtree_entry_count(const Node *node) {
+    if (node->is_leaf()) {
+      return node->count;
+    }
+    return static_cast<const InnerNode *>(node)->get_entry_count();
+  }
+
+  /// Does a node hold so few entries that it should be merged?
+  static bool is_underfull(const Node *node) {
+    if (node->is_leaf()) {
+      return node->count <= LeafNode::kCapacity / 4;
+    }
+    return node->count <= InnerNode::kCapacity / 4;
+  }
+
+  /// Merge an underfull node with a sibling if both fit into one node with
+  /// room to spare, otherwise move entries from the sibling over. Gives up
+  /// silently when the sibling is locked.
+  /// @param[in] key      The key that led to the node.
+  /// @param[in] path     The path to the node, write-locked at `depth` and
+  ///                     `depth - 1`.
+  /// @return             True if the nodes were merged, so that the parent
+  ///                     lost a child.
+  bool merge_or_balance(const KeyT &key, Path &path, size_t depth) {
+    auto parent_node = path.template get_node<InnerNode>(depth - 1);
+    uint32_t separator_count = parent_node->get_separator_count();
+    if (separator_count == 0) {
+      return false;
+    }
+    uint32_t index = key_search::lower_bound<KeyT, ComparatorT>(
+        parent_node->keys, separator_count, key);
+    // Prefer the right sibling, the last child can only use its left one.
+    uint32_t separator = index == separator_count ? index - 1 : index;
+    bool is_left = separator == index;
+    FixedPage sibling_page(
+        this->buffer_manager,
+        parent_node->children[is_left ? index + 1 : separator]);
+    // Somebody else may hold the sibling and wait for our nodes, so never
+    // wait for it.
+    if (!sibling_page.get_node()->try_write_lock()) {
+      return false;
+    }
+
+    FixedPage &page = path.get_page(depth);
+    FixedPage &left_page = is_left ? page : sibling_page;
+    FixedPage &right_page = is_left ? sibling_page : page;
+    auto left_node = left_page.get_node();
+    auto right_node = right_page.get_node();
+    path.get_page(depth - 1).mark_dirty();
+    left_page.mark_dirty();
+    uint32_t capacity =
+        left_node->is_leaf() ? LeafNode::kCapacity : InnerNode::kCapacity;
+    if (left_node->count + right_node->count <= capacity * 3 / 4) {
+      if (left_node->is_leaf()) {
+        static_cast<LeafNode *>(left_node)->merge(
+            *static_cast<LeafNode *>(right_node));
+      } else {
+        static_cast<InnerNode *>(left_node)->merge(
+            parent_node->keys[separator],
+            *static_cast<InnerNode *>(right_node));
+      }
+      if constexpr (CountEntries) {
+        parent_node->counts[separator] += parent_node->counts[separator + 1];
+      }
+      parent_node->erase(separator);
+      if (is_left) {
+        right_node->write_unlock_obsolete();
+      } else {
+        left_node->write_unlock();
+        path.unlock_obsolete(depth);
+      }
+      free_page(right_page.get_page_id());
+      return true;
+    }
+
+    if (left_node->is_leaf()) {
+      parent_node->keys[separator] =
+          static_cast<LeafNode *>(left_node)->balance(
+              *static_cast<LeafNode *>(right_node));
+    } else {
+      parent_node->keys[separator] =
+          static_cast<InnerNode *>(left_node)->balance(
+              parent_node->keys[separator],
+              *static_cast<InnerNode *>(right_node));
+    }
+    parent_node->set_counts(parent_node->keys[separator],
+                            {get_subtree_entry_count(left_node),
+                             get_subtree_entry_count(right_node)});
+    right_page.mark_dirty();
+    sibling_page.get_node()->write_unlock();
+    return false;
+  }
+
+  /// Replace a write-locked root that has a single child with that child.
+  /// @param[in] path     The path to the root.
+  void collapse_root(Path &path) {
+    auto root_node = path.template get_node<InnerNode>(0);
+    uint64_t child_page_id = root_node->children[0];
+    if (path.get_size() > 1 && path.is_locked(1) &&
+        path.get_page(1).get_page_id() == child_page_id) {
+      path.get_node(1)->copy_to(root_node);
+      path.unlock_obsolete(1);
+    } else {
+      FixedPage child_page(this->buffer_manager, child_page_id);
+      if (!child_page.get_node()->try_write_lock()) {
+        return;
+      }
+      child_page.get_node()->copy_to(root_node);
+      child_page.get_node()->write_unlock_obsolete();
+    }
+    metadata->root_level -= 1;
+    path.get_page(0).mark_dirty();
+    free_page(child_page_id);
+  }
+
+  /// Builds the tree bottom-up from sorted entries.
+  ///
+  /// The leaves are packed left to right, then every inner level is built
+  /// from the level below it. All pages are allocated sequentially and
+  /// written exactly once. Nodes are filled evenly with at most
+  /// `fill_factor` of their capacity, so that later inserts do not split
+  /// right away. Throws `std::logic_error` if the tree holds entries or the
+  /// keys are not strictly increasing. The nodes of a tree whose entries
+  /// were all erased are freed.
+  /// Is not thread-safe.
+  /// @param[in] first        The first `(key, value)` pair.
+  /// @param[in] last         The end of the pairs.
+  /// @param[in] fill_factor  The fill factor of the nodes in (0, 1].
+  template <typename ForwardIt>
+  void bulk_load(ForwardIt first, ForwardIt last, double fill_factor = 1.0) {
+    if (metadata->entry_count != 0) {
+      throw std::logic_error("bulk loading requires an empty B-Tree");
+    }
+    auto not_increasing = [](const auto &lhs, const auto &rhs) {
+      return !ComparatorT()(lhs.first, rhs.first);
+    };
+    if (std::adjacent_find(first, last, not_increasing) != last) {
+      throw std::logic_error("bulk loading requires strictly increasing keys");
+    }
+    uint64_t entry_count = std::distance(first, last);
+    if (entry_count == 0) {
+      return;
+    }
+    // Erases merge lazily, so empty nodes may be left below the root. The
+    // root page is overwritten below.
     if (this->root) {
-      bool keyFound = false;
-      auto currPageId = *this->root;
-      int next = 0;
-      uint64_t previousParentPageId = currPageId;
-      while (!keyFound) {
-        auto &current_page = this->buffer_manager.fix_page(currPageId, true);
-        auto current_node = reinterpret_cast<Node *>(current_page.get_data());
-        if (current_node->is_leaf()) {
-          auto leaf_node = reinterpret_cast<LeafNode *>(current_node);
-          for (int i = 0; i < leaf_node->count; i++) {
-            if (leaf_node->keys[i] == key) {
-              leaf_node->erase(i);
-              this->erasedKeys.insert(std::pair<KeyT, bool>(key, true));
-              keyFound = true;
-              break;
-            }
+      free_descendants(*this->root);
+    }
+
+    // Plan the sizes of the nodes of all levels first, so that the pages of
+    // all nodes are known when they are written.
+    uint32_t leaf_fill = std::clamp<uint32_t>(
+        LeafNode::kCapacity * fill_factor, 1, LeafNode::kCapacity);
+    uint32_t inner_fill = std::clamp<uint32_t>(
+        InnerNode::kCapacity * fill_factor, 2, InnerNode::kCapacity);
+    std::vector<std::vector<uint32_t>> node_sizes;
+    node_sizes.push_back(get_bulk_load_node_sizes(entry_count, leaf_fill, 1));
+    while (node_sizes.back().size() > 1) {
+      // An inner node with a single child would only add a level.
+      node_sizes.push_back(
+          get_bulk_load_node_sizes(node_sizes.back().size(), inner_fill, 2));
+    }
+    // The root goes to its own page, the other levels follow bottom-up.
+    std::vector<uint64_t> first_page_ids;
+    uint64_t page_count = metadata->next_page_id;
+    for (size_t level = 0; level + 1 < node_sizes.size(); ++level) {
+      first_page_ids.push_back(get_page_id(page_count));
+      page_count += node_sizes[level].size();
+    }
+    first_page_ids.push_back(get_page_id(kRootPageId));
+
+    // The largest key and the number of entries in the subtree of every
+    // node of the current level.
+    std::vector<KeyT> max_keys;
+    max_keys.reserve(node_sizes[0].size());
+    std::vector<uint64_t> entry_counts;
+    for (uint16_t level = 0; level < node_sizes.size(); ++level) {
+      auto &sizes = node_sizes[level];
+      uint64_t child_index = 0;
+      std::vector<KeyT> level_max_keys;
+      level_max_keys.reserve(sizes.size());
+      std::vector<uint64_t> level_entry_counts;
+      for (uint32_t i = 0; i < sizes.size(); ++i) {
+        FixedPage page(this->buffer_manager, first_page_ids[level] + i);
+        if (level == 0) {
+          auto leaf_node = page.template init_node<LeafNode>();
+          for (uint32_t j = 0; j < sizes[i]; ++j, ++first) {
+            leaf_node->set(j, first->first, first->second);
           }
-          currPageId = previousParentPageId;
-          next++;
-        } else {
-          auto inner_node = reinterpret_cast<InnerNode *>(current_node);
-          if (current_node->parentPageId) {
-            previousParentPageId = *current_node->parentPageId;
+          if (i + 1 < sizes.size()) {
+            leaf_node->next_leaf = first_page_ids[level] + i + 1;
+          }
+          leaf_node->count = sizes[i];
+          level_max_keys.push_back(leaf_node->keys[sizes[i] - 1]);
+          if constexpr (CountEntries) {
+            level_entry_counts.push_back(sizes[i]);
           }
-          /// move to next node
-          std::pair<uint32_t, bool> lower_bound = inner_node->lower_bound(key);
-          if (lower_bound.second) {
-            if (inner_node->count < next) {
-              keyFound = true;
-            } else {
-              currPageId = inner_node->children[lower_bound.first + next];
-              next = 0;
+        } else {
+          auto inner_node = page.template init_node<InnerNode>();
+          inner_node->level = level;
+          for (uint32_t j = 0; j < sizes[i]; ++j, ++child_index) {
+            inner_node->children[j] = first_page_ids[level - 1] + child_index;
+            if (j + 1 < sizes[i]) {
+              inner_node->keys[j] = max_keys[child_index];
             }
-          } else {
-            currPageId = inner_node->children[inner_node->count - 1];
+            if constexpr (CountEntries) {
+              inner_node->counts[j] = entry_counts[child_index];
+            }
+          }
+          inner_node->count = sizes[i];
+          level_max_keys.push_back(max_keys[child_index - 1]);
+          if constexpr (CountEntries) {
+            level_entry_counts.push_back(inner_node->get_entry_count());
           }
         }
-        this->buffer_manager.unfix_page(current_page, true);
       }
+      max_keys = std::move(level_max_keys);
+      entry_counts = std::move(level_entry_counts);
     }
+
+    metadata->has_root = true;
+    metadata->root_level = node_sizes.size() - 1;
+    metadata->next_page_id = page_count;
+    metadata->entry_count = entry_count;
+    this->root = get_page_id(kRootPageId);
+    this->isTreeEmpty = false;
   }
 
   /// Inserts a new entry into the tree.
+  /// Is thread-safe.
   /// @param[in] key      The key that should be inserted.
   /// @param[in] value    The value that should be inserted.
   void insert(const KeyT &key, const ValueT &value) {
-    if (this->isTreeEmpty) {
-      this->root = 0;
-      this->next_page_id = 1;
-      this->isTreeEmpty = false;
+    if (this->isTreeEmpty.load()) {
+      create_root();
     }
-    auto current_node_page_id = *this->root;
-    bool isKeyInserted = false;
-
-    while (!isKeyInserted) {
-      auto &current_page =
-          this->buffer_manager.fix_page(current_node_page_id, true);
-      auto current_node = reinterpret_cast<Node *>(current_page.get_data());
-      /// if root node is a leaf node
-      if (current_node->is_leaf()) {
-        auto leaf_node = static_cast<LeafNode *>(current_node);
-        /// if there is space to insert the key
-        if (leaf_node->count < leaf_node->kCapacity) {
-          leaf_node->insert(key, value);
-          this->buffer_manager.unfix_page(current_page, true);
-          isKeyInserted = true;
-        } else
-        /// no space to insert the key
-        {
-          /// create new leaf node
-          auto new_leaf_page_id = this->next_page_id;
-          this->next_page_id++;
-          auto &new_leaf_page =
-              this->buffer_manager.fix_page(new_leaf_page_id, true);
-
-          /// split the current leaf node
-          KeyT separator_key = leaf_node->split(
-              reinterpret_cast<std::byte *>(new_leaf_page.get_data()));
-          auto new_node = reinterpret_cast<Node *>(new_leaf_page.get_data());
-          auto new_leaf_node = static_cast<LeafNode *>(new_node);
-
-          /// if separator_key >= key
-          /// add new key to left subtree, otherwise add new key to right
-          /// subtree
-          if (!ComparatorT()(separator_key, key)) {
-            leaf_node->insert(key, value);
-          } else {
-            new_leaf_node->insert(key, value);
-          }
+    // Appends skip the ancestors, whose entry counts would go stale.
+    if (!CountEntries && try_append(key, value)) {
+      return;
+    }
+    auto assign = [&](ValueT &entry_value) { entry_value = value; };
+    while (!try_upsert(key, assign)) {
+    }
+  }
 
-          /// check if current node has a parent
-          if (!leaf_node->parentPageId) {
-            /// root has new page id
-            this->root = this->next_page_id;
-            this->next_page_id++;
-            auto &new_root_node_page =
-                this->buffer_manager.fix_page(*this->root, true);
-            auto new_inner_root_node =
-                reinterpret_cast<Node *>(new_root_node_page.get_data());
-            auto new_root_node = static_cast<InnerNode *>(new_inner_root_node);
-            /// increase level by 1
-            rootLevel += 1;
-            new_root_node->level = rootLevel;
-            new_root_node->keys[0] = separator_key;
-            new_root_node->children[0] = current_node_page_id;
-            new_root_node->children[1] = new_leaf_page_id;
-            new_root_node->count += 2;
-            leaf_node->parentPageId = *this->root;
-            new_leaf_node->parentPageId = *this->root;
-
-            this->buffer_manager.unfix_page(new_leaf_page, true);
-            this->buffer_manager.unfix_page(new_root_node_page, true);
-          } else {
-            /// add separator_key into existing parent node
-            auto &parent_node_page =
-                this->buffer_manager.fix_page(*leaf_node->parentPageId, true);
-            auto parent_node =
-                reinterpret_cast<Node *>(parent_node_page.get_data());
-            auto parent_inner_node = static_cast<InnerNode *>(parent_node);
-
-            std::optional<uint64_t> leftNode;
-            if (leaf_node->values[leaf_node->count - 1] <
-                new_leaf_node->values[0]) {
-              leftNode = current_node_page_id;
-            }
-            parent_inner_node->insert(separator_key, new_leaf_page_id,
-                                      leftNode);
+  /// Updates the value of a key in place, or inserts the key if it does not
+  /// exist yet. Takes a single descent, unlike a `lookup()` followed by an
+  /// `insert()`.
+  /// Is thread-safe.
+  /// @param[in] key      The key that should be updated or inserted.
+  /// @param[in] fn       Called exactly once with a reference to the value of
+  ///                     the key, or to a value-initialized `ValueT` that is
+  ///                     then inserted, e.g. `[](auto &count) { ++count; }`.
+  ///                     The leaf is write-locked during the call, so `fn`
+  ///                     must not access the tree.
+  /// @return             True if the key was inserted.
+  template <typename FnT>
+  bool upsert(const KeyT &key, FnT &&fn) {
+    if (this->isTreeEmpty.load()) {
+      create_root();
+    }
+    while (true) {
+      if (auto is_inserted = try_upsert(key, fn)) {
+        return *is_inserted;
+      }
+    }
+  }
 
-            new_leaf_node->parentPageId = *leaf_node->parentPageId;
-            this->buffer_manager.unfix_page(parent_node_page, true);
-          }
-          this->buffer_manager.unfix_page(current_page, true);
-          isKeyInserted = true;
-        }
-      } else {
-        auto inner_node = static_cast<InnerNode *>(current_node);
-        /// check capacity of inner node
-        if (inner_node->count == (inner_node->kCapacity + 1)) {
-          auto new_inner_node_page_id = this->next_page_id;
-          this->next_page_id++;
-          auto &new_inner_node_page =
-              this->buffer_manager.fix_page(new_inner_node_page_id, true);
-          KeyT separator_key = inner_node->split(
-              reinterpret_cast<std::byte *>(new_inner_node_page.get_data()));
-          auto new_node =
-              reinterpret_cast<Node *>(new_inner_node_page.get_data());
-          auto new_inner_node = static_cast<InnerNode *>(new_node);
-          new_inner_node->level = inner_node->level;
-          
-          for (int i = 0; i < new_inner_node->count; i++) {
-            auto &child = this->buffer_manager.fix_page(
-                new_inner_node->children[i], true);
-            auto child_node = reinterpret_cast<Node *>(child.get_data());
-            auto child_inner_node = static_cast<InnerNode *>(child_node);
-            child_inner_node->parentPageId = new_inner_node_page_id;
-          }
-          /// check if current inner node has a parent
-          if (!inner_node->parentPageId) {
-            /// root has new page id
-            this->root = this->next_page_id;
-            this->next_page_id++;
-            auto &new_root_node_page =
-                this->buffer_manager.fix_page(*this->root, true);
-            auto new_root_node =
-                reinterpret_cast<Node *>(new_root_node_page.get_data());
-            auto new_root_inner_node = static_cast<InnerNode *>(new_root_node);
-            /// increase level by 1
-            rootLevel += 1;
-            new_root_inner_node->level = rootLevel;
-            /// add first key
-            new_root_inner_node->keys[0] = separator_key;
-            /// add children to first key
-            new_root_inner_node->children[0] = current_node_page_id;
-            new_root_inner_node->children[1] = new_inner_node_page_id;
-            /// increase children number
-            new_root_inner_node->count += 2;
-            /// set parent page id for both inner nodes
-            inner_node->parentPageId = *this->root;
-            new_inner_node->parentPageId = *this->root;
-
-            this->buffer_manager.unfix_page(new_root_node_page, true);
-            /// move to next node
-            std::pair<uint32_t, bool> lower_bound =
-                new_root_inner_node->lower_bound(key);
-            if (lower_bound.second) {
-              /// go to lhs child
-              current_node_page_id =
-                  new_root_inner_node->children[lower_bound.first];
-            } else {
-              /// go to rhs child
-              current_node_page_id =
-                  new_root_inner_node->children[new_root_inner_node->count - 1];
-            }
-          } else {
-            /// get the parent node of the current node
-            auto &parent_node_page =
-                this->buffer_manager.fix_page(*inner_node->parentPageId, true);
-            auto parent_node =
-                reinterpret_cast<Node *>(parent_node_page.get_data());
-            auto parent_inner_node = static_cast<InnerNode *>(parent_node);
-            std::optional<uint64_t> leftNode;
-            parent_inner_node->insert(separator_key, new_inner_node_page_id,
-                                      leftNode);
-            new_inner_node->parentPageId = *inner_node->parentPageId;
-
-            /// move to next node
-            std::pair<uint32_t, bool> lower_bound =
-                parent_inner_node->lower_bound(key);
-            if (lower_bound.second) {
-              /// go to lhs child
-              current_node_page_id =
-                  parent_inner_node->children[lower_bound.first];
-            } else {
-              /// go to rhs child
-              current_node_page_id =
-                  parent_inner_node->children[parent_inner_node->count - 1];
-            }
-            this->buffer_manager.unfix_page(parent_node_page, true);
-          }
-          this->buffer_manager.unfix_page(new_inner_node_page, true);
-        } else {
-          std::pair<uint32_t, bool> lower_bound = inner_node->lower_bound(key);
-          if (lower_bound.second) {
-            current_node_page_id = inner_node->children[lower_bound.first];
-          } else {
-            current_node_page_id = inner_node->children[inner_node->count - 1];
-          }
+  /// Tries to append an entry to the rightmost leaf without descending the
+  /// tree, see `rightmost_leaf`.
+  /// @return             False if the key does not belong behind the last
+  ///                     entry of the rightmost leaf or the leaf is full.
+  bool try_append(const KeyT &key, const ValueT &value) {
+    uint64_t page_id = rightmost_leaf.load(std::memory_order_relaxed);
+    if (page_id == 0) {
+      return false;
+    }
+    FixedPage page(this->buffer_manager, page_id);
+    auto leaf_node = page.template get_node<LeafNode>();
+    uint64_t version;
+    while (leaf_node->read_lock(version)) {
+      // Only the rightmost leaf has no right sibling, unless the page was
+      // reused for an inner node in the meantime.
+      uint32_t count = leaf_node->get_count();
+      bool is_append = leaf_node->is_leaf() && !leaf_node->next_leaf &&
+                       count > 0 &&
+                       ComparatorT()(leaf_node->keys[count - 1], key);
+      if (!leaf_node->validate(version)) {
+        continue;
+      }
+      if (!is_append) {
+        break;
+      }
+      if (count == LeafNode::kCapacity) {
+        // The split in `try_upsert()` moves the hint to the new leaf.
+        return false;
+      }
+      if (leaf_node->upgrade_to_write_lock(version)) {
+        leaf_node->set(count, key, value);
+        leaf_node->count = count + 1;
+        leaf_node->write_unlock();
+        page.mark_dirty();
+        metadata->entry_count.fetch_add(1, std::memory_order_relaxed);
+        return true;
+      }
+    }
+    // The inserts stopped appending, wait for the next append before the
+    // leaf is checked again.
+    rightmost_leaf.compare_exchange_strong(page_id, 0,
+                                           std::memory_order_relaxed);
+    return false;
+  }
+
+  /// Remember the rightmost leaf for `try_append()`.
+  void set_rightmost_leaf(uint64_t page_id) {
+    if (rightmost_leaf.load(std::memory_order_relaxed) != page_id) {
+      rightmost_leaf.store(page_id, std::memory_order_relaxed);
+    }
+  }
+
+  /// Tries to update or insert an entry, see `upsert()`. `fn` is only called
+  /// once nothing can fail anymore.
+  /// @return             Whether the key was inserted, or nothing if the
+  ///                     upsert must be restarted.
+  template <typename FnT>
+  std::optional<bool> try_upsert(const KeyT &key, FnT &fn) {
+    Path path;
+    if (!find_path(key, path)) {
+      return std::nullopt;
+    }
+    size_t leaf_depth = path.get_size() - 1;
+    if (!path.lock(leaf_depth)) {
+      return std::nullopt;
+    }
+    auto leaf_node = path.template get_node<LeafNode>(leaf_depth);
+    uint32_t index = leaf_node->lower_bound(key);
+    if (index < leaf_node->count &&
+        !ComparatorT()(key, leaf_node->keys[index])) {
+      fn(leaf_node->values[index]);
+      path.get_page(leaf_depth).mark_dirty();
+      return false;
+    }
+    if constexpr (CountEntries) {
+      if (!add_to_counts(key, path, 1)) {
+        return std::nullopt;
+      }
+    }
+    if (leaf_node->count < LeafNode::kCapacity) {
+      ValueT value{};
+      fn(value);
+      leaf_node->insert_at(index, key, value);
+      metadata->entry_count.fetch_add(1, std::memory_order_relaxed);
+      path.get_page(leaf_depth).mark_dirty();
+      if (!leaf_node->next_leaf && index + 1 == leaf_node->count) {
+        set_rightmost_leaf(path.get_page(leaf_depth).get_page_id());
+      }
+      return true;
+    }
+
+    // An insert behind the last key of the rightmost leaf splits the
+    // rightmost nodes, and the following inserts are likely to do the same.
+    bool is_append =
+        !leaf_node->next_leaf &&
+        ComparatorT()(leaf_node->keys[leaf_node->count - 1], key);
+
+    // The leaf splits. Lock the full ancestors that split with it, up to the
+    // first one that has room for a separator.
+    size_t top = leaf_depth;
+    while (top > 0 && is_full(path.get_node(top))) {
+      if (!path.lock(top - 1)) {
+        return std::nullopt;
+      }
+      --top;
+    }
+
+    // Split bottom-up. Every split hands its separator and new sibling to
+    // the level above.
+    ValueT value{};
+    fn(value);
+    metadata->entry_count.fetch_add(1, std::memory_order_relaxed);
+    KeyT pending_key = key;
+    uint64_t pending_page_id = 0;
+    std::pair<uint64_t, uint64_t> pending_counts;
+    for (size_t depth = leaf_depth;; --depth) {
+      FixedPage &page = path.get_page(depth);
+      auto node = page.get_node();
+      page.mark_dirty();
+      if (!is_full(node)) {
+        insert_into(node, pending_key, value, pending_page_id, pending_counts);
+        return true;
+      }
+      if (depth == 0) {
+        auto [left_page, right_page] = split_root(page, is_append);
+        auto root_node = page.template get_node<InnerNode>();
+        auto &target = ComparatorT()(root_node->keys[0], pending_key)
+                           ? right_page
+                           : left_page;
+        insert_into(target.get_node(), pending_key, value, pending_page_id,
+                    pending_counts);
+        root_node->set_counts(
+            root_node->keys[0],
+            {get_subtree_entry_count(left_page.get_node()),
+             get_subtree_entry_count(right_page.get_node())});
+        if (is_append && depth == leaf_depth) {
+          set_rightmost_leaf(right_page.get_page_id());
         }
-        this->buffer_manager.unfix_page(current_page, true);
+        left_page.get_node()->write_unlock();
+        right_page.get_node()->write_unlock();
+        return true;
+      }
+      auto [separator_key, new_page] = split(page, is_append);
+      auto target = ComparatorT()(separator_key, pending_key)
+                        ? new_page.get_node()
+                        : node;
+      insert_into(target, pending_key, value, pending_page_id, pending_counts);
+      if (is_append && depth == leaf_depth) {
+        set_rightmost_leaf(new_page.get_page_id());
       }
+      if constexpr (CountEntries) {
+        pending_counts = {get_subtree_entry_count(node),
+                          get_subtree_entry_count(new_page.get_node())};
+      }
+      new_page.get_node()->write_unlock();
+      pending_key = separator_key;
+      pending_page_id = new_page.get_page_id();
     }
   }
+
+  /// Is a node out of room for another entry?
+  static bool is_full(const Node *node) {
+    if (node->is_leaf()) {
+      return node->count >= LeafNode::kCapacity;
+    }
+    return node->count >= InnerNode::kCapacity;
+  }
+
+  /// Insert into a write-locked node that has room: the entry if it is a
+  /// leaf, otherwise the separator `key` and its new right child, with the
+  /// entry counts `child_counts` of the split child and the new child.
+  static void insert_into(Node *node, const KeyT &key, const ValueT &value,
+                          uint64_t child_page_id,
+                          std::pair<uint64_t, uint64_t> child_counts) {
+    if (node->is_leaf()) {
+      static_cast<LeafNode *>(node)->insert(key, value);
+    } else {
+      auto inner_node = static_cast<InnerNode *>(node);
+      inner_node->insert(key, child_page_id);
+      inner_node->set_counts(key, child_counts);
+    }
+  }
+
+  /// The share of the entries that stays in the left node when the rightmost
+  /// nodes split for an insert behind all keys. The rest leaves some room
+  /// for keys that arrive slightly out of order.
+  static constexpr uint32_t kAppendSplitPercent = 90;
+
+  /// Split a write-locked node into a new right sibling.
+  /// @param[in] page       The node.
+  /// @param[in] is_append  Does the split make room for a key behind all
+  ///                       keys of the rightmost node of its level? Most
+  ///                       entries then stay in the node.
+  /// @return               The separator, i.e. the largest key that stays
+  ///                       in the node, and the page of the new sibling,
+  ///                       which is still write-locked. The sibling is
+  ///                       reachable once the separator is inserted into the
+  ///                       parent.
+  std::pair<KeyT, FixedPage> split(FixedPage &page, bool is_append) {
+    FixedPage new_page = allocate_page();
+    auto node = page.get_node();
+    uint32_t left_count = (node->count + 1) / 2;
+    if (is_append) {
+      left_count = std::clamp<uint32_t>(
+          node->count * kAppendSplitPercent / 100, 1, node->count - 1);
+    }
+    KeyT separator_key;
+    if (node->is_leaf()) {
+      auto leaf_node = static_cast<LeafNode *>(node);
+      auto new_leaf_node = new_page.template init_node<LeafNode>();
+      separator_key = leaf_node->split(
+          reinterpret_cast<std::byte *>(new_leaf_node), left_count);
+      new_leaf_node->next_leaf = leaf_node->next_leaf;
+      leaf_node->next_leaf = new_page.get_page_id();
+    } else {
+      auto inner_node = static_cast<InnerNode *>(node);
+      auto new_inner_node = new_page.template init_node<InnerNode>();
+      new_inner_node->level = inner_node->level;
+      separator_key = inner_node->split(
+          reinterpret_cast<std::byte *>(new_inner_node), left_count);
+    }
+    return {separator_key, std::move(new_page)};
+  }
+
+  /// Split the write-locked root. The root stays on its page: its content
+  /// moves to a new left child, which is then split like any other node.
+  /// @param[in] root_page  The root.
+  /// @param[in] is_append  See `split()`.
+  /// @return               The pages of the two children of the new root,
+  ///                       which are still write-locked.
+  std::pair<FixedPage, FixedPage> split_root(FixedPage &root_page,
+                                             bool is_append) {
+    FixedPage left_page = allocate_page();
+    root_page.get_node()->copy_to(left_page.get_node());
+    auto [separator_key, right_page] = split(left_page, is_append);
+
+    // Readers may still look at the root, so its version must stay intact
+    // and no constructor may reset it.
+    auto new_root_node = root_page.template get_node<InnerNode>();
+    metadata->root_level += 1;
+    new_root_node->level = metadata->root_level;
+    new_root_node->children[0] = left_page.get_page_id();
+    new_root_node->count = 1;
+    new_root_node->insert(separator_key, right_page.get_page_id());
+    return {std::move(left_page), std::move(right_page)};
+  }
 };
 
 }  // namespace buzzdb
@@ -0,0 +1,533 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+#include "buffer/buffer_manager.h"
+#include "index/key_search.h"
+#include "storage/fixed_page.h"
+#include "storage/segment.h"
+
+namespace buzzdb {
+
+/// A write-optimized B-Tree (a B^epsilon-Tree) that is stored in the pages of
+/// a segment. It trades some lookup speed for far fewer page writes on
+/// random inserts into a tree that is much larger than the buffer.
+///
+/// Inner nodes spend only an eighth of their page on separators and
+/// children, the rest holds a buffer of pending messages, i.e. inserts and
+/// erases that have not reached their leaf yet. Every insert or erase just
+/// adds a message to the buffer of the root, which stays in memory. When a
+/// buffer runs full, the messages for the child that has the most of them
+/// move down in one batch, so that writing a child page applies many
+/// messages at once instead of one. Leaves split as usual when flushed
+/// messages fill them, and children split when their buffers or separators
+/// run full. A buffer holds at most one message per key, newer messages
+/// replace older ones, and messages higher up in the tree are newer than the
+/// ones below. A lookup therefore returns the first message for its key on
+/// the way down, or the entry in the leaf.
+///
+/// Erases are blind: they do not know whether the key exists, so neither do
+/// they return it nor does the tree count its entries. Nodes do not merge;
+/// leaves that become empty stay in the tree.
+///
+/// The first page of the segment holds the metadata of the tree. Lookups
+/// share a latch on the tree, inserts and erases hold it exclusively, which
+/// protects all pages.
+template <typename KeyT, typename ValueT, typename ComparatorT, size_t PageSize>
+struct BufferedBTree : public Segment {
+  // Nodes are raw pages.
+  static_assert(std::is_trivially_copyable_v<KeyT> &&
+                    std::is_trivially_copyable_v<ValueT>,
+                "keys and values are stored in raw pages");
+
+  struct Node {
+    /// The level of the node in the tree, 0 for leaves.
+    uint16_t level;
+
+    /// The number of entries of a leaf, or of children of an inner node.
+    uint16_t count;
+
+    /// Is the node a leaf node?
+    bool is_leaf() const { return level == 0; }
+  };
+
+  /// The kinds of messages in the buffers of inner nodes.
+  enum class MessageType : uint8_t { kInsert, kErase };
+
+  struct LeafNode : public Node {
+    /// The capacity of a node.
+    static constexpr uint32_t kCapacity =
+        (PageSize - sizeof(Node) - alignof(KeyT) - alignof(ValueT)) /
+        (sizeof(KeyT) + sizeof(ValueT));
+
+    /// The keys.
+    KeyT keys[kCapacity];
+
+    /// The values.
+    ValueT values[kCapacity];
+
+    /// Get the index of the first key that is not less than a key.
+    uint32_t lower_bound(const KeyT &key) const {
+      return key_search::lower_bound<KeyT, ComparatorT>(keys, this->count,
+                                                        key);
+    }
+
+    /// Find the slot of a key.
+    std::optional<uint32_t> find(const KeyT &key) const {
+      uint32_t index = lower_bound(key);
+      if (index < this->count && !ComparatorT()(key, keys[index])) {
+        return index;
+      }
+      return std::nullopt;
+    }
+
+    /// Apply a message to the leaf, which must have room for a new key.
+    void apply(const KeyT &key, MessageType type, const ValueT &value) {
+      uint32_t index = lower_bound(key);
+      bool exists = index < this->count && !ComparatorT()(key, keys[index]);
+      uint32_t tail = this->count - index;
+      if (type == MessageType::kErase) {
+        if (exists) {
+          std::memmove(&keys[index], &keys[index + 1],
+                       (tail - 1) * sizeof(KeyT));
+          std::memmove(&values[index], &values[index + 1],
+                       (tail - 1) * sizeof(ValueT));
+          this->count--;
+        }
+      } else if (exists) {
+        values[index] = value;
+      } else {
+        std::memmove(&keys[index + 1], &keys[index], tail * sizeof(KeyT));
+        std::memmove(&values[index + 1], &values[index],
+                     tail * sizeof(ValueT));
+        keys[index] = key;
+        values[index] = value;
+        this->count++;
+      }
+    }
+
+    /// Move the upper half of the entries to an empty right sibling.
+    /// @return                 The separator, i.e. the largest key that
+    ///                         stays in the node.
+    KeyT split(LeafNode &right) {
+      uint32_t left_count = (this->count + 1) / 2;
+      right.count = this->count - left_count;
+      std::memcpy(right.keys, &keys[left_count], right.count * sizeof(KeyT));
+      std::memcpy(right.values, &values[left_count],
+                  right.count * sizeof(ValueT));
+      this->count = left_count;
+      return keys[left_count - 1];
+    }
+  };
+  static_assert(sizeof(LeafNode) <= PageSize, "a leaf must fit into a page");
+
+  struct InnerNode : public Node {
+    /// The maximum number of children. Separators and children take an
+    /// eighth of the page, which makes the fanout about the square root of
+    /// the number of keys that fit into a page.
+    static constexpr uint32_t kCapacity = std::max<size_t>(
+        4, PageSize / 8 / (sizeof(KeyT) + sizeof(uint64_t)));
+
+    /// The maximum number of buffered messages.
+    static constexpr uint32_t kBufferCapacity =
+        (PageSize - sizeof(Node) - sizeof(uint16_t) -
+         kCapacity * (sizeof(KeyT) + sizeof(uint64_t)) - alignof(KeyT) -
+         alignof(ValueT)) /
+        (sizeof(KeyT) + sizeof(ValueT) + sizeof(MessageType));
+
+    /// The number of buffered messages.
+    uint16_t message_count;
+
+    /// The separators, `count - 1` of them. The subtree of a child holds
+    /// keys up to its separator.
+    KeyT keys[kCapacity];
+
+    /// The page ids of the children.
+    uint64_t children[kCapacity];
+
+    /// The keys of the messages in ascending order.
+    KeyT message_keys[kBufferCapacity];
+
+    /// The values of insert messages.
+    ValueT message_values[kBufferCapacity];
+
+    /// The kinds of the messages.
+    MessageType message_types[kBufferCapacity];
+
+    /// Get the index of the child whose subtree contains a key.
+    uint32_t find_child_index(const KeyT &key) const {
+      return key_search::lower_bound<KeyT, ComparatorT>(keys, this->count - 1,
+                                                        key);
+    }
+
+    /// Get the index of the first message whose key is not less than a key.
+    uint32_t find_message(const KeyT &key) const {
+      return key_search::lower_bound<KeyT, ComparatorT>(message_keys,
+                                                        message_count, key);
+    }
+
+    /// Is the node out of room for another child?
+    bool is_full() const { return this->count == kCapacity; }
+
+    /// Is the buffer out of room for another message?
+    bool is_buffer_full() const { return message_count == kBufferCapacity; }
+
+    /// Add a message to a buffer that has room for it, or replace the
+    /// message for the same key.
+    void add_message(const KeyT &key, MessageType type, const ValueT &value) {
+      uint32_t index = find_message(key);
+      if (index == message_count ||
+          ComparatorT()(key, message_keys[index])) {
+        uint32_t tail = message_count - index;
+        std::memmove(&message_keys[index + 1], &message_keys[index],
+                     tail * sizeof(KeyT));
+        std::memmove(&message_values[index + 1], &message_values[index],
+                     tail * sizeof(ValueT));
+        std::memmove(&message_types[index + 1], &message_types[index],
+                     tail * sizeof(MessageType));
+        message_keys[index] = key;
+        message_count++;
+      }
+      message_values[index] = value;
+      message_types[index] = type;
+    }
+
+    /// Remove the messages in [begin, end).
+    void erase_messages(uint32_t begin, uint32_t end) {
+      uint32_t tail = message_count - end;
+      std::memmove(&message_keys[begin], &message_keys[end],
+                   tail * sizeof(KeyT));
+      std::memmove(&message_values[begin], &message_values[end],
+                   tail * sizeof(ValueT));
+      std::memmove(&message_types[begin], &message_types[end],
+                   tail * sizeof(MessageType));
+      message_count -= end - begin;
+    }
+
+    /// Get the child that the most messages are buffered for.
+    uint32_t find_fullest_child() const {
+      // Messages and separators are both sorted, so one pass over the
+      // messages counts them for all children.
+      ComparatorT less;
+      uint32_t child = 0;
+      uint32_t fullest_child = 0;
+      uint32_t run = 0;
+      uint32_t longest_run = 0;
+      for (uint32_t i = 0; i < message_count; ++i) {
+        while (child + 1 < this->count && less(keys[child], message_keys[i])) {
+          ++child;
+          run = 0;
+        }
+        if (++run > longest_run) {
+          longest_run = run;
+          fullest_child = child;
+        }
+      }
+      return fullest_child;
+    }
+
+    /// Insert the separator of a split child and the new right child.
+    void insert(const KeyT &key, uint64_t split_page) {
+      uint32_t index = find_child_index(key);
+      uint32_t tail = this->count - 1 - index;
+      std::memmove(&keys[index + 1], &keys[index], tail * sizeof(KeyT));
+      std::memmove(&children[index + 2], &children[index + 1],
+                   tail * sizeof(uint64_t));
+      keys[index] = key;
+      children[index + 1] = split_page;
+      this->count++;
+    }
+
+    /// Move the upper half of the children and their messages to an empty
+    /// right sibling.
+    /// @return                 The separator between the nodes.
+    KeyT split(InnerNode &right) {
+      uint32_t left_count = (this->count + 1) / 2;
+      KeyT separator = keys[left_count - 1];
+      right.level = this->level;
+      right.count = this->count - left_count;
+      std::memcpy(right.keys, &keys[left_count],
+                  (right.count - 1) * sizeof(KeyT));
+      std::memcpy(right.children, &children[left_count],
+                  right.count * sizeof(uint64_t));
+      this->count = left_count;
+
+      uint32_t begin = key_search::lower_bound<KeyT, ComparatorT>(
+          message_keys, message_count, separator);
+      if (begin < message_count &&
+          !ComparatorT()(separator, message_keys[begin])) {
+        ++begin;
+      }
+      right.message_count = message_count - begin;
+      std::memcpy(right.message_keys, &message_keys[begin],
+                  right.message_count * sizeof(KeyT));
+      std::memcpy(right.message_values, &message_values[begin],
+                  right.message_count * sizeof(ValueT));
+      std::memcpy(right.message_types, &message_types[begin],
+                  right.message_count * sizeof(MessageType));
+      message_count = begin;
+      return separator;
+    }
+  };
+  static_assert(sizeof(InnerNode) <= PageSize,
+                "an inner node must fit into a page");
+  static_assert(InnerNode::kBufferCapacity >= InnerNode::kCapacity,
+                "the buffer must hold at least one message per child");
+
+  struct Metadata {
+    /// Identifies a segment that holds a buffered B-Tree.
+    static constexpr uint64_t kMagic = 0x4255'5a5a'4245'5053;
+
+    /// `kMagic` once the page was initialized.
+    uint64_t magic;
+
+    /// The page size the tree was created with.
+    uint64_t page_size;
+
+    /// The page of the root.
+    uint64_t root;
+
+    /// The number of levels.
+    uint64_t height;
+
+    /// The number of segment pages that were allocated so far.
+    uint64_t next_page_id;
+  };
+
+  /// The segment page of the metadata.
+  static constexpr uint64_t kMetadataPageId = 0;
+
+  /// A page that stays fixed for the lifetime of the object. The tree latch
+  /// protects the pages, so they are fixed in shared mode.
+  using FixedPage = buzzdb::FixedPage<Node>;
+
+  /// The metadata page, which stays fixed while the tree is open.
+  FixedPage metadata_page;
+
+  /// The metadata in `metadata_page`.
+  Metadata *metadata;
+
+  /// Shared by lookups, held exclusively by inserts and erases.
+  std::shared_mutex latch;
+
+  /// Constructor. Opens the tree in the segment, or creates an empty one if
+  /// the segment does not hold a tree yet. Throws `std::logic_error` if the
+  /// tree was created with another page size.
+  BufferedBTree(uint16_t segment_id, BufferManager &buffer_manager)
+      : Segment(segment_id, buffer_manager),
+        metadata_page(buffer_manager,
+                      BufferManager::get_overall_page_id(segment_id,
+                                                         kMetadataPageId)),
+        metadata(metadata_page.template get_node<Metadata>()) {
+    if (open_metadata<Metadata>(metadata_page, PageSize, "buffered B-Tree")) {
+      return;
+    }
+    metadata->next_page_id = kMetadataPageId + 1;
+    metadata->height = 1;
+    metadata->root = allocate_page();
+    FixedPage root_page(this->buffer_manager, metadata->root);
+    auto root_node = root_page.template get_node<LeafNode>();
+    root_node->level = 0;
+    root_node->count = 0;
+    root_page.mark_dirty();
+  }
+
+  /// Destructor. Writes the metadata back.
+  ~BufferedBTree() { metadata_page.mark_dirty(); }
+
+  /// Get the number of levels.
+  /// Is thread-safe.
+  uint64_t get_height() {
+    std::shared_lock<std::shared_mutex> guard(latch);
+    return metadata->height;
+  }
+
+  /// Get the number of pages of the tree, including the metadata page.
+  /// Is thread-safe.
+  uint64_t get_page_count() {
+    std::shared_lock<std::shared_mutex> guard(latch);
+    return metadata->next_page_id;
+  }
+
+  /// Allocate a page at the end of the segment.
+  /// @return             The id of the page.
+  uint64_t allocate_page() {
+    return BufferManager::get_overall_page_id(this->segment_id,
+                                              metadata->next_page_id++);
+  }
+
+  /// Lookup an entry in the tree.
+  /// Is thread-safe.
+  /// @param[in] key      The key that should be searched.
+  std::optional<ValueT> lookup(const KeyT &key) {
+    std::shared_lock<std::shared_mutex> guard(latch);
+    uint64_t page_id = metadata->root;
+    while (true) {
+      FixedPage page(this->buffer_manager, page_id);
+      if (page.get_node()->is_leaf()) {
+        auto leaf_node = page.template get_node<LeafNode>();
+        if (auto index = leaf_node->find(key)) {
+          return leaf_node->values[*index];
+        }
+        return std::nullopt;
+      }
+      // The first message on the way down is the latest one for the key.
+      auto inner_node = page.template get_node<InnerNode>();
+      uint32_t index = inner_node->find_message(key);
+      if (index < inner_node->message_count &&
+          !ComparatorT()(key, inner_node->message_keys[index])) {
+        if (inner_node->message_types[index] == MessageType::kErase) {
+          return std::nullopt;
+        }
+        return inner_node->message_values[index];
+      }
+      page_id = inner_node->children[inner_node->find_child_index(key)];
+    }
+  }
+
+  /// Inserts a new entry into the tree or replaces the value of the key.
+  /// Is thread-safe.
+  /// @param[in] key      The key that should be inserted.
+  /// @param[in] value    The value that should be inserted.
+  void insert(const KeyT &key, const ValueT &value) {
+    apply(key, MessageType::kInsert, value);
+  }
+
+  /// Erase the entry of a key, if there is one.
+  /// Is thread-safe.
+  /// @param[in] key      The key that should be erased.
+  void erase(const KeyT &key) { apply(key, MessageType::kErase, ValueT()); }
+
+  /// Add a message to the root, or apply it if the root is a leaf.
+  void apply(const KeyT &key, MessageType type, const ValueT &value) {
+    std::unique_lock<std::shared_mutex> guard(latch);
+    while (true) {
+      FixedPage root_page(this->buffer_manager, metadata->root);
+      if (root_page.get_node()->is_leaf()) {
+        auto leaf_node = root_page.template get_node<LeafNode>();
+        if (leaf_node->count < LeafNode::kCapacity || leaf_node->find(key)) {
+          leaf_node->apply(key, type, value);
+          root_page.mark_dirty();
+          return;
+        }
+      } else {
+        auto root_node = root_page.template get_node<InnerNode>();
+        if (!root_node->is_buffer_full()) {
+          root_node->add_message(key, type, value);
+          root_page.mark_dirty();
+          return;
+        }
+        flush(root_page);
+        if (!root_node->is_full()) {
+          continue;
+        }
+      }
+      grow_root(root_page);
+    }
+  }
+
+  /// Move the messages for the child that the most messages are buffered
+  /// for down into it. Stops early when the node runs out of room for the
+  /// children that split on the way.
+  /// @param[in] page     The inner node, which has room for another child.
+  void flush(FixedPage &page) {
+    auto node = page.template get_node<InnerNode>();
+    page.mark_dirty();
+    uint32_t child_index = node->find_fullest_child();
+    uint32_t begin = child_index == 0
+                         ? 0
+                         : node->find_message(node->keys[child_index - 1]);
+    if (child_index > 0 && begin < node->message_count &&
+        !ComparatorT()(node->keys[child_index - 1],
+                       node->message_keys[begin])) {
+      ++begin;
+    }
+    // The messages of the child are its keys up to its separator, even if
+    // it splits on the way.
+    std::optional<KeyT> upper;
+    if (child_index + 1 < node->count) {
+      upper = node->keys[child_index];
+    }
+
+    ComparatorT less;
+    uint32_t end = begin;
+    while (end < node->message_count &&
+           !(upper && less(*upper, node->message_keys[end])) &&
+           !node->is_full()) {
+      const KeyT &key = node->message_keys[end];
+      MessageType type = node->message_types[end];
+      uint32_t index = node->find_child_index(key);
+      FixedPage child_page(this->buffer_manager, node->children[index]);
+      if (child_page.get_node()->is_leaf()) {
+        auto leaf_node = child_page.template get_node<LeafNode>();
+        if (leaf_node->count == LeafNode::kCapacity &&
+            type == MessageType::kInsert && !leaf_node->find(key)) {
+          split_child(node, child_page);
+          continue;
+        }
+        leaf_node->apply(key, type, node->message_values[end]);
+      } else {
+        auto child_node = child_page.template get_node<InnerNode>();
+        if (child_node->is_buffer_full()) {
+          flush(child_page);
+          if (child_node->is_full()) {
+            split_child(node, child_page);
+          }
+          continue;
+        }
+        child_node->add_message(key, type, node->message_values[end]);
+      }
+      child_page.mark_dirty();
+      ++end;
+    }
+    node->erase_messages(begin, end);
+  }
+
+  /// Split a child into a new right sibling.
+  /// @param[in] node         The parent, which has room for another child.
+  /// @param[in] child_page   The page of the child.
+  void split_child(InnerNode *node, FixedPage &child_page) {
+    FixedPage new_page(this->buffer_manager, allocate_page());
+    KeyT separator;
+    if (child_page.get_node()->is_leaf()) {
+      auto new_leaf_node = new_page.template get_node<LeafNode>();
+      new_leaf_node->level = 0;
+      separator =
+          child_page.template get_node<LeafNode>()->split(*new_leaf_node);
+    } else {
+      separator = child_page.template get_node<InnerNode>()->split(
+          *new_page.template get_node<InnerNode>());
+    }
+    node->insert(separator, new_page.get_page_id());
+    new_page.mark_dirty();
+    child_page.mark_dirty();
+  }
+
+  /// Put a new root with an empty buffer above the current root, which is
+  /// full, and split the old root.
+  /// @param[in] root_page    The page of the old root.
+  void grow_root(FixedPage &root_page) {
+    FixedPage new_root_page(this->buffer_manager, allocate_page());
+    auto new_root_node = new_root_page.template get_node<InnerNode>();
+    new_root_node->level = metadata->height;
+    new_root_node->count = 1;
+    new_root_node->message_count = 0;
+    new_root_node->children[0] = root_page.get_page_id();
+    split_child(new_root_node, root_page);
+    new_root_page.mark_dirty();
+    metadata->root = new_root_page.get_page_id();
+    metadata->height += 1;
+    metadata_page.mark_dirty();
+  }
+};
+
+}  // namespace buzzdb
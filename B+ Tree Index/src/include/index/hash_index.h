@@ -0,0 +1,536 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "buffer/buffer_manager.h"
+#include "index/key_search.h"
+#include "storage/fixed_page.h"
+#include "storage/segment.h"
+
+namespace buzzdb {
+
+/// A hash index with extendible hashing that is stored in the pages of a
+/// segment. It only supports equality lookups, which cost one access to the
+/// directory and one bucket page instead of a descent through a `BTree`.
+///
+/// The directory maps the lowest `global_depth` bits of the hash of a key to
+/// the page of its bucket. A bucket with a local depth `l` is shared by all
+/// directory slots that agree in the lowest `l` bits. When a bucket runs
+/// full, only that bucket splits in two by the next bit of the hashes, and
+/// only when its local depth reaches the global depth, the directory doubles
+/// by copying its slots. The index therefore grows one bucket at a time and
+/// never rehashes all entries. Buckets whose keys cannot be told apart by
+/// the bits the directory can hold, e.g. because their hashes collide,
+/// continue in a chain of overflow pages instead. Buckets do not merge and
+/// the directory does not shrink when entries are erased; overflow pages
+/// that become empty are reused.
+///
+/// Every bucket also stores a one-byte fingerprint of each key, taken from
+/// the bits of the hash that the directory does not use, so that a lookup
+/// compares the fingerprints of a bucket with a few vector instructions and
+/// only compares the keys that match.
+///
+/// The first page of the segment holds the metadata of the index, including
+/// the ids of the directory pages. The metadata and directory pages stay
+/// fixed while the index is open, so that a lookup only fixes its bucket.
+/// Lookups, inserts and erases share a latch on the directory and latch the
+/// bucket pages through the buffer manager. Inserts that split a bucket or
+/// need an overflow page hold the directory latch exclusively.
+template <typename KeyT, typename ValueT, size_t PageSize,
+          typename HashT = std::hash<KeyT>,
+          typename KeyEqualT = std::equal_to<KeyT>>
+struct HashIndex : public Segment {
+  // Buckets are raw pages.
+  static_assert(std::is_trivially_copyable_v<KeyT> &&
+                    std::is_trivially_copyable_v<ValueT>,
+                "keys and values are stored in raw pages");
+
+  struct Bucket {
+    /// The number of hash bits that all keys of the bucket share. Only
+    /// valid in the first page of a bucket.
+    uint16_t local_depth;
+
+    /// The number of entries in this page.
+    uint16_t count;
+
+    /// The next overflow page of the bucket, 0 for the last page.
+    uint64_t next_page;
+
+    /// The maximum number of entries in a page.
+    static constexpr uint32_t kCapacity =
+        (PageSize - 2 * sizeof(uint64_t) - alignof(KeyT) - alignof(ValueT)) /
+        (1 + sizeof(KeyT) + sizeof(ValueT));
+
+    /// The fingerprints of the keys.
+    uint8_t fingerprints[kCapacity];
+
+    /// The keys.
+    KeyT keys[kCapacity];
+
+    /// The values.
+    ValueT values[kCapacity];
+
+    /// Turn the page into an empty bucket page.
+    void init(uint16_t local_depth) {
+      this->local_depth = local_depth;
+      this->count = 0;
+      this->next_page = 0;
+    }
+
+    /// Is the page out of room for another entry?
+    bool is_full() const { return count == kCapacity; }
+
+    /// Get the index of a key.
+    /// @param[in] key          The key that should be searched.
+    /// @param[in] fingerprint  The fingerprint of the key.
+    std::optional<uint32_t> find(const KeyT &key, uint8_t fingerprint) const {
+      uint32_t index = key_search::find_fingerprint(
+          fingerprints, count, fingerprint,
+          [&](uint32_t i) { return KeyEqualT()(keys[i], key); });
+      if (index == count) {
+        return std::nullopt;
+      }
+      return index;
+    }
+
+    /// Append an entry to a page that has room for it.
+    void append(const KeyT &key, const ValueT &value, uint8_t fingerprint) {
+      fingerprints[count] = fingerprint;
+      keys[count] = key;
+      values[count] = value;
+      count++;
+    }
+
+    /// Replace the entry at `index` with the last entry of `source`, which
+    /// may be this page.
+    void replace_with_last(uint32_t index, Bucket &source) {
+      uint32_t last = --source.count;
+      fingerprints[index] = source.fingerprints[last];
+      keys[index] = source.keys[last];
+      values[index] = source.values[last];
+    }
+  };
+  static_assert(sizeof(Bucket) <= PageSize, "a bucket must fit into a page");
+
+  /// The number of directory slots per directory page.
+  static constexpr uint64_t kDirectoryFanout = PageSize / sizeof(uint64_t);
+
+  /// The maximum number of directory pages, whose ids the metadata holds.
+  static constexpr uint64_t kMaxDirectoryPages =
+      (PageSize - 8 * sizeof(uint64_t)) / sizeof(uint64_t);
+
+  /// The largest global depth whose directory fits into
+  /// `kMaxDirectoryPages` pages.
+  static constexpr uint16_t kMaxDepth = [] {
+    uint16_t depth = 0;
+    while ((uint64_t{2} << depth) <= kDirectoryFanout * kMaxDirectoryPages) {
+      depth++;
+    }
+    return depth;
+  }();
+
+  struct Metadata {
+    /// Identifies a segment that holds a hash index.
+    static constexpr uint64_t kMagic = 0x4255'5a5a'4841'5348;
+
+    /// `kMagic` once the page was initialized.
+    uint64_t magic;
+
+    /// The page size the index was created with.
+    uint64_t page_size;
+
+    /// The number of hash bits that select a directory slot.
+    uint16_t global_depth;
+
+    /// The number of segment pages that were allocated so far. Protected by
+    /// `allocator_latch`.
+    uint64_t next_page_id;
+
+    /// The first page of the free list, 0 if it is empty. Protected by
+    /// `allocator_latch`.
+    uint64_t first_free_page;
+
+    /// The number of entries in the index.
+    std::atomic<uint64_t> entry_count;
+
+    /// The number of directory pages.
+    uint64_t directory_page_count;
+
+    /// The directory pages, which hold the slots in order.
+    uint64_t directory_pages[kMaxDirectoryPages];
+  };
+  static_assert(sizeof(Metadata) <= PageSize,
+                "the metadata must fit into a page");
+
+  /// The segment page of the metadata.
+  static constexpr uint64_t kMetadataPageId = 0;
+
+  /// A page that stays fixed for the lifetime of the object.
+  using FixedPage = buzzdb::FixedPage<Bucket>;
+
+  /// The metadata page, which stays fixed while the index is open.
+  FixedPage metadata_page;
+
+  /// The metadata in `metadata_page`.
+  Metadata *metadata;
+
+  /// The directory pages, which stay fixed while the index is open.
+  std::vector<FixedPage> directory_pages;
+
+  /// Protects the directory. Held exclusively while buckets split.
+  std::shared_mutex directory_latch;
+
+  /// Protects the page allocator in the metadata.
+  std::mutex allocator_latch;
+
+  /// Constructor. Opens the index in the segment, or creates an empty one if
+  /// the segment does not hold an index yet. Throws `std::logic_error` if
+  /// the index was created with another page size.
+  HashIndex(uint16_t segment_id, BufferManager &buffer_manager)
+      : Segment(segment_id, buffer_manager),
+        metadata_page(buffer_manager,
+                      BufferManager::get_overall_page_id(segment_id,
+                                                         kMetadataPageId)),
+        metadata(metadata_page.template get_node<Metadata>()) {
+    if (open_metadata<Metadata>(metadata_page, PageSize, "hash index")) {
+      for (uint64_t i = 0; i < metadata->directory_page_count; ++i) {
+        directory_pages.emplace_back(buffer_manager,
+                                     metadata->directory_pages[i]);
+      }
+      return;
+    }
+    metadata->global_depth = 0;
+    metadata->next_page_id = kMetadataPageId + 1;
+    metadata->first_free_page = 0;
+    metadata->entry_count = 0;
+    metadata->directory_page_count = 0;
+    add_directory_page();
+    FixedPage bucket_page = allocate_page();
+    bucket_page.get_node()->init(0);
+    bucket_page.mark_dirty();
+    get_directory_slot(0) = bucket_page.get_page_id();
+  }
+
+  /// Destructor. Writes the metadata and the directory back.
+  ~HashIndex() {
+    metadata_page.mark_dirty();
+    for (auto &page : directory_pages) {
+      page.mark_dirty();
+    }
+  }
+
+  /// Get the page id of a page of the segment.
+  uint64_t get_page_id(uint64_t segment_page_id) const {
+    return BufferManager::get_overall_page_id(this->segment_id,
+                                              segment_page_id);
+  }
+
+  /// Get the number of entries.
+  /// Is thread-safe.
+  uint64_t get_entry_count() const {
+    return metadata->entry_count.load(std::memory_order_relaxed);
+  }
+
+  /// Get the number of hash bits that select a directory slot.
+  /// Is thread-safe.
+  uint16_t get_global_depth() {
+    std::shared_lock<std::shared_mutex> guard(directory_latch);
+    return metadata->global_depth;
+  }
+
+  /// Hash a key. The hash of `HashT` is mixed, since e.g. `std::hash` of
+  /// integers is the identity and leaves the low bits of strided keys equal.
+  static uint64_t get_hash(const KeyT &key) {
+    uint64_t hash = HashT()(key);
+    hash ^= hash >> 33;
+    hash *= 0xff51'afd7'ed55'8ccd;
+    hash ^= hash >> 33;
+    hash *= 0xc4ce'b9fe'1a85'ec53;
+    hash ^= hash >> 33;
+    return hash;
+  }
+
+  /// Get the fingerprint of a hash, its highest byte, which the directory
+  /// never uses.
+  static uint8_t get_fingerprint(uint64_t hash) {
+    return static_cast<uint8_t>(hash >> 56);
+  }
+
+  /// Get a directory slot. `directory_latch` must be held, exclusively to
+  /// modify the slot.
+  uint64_t &get_directory_slot(uint64_t index) {
+    return directory_pages[index / kDirectoryFanout]
+        .template get_node<uint64_t>()[index % kDirectoryFanout];
+  }
+
+  /// Get the first page of the bucket of a hash. `directory_latch` must be
+  /// held.
+  uint64_t get_bucket_page_id(uint64_t hash) {
+    uint64_t mask = (uint64_t{1} << metadata->global_depth) - 1;
+    return get_directory_slot(hash & mask);
+  }
+
+  /// Allocate a page, preferably one of the free pages. The page is fixed
+  /// exclusively.
+  FixedPage allocate_page() {
+    std::unique_lock<std::mutex> guard(allocator_latch);
+    if (metadata->first_free_page == 0) {
+      return FixedPage(this->buffer_manager,
+                       get_page_id(metadata->next_page_id++), true);
+    }
+    FixedPage page(this->buffer_manager, metadata->first_free_page, true);
+    metadata->first_free_page = *page.template get_node<uint64_t>();
+    return page;
+  }
+
+  /// Put a page that is no longer reachable on the free list.
+  void free_page(FixedPage &page) {
+    std::unique_lock<std::mutex> guard(allocator_latch);
+    *page.template get_node<uint64_t>() = metadata->first_free_page;
+    page.mark_dirty();
+    metadata->first_free_page = page.get_page_id();
+  }
+
+  /// Add a directory page. `directory_latch` must be held exclusively.
+  /// Throws `std::length_error` if the metadata has no room for its id.
+  void add_directory_page() {
+    if (metadata->directory_page_count == kMaxDirectoryPages) {
+      throw std::length_error("the hash directory is full");
+    }
+    FixedPage page = allocate_page();
+    page.mark_dirty();
+    uint64_t page_id = page.get_page_id();
+    // Directory pages stay fixed in shared mode like the metadata page.
+    page.release();
+    metadata->directory_pages[metadata->directory_page_count++] = page_id;
+    directory_pages.emplace_back(this->buffer_manager, page_id);
+  }
+
+  /// Fix all pages of a bucket exclusively.
+  /// @param[in] page_id  The first page of the bucket.
+  std::vector<FixedPage> fix_chain(uint64_t page_id) {
+    std::vector<FixedPage> chain;
+    while (page_id != 0) {
+      chain.emplace_back(this->buffer_manager, page_id, true);
+      page_id = chain.back().get_node()->next_page;
+    }
+    return chain;
+  }
+
+  /// Lookup an entry in the index.
+  /// Is thread-safe.
+  /// @param[in] key      The key that should be searched.
+  std::optional<ValueT> lookup(const KeyT &key) {
+    uint64_t hash = get_hash(key);
+    uint8_t fingerprint = get_fingerprint(hash);
+    std::shared_lock<std::shared_mutex> guard(directory_latch);
+    FixedPage page(this->buffer_manager, get_bucket_page_id(hash));
+    while (true) {
+      auto bucket = page.get_node();
+      if (auto index = bucket->find(key, fingerprint)) {
+        return bucket->values[*index];
+      }
+      if (bucket->next_page == 0) {
+        return std::nullopt;
+      }
+      // The next page is fixed before the current one is released.
+      page = FixedPage(this->buffer_manager, bucket->next_page);
+    }
+  }
+
+  /// Inserts a new entry into the index or replaces the value of the key.
+  /// Is thread-safe.
+  /// @param[in] key      The key that should be inserted.
+  /// @param[in] value    The value that should be inserted.
+  void insert(const KeyT &key, const ValueT &value) {
+    uint64_t hash = get_hash(key);
+    {
+      std::shared_lock<std::shared_mutex> guard(directory_latch);
+      auto chain = fix_chain(get_bucket_page_id(hash));
+      if (try_insert(chain, key, value, hash)) {
+        return;
+      }
+    }
+
+    // The bucket is full. Split it, or grow its overflow chain, until the
+    // key has room.
+    std::unique_lock<std::shared_mutex> guard(directory_latch);
+    while (true) {
+      auto chain = fix_chain(get_bucket_page_id(hash));
+      if (try_insert(chain, key, value, hash)) {
+        return;
+      }
+      if (can_split(chain, hash)) {
+        split(chain, hash);
+        continue;
+      }
+      append(chain, key, value, hash);
+      metadata->entry_count.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+  }
+
+  /// Insert an entry into an exclusively fixed bucket, or replace the value
+  /// of the key.
+  /// @param[in] chain    The pages of the bucket.
+  /// @return             False if the bucket is full.
+  bool try_insert(std::vector<FixedPage> &chain, const KeyT &key,
+                  const ValueT &value, uint64_t hash) {
+    uint8_t fingerprint = get_fingerprint(hash);
+    FixedPage *target = nullptr;
+    for (auto &page : chain) {
+      auto bucket = page.get_node();
+      if (auto index = bucket->find(key, fingerprint)) {
+        bucket->values[*index] = value;
+        page.mark_dirty();
+        return true;
+      }
+      if (!target && !bucket->is_full()) {
+        target = &page;
+      }
+    }
+    if (!target) {
+      return false;
+    }
+    target->get_node()->append(key, value, fingerprint);
+    target->mark_dirty();
+    metadata->entry_count.fetch_add(1, std::memory_order_relaxed);
+    return true;
+  }
+
+  /// Would splitting a full bucket, possibly repeatedly, make room for the
+  /// key with `hash`? That is the case when the bucket may get deeper and
+  /// some key differs from `hash` in a bit that the directory can use.
+  bool can_split(std::vector<FixedPage> &chain, uint64_t hash) {
+    uint16_t local_depth = chain.front().get_node()->local_depth;
+    if (local_depth == kMaxDepth) {
+      return false;
+    }
+    uint64_t mask = ((uint64_t{1} << kMaxDepth) - 1) &
+                    ~((uint64_t{1} << local_depth) - 1);
+    for (auto &page : chain) {
+      auto bucket = page.get_node();
+      for (uint32_t i = 0; i < bucket->count; ++i) {
+        if ((get_hash(bucket->keys[i]) ^ hash) & mask) {
+          return true;
+        }
+      }
+    }
+    return false;
+  }
+
+  /// Split a bucket by the next bit of the hashes of its keys and double the
+  /// directory first if the bucket is as deep as the directory.
+  /// `directory_latch` must be held exclusively.
+  /// @param[in] chain    The pages of the bucket.
+  /// @param[in] hash     A hash that belongs to the bucket.
+  void split(std::vector<FixedPage> &chain, uint64_t hash) {
+    uint16_t local_depth = chain.front().get_node()->local_depth;
+    if (local_depth == metadata->global_depth) {
+      double_directory();
+    }
+
+    // Collect the entries and keep only the first page of the chain.
+    std::vector<std::pair<KeyT, ValueT>> entries;
+    for (auto &page : chain) {
+      auto bucket = page.get_node();
+      for (uint32_t i = 0; i < bucket->count; ++i) {
+        entries.emplace_back(bucket->keys[i], bucket->values[i]);
+      }
+    }
+    while (chain.size() > 1) {
+      free_page(chain.back());
+      chain.pop_back();
+    }
+    chain.front().get_node()->init(local_depth + 1);
+    chain.front().mark_dirty();
+    std::vector<FixedPage> new_chain;
+    new_chain.push_back(allocate_page());
+    new_chain.front().get_node()->init(local_depth + 1);
+    new_chain.front().mark_dirty();
+
+    uint64_t bit = uint64_t{1} << local_depth;
+    for (auto &[key, value] : entries) {
+      uint64_t key_hash = get_hash(key);
+      append(key_hash & bit ? new_chain : chain, key, value, key_hash);
+    }
+
+    // Every other slot of the old bucket now refers to the new one.
+    uint64_t first_slot = (hash & (bit - 1)) | bit;
+    uint64_t slot_count = uint64_t{1} << metadata->global_depth;
+    for (uint64_t slot = first_slot; slot < slot_count; slot += 2 * bit) {
+      get_directory_slot(slot) = new_chain.front().get_page_id();
+    }
+  }
+
+  /// Append an entry to the last page of a bucket, or to a new overflow page
+  /// if the last page is full.
+  void append(std::vector<FixedPage> &chain, const KeyT &key,
+              const ValueT &value, uint64_t hash) {
+    if (chain.back().get_node()->is_full()) {
+      FixedPage overflow_page = allocate_page();
+      overflow_page.get_node()->init(0);
+      chain.back().get_node()->next_page = overflow_page.get_page_id();
+      chain.back().mark_dirty();
+      chain.push_back(std::move(overflow_page));
+    }
+    chain.back().get_node()->append(key, value, get_fingerprint(hash));
+    chain.back().mark_dirty();
+  }
+
+  /// Double the directory. The new upper half is a copy of the lower half.
+  /// `directory_latch` must be held exclusively.
+  void double_directory() {
+    uint64_t slot_count = uint64_t{1} << metadata->global_depth;
+    while (directory_pages.size() * kDirectoryFanout < 2 * slot_count) {
+      add_directory_page();
+    }
+    for (uint64_t slot = 0; slot < slot_count; ++slot) {
+      get_directory_slot(slot_count + slot) = get_directory_slot(slot);
+    }
+    metadata->global_depth++;
+  }
+
+  /// Erase an entry in the index. The hole is filled with the last entry of
+  /// the bucket, and its last overflow page is freed once it is empty.
+  /// Is thread-safe.
+  /// @param[in] key      The key that should be erased.
+  /// @return             False if the key was not found.
+  bool erase(const KeyT &key) {
+    uint64_t hash = get_hash(key);
+    uint8_t fingerprint = get_fingerprint(hash);
+    std::shared_lock<std::shared_mutex> guard(directory_latch);
+    auto chain = fix_chain(get_bucket_page_id(hash));
+    for (auto &page : chain) {
+      auto bucket = page.get_node();
+      auto index = bucket->find(key, fingerprint);
+      if (!index) {
+        continue;
+      }
+      auto last_bucket = chain.back().get_node();
+      bucket->replace_with_last(*index, *last_bucket);
+      page.mark_dirty();
+      chain.back().mark_dirty();
+      if (last_bucket->count == 0 && chain.size() > 1) {
+        chain[chain.size() - 2].get_node()->next_page = 0;
+        chain[chain.size() - 2].mark_dirty();
+        free_page(chain.back());
+      }
+      metadata->entry_count.fetch_sub(1, std::memory_order_relaxed);
+      return true;
+    }
+    return false;
+  }
+};
+
+}  // namespace buzzdb
@@ -0,0 +1,220 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <type_traits>
+
+#if defined(__AVX2__) || defined(__SSE4_2__)
+#include <immintrin.h>
+#endif
+
+namespace buzzdb {
+
+/// Searches within sorted key arrays of B-Tree nodes.
+///
+/// `lower_bound()` narrows the range with a branch-free binary search and,
+/// for integral keys that are ordered by `std::less`, finishes the last
+/// `kSimdWindow` keys with vector compares. The vector path is selected at
+/// compile time and needs AVX2 or SSE4.2 to be enabled (e.g. with
+/// `-march=native`); otherwise the scalar search is used for all keys.
+/// `find_fingerprint()` looks for a key by a one-byte hash of it instead,
+/// for leaves that store the hashes of their keys.
+namespace key_search {
+
+/// Returns the index of the first of the `count` sorted `keys` that is not
+/// less than `key`, or `count` if there is none. The loop only contains a
+/// conditional move, so its cost does not depend on the branch predictor.
+template <typename KeyT, typename ComparatorT>
+inline uint32_t scalar_lower_bound(const KeyT* keys, uint32_t count,
+                                   const KeyT& key) {
+  ComparatorT less;
+  const KeyT* first = keys;
+  uint32_t length = count;
+  while (length > 1) {
+    uint32_t half = length / 2;
+    first = less(first[half - 1], key) ? first + half : first;
+    length -= half;
+  }
+  return static_cast<uint32_t>(first - keys) +
+         (length == 1 && less(*first, key));
+}
+
+/// Can `count_less()` use vector instructions for the key type?
+template <typename KeyT, typename ComparatorT>
+constexpr bool kHasSimdSearch =
+#if defined(__AVX2__) || defined(__SSE4_2__)
+    std::is_integral_v<KeyT> &&
+    std::is_same_v<ComparatorT, std::less<KeyT>> &&
+    (sizeof(KeyT) == 4 || sizeof(KeyT) == 8);
+#else
+    false;
+#endif
+
+/// Number of keys that are compared with vector instructions at the end of
+/// the binary search.
+template <typename KeyT>
+constexpr uint32_t kSimdWindow = 64 / sizeof(KeyT);
+
+#if defined(__AVX2__) || defined(__SSE4_2__)
+
+/// Returns the number of the `count` keys that are less than `key`. Only
+/// defined for 32 and 64 bit integers.
+template <typename KeyT>
+inline uint32_t count_less(const KeyT* keys, uint32_t count, KeyT key) {
+  // The vector compares are signed. Flipping the sign bit maps the order of
+  // unsigned keys onto the signed order.
+  using SignedT = std::make_signed_t<KeyT>;
+  constexpr KeyT kFlip =
+      std::is_signed_v<KeyT>
+          ? KeyT{0}
+          : static_cast<KeyT>(KeyT{1} << (sizeof(KeyT) * 8 - 1));
+  uint32_t result = 0;
+  uint32_t i = 0;
+#if defined(__AVX2__)
+  constexpr uint32_t kLanes = 32 / sizeof(KeyT);
+  if constexpr (sizeof(KeyT) == 8) {
+    const __m256i flip = _mm256_set1_epi64x(static_cast<int64_t>(kFlip));
+    const __m256i needle = _mm256_set1_epi64x(
+        static_cast<int64_t>(static_cast<SignedT>(key ^ kFlip)));
+    for (; i + kLanes <= count; i += kLanes) {
+      __m256i values = _mm256_xor_si256(
+          _mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys + i)),
+          flip);
+      __m256i less = _mm256_cmpgt_epi64(needle, values);
+      result += __builtin_popcount(
+          _mm256_movemask_pd(_mm256_castsi256_pd(less)));
+    }
+  } else {
+    const __m256i flip = _mm256_set1_epi32(static_cast<int32_t>(kFlip));
+    const __m256i needle = _mm256_set1_epi32(
+        static_cast<int32_t>(static_cast<SignedT>(key ^ kFlip)));
+    for (; i + kLanes <= count; i += kLanes) {
+      __m256i values = _mm256_xor_si256(
+          _mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys + i)),
+          flip);
+      __m256i less = _mm256_cmpgt_epi32(needle, values);
+      result += __builtin_popcount(
+          _mm256_movemask_ps(_mm256_castsi256_ps(less)));
+    }
+  }
+#else
+  constexpr uint32_t kLanes = 16 / sizeof(KeyT);
+  if constexpr (sizeof(KeyT) == 8) {
+    const __m128i flip = _mm_set1_epi64x(static_cast<int64_t>(kFlip));
+    const __m128i needle = _mm_set1_epi64x(
+        static_cast<int64_t>(static_cast<SignedT>(key ^ kFlip)));
+    for (; i + kLanes <= count; i += kLanes) {
+      __m128i values = _mm_xor_si128(
+          _mm_loadu_si128(reinterpret_cast<const __m128i*>(keys + i)), flip);
+      __m128i less = _mm_cmpgt_epi64(needle, values);
+      result += __builtin_popcount(_mm_movemask_pd(_mm_castsi128_pd(less)));
+    }
+  } else {
+    const __m128i flip = _mm_set1_epi32(static_cast<int32_t>(kFlip));
+    const __m128i needle = _mm_set1_epi32(
+        static_cast<int32_t>(static_cast<SignedT>(key ^ kFlip)));
+    for (; i + kLanes <= count; i += kLanes) {
+      __m128i values = _mm_xor_si128(
+          _mm_loadu_si128(reinterpret_cast<const __m128i*>(keys + i)), flip);
+      __m128i less = _mm_cmpgt_epi32(needle, values);
+      result += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(less)));
+    }
+  }
+#endif
+  for (; i < count; ++i) {
+    result += keys[i] < key;
+  }
+  return result;
+}
+
+#endif
+
+/// Returns the index of the first of the `count` sorted `keys` that is not
+/// less than `key`, or `count` if there is none.
+template <typename KeyT, typename ComparatorT>
+inline uint32_t lower_bound(const KeyT* keys, uint32_t count,
+                            const KeyT& key) {
+#if defined(__AVX2__) || defined(__SSE4_2__)
+  if constexpr (kHasSimdSearch<KeyT, ComparatorT>) {
+    // Binary search until the remaining range fits into a few vectors.
+    ComparatorT less;
+    const KeyT* first = keys;
+    uint32_t length = count;
+    while (length > kSimdWindow<KeyT>) {
+      uint32_t half = length / 2;
+      first = less(first[half - 1], key) ? first + half : first;
+      length -= half;
+    }
+    return static_cast<uint32_t>(first - keys) +
+           count_less(first, length, key);
+  }
+#endif
+  return scalar_lower_bound<KeyT, ComparatorT>(keys, count, key);
+}
+
+/// Returns a one-byte hash of the bytes of a key. Only meaningful for keys
+/// whose equal values have equal bytes.
+template <typename KeyT>
+inline uint8_t get_fingerprint(const KeyT& key) {
+  auto bytes = reinterpret_cast<const unsigned char*>(&key);
+  uint64_t hash = 0;
+  for (size_t offset = 0; offset < sizeof(KeyT); offset += 8) {
+    uint64_t word = 0;
+    std::memcpy(&word, bytes + offset,
+                std::min<size_t>(8, sizeof(KeyT) - offset));
+    hash = (hash ^ word) * 0x9e37'79b9'7f4a'7c15;
+  }
+  // The high bits of the product depend on all bits of the key.
+  return static_cast<uint8_t>(hash >> 56);
+}
+
+/// Returns the first index `i < count` with `fingerprints[i] == fingerprint`
+/// for which `is_match(i)` holds, or `count` if there is none. Compares 32
+/// or 16 fingerprints at once with AVX2 or SSE4.2, so that most indexes are
+/// rejected without looking at their keys.
+template <typename MatchT>
+inline uint32_t find_fingerprint(const uint8_t* fingerprints, uint32_t count,
+                                 uint8_t fingerprint, MatchT is_match) {
+  uint32_t i = 0;
+#if defined(__AVX2__)
+  const __m256i needle = _mm256_set1_epi8(static_cast<char>(fingerprint));
+  for (; i + 32 <= count; i += 32) {
+    __m256i values = _mm256_loadu_si256(
+        reinterpret_cast<const __m256i*>(fingerprints + i));
+    auto mask = static_cast<uint32_t>(
+        _mm256_movemask_epi8(_mm256_cmpeq_epi8(needle, values)));
+    for (; mask != 0; mask &= mask - 1) {
+      uint32_t index = i + __builtin_ctz(mask);
+      if (is_match(index)) {
+        return index;
+      }
+    }
+  }
+#elif defined(__SSE4_2__)
+  const __m128i needle = _mm_set1_epi8(static_cast<char>(fingerprint));
+  for (; i + 16 <= count; i += 16) {
+    __m128i values =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(fingerprints + i));
+    auto mask = static_cast<uint32_t>(
+        _mm_movemask_epi8(_mm_cmpeq_epi8(needle, values)));
+    for (; mask != 0; mask &= mask - 1) {
+      uint32_t index = i + __builtin_ctz(mask);
+      if (is_match(index)) {
+        return index;
+      }
+    }
+  }
+#endif
+  for (; i < count; ++i) {
+    if (fingerprints[i] == fingerprint && is_match(i)) {
+      return i;
+    }
+  }
+  return count;
+}
+
+}  // namespace key_search
+}  // namespace buzzdb
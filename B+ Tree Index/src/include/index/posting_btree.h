@@ -0,0 +1,468 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <shared_mutex>
+#include <utility>
+#include <vector>
+
+#include "buffer/buffer_manager.h"
+#include "index/btree.h"
+
+namespace buzzdb {
+
+/// The posting list of a key in a `PostingBTree`, which the leaves of its
+/// tree store as the value of the key. Small lists are stored inline, larger
+/// ones in a chain of overflow pages.
+struct PostingList {
+  /// The maximum number of values that are stored inline.
+  static constexpr uint32_t kInlineCapacity = 3;
+
+  /// The first and the last overflow page.
+  struct Chain {
+    uint64_t first_page;
+    uint64_t last_page;
+  };
+
+  /// The number of values.
+  uint32_t count = 0;
+
+  union {
+    /// The sorted values if `count <= kInlineCapacity`.
+    uint64_t values[kInlineCapacity];
+
+    /// The overflow pages otherwise.
+    Chain chain;
+  };
+
+  /// Are the values stored in overflow pages?
+  bool is_spilled() const { return count > kInlineCapacity; }
+};
+
+/// A B+-Tree for non-unique keys. Every key maps to a sorted posting list of
+/// distinct `uint64_t` values, e.g. the tuple ids of the rows that hold the
+/// key in an indexed column.
+///
+/// The entries of the underlying `BTree` map the keys to `PostingList`s.
+/// Lists of up to `PostingList::kInlineCapacity` values sit inline in the
+/// leaves. Larger lists spill to a chain of overflow pages, which the tree
+/// allocates from its own segment. Every overflow page holds a sorted run of
+/// the values that is compressed independently of the other pages: the first
+/// value is stored as is, the remaining values as the bit-packed differences
+/// to their predecessors, with as many bits as the largest difference of the
+/// page needs. Lists of dense tuple ids therefore take about one bit per
+/// value. An insert or erase decodes and rewrites only the page of its value
+/// and splits the page if the values no longer fit.
+///
+/// Lookups share a latch on the posting lists, inserts and erases hold it
+/// exclusively. The tree itself uses optimistic lock coupling as usual.
+template <typename KeyT, typename ComparatorT, size_t PageSize>
+struct PostingBTree {
+  using Tree = BTree<KeyT, PostingList, ComparatorT, PageSize>;
+  using FixedPage = typename Tree::FixedPage;
+
+  /// An overflow page of a posting list. It keeps the node header, so that
+  /// threads that still look at a removed node that used the page before see
+  /// that the node is obsolete.
+  struct PostingPage : public Tree::Node {
+    /// The number of words for the packed differences.
+    static constexpr size_t kWordCount =
+        (PageSize - sizeof(typename Tree::Node) - 4 * sizeof(uint64_t)) /
+        sizeof(uint64_t);
+
+    /// The number of bits for the packed differences.
+    static constexpr uint64_t kBitCount = kWordCount * 64;
+
+    /// The next page of the list, 0 for the last page.
+    uint64_t next_page;
+
+    /// The smallest value of the page.
+    uint64_t first_value;
+
+    /// The largest value of the page.
+    uint64_t last_value;
+
+    /// The number of values.
+    uint32_t count;
+
+    /// The number of bits of every difference.
+    uint8_t bit_width;
+
+    /// The differences of the other values to their predecessors minus one.
+    uint64_t words[kWordCount];
+
+    /// Get the number of bits that a difference needs.
+    static uint8_t get_bit_width(uint64_t delta) {
+      return delta == 0 ? 0 : 64 - __builtin_clzll(delta);
+    }
+
+    /// Can the page hold `count` values whose differences need `bit_width`
+    /// bits? Every difference takes at least one bit of the capacity, so that
+    /// runs of consecutive values do not make a page arbitrarily large.
+    static bool fits(uint64_t count, uint8_t bit_width) {
+      return (count - 1) * std::max<uint64_t>(bit_width, 1) <= kBitCount;
+    }
+
+    /// Pack the difference of the value at `index` to its predecessor.
+    /// Differences are packed in order, so a word that the difference
+    /// reaches first is overwritten.
+    void pack(uint32_t index, uint64_t delta) {
+      if (bit_width == 0) {
+        return;
+      }
+      uint64_t bit = (index - 1) * uint64_t{bit_width};
+      uint32_t shift = bit % 64;
+      if (shift == 0) {
+        words[bit / 64] = delta;
+      } else {
+        words[bit / 64] |= delta << shift;
+      }
+      if (shift + bit_width > 64) {
+        words[bit / 64 + 1] = delta >> (64 - shift);
+      }
+    }
+
+    /// Store as many of the sorted `values` as fit into the page.
+    /// @return             The number of values that were stored, at least 1.
+    size_t encode(const uint64_t *values, size_t count) {
+      size_t n = 1;
+      uint8_t width = 0;
+      for (; n < count; ++n) {
+        uint8_t new_width =
+            std::max(width, get_bit_width(values[n] - values[n - 1] - 1));
+        if (!fits(n + 1, new_width)) {
+          break;
+        }
+        width = new_width;
+      }
+      this->first_value = values[0];
+      this->last_value = values[n - 1];
+      this->count = n;
+      this->bit_width = width;
+      for (size_t i = 1; i < n; ++i) {
+        pack(i, values[i] - values[i - 1] - 1);
+      }
+      return n;
+    }
+
+    /// Append a value that is greater than all values of the page without
+    /// decoding it.
+    /// @return             False if the page has no room for the value or
+    ///                     its difference needs more bits.
+    bool try_append(uint64_t value) {
+      uint64_t delta = value - last_value - 1;
+      if (get_bit_width(delta) > bit_width || !fits(count + 1, bit_width)) {
+        return false;
+      }
+      pack(count++, delta);
+      last_value = value;
+      return true;
+    }
+
+    /// Append the values of the page to `values`.
+    void decode(std::vector<uint64_t> &values) const {
+      uint64_t mask = bit_width == 64 ? ~uint64_t{0}
+                                      : (uint64_t{1} << bit_width) - 1;
+      uint64_t value = first_value;
+      values.push_back(value);
+      for (uint32_t i = 1; i < count; ++i) {
+        uint64_t delta = 0;
+        if (bit_width > 0) {
+          uint64_t bit = (i - 1) * uint64_t{bit_width};
+          uint32_t shift = bit % 64;
+          delta = words[bit / 64] >> shift;
+          if (shift + bit_width > 64) {
+            delta |= words[bit / 64 + 1] << (64 - shift);
+          }
+          delta &= mask;
+        }
+        value += delta + 1;
+        values.push_back(value);
+      }
+    }
+  };
+  static_assert(sizeof(PostingPage) <= PageSize,
+                "a posting page must fit into a page");
+
+  /// The buffer manager of the overflow pages.
+  BufferManager &buffer_manager;
+
+  /// The tree from the keys to their posting lists.
+  Tree tree;
+
+  /// Protects the posting lists.
+  std::shared_mutex latch;
+
+  /// Constructor. Opens the tree in the segment, or creates an empty one.
+  PostingBTree(uint16_t segment_id, BufferManager &buffer_manager)
+      : buffer_manager(buffer_manager), tree(segment_id, buffer_manager) {}
+
+  /// Get the number of distinct keys.
+  /// Is thread-safe.
+  uint64_t get_key_count() const { return tree.get_entry_count(); }
+
+  /// Get the number of values of a key.
+  /// Is thread-safe.
+  /// @param[in] key      The key that should be searched.
+  uint64_t get_value_count(const KeyT &key) {
+    auto list = tree.lookup(key);
+    return list ? list->count : 0;
+  }
+
+  /// Lookup the sorted values of a key, none if the key is not in the tree.
+  /// Is thread-safe.
+  /// @param[in] key      The key that should be searched.
+  std::vector<uint64_t> lookup(const KeyT &key) {
+    std::shared_lock<std::shared_mutex> guard(latch);
+    auto list = tree.lookup(key);
+    if (!list) {
+      return {};
+    }
+    if (!list->is_spilled()) {
+      return {list->values, list->values + list->count};
+    }
+    std::vector<uint64_t> values;
+    values.reserve(list->count);
+    for (uint64_t page_id = list->chain.first_page; page_id != 0;) {
+      FixedPage page(buffer_manager, page_id);
+      auto posting_page = page.template get_node<PostingPage>();
+      posting_page->decode(values);
+      page_id = posting_page->next_page;
+    }
+    return values;
+  }
+
+  /// Adds a value to the posting list of a key.
+  /// Is thread-safe.
+  /// @param[in] key      The key.
+  /// @param[in] value    The value that should be added.
+  /// @return             False if the list already held the value.
+  bool insert(const KeyT &key, uint64_t value) {
+    std::unique_lock<std::shared_mutex> guard(latch);
+    PostingList list = tree.lookup(key).value_or(PostingList{});
+    if (list.is_spilled()) {
+      if (!insert_into_chain(list.chain, value)) {
+        return false;
+      }
+      list.count++;
+      tree.insert(key, list);
+      return true;
+    }
+
+    uint64_t *end = list.values + list.count;
+    uint64_t *position = std::lower_bound(list.values, end, value);
+    if (position != end && *position == value) {
+      return false;
+    }
+    if (list.count < PostingList::kInlineCapacity) {
+      std::copy_backward(position, end, end + 1);
+      *position = value;
+      list.count++;
+      tree.insert(key, list);
+      return true;
+    }
+
+    // The list spills to an overflow page.
+    std::vector<uint64_t> values(list.values, position);
+    values.push_back(value);
+    values.insert(values.end(), position, end);
+    FixedPage page = allocate_page();
+    list.chain = {page.get_page_id(), page.get_page_id()};
+    store(page, values, list.chain);
+    list.count++;
+    tree.insert(key, list);
+    return true;
+  }
+
+  /// Removes a value from the posting list of a key, and the key once its
+  /// list is empty.
+  /// Is thread-safe.
+  /// @param[in] key      The key.
+  /// @param[in] value    The value that should be removed.
+  /// @return             False if the list did not hold the value.
+  bool erase(const KeyT &key, uint64_t value) {
+    std::unique_lock<std::shared_mutex> guard(latch);
+    auto list = tree.lookup(key);
+    if (!list) {
+      return false;
+    }
+    if (list->is_spilled()) {
+      if (!erase_from_chain(list->chain, value)) {
+        return false;
+      }
+      if (--list->count == PostingList::kInlineCapacity) {
+        unspill(*list);
+      }
+      tree.insert(key, *list);
+      return true;
+    }
+
+    uint64_t *end = list->values + list->count;
+    uint64_t *position = std::lower_bound(list->values, end, value);
+    if (position == end || *position != value) {
+      return false;
+    }
+    std::copy(position + 1, end, position);
+    if (--list->count == 0) {
+      tree.erase(key);
+    } else {
+      tree.insert(key, *list);
+    }
+    return true;
+  }
+
+  /// Allocate an overflow page. It reads as an obsolete node to threads that
+  /// still look at a removed node that used the page before.
+  FixedPage allocate_page() {
+    FixedPage page = tree.allocate_page();
+    auto posting_page = page.template get_node<PostingPage>();
+    posting_page->write_unlock_obsolete();
+    posting_page->next_page = 0;
+    return page;
+  }
+
+  /// Find the overflow page that a value belongs to: the last page whose
+  /// first value is not greater than the value, or the first page.
+  /// @param[in] chain      The pages of the list.
+  /// @param[in] value      The value.
+  /// @param[out] previous  If given, receives the page before the page, or
+  ///                       no page if it is the first one.
+  FixedPage find_page(const PostingList::Chain &chain, uint64_t value,
+                      FixedPage *previous = nullptr) {
+    if (!previous) {
+      // Values mostly grow, so try the last page first.
+      FixedPage page(buffer_manager, chain.last_page);
+      if (page.template get_node<PostingPage>()->first_value <= value) {
+        return page;
+      }
+    }
+    FixedPage page(buffer_manager, chain.first_page);
+    while (true) {
+      uint64_t next_page = page.template get_node<PostingPage>()->next_page;
+      if (next_page == 0) {
+        return page;
+      }
+      FixedPage next(buffer_manager, next_page);
+      if (next.template get_node<PostingPage>()->first_value > value) {
+        return page;
+      }
+      if (previous) {
+        *previous = std::move(page);
+      }
+      page = std::move(next);
+    }
+  }
+
+  /// Store sorted values in an overflow page and, if they do not fit, in new
+  /// pages that are linked behind it.
+  /// @param[in] page       The page, whose previous values are replaced.
+  /// @param[in] values     The values.
+  /// @param[in] chain      The pages of the list, updated if the last page
+  ///                       changes.
+  /// @param[in] is_append  Was the value that overflows the page appended
+  ///                       behind all others? The page then stays full,
+  ///                       otherwise it splits in half, so that further
+  ///                       values between its values fit.
+  void store(FixedPage &page, const std::vector<uint64_t> &values,
+             PostingList::Chain &chain, bool is_append = false) {
+    auto posting_page = page.template get_node<PostingPage>();
+    size_t stored = posting_page->encode(values.data(), values.size());
+    if (stored < values.size() && !is_append) {
+      stored = posting_page->encode(values.data(), (values.size() + 1) / 2);
+    }
+    page.mark_dirty();
+    uint64_t page_id = page.get_page_id();
+    // The last new page, which stays fixed until its successor is linked.
+    FixedPage new_page;
+    while (stored < values.size()) {
+      FixedPage next_page = allocate_page();
+      auto next_posting_page = next_page.template get_node<PostingPage>();
+      stored += next_posting_page->encode(values.data() + stored,
+                                          values.size() - stored);
+      next_posting_page->next_page = posting_page->next_page;
+      posting_page->next_page = next_page.get_page_id();
+      if (chain.last_page == page_id) {
+        chain.last_page = next_page.get_page_id();
+      }
+      page_id = next_page.get_page_id();
+      posting_page = next_posting_page;
+      new_page = std::move(next_page);
+    }
+  }
+
+  /// Add a value to the overflow pages of a list.
+  /// @return             False if the list already held the value.
+  bool insert_into_chain(PostingList::Chain &chain, uint64_t value) {
+    FixedPage page = find_page(chain, value);
+    auto posting_page = page.template get_node<PostingPage>();
+    bool is_append = value > posting_page->last_value;
+    if (is_append && posting_page->try_append(value)) {
+      page.mark_dirty();
+      return true;
+    }
+    std::vector<uint64_t> values;
+    posting_page->decode(values);
+    auto position = std::lower_bound(values.begin(), values.end(), value);
+    if (position != values.end() && *position == value) {
+      return false;
+    }
+    values.insert(position, value);
+    store(page, values, chain, is_append);
+    return true;
+  }
+
+  /// Remove a value from the overflow pages of a list and free the page of
+  /// the value once it is empty.
+  /// @return             False if the list did not hold the value.
+  bool erase_from_chain(PostingList::Chain &chain, uint64_t value) {
+    FixedPage previous;
+    FixedPage page = find_page(chain, value, &previous);
+    auto posting_page = page.template get_node<PostingPage>();
+    std::vector<uint64_t> values;
+    posting_page->decode(values);
+    auto position = std::lower_bound(values.begin(), values.end(), value);
+    if (position == values.end() || *position != value) {
+      return false;
+    }
+    values.erase(position);
+    if (!values.empty()) {
+      // The differences around the value merge and may need more bits.
+      store(page, values, chain);
+      return true;
+    }
+    uint64_t next_page = posting_page->next_page;
+    if (previous) {
+      previous.template get_node<PostingPage>()->next_page = next_page;
+      previous.mark_dirty();
+    } else {
+      chain.first_page = next_page;
+    }
+    if (chain.last_page == page.get_page_id()) {
+      chain.last_page = previous.get_page_id();
+    }
+    uint64_t page_id = page.get_page_id();
+    page.release();
+    tree.free_page(page_id);
+    return true;
+  }
+
+  /// Move the values of a list that shrank to `kInlineCapacity` values back
+  /// inline and free its overflow pages.
+  void unspill(PostingList &list) {
+    std::vector<uint64_t> values;
+    for (uint64_t page_id = list.chain.first_page; page_id != 0;) {
+      FixedPage page(buffer_manager, page_id);
+      auto posting_page = page.template get_node<PostingPage>();
+      posting_page->decode(values);
+      uint64_t next_page = posting_page->next_page;
+      page.release();
+      tree.free_page(page_id);
+      page_id = next_page;
+    }
+    std::copy(values.begin(), values.end(), list.values);
+  }
+};
+
+}  // namespace buzzdb
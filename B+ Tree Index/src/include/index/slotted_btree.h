@@ -0,0 +1,803 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "buffer/buffer_manager.h"
+#include "storage/fixed_page.h"
+#include "storage/segment.h"
+
+namespace buzzdb {
+
+/// A B+-Tree for variable-length byte-string keys and values that is stored
+/// in the pages of a segment.
+///
+/// Nodes are slotted pages: the header and an array of fixed-size slots grow
+/// from the front of the page, the bytes of the keys and values grow from
+/// its end towards them. The slots are sorted by key; keys are compared
+/// bytewise like `std::string_view`. In inner nodes, the value of a slot is
+/// the id of a child and the key is the largest key of that child; the last
+/// child is kept in the header. When a leaf splits, the separator that moves
+/// up is truncated to the shortest prefix that still separates both halves,
+/// which keeps inner nodes small and their fanout high.
+///
+/// Every node also stores its fence keys, the separators in its parents that
+/// bound its keys. All keys of a node share the common prefix of its fences,
+/// so the prefix is stored once and the slots only hold the rest of the
+/// keys. Searches strip the prefix from the search key once and compare the
+/// remaining suffixes.
+///
+/// Like `BTree`, the first page of the segment holds the metadata of the tree
+/// and the root always stays on the second page. Lookups and scans share a
+/// latch on the tree, inserts and erases hold it exclusively. Optimistic
+/// reads would have to check every offset they read from a slot that is
+/// modified concurrently.
+template <size_t PageSize>
+struct SlottedBTree : public Segment {
+  // Offsets within a page are stored in 16 bits.
+  static_assert(PageSize < (1u << 16), "pages must be smaller than 64 KiB");
+
+  /// An entry of a node.
+  struct Slot {
+    /// The offset of the key in the page, the value follows the key.
+    uint16_t offset;
+
+    /// The length of the key.
+    uint16_t key_length;
+
+    /// The length of the value.
+    uint16_t value_length;
+  };
+
+  struct Node {
+    /// The level in the tree.
+    uint16_t level;
+
+    /// The number of slots.
+    uint16_t count;
+
+    /// The offset of the first byte of the heap, which grows downwards.
+    uint16_t heap_begin;
+
+    /// The number of heap bytes that belong to entries and fences. Erased
+    /// entries leave gaps that are reclaimed by `compact()`.
+    uint16_t heap_size;
+
+    union {
+      /// The next leaf, 0 for the last leaf.
+      uint64_t next_leaf;
+
+      /// The last child of an inner node.
+      uint64_t upper;
+    };
+
+    /// The offset of the lower fence, which all keys of the node are greater
+    /// than. The leftmost nodes have an empty lower fence.
+    uint16_t lower_fence_offset;
+
+    /// The length of the lower fence.
+    uint16_t lower_fence_length;
+
+    /// The offset of the upper fence, which no key of the node is greater
+    /// than. The rightmost nodes have no upper fence and store 0.
+    uint16_t upper_fence_offset;
+
+    /// The length of the upper fence.
+    uint16_t upper_fence_length;
+
+    /// The length of the prefix that the fences and therefore all keys of
+    /// the node share. The slots store the keys without it.
+    uint16_t prefix_length;
+
+    /// Turn the page into an empty node. The fences must not point into the
+    /// page itself.
+    /// @param[in] level        The level in the tree.
+    /// @param[in] lower_fence  The lower fence.
+    /// @param[in] upper_fence  The upper fence, none for the rightmost nodes.
+    void init(uint16_t level, std::string_view lower_fence = {},
+              std::optional<std::string_view> upper_fence = std::nullopt) {
+      this->level = level;
+      this->count = 0;
+      this->heap_begin = PageSize;
+      this->heap_size = 0;
+      this->next_leaf = 0;
+      this->lower_fence_offset = store(lower_fence);
+      this->lower_fence_length = lower_fence.size();
+      this->upper_fence_offset = upper_fence ? store(*upper_fence) : 0;
+      this->upper_fence_length = upper_fence ? upper_fence->size() : 0;
+      this->prefix_length = get_prefix_length(lower_fence, upper_fence);
+    }
+
+    /// Is the node a leaf node?
+    bool is_leaf() const { return level == 0; }
+
+    /// Get the slots.
+    Slot *get_slots() { return reinterpret_cast<Slot *>(this + 1); }
+    const Slot *get_slots() const {
+      return reinterpret_cast<const Slot *>(this + 1);
+    }
+
+    /// Get the lower fence.
+    std::string_view get_lower_fence() const {
+      return {reinterpret_cast<const char *>(this) + lower_fence_offset,
+              lower_fence_length};
+    }
+
+    /// Get the upper fence, none for the rightmost nodes.
+    std::optional<std::string_view> get_upper_fence() const {
+      if (upper_fence_offset == 0) {
+        return std::nullopt;
+      }
+      return std::string_view(
+          reinterpret_cast<const char *>(this) + upper_fence_offset,
+          upper_fence_length);
+    }
+
+    /// Get the prefix that all keys of the node share.
+    std::string_view get_prefix() const {
+      return get_lower_fence().substr(0, prefix_length);
+    }
+
+    /// Does a key start with the prefix of the node?
+    bool has_prefix(std::string_view key) const {
+      return key.substr(0, prefix_length) == get_prefix();
+    }
+
+    /// Get the key of a slot without the prefix of the node.
+    std::string_view get_key(uint32_t index) const {
+      const Slot &slot = get_slots()[index];
+      return {reinterpret_cast<const char *>(this) + slot.offset,
+              slot.key_length};
+    }
+
+    /// Get the key of a slot including the prefix of the node.
+    std::string get_full_key(uint32_t index) const {
+      std::string key(get_prefix());
+      key += get_key(index);
+      return key;
+    }
+
+    /// Get the value of a slot.
+    std::string_view get_value(uint32_t index) const {
+      const Slot &slot = get_slots()[index];
+      return {reinterpret_cast<const char *>(this) + slot.offset +
+                  slot.key_length,
+              slot.value_length};
+    }
+
+    /// Get the child of an inner node at `index`, the last child for
+    /// `index == count`.
+    uint64_t get_child(uint32_t index) const {
+      if (index == count) {
+        return upper;
+      }
+      uint64_t child;
+      std::memcpy(&child, get_value(index).data(), sizeof(uint64_t));
+      return child;
+    }
+
+    /// Replace the child of an inner node at `index`.
+    void set_child(uint32_t index, uint64_t child) {
+      if (index == count) {
+        upper = child;
+        return;
+      }
+      std::memcpy(const_cast<char *>(get_value(index).data()), &child,
+                  sizeof(uint64_t));
+    }
+
+    /// Get the number of bytes that the entries and fences use, including
+    /// the slots.
+    size_t get_used_space() const { return count * sizeof(Slot) + heap_size; }
+
+    /// Get the number of bytes that the node uses after merging the right
+    /// sibling into it, see `merge()`.
+    size_t get_merged_size(std::string_view separator,
+                           const Node &right) const {
+      // The merged node has the outer fences of both nodes and a prefix that
+      // is no longer than theirs, so that the suffixes grow.
+      size_t prefix =
+          get_prefix_length(get_lower_fence(), right.get_upper_fence());
+      size_t size = get_used_space() - upper_fence_length +
+                    count * (prefix_length - prefix) +
+                    right.get_used_space() - right.lower_fence_length +
+                    right.count * (right.prefix_length - prefix);
+      if (!is_leaf()) {
+        size += sizeof(Slot) + separator.size() - prefix + sizeof(uint64_t);
+      }
+      return size;
+    }
+
+    /// Does an entry of `size` key and value bytes fit into the node, if
+    /// necessary after compaction?
+    bool has_room(size_t size) const {
+      return sizeof(Node) + get_used_space() + sizeof(Slot) + size <= PageSize;
+    }
+
+    /// Get the index of the first slot whose key is not less than `key`.
+    uint32_t lower_bound(std::string_view key) const {
+      // Keys that lead to the node share its prefix, all others are less or
+      // greater than all of its keys.
+      if (!has_prefix(key)) {
+        return key < get_prefix() ? 0 : count;
+      }
+      key.remove_prefix(prefix_length);
+      uint32_t first = 0;
+      uint32_t length = count;
+      while (length > 0) {
+        uint32_t half = length / 2;
+        if (get_key(first + half) < key) {
+          first += half + 1;
+          length -= half + 1;
+        } else {
+          length = half;
+        }
+      }
+      return first;
+    }
+
+    /// Get the index of the slot with a key.
+    std::optional<uint32_t> find(std::string_view key) const {
+      uint32_t index = lower_bound(key);
+      if (index < count && has_prefix(key) &&
+          get_key(index) == key.substr(prefix_length)) {
+        return index;
+      }
+      return std::nullopt;
+    }
+
+    /// Insert an entry at a slot index. The node must have room for it.
+    /// @param[in] index    The slot index.
+    /// @param[in] key      The key without the prefix of the node.
+    /// @param[in] value    The value.
+    void insert(uint32_t index, std::string_view key, std::string_view value) {
+      size_t size = key.size() + value.size();
+      if (heap_begin < sizeof(Node) + (count + 1) * sizeof(Slot) + size) {
+        compact();
+      }
+      heap_begin -= size;
+      auto data = reinterpret_cast<char *>(this) + heap_begin;
+      std::memcpy(data, key.data(), key.size());
+      std::memcpy(data + key.size(), value.data(), value.size());
+      Slot *slots = get_slots();
+      std::memmove(&slots[index + 1], &slots[index],
+                   (count - index) * sizeof(Slot));
+      slots[index] = {heap_begin, static_cast<uint16_t>(key.size()),
+                      static_cast<uint16_t>(value.size())};
+      heap_size += size;
+      count++;
+    }
+
+    /// Remove the entry at a slot index.
+    void erase(uint32_t index) {
+      Slot *slots = get_slots();
+      heap_size -= slots[index].key_length + slots[index].value_length;
+      std::memmove(&slots[index], &slots[index + 1],
+                   (count - index - 1) * sizeof(Slot));
+      count--;
+    }
+
+    /// Append the entries `[begin, end)` of another node whose keys lie
+    /// within the fences of this node.
+    void append(const Node &source, uint32_t begin, uint32_t end) {
+      if (source.prefix_length >= prefix_length) {
+        auto extension = source.get_prefix().substr(prefix_length);
+        std::string key;
+        for (uint32_t i = begin; i < end; ++i) {
+          if (extension.empty()) {
+            insert(count, source.get_key(i), source.get_value(i));
+            continue;
+          }
+          key.assign(extension);
+          key += source.get_key(i);
+          insert(count, key, source.get_value(i));
+        }
+        return;
+      }
+      size_t truncation = prefix_length - source.prefix_length;
+      for (uint32_t i = begin; i < end; ++i) {
+        insert(count, source.get_key(i).substr(truncation),
+               source.get_value(i));
+      }
+    }
+
+    /// Close the gaps that erased entries left in the heap.
+    void compact() { truncate(count); }
+
+    /// Keep the entries `[0, end)` only and close all gaps in the heap.
+    void truncate(uint32_t end) {
+      alignas(Node) std::byte buffer[PageSize];
+      std::memcpy(buffer, this, PageSize);
+      auto &source = *reinterpret_cast<const Node *>(buffer);
+      init(level, source.get_lower_fence(), source.get_upper_fence());
+      next_leaf = source.next_leaf;
+      append(source, 0, end);
+    }
+
+    /// Split the node. The upper half of the bytes moves to `right`. Both
+    /// nodes get the separator as fence and may have a longer prefix.
+    /// @param[in] right        The page of the new right sibling.
+    /// @return                 The separator: all keys of the node are not
+    ///                         greater, all keys of `right` are greater.
+    std::string split(Node &right) {
+      // Split by bytes rather than by entries, so that both halves have
+      // the same room for longer keys.
+      size_t entry_bytes =
+          get_used_space() - lower_fence_length - upper_fence_length;
+      uint32_t middle = 0;
+      size_t bytes = 0;
+      while (middle + 1 < count && 2 * bytes < entry_bytes) {
+        const Slot &slot = get_slots()[middle];
+        bytes += sizeof(Slot) + slot.key_length + slot.value_length;
+        ++middle;
+      }
+      middle = std::max<uint32_t>(middle, 1);
+
+      alignas(Node) std::byte buffer[PageSize];
+      std::memcpy(buffer, this, PageSize);
+      auto &source = *reinterpret_cast<const Node *>(buffer);
+      std::string separator;
+      if (is_leaf()) {
+        separator = get_separator(get_full_key(middle - 1),
+                                  get_full_key(middle));
+      } else {
+        separator = get_full_key(middle - 1);
+      }
+      right.init(level, separator, source.get_upper_fence());
+      right.append(source, middle, source.count);
+      init(level, source.get_lower_fence(), separator);
+      if (source.is_leaf()) {
+        next_leaf = source.next_leaf;
+        append(source, 0, middle);
+      } else {
+        // The child of the separator becomes the last child of this node.
+        right.upper = source.upper;
+        upper = source.get_child(middle - 1);
+        append(source, 0, middle - 1);
+      }
+      return separator;
+    }
+
+    /// Append all entries of the right sibling and take over its link and
+    /// upper fence. The node must have room for the merged entries, see
+    /// `get_merged_size()`.
+    /// @param[in] separator    The separator between both nodes.
+    /// @param[in] right        The right sibling.
+    void merge(std::string_view separator, const Node &right) {
+      alignas(Node) std::byte buffer[PageSize];
+      std::memcpy(buffer, this, PageSize);
+      auto &source = *reinterpret_cast<const Node *>(buffer);
+      init(level, source.get_lower_fence(), right.get_upper_fence());
+      append(source, 0, source.count);
+      if (!is_leaf()) {
+        // The last child becomes a regular child with the separator as key.
+        uint64_t child = source.upper;
+        insert(count,
+               separator.substr(prefix_length),
+               {reinterpret_cast<const char *>(&child), sizeof(uint64_t)});
+      }
+      append(right, 0, right.count);
+      next_leaf = right.next_leaf;
+    }
+
+    /// Get the shortest key that is not less than `left` and less than
+    /// `right`, given that `left < right`.
+    static std::string get_separator(std::string_view left,
+                                     std::string_view right) {
+      size_t prefix = 0;
+      while (prefix < left.size() && left[prefix] == right[prefix]) {
+        ++prefix;
+      }
+      // The first byte in which both keys differ separates them, unless it
+      // is the last byte of `right`.
+      if (prefix + 1 < right.size()) {
+        return std::string(right.substr(0, prefix + 1));
+      }
+      return std::string(left);
+    }
+
+    /// Get the length of the common prefix of two fences.
+    static uint16_t get_prefix_length(
+        std::string_view lower, std::optional<std::string_view> upper) {
+      if (!upper) {
+        return 0;
+      }
+      auto mismatch =
+          std::mismatch(lower.begin(), lower.end(), upper->begin(),
+                        upper->end());
+      return mismatch.first - lower.begin();
+    }
+
+   private:
+    /// Copy bytes to the heap.
+    /// @return             The offset of the bytes.
+    uint16_t store(std::string_view bytes) {
+      heap_begin -= bytes.size();
+      heap_size += bytes.size();
+      std::copy(bytes.begin(), bytes.end(),
+                reinterpret_cast<char *>(this) + heap_begin);
+      return heap_begin;
+    }
+  };
+
+  /// The first page of the segment, which describes the tree.
+  struct Metadata {
+    /// Identifies a segment that holds a slotted tree.
+    static constexpr uint64_t kMagic = 0x4255'5a5a'534c'4f54;
+
+    /// `kMagic` once the page was initialized.
+    uint64_t magic;
+
+    /// The page size the tree was created with.
+    uint64_t page_size;
+
+    /// The level of the root.
+    uint16_t root_level;
+
+    /// The number of segment pages that were allocated so far.
+    uint64_t next_page_id;
+
+    /// The first page of the free list, 0 if it is empty.
+    uint64_t first_free_page;
+
+    /// The number of entries in the tree.
+    uint64_t entry_count;
+  };
+
+  /// The segment page of the metadata.
+  static constexpr uint64_t kMetadataPageId = 0;
+
+  /// The segment page of the root.
+  static constexpr uint64_t kRootPageId = 1;
+
+  /// The maximum size of the key and value of an entry. Every node has room
+  /// for two fences and at least four entries, so that each half of a split
+  /// has room for a new entry and its new fences.
+  static constexpr size_t kMaxEntrySize =
+      (PageSize - sizeof(Node)) / 8 - sizeof(Slot);
+
+  /// A page that stays fixed (shared) for the lifetime of the object.
+  using FixedPage = buzzdb::FixedPage<Node>;
+
+  /// Iterates over the entries of a key range in key order. Holds the tree
+  /// latch in shared mode while it is alive.
+  class Iterator {
+   public:
+    /// Constructor.
+    /// @param[in] tree     The tree.
+    /// @param[in] lower    The smallest key of the range.
+    /// @param[in] upper    The largest key of the range.
+    Iterator(SlottedBTree &tree, std::string_view lower,
+             std::string_view upper)
+        : tree(tree), guard(tree.latch), upper(upper) {
+      page = tree.find_leaf(lower);
+      slot = page.get_node()->lower_bound(lower);
+    }
+
+    /// Move to the next entry.
+    /// @return             False if there are no more entries in the range.
+    bool next() {
+      if (!page) {
+        return false;
+      }
+      while (slot == page.get_node()->count) {
+        uint64_t next_leaf = page.get_node()->next_leaf;
+        if (next_leaf == 0) {
+          page.release();
+          return false;
+        }
+        page = FixedPage(tree.buffer_manager, next_leaf);
+        slot = 0;
+      }
+      auto node = page.get_node();
+      current_key.assign(node->get_prefix());
+      current_key += node->get_key(slot);
+      if (upper < current_key) {
+        page.release();
+        return false;
+      }
+      current = slot++;
+      return true;
+    }
+
+    /// Get the key of the current entry. Valid until `next()` is called.
+    std::string_view key() const { return current_key; }
+
+    /// Get the value of the current entry. Valid until `next()` is called.
+    std::string_view value() const {
+      return page.get_node()->get_value(current);
+    }
+
+   private:
+    SlottedBTree &tree;
+    std::shared_lock<std::shared_mutex> guard;
+    /// The current leaf, released once the iterator is exhausted.
+    FixedPage page;
+    /// The slot that `next()` moves to.
+    uint32_t slot = 0;
+    /// The slot of the current entry.
+    uint32_t current = 0;
+    /// The key of the current entry including the prefix of its leaf.
+    std::string current_key;
+    /// The largest key of the range.
+    std::string upper;
+  };
+
+  /// The metadata page, which stays fixed while the tree is open.
+  FixedPage metadata_page;
+
+  /// The metadata in `metadata_page`.
+  Metadata *metadata;
+
+  /// Protects the whole tree.
+  std::shared_mutex latch;
+
+  /// Constructor. Opens the tree in the segment, or creates an empty one if
+  /// the segment does not hold a tree yet. Throws `std::logic_error` if the
+  /// tree was created with another page size.
+  SlottedBTree(uint16_t segment_id, BufferManager &buffer_manager)
+      : Segment(segment_id, buffer_manager),
+        metadata_page(buffer_manager,
+                      BufferManager::get_overall_page_id(segment_id,
+                                                         kMetadataPageId)),
+        metadata(metadata_page.template get_node<Metadata>()) {
+    if (open_metadata<Metadata>(metadata_page, PageSize, "B-Tree")) {
+      return;
+    }
+    metadata->root_level = 0;
+    metadata->next_page_id = kRootPageId + 1;
+    metadata->first_free_page = 0;
+    metadata->entry_count = 0;
+    FixedPage root_page(buffer_manager, get_page_id(kRootPageId));
+    root_page.get_node()->init(0);
+    root_page.mark_dirty();
+  }
+
+  /// Destructor. Writes the metadata back.
+  ~SlottedBTree() { metadata_page.mark_dirty(); }
+
+  /// Get the page id of a page of the segment.
+  uint64_t get_page_id(uint64_t segment_page_id) const {
+    return BufferManager::get_overall_page_id(this->segment_id,
+                                              segment_page_id);
+  }
+
+  /// Get the number of entries.
+  /// Is thread-safe.
+  uint64_t get_entry_count() {
+    std::shared_lock<std::shared_mutex> guard(latch);
+    return metadata->entry_count;
+  }
+
+  /// Get the number of levels.
+  /// Is thread-safe.
+  uint16_t get_height() {
+    std::shared_lock<std::shared_mutex> guard(latch);
+    return metadata->root_level + 1;
+  }
+
+  /// Allocate a page for a new node, preferably one of the free pages.
+  FixedPage allocate_page() {
+    if (metadata->first_free_page == 0) {
+      return FixedPage(this->buffer_manager,
+                       get_page_id(metadata->next_page_id++));
+    }
+    FixedPage page(this->buffer_manager, metadata->first_free_page);
+    metadata->first_free_page = *page.template get_node<uint64_t>();
+    return page;
+  }
+
+  /// Put the page of a removed node on the free list.
+  void free_page(FixedPage &page) {
+    *page.template get_node<uint64_t>() = metadata->first_free_page;
+    page.mark_dirty();
+    metadata->first_free_page = page.get_page_id();
+  }
+
+  /// Descend to the leaf that may contain a key.
+  /// @param[in] key      The key that should be searched.
+  /// @param[out] path    If given, receives the inner nodes on the way.
+  FixedPage find_leaf(std::string_view key,
+                      std::vector<FixedPage> *path = nullptr) {
+    FixedPage page(this->buffer_manager, get_page_id(kRootPageId));
+    while (!page.get_node()->is_leaf()) {
+      auto node = page.get_node();
+      FixedPage child_page(this->buffer_manager,
+                           node->get_child(node->lower_bound(key)));
+      if (path) {
+        path->push_back(std::move(page));
+      }
+      page = std::move(child_page);
+    }
+    return page;
+  }
+
+  /// Lookup an entry in the tree.
+  /// Is thread-safe.
+  /// @param[in] key      The key that should be searched.
+  std::optional<std::string> lookup(std::string_view key) {
+    std::shared_lock<std::shared_mutex> guard(latch);
+    auto page = find_leaf(key);
+    auto node = page.get_node();
+    if (auto index = node->find(key)) {
+      return std::string(node->get_value(*index));
+    }
+    return std::nullopt;
+  }
+
+  /// Scan all entries with keys in the range [lower, upper].
+  /// Is thread-safe.
+  /// @param[in] lower    The smallest key of the range.
+  /// @param[in] upper    The largest key of the range.
+  Iterator scan(std::string_view lower, std::string_view upper) {
+    return Iterator(*this, lower, upper);
+  }
+
+  /// Inserts a new entry into the tree or replaces the value of the key.
+  /// Throws `std::length_error` if the entry exceeds `kMaxEntrySize`.
+  /// Is thread-safe.
+  /// @param[in] key      The key that should be inserted.
+  /// @param[in] value    The value that should be inserted.
+  void insert(std::string_view key, std::string_view value) {
+    if (key.size() + value.size() > kMaxEntrySize ||
+        key.size() + sizeof(uint64_t) > kMaxEntrySize) {
+      throw std::length_error("the B-Tree entry is too large");
+    }
+    std::unique_lock<std::shared_mutex> guard(latch);
+    std::vector<FixedPage> path;
+    path.push_back(find_leaf(key, &path));
+    auto leaf_node = path.back().get_node();
+    if (auto index = leaf_node->find(key)) {
+      leaf_node->erase(*index);
+    } else {
+      metadata->entry_count++;
+    }
+
+    // Insert bottom-up. Every split hands its separator to the level above,
+    // together with the split node as left and the new node as right child.
+    std::string_view pending_key = key;
+    std::string_view pending_value = value;
+    std::string separator;
+    uint64_t left_child = 0;
+    uint64_t right_child = 0;
+    for (size_t depth = path.size(); depth-- > 0;) {
+      FixedPage &page = path[depth];
+      auto node = page.get_node();
+      page.mark_dirty();
+      size_t size =
+          pending_key.size() - node->prefix_length + pending_value.size();
+      if (node->has_room(size)) {
+        insert_entry(node, pending_key, pending_value, right_child);
+        return;
+      }
+      FixedPage left_page;
+      FixedPage right_page = allocate_page();
+      right_page.mark_dirty();
+      if (depth == 0) {
+        // The root stays on its page, its content moves to a new left
+        // child that is split instead.
+        left_page = allocate_page();
+        std::memcpy(left_page.get_node(), node, PageSize);
+        left_page.mark_dirty();
+      }
+      Node *left_node = depth == 0 ? left_page.get_node() : node;
+      std::string new_separator = left_node->split(*right_page.get_node());
+      if (left_node->is_leaf()) {
+        right_page.get_node()->next_leaf = left_node->next_leaf;
+        left_node->next_leaf = right_page.get_page_id();
+      }
+      auto target =
+          pending_key <= new_separator ? left_node : right_page.get_node();
+      insert_entry(target, pending_key, pending_value, right_child);
+
+      separator = std::move(new_separator);
+      pending_key = separator;
+      left_child = depth == 0 ? left_page.get_page_id() : page.get_page_id();
+      pending_value = {reinterpret_cast<const char *>(&left_child),
+                       sizeof(uint64_t)};
+      right_child = right_page.get_page_id();
+      if (depth == 0) {
+        node->init(++metadata->root_level);
+        insert_entry(node, pending_key, pending_value, right_child);
+      }
+    }
+  }
+
+  /// Insert an entry into a node that has room for it and whose fences
+  /// include the key. In an inner node the entry is a separator and its left
+  /// child; the child after it is replaced with `right_child`.
+  static void insert_entry(Node *node, std::string_view key,
+                           std::string_view value, uint64_t right_child) {
+    uint32_t index = node->lower_bound(key);
+    node->insert(index, key.substr(node->prefix_length), value);
+    if (!node->is_leaf()) {
+      node->set_child(index + 1, right_child);
+    }
+  }
+
+  /// Erase an entry in the tree.
+  /// Is thread-safe.
+  /// @param[in] key      The key that should be erased.
+  /// @return             False if the key was not found.
+  bool erase(std::string_view key) {
+    std::unique_lock<std::shared_mutex> guard(latch);
+    std::vector<FixedPage> path;
+    path.push_back(find_leaf(key, &path));
+    auto leaf_node = path.back().get_node();
+    auto index = leaf_node->find(key);
+    if (!index) {
+      return false;
+    }
+    leaf_node->erase(*index);
+    path.back().mark_dirty();
+    metadata->entry_count--;
+
+    // Merge nodes that are nearly empty with a sibling, bottom-up.
+    size_t depth = path.size() - 1;
+    while (depth > 0 && is_underfull(path[depth].get_node()) &&
+           merge(key, path[depth - 1], path[depth])) {
+      --depth;
+    }
+    auto root_node = path[0].get_node();
+    if (!root_node->is_leaf() && root_node->count == 0) {
+      FixedPage child_page(this->buffer_manager, root_node->upper);
+      std::memcpy(root_node, child_page.get_node(), PageSize);
+      metadata->root_level--;
+      free_page(child_page);
+    }
+    return true;
+  }
+
+  /// Does a node use so little space that it should be merged?
+  static bool is_underfull(const Node *node) {
+    return node->get_used_space() < (PageSize - sizeof(Node)) / 4;
+  }
+
+  /// Merge a node with a sibling if both fit into one node with room to
+  /// spare.
+  /// @param[in] key            The key that led to the node.
+  /// @param[in] parent_page    The parent of the node.
+  /// @param[in] page           The node.
+  /// @return                   True if the nodes were merged, so that the
+  ///                           parent lost a child.
+  bool merge(std::string_view key, FixedPage &parent_page, FixedPage &page) {
+    auto parent_node = parent_page.get_node();
+    if (parent_node->count == 0) {
+      return false;
+    }
+    // Prefer the right sibling, the last child can only use its left one.
+    uint32_t index = parent_node->lower_bound(key);
+    uint32_t separator = index == parent_node->count ? index - 1 : index;
+    FixedPage sibling_page(
+        this->buffer_manager,
+        parent_node->get_child(separator == index ? index + 1 : separator));
+    FixedPage &left_page = separator == index ? page : sibling_page;
+    FixedPage &right_page = separator == index ? sibling_page : page;
+    auto left_node = left_page.get_node();
+    auto right_node = right_page.get_node();
+    std::string separator_key = parent_node->get_full_key(separator);
+    size_t merged_size = left_node->get_merged_size(separator_key, *right_node);
+    if (merged_size > (PageSize - sizeof(Node)) * 3 / 4) {
+      return false;
+    }
+    left_node->merge(separator_key, *right_node);
+    parent_node->set_child(separator + 1, left_page.get_page_id());
+    parent_node->erase(separator);
+    left_page.mark_dirty();
+    parent_page.mark_dirty();
+    free_page(right_page);
+    return true;
+  }
+};
+
+}  // namespace buzzdb
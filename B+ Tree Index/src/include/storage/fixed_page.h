@@ -0,0 +1,128 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#include "buffer/buffer_manager.h"
+
+namespace buzzdb {
+
+/// A page that stays fixed for the lifetime of the object, or a page that
+/// is pinned elsewhere and only referred to. The indexes keep their nodes,
+/// buckets and metadata in such pages.
+/// @tparam DefaultT  The structure that `get_node()` returns by default.
+template <typename DefaultT>
+class FixedPage {
+ public:
+  /// Constructor. Holds no page.
+  FixedPage() = default;
+
+  /// Constructor. Fixes the page `page_id`.
+  FixedPage(BufferManager &buffer_manager, uint64_t page_id,
+            bool exclusive = false)
+      : buffer_manager(&buffer_manager),
+        frame(&buffer_manager.fix_page(page_id, exclusive)),
+        page_id(page_id) {}
+
+  /// Constructor. Refers to a pinned page without fixing it again. When the
+  /// page is released after `mark_dirty()`, `is_pin_dirty` is set, so that
+  /// the page is written back when it is unpinned.
+  FixedPage(BufferFrame &frame, uint64_t page_id,
+            std::atomic<bool> &is_pin_dirty)
+      : frame(&frame), page_id(page_id), is_pin_dirty(&is_pin_dirty) {}
+
+  FixedPage(const FixedPage &) = delete;
+  FixedPage &operator=(const FixedPage &) = delete;
+
+  FixedPage(FixedPage &&other) noexcept { *this = std::move(other); }
+
+  FixedPage &operator=(FixedPage &&other) noexcept {
+    if (this != &other) {
+      release();
+      buffer_manager = other.buffer_manager;
+      frame = std::exchange(other.frame, nullptr);
+      page_id = other.page_id;
+      is_dirty = other.is_dirty;
+      is_pin_dirty = other.is_pin_dirty;
+    }
+    return *this;
+  }
+
+  /// Destructor. Unfixes the page.
+  ~FixedPage() { release(); }
+
+  /// Does the object hold a page?
+  explicit operator bool() const { return frame != nullptr; }
+
+  /// Get the id of the page.
+  uint64_t get_page_id() const { return page_id; }
+
+  /// Get the data of the page.
+  char *get_data() const { return frame->get_data(); }
+
+  /// Get the node or other structure that is stored in the page.
+  template <typename T = DefaultT>
+  T *get_node() const {
+    return reinterpret_cast<T *>(frame->get_data());
+  }
+
+  /// Write the page back when it is unfixed.
+  void mark_dirty() { is_dirty = true; }
+
+  /// Unfix the page early.
+  void release() {
+    if (frame && buffer_manager) {
+      buffer_manager->unfix_page(*frame, is_dirty);
+    } else if (frame && is_dirty && is_pin_dirty) {
+      is_pin_dirty->store(true, std::memory_order_relaxed);
+    }
+    frame = nullptr;
+    is_dirty = false;
+  }
+
+ private:
+  /// Not set for pinned pages, which are written back when they are
+  /// unpinned.
+  BufferManager *buffer_manager = nullptr;
+  BufferFrame *frame = nullptr;
+  uint64_t page_id = 0;
+  bool is_dirty = false;
+  /// The dirty flag of the pin, only set for pinned pages.
+  std::atomic<bool> *is_pin_dirty = nullptr;
+};
+
+/// Opens the metadata of an index in its metadata page. `MetadataT` must
+/// start with the fields `magic` and `page_size`, and define the constant
+/// `kMagic` that identifies the kind of index.
+/// Returns true if the page already holds the metadata of such an index.
+/// Otherwise constructs empty metadata with `kMagic` and `page_size`, marks
+/// the page dirty and returns false, and the caller initializes the rest.
+/// Throws `std::logic_error` if the index was created with another page
+/// size.
+/// @param[in] page         The metadata page.
+/// @param[in] page_size    The page size of the index.
+/// @param[in] index_name   The kind of index, for the error message.
+template <typename MetadataT, typename DefaultT>
+bool open_metadata(FixedPage<DefaultT> &page, size_t page_size,
+                   const char *index_name) {
+  auto metadata = page.template get_node<MetadataT>();
+  if (metadata->magic == MetadataT::kMagic) {
+    if (metadata->page_size != page_size) {
+      throw std::logic_error(std::string("the segment holds a ") + index_name +
+                             " of another page size");
+    }
+    return true;
+  }
+  metadata = new (page.get_data()) MetadataT();
+  metadata->magic = MetadataT::kMagic;
+  metadata->page_size = page_size;
+  page.mark_dirty();
+  return false;
+}
+
+}  // namespace buzzdb
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <unistd.h>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+
+#include "buffer/buffer_manager.h"
+#include "storage/file.h"
+
+namespace buzzdb {
+
+/// A temporary directory for the segment files of a test, so that buffer
+/// managers that are created one after another work on the same segments.
+/// The directory is removed together with the object.
+class TestSegmentDirectory {
+ private:
+  std::filesystem::path path;
+
+ public:
+  /// Constructor. Creates the directory `<name>.<pid>` in the temporary
+  /// directory of the system.
+  explicit TestSegmentDirectory(const std::string& name)
+      : path(std::filesystem::temp_directory_path() /
+             (name + "." + std::to_string(::getpid()))) {
+    std::filesystem::create_directory(path);
+  }
+
+  TestSegmentDirectory(const TestSegmentDirectory&) = delete;
+  TestSegmentDirectory& operator=(const TestSegmentDirectory&) = delete;
+
+  /// Destructor. Removes the directory and the segment files.
+  ~TestSegmentDirectory() { std::filesystem::remove_all(path); }
+
+  /// Returns an opener for `BufferManager` that opens the file of a segment
+  /// in this directory.
+  BufferManager::SegmentFileOpener get_opener() const {
+    return [path = path](uint16_t segment_id) {
+      auto file_path = path / std::to_string(segment_id);
+      return File::open_file(file_path.c_str(), File::WRITE);
+    };
+  }
+};
+
+}  // namespace buzzdb
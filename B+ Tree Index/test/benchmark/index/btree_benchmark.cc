@@ -0,0 +1,719 @@
+#include <benchmark/benchmark.h>
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <numeric>
+#include <optional>
+#include <random>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "buffer/buffer_manager.h"
+#include "index/btree.h"
+#include "index/buffered_btree.h"
+#include "index/hash_index.h"
+#include "index/key_search.h"
+
+namespace {
+
+using BufferManager = buzzdb::BufferManager;
+using BTree = buzzdb::BTree<uint64_t, uint64_t, std::less<uint64_t>, 4096>;
+using LeafNode = BTree::LeafNode;
+using BufferedBTree =
+    buzzdb::BufferedBTree<uint64_t, uint64_t, std::less<uint64_t>, 4096>;
+
+/// The number of buffer frames, so that all trees stay in memory unless a
+/// benchmark limits the buffer.
+constexpr size_t kPageCount = 1 << 18;
+
+/// Returns `count` random probes for the keys `0, 2, 4, ...` of a full leaf.
+std::vector<uint64_t> get_leaf_probes(size_t count) {
+  std::mt19937_64 engine{0};
+  std::uniform_int_distribution<uint64_t> distr{0, 2 * LeafNode::kCapacity};
+  std::vector<uint64_t> probes(count);
+  for (auto &probe : probes) {
+    probe = distr(engine);
+  }
+  return probes;
+}
+
+std::vector<uint64_t> get_leaf_keys() {
+  std::vector<uint64_t> keys(LeafNode::kCapacity);
+  for (size_t i = 0; i < keys.size(); ++i) {
+    keys[i] = 2 * i;
+  }
+  return keys;
+}
+
+/// The linear scan `lookup` used before the binary search.
+void BM_LeafSearchLinear(benchmark::State &state) {
+  auto keys = get_leaf_keys();
+  auto probes = get_leaf_probes(1024);
+  size_t i = 0;
+  for (auto _ : state) {
+    auto probe = probes[i++ % probes.size()];
+    uint32_t index = 0;
+    while (index < keys.size() && keys[index] < probe) {
+      ++index;
+    }
+    benchmark::DoNotOptimize(index);
+  }
+}
+
+void BM_LeafSearchBinary(benchmark::State &state) {
+  auto keys = get_leaf_keys();
+  auto probes = get_leaf_probes(1024);
+  size_t i = 0;
+  for (auto _ : state) {
+    auto probe = probes[i++ % probes.size()];
+    benchmark::DoNotOptimize(
+        buzzdb::key_search::scalar_lower_bound<uint64_t, std::less<uint64_t>>(
+            keys.data(), keys.size(), probe));
+  }
+}
+
+/// Uses vector compares when the benchmark is compiled with AVX2 or SSE4.2.
+void BM_LeafSearchSimd(benchmark::State &state) {
+  auto keys = get_leaf_keys();
+  auto probes = get_leaf_probes(1024);
+  size_t i = 0;
+  for (auto _ : state) {
+    auto probe = probes[i++ % probes.size()];
+    benchmark::DoNotOptimize(
+        buzzdb::key_search::lower_bound<uint64_t, std::less<uint64_t>>(
+            keys.data(), keys.size(), probe));
+  }
+  state.SetLabel(buzzdb::key_search::kHasSimdSearch<uint64_t,
+                                                    std::less<uint64_t>>
+                     ? "simd"
+                     : "scalar");
+}
+
+/// Looks up random existing keys in a tree with `state.range(0)` keys.
+void BM_Lookup(benchmark::State &state) {
+  uint64_t n = state.range(0);
+  BufferManager buffer_manager(4096, kPageCount);
+  BTree tree(0, buffer_manager);
+  std::vector<uint64_t> keys(n);
+  std::iota(keys.begin(), keys.end(), 0);
+  std::mt19937_64 engine{0};
+  std::shuffle(keys.begin(), keys.end(), engine);
+  for (auto key : keys) {
+    tree.insert(key, key);
+  }
+  size_t i = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(tree.lookup(keys[i++ % n]));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+/// Looks up random keys of a tree with `state.range(0)` keys in batches of
+/// `state.range(1)` keys, either with `lookup_batch()` (1) or with one
+/// `lookup()` per key (0).
+void BM_LookupBatch(benchmark::State &state) {
+  uint64_t n = state.range(0);
+  size_t batch_size = state.range(1);
+  bool use_batch = state.range(2);
+  BufferManager buffer_manager(4096, kPageCount);
+  BTree tree(0, buffer_manager);
+  std::vector<std::pair<uint64_t, uint64_t>> entries(n);
+  for (uint64_t i = 0; i < n; ++i) {
+    entries[i] = {i, i};
+  }
+  tree.bulk_load(entries.begin(), entries.end());
+  std::mt19937_64 engine{0};
+  std::uniform_int_distribution<uint64_t> distr{0, n - 1};
+  std::vector<uint64_t> probes(batch_size);
+  std::vector<std::optional<uint64_t>> results(batch_size);
+  for (auto _ : state) {
+    state.PauseTiming();
+    for (auto &probe : probes) {
+      probe = distr(engine);
+    }
+    state.ResumeTiming();
+    if (use_batch) {
+      tree.lookup_batch(probes.data(), batch_size, results.data());
+    } else {
+      for (size_t i = 0; i < batch_size; ++i) {
+        results[i] = tree.lookup(probes[i]);
+      }
+    }
+    benchmark::DoNotOptimize(results.data());
+  }
+  state.SetItemsProcessed(state.iterations() * batch_size);
+}
+
+/// Looks up random keys of a tree with `state.range(0)` keys that is
+/// `state.range(1)` times larger than the buffer, so that the lookups read
+/// the evicted pages back from the segment file. Reports the pages that are
+/// read per lookup.
+void BM_LookupOutOfMemory(benchmark::State &state) {
+  uint64_t n = state.range(0);
+  uint64_t ratio = state.range(1);
+  std::vector<std::pair<uint64_t, uint64_t>> entries(n);
+  for (uint64_t i = 0; i < n; ++i) {
+    entries[i] = {i, i};
+  }
+  // A first load with enough frames measures the size of the tree.
+  uint64_t tree_page_count;
+  {
+    BufferManager buffer_manager(4096, kPageCount);
+    BTree tree(0, buffer_manager);
+    tree.bulk_load(entries.begin(), entries.end());
+    tree_page_count = tree.get_page_count();
+  }
+  BufferManager buffer_manager(4096, tree_page_count / ratio + 16);
+  BTree tree(0, buffer_manager);
+  tree.bulk_load(entries.begin(), entries.end());
+  std::mt19937_64 engine{0};
+  std::uniform_int_distribution<uint64_t> distr{0, n - 1};
+  uint64_t read_count = buffer_manager.get_read_count();
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(tree.lookup(distr(engine)));
+  }
+  state.SetItemsProcessed(state.iterations());
+  state.counters["reads/op"] =
+      benchmark::Counter(buffer_manager.get_read_count() - read_count,
+                         benchmark::Counter::kAvgIterations);
+  state.counters["pages"] = tree_page_count;
+}
+
+/// Inserts `state.range(0)` random keys into a tree with a buffer of
+/// `state.range(1)` frames, so that most leaves are evicted between two
+/// inserts into them. Reports the pages that are written per insert.
+template <typename TreeT>
+void BM_InsertOutOfMemory(benchmark::State &state) {
+  uint64_t n = state.range(0);
+  std::vector<uint64_t> keys(n);
+  std::mt19937_64 engine{0};
+  for (auto &key : keys) {
+    key = engine();
+  }
+  uint64_t write_count = 0;
+  for (auto _ : state) {
+    BufferManager buffer_manager(4096, state.range(1));
+    {
+      TreeT tree(0, buffer_manager);
+      for (auto key : keys) {
+        tree.insert(key, key);
+      }
+    }
+    write_count += buffer_manager.get_write_count();
+  }
+  state.SetItemsProcessed(state.iterations() * n);
+  state.counters["writes/op"] = static_cast<double>(write_count) /
+                                static_cast<double>(state.iterations() * n);
+}
+
+/// Fills a leaf in random key order, measures the shifting of the keys.
+void BM_LeafInsert(benchmark::State &state) {
+  auto keys = get_leaf_keys();
+  std::mt19937_64 engine{0};
+  std::shuffle(keys.begin(), keys.end(), engine);
+  std::vector<std::byte> page(4096);
+  for (auto _ : state) {
+    auto leaf_node = new (page.data()) LeafNode();
+    for (auto key : keys) {
+      leaf_node->insert(key, key);
+    }
+    benchmark::DoNotOptimize(leaf_node->count);
+  }
+  state.SetItemsProcessed(state.iterations() * keys.size());
+}
+
+/// Builds a tree with `state.range(0)` keys in random order.
+void BM_Insert(benchmark::State &state) {
+  uint64_t n = state.range(0);
+  std::vector<uint64_t> keys(n);
+  std::iota(keys.begin(), keys.end(), 0);
+  std::mt19937_64 engine{0};
+  std::shuffle(keys.begin(), keys.end(), engine);
+  for (auto _ : state) {
+    BufferManager buffer_manager(4096, kPageCount);
+    BTree tree(0, buffer_manager);
+    for (auto key : keys) {
+      tree.insert(key, key);
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * n);
+}
+
+/// Increments counters of random keys in a tree with `state.range(0)` keys,
+/// either with a lookup and an insert (0) or with an upsert (1).
+void BM_Upsert(benchmark::State &state) {
+  uint64_t n = state.range(0);
+  bool use_upsert = state.range(1);
+  BufferManager buffer_manager(4096, kPageCount);
+  BTree tree(0, buffer_manager);
+  for (uint64_t key = 0; key < n; ++key) {
+    tree.insert(key, 0);
+  }
+  std::mt19937_64 engine{0};
+  std::uniform_int_distribution<uint64_t> distr{0, n - 1};
+  for (auto _ : state) {
+    uint64_t key = distr(engine);
+    if (use_upsert) {
+      tree.upsert(key, [](uint64_t &count) { ++count; });
+    } else {
+      tree.insert(key, tree.lookup(key).value_or(0) + 1);
+    }
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+/// Builds a tree with `state.range(0)` sorted keys, either with one insert
+/// per key (0) or with a bulk load (1).
+void BM_Build(benchmark::State &state) {
+  uint64_t n = state.range(0);
+  bool use_bulk_load = state.range(1);
+  std::vector<std::pair<uint64_t, uint64_t>> entries(n);
+  for (uint64_t i = 0; i < n; ++i) {
+    entries[i] = {i, i};
+  }
+  for (auto _ : state) {
+    BufferManager buffer_manager(4096, kPageCount);
+    BTree tree(0, buffer_manager);
+    if (use_bulk_load) {
+      tree.bulk_load(entries.begin(), entries.end());
+    } else {
+      for (auto &[key, value] : entries) {
+        tree.insert(key, value);
+      }
+    }
+    state.counters["pages"] = tree.get_page_count();
+  }
+  state.SetItemsProcessed(state.iterations() * n);
+}
+
+/// Inserts and erases random keys in a tree that keeps 2^16 keys, the
+/// pages of merged nodes are reused by later splits.
+void BM_EraseChurn(benchmark::State &state) {
+  uint64_t n = 1 << 16;
+  BufferManager buffer_manager(4096, kPageCount);
+  BTree tree(0, buffer_manager);
+  std::vector<uint64_t> keys(n);
+  std::iota(keys.begin(), keys.end(), 0);
+  std::mt19937_64 engine{0};
+  std::shuffle(keys.begin(), keys.end(), engine);
+  for (auto key : keys) {
+    tree.insert(key, key);
+  }
+  size_t i = 0;
+  for (auto _ : state) {
+    auto &key = keys[i++ % n];
+    tree.erase(key);
+    key += n;
+    tree.insert(key, key);
+  }
+  state.SetItemsProcessed(state.iterations());
+  state.counters["pages"] = tree.get_page_count();
+}
+
+/// Reads `state.range(0)` consecutive keys from a tree with 2^20 keys.
+/// `state.range(1)` selects a scan (1) or a point lookup per key (0).
+void BM_Scan(benchmark::State &state) {
+  uint64_t n = 1 << 20;
+  uint64_t length = state.range(0);
+  bool use_scan = state.range(1);
+  BufferManager buffer_manager(4096, kPageCount);
+  BTree tree(0, buffer_manager);
+  std::vector<uint64_t> keys(n);
+  std::iota(keys.begin(), keys.end(), 0);
+  std::mt19937_64 engine{0};
+  std::shuffle(keys.begin(), keys.end(), engine);
+  for (auto key : keys) {
+    tree.insert(key, key);
+  }
+  size_t i = 0;
+  for (auto _ : state) {
+    uint64_t lower = keys[i++ % n] % (n - length);
+    uint64_t sum = 0;
+    if (use_scan) {
+      auto scan = tree.scan(lower, lower + length - 1);
+      while (scan.next()) {
+        sum += scan.value();
+      }
+    } else {
+      for (auto key = lower; key < lower + length; ++key) {
+        sum += *tree.lookup(key);
+      }
+    }
+    benchmark::DoNotOptimize(sum);
+  }
+  state.SetItemsProcessed(state.iterations() * length);
+}
+
+/// Tree that is shared by the threads of the concurrent benchmarks.
+std::unique_ptr<BufferManager> shared_buffer_manager;
+std::unique_ptr<BTree> shared_tree;
+
+/// Every thread runs a mix of lookups and inserts on a shared tree with
+/// 2^20 keys; `state.range(0)` is the percentage of inserts.
+void BM_Concurrent(benchmark::State &state) {
+  uint64_t n = 1 << 20;
+  if (state.thread_index() == 0) {
+    shared_buffer_manager =
+        std::make_unique<BufferManager>(4096, kPageCount);
+    shared_tree = std::make_unique<BTree>(0, *shared_buffer_manager);
+    std::vector<std::pair<uint64_t, uint64_t>> entries(n);
+    for (uint64_t i = 0; i < n; ++i) {
+      entries[i] = {2 * i, i};
+    }
+    shared_tree->bulk_load(entries.begin(), entries.end(), 0.7);
+  }
+  std::mt19937_64 engine(state.thread_index());
+  std::uniform_int_distribution<uint64_t> key_distr(0, 2 * n);
+  std::uniform_int_distribution<int64_t> op_distr(0, 99);
+  for (auto _ : state) {
+    uint64_t key = key_distr(engine);
+    if (op_distr(engine) < state.range(0)) {
+      shared_tree->insert(key, key);
+    } else {
+      benchmark::DoNotOptimize(shared_tree->lookup(key));
+    }
+  }
+  state.SetItemsProcessed(state.iterations());
+  if (state.thread_index() == 0) {
+    shared_tree.reset();
+    shared_buffer_manager.reset();
+  }
+}
+
+/// A key that is wider than a register.
+struct WideKey {
+  uint64_t high;
+  uint64_t low;
+
+  bool operator<(const WideKey &other) const {
+    return std::tie(high, low) < std::tie(other.high, other.low);
+  }
+};
+
+/// A value that fills a cache line, like a small record.
+struct WideValue {
+  uint64_t fields[8];
+};
+
+/// Makes a key or value of a workload benchmark from a number. Keys keep
+/// the order of the numbers.
+template <typename T>
+T make(uint64_t i) {
+  if constexpr (std::is_same_v<T, WideKey>) {
+    return {i >> 8, i};
+  } else if constexpr (std::is_same_v<T, WideValue>) {
+    return {{i}};
+  } else {
+    return static_cast<T>(i);
+  }
+}
+
+/// The key distributions of the workload benchmarks.
+enum Distribution : int64_t { kSequential, kUniform, kZipf };
+
+/// Computes the generalized harmonic number `sum(1 / i^theta)` for
+/// `i = 1, ..., n` once per `n`.
+double get_zeta(uint64_t n, double theta) {
+  static std::mutex mutex;
+  static std::map<std::pair<uint64_t, double>, double> zetas;
+  std::unique_lock<std::mutex> guard(mutex);
+  auto [it, is_new] = zetas.try_emplace({n, theta}, 0.0);
+  if (is_new) {
+    for (uint64_t i = 1; i <= n; ++i) {
+      it->second += 1.0 / std::pow(static_cast<double>(i), theta);
+    }
+  }
+  return it->second;
+}
+
+/// Generates the ranks of the keys that a thread of a workload benchmark
+/// accesses.
+class RankGenerator {
+ public:
+  /// The skew of the Zipf distribution, as in YCSB.
+  static constexpr double kTheta = 0.99;
+
+  /// Constructor.
+  /// @param[in] distribution   The distribution of the ranks.
+  /// @param[in] n              The number of ranks, a power of two.
+  /// @param[in] thread         The index of the thread.
+  /// @param[in] thread_count   The number of threads.
+  RankGenerator(Distribution distribution, uint64_t n, uint64_t thread,
+                uint64_t thread_count)
+      : distribution(distribution),
+        n(n),
+        next_rank(thread),
+        stride(thread_count),
+        engine(thread) {
+    if (distribution == kZipf) {
+      zeta_n = get_zeta(n, kTheta);
+      alpha = 1.0 / (1.0 - kTheta);
+      eta = (1.0 - std::pow(2.0 / n, 1.0 - kTheta)) /
+            (1.0 - get_zeta(2, kTheta) / zeta_n);
+    }
+  }
+
+  /// Get the next rank. The sequential ranks of all threads interleave and
+  /// keep growing beyond `n`, the other ranks are less than `n`.
+  uint64_t next() {
+    switch (distribution) {
+      case kSequential:
+        return std::exchange(next_rank, next_rank + stride);
+      case kUniform:
+        return engine() & (n - 1);
+      default: {
+        // Gray et al., "Quickly generating billion-record synthetic
+        // databases". The hot ranks are scattered over the key range, so
+        // that they do not share a few leaves.
+        double u = std::uniform_real_distribution<double>()(engine);
+        double uz = u * zeta_n;
+        uint64_t rank;
+        if (uz < 1.0) {
+          rank = 0;
+        } else if (uz < 1.0 + std::pow(0.5, kTheta)) {
+          rank = 1;
+        } else {
+          rank = std::min<uint64_t>(
+              n - 1, n * std::pow(eta * u - eta + 1.0, alpha));
+        }
+        return (rank * 0x9e37'79b9'7f4a'7c15) & (n - 1);
+      }
+    }
+  }
+
+ private:
+  Distribution distribution;
+  uint64_t n;
+  uint64_t next_rank;
+  uint64_t stride;
+  std::mt19937_64 engine;
+  double zeta_n = 0;
+  double alpha = 0;
+  double eta = 0;
+};
+
+/// The operations of the workload benchmarks.
+enum class Operation {
+  /// Looks up existing keys.
+  kLookup,
+  /// Inserts keys between the existing ones, sequential keys are appended
+  /// behind them. Repeated keys overwrite their values.
+  kInsert,
+  /// Erases existing keys and inserts them again, which counts as two
+  /// operations.
+  kErase,
+  /// Scans 100 entries from an existing key.
+  kScan,
+};
+
+/// Runs one operation on a tree that is shared by all threads of the
+/// benchmark. The tree is bulk loaded to 70% with the even keys below
+/// `2 * state.range(0)`, `state.range(1)` selects the `Distribution` of the
+/// accessed keys. Reports the operations per second, the pages that are
+/// fixed per operation and the height of the tree afterwards.
+/// `kUseFingerprints` enables the fingerprints of the leaves.
+template <typename KeyT, typename ValueT, size_t PageSize,
+          Operation kOperation, bool kUseFingerprints = false>
+void BM_Workload(benchmark::State &state) {
+  using Tree = buzzdb::BTree<KeyT, ValueT, std::less<KeyT>, PageSize,
+                             kUseFingerprints>;
+  static std::unique_ptr<BufferManager> buffer_manager;
+  static std::unique_ptr<Tree> tree;
+  static uint64_t fix_count;
+  constexpr uint64_t kScanLength = 100;
+  constexpr uint64_t kOperationsPerIteration =
+      kOperation == Operation::kErase ? 2 : 1;
+
+  uint64_t n = state.range(0);
+  if (state.thread_index() == 0) {
+    buffer_manager = std::make_unique<BufferManager>(PageSize, kPageCount);
+    tree = std::make_unique<Tree>(0, *buffer_manager);
+    std::vector<std::pair<KeyT, ValueT>> entries(n);
+    for (uint64_t i = 0; i < n; ++i) {
+      entries[i] = {make<KeyT>(2 * i), make<ValueT>(i)};
+    }
+    tree->bulk_load(entries.begin(), entries.end(), 0.7);
+    fix_count = buffer_manager->get_fix_count();
+  }
+  auto distribution = static_cast<Distribution>(state.range(1));
+  RankGenerator ranks(distribution, n, state.thread_index(), state.threads());
+  for (auto _ : state) {
+    uint64_t rank = ranks.next();
+    if constexpr (kOperation == Operation::kLookup) {
+      benchmark::DoNotOptimize(tree->lookup(make<KeyT>(2 * (rank % n))));
+    } else if constexpr (kOperation == Operation::kInsert) {
+      if (distribution == kSequential) {
+        rank += n;
+      }
+      tree->insert(make<KeyT>(2 * rank + 1), make<ValueT>(rank));
+    } else if constexpr (kOperation == Operation::kErase) {
+      auto key = make<KeyT>(2 * (rank % n));
+      tree->erase(key);
+      tree->insert(key, make<ValueT>(rank));
+    } else {
+      uint64_t lower = 2 * (rank % n);
+      auto scan = tree->scan(make<KeyT>(lower),
+                             make<KeyT>(lower + 2 * (kScanLength - 1)));
+      while (scan.next()) {
+        benchmark::DoNotOptimize(scan.value());
+      }
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * kOperationsPerIteration);
+  // Counters of all threads are summed up, so only the first one reports.
+  if (state.thread_index() == 0) {
+    double fixes = buffer_manager->get_fix_count() - fix_count;
+    state.counters["fixes/op"] = benchmark::Counter(
+        fixes / kOperationsPerIteration, benchmark::Counter::kAvgIterations);
+    state.counters["height"] = tree->get_height();
+    tree.reset();
+    buffer_manager.reset();
+  }
+}
+
+/// Runs one operation of a workload benchmark on a `HashIndex` instead of a
+/// tree, for comparison with the point operations of `BM_Workload`. The
+/// index is filled by inserts, since it cannot be bulk loaded. Reports the
+/// global depth instead of the height.
+template <Operation kOperation>
+void BM_HashIndexWorkload(benchmark::State &state) {
+  using HashIndex = buzzdb::HashIndex<uint64_t, uint64_t, 4096>;
+  static std::unique_ptr<BufferManager> buffer_manager;
+  static std::unique_ptr<HashIndex> index;
+  static uint64_t fix_count;
+  constexpr uint64_t kOperationsPerIteration =
+      kOperation == Operation::kErase ? 2 : 1;
+
+  uint64_t n = state.range(0);
+  if (state.thread_index() == 0) {
+    buffer_manager = std::make_unique<BufferManager>(4096, kPageCount);
+    index = std::make_unique<HashIndex>(0, *buffer_manager);
+    for (uint64_t i = 0; i < n; ++i) {
+      index->insert(2 * i, i);
+    }
+    fix_count = buffer_manager->get_fix_count();
+  }
+  auto distribution = static_cast<Distribution>(state.range(1));
+  RankGenerator ranks(distribution, n, state.thread_index(), state.threads());
+  for (auto _ : state) {
+    uint64_t rank = ranks.next();
+    if constexpr (kOperation == Operation::kLookup) {
+      benchmark::DoNotOptimize(index->lookup(2 * (rank % n)));
+    } else if constexpr (kOperation == Operation::kInsert) {
+      if (distribution == kSequential) {
+        rank += n;
+      }
+      index->insert(2 * rank + 1, rank);
+    } else {
+      uint64_t key = 2 * (rank % n);
+      index->erase(key);
+      index->insert(key, rank);
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * kOperationsPerIteration);
+  if (state.thread_index() == 0) {
+    double fixes = buffer_manager->get_fix_count() - fix_count;
+    state.counters["fixes/op"] = benchmark::Counter(
+        fixes / kOperationsPerIteration, benchmark::Counter::kAvgIterations);
+    state.counters["depth"] = index->get_global_depth();
+    index.reset();
+    buffer_manager.reset();
+  }
+}
+
+/// The full matrix of the workload benchmarks for the common tree.
+void WorkloadArgs(benchmark::internal::Benchmark *benchmark) {
+  benchmark->ArgNames({"n", "distribution"})
+      ->ArgsProduct({{1 << 16, 1 << 22}, {kSequential, kUniform, kZipf}})
+      ->ThreadRange(1, 8)
+      ->UseRealTime();
+}
+
+/// The workload benchmarks for other key, value and page sizes.
+void VariantArgs(benchmark::internal::Benchmark *benchmark) {
+  benchmark->ArgNames({"n", "distribution"})
+      ->ArgsProduct({{1 << 20}, {kUniform, kZipf}})
+      ->UseRealTime();
+}
+
+}  // namespace
+
+BENCHMARK(BM_LeafSearchLinear);
+BENCHMARK(BM_LeafSearchBinary);
+BENCHMARK(BM_LeafSearchSimd);
+BENCHMARK(BM_Lookup)->Range(1 << 10, 1 << 20);
+BENCHMARK(BM_LookupBatch)
+    ->ArgsProduct({{1 << 16, 1 << 22}, {16, 1024, 65536}, {0, 1}});
+BENCHMARK(BM_LookupOutOfMemory)
+    ->ArgNames({"n", "ratio"})
+    ->ArgsProduct({{1 << 22}, {1, 2, 10}});
+BENCHMARK_TEMPLATE(BM_InsertOutOfMemory, BTree)
+    ->ArgNames({"n", "frames"})
+    ->ArgsProduct({{1 << 20}, {64, 1024}});
+BENCHMARK_TEMPLATE(BM_InsertOutOfMemory, BufferedBTree)
+    ->ArgNames({"n", "frames"})
+    ->ArgsProduct({{1 << 20}, {64, 1024}});
+BENCHMARK(BM_LeafInsert);
+BENCHMARK(BM_Insert)->Range(1 << 10, 1 << 20);
+BENCHMARK(BM_Upsert)->ArgsProduct({{1 << 16, 1 << 20}, {0, 1}});
+BENCHMARK(BM_Build)->ArgsProduct({{1 << 16, 1 << 20}, {0, 1}});
+BENCHMARK(BM_EraseChurn);
+BENCHMARK(BM_Scan)->ArgsProduct({{16, 1024, 65536}, {0, 1}});
+BENCHMARK(BM_Concurrent)
+    ->Arg(0)
+    ->Arg(10)
+    ->Arg(50)
+    ->ThreadRange(1, 32)
+    ->UseRealTime();
+
+BENCHMARK_TEMPLATE(BM_Workload, uint64_t, uint64_t, 4096, Operation::kLookup)
+    ->Apply(WorkloadArgs);
+BENCHMARK_TEMPLATE(BM_Workload, uint64_t, uint64_t, 4096, Operation::kInsert)
+    ->Apply(WorkloadArgs);
+BENCHMARK_TEMPLATE(BM_Workload, uint64_t, uint64_t, 4096, Operation::kErase)
+    ->Apply(WorkloadArgs);
+BENCHMARK_TEMPLATE(BM_Workload, uint64_t, uint64_t, 4096, Operation::kScan)
+    ->Apply(WorkloadArgs);
+BENCHMARK_TEMPLATE(BM_Workload, uint32_t, uint32_t, 4096, Operation::kLookup)
+    ->Apply(VariantArgs);
+BENCHMARK_TEMPLATE(BM_Workload, uint32_t, uint32_t, 4096, Operation::kInsert)
+    ->Apply(VariantArgs);
+BENCHMARK_TEMPLATE(BM_Workload, WideKey, uint64_t, 4096, Operation::kLookup)
+    ->Apply(VariantArgs);
+BENCHMARK_TEMPLATE(BM_Workload, WideKey, uint64_t, 4096, Operation::kInsert)
+    ->Apply(VariantArgs);
+BENCHMARK_TEMPLATE(BM_Workload, WideKey, uint64_t, 4096, Operation::kLookup,
+                   true)
+    ->Apply(VariantArgs);
+BENCHMARK_TEMPLATE(BM_Workload, WideKey, uint64_t, 4096, Operation::kInsert,
+                   true)
+    ->Apply(VariantArgs);
+BENCHMARK_TEMPLATE(BM_Workload, uint64_t, WideValue, 4096, Operation::kLookup)
+    ->Apply(VariantArgs);
+BENCHMARK_TEMPLATE(BM_Workload, uint64_t, WideValue, 4096, Operation::kInsert)
+    ->Apply(VariantArgs);
+BENCHMARK_TEMPLATE(BM_Workload, uint64_t, uint64_t, 1024, Operation::kLookup)
+    ->Apply(VariantArgs);
+BENCHMARK_TEMPLATE(BM_Workload, uint64_t, uint64_t, 1024, Operation::kInsert)
+    ->Apply(VariantArgs);
+BENCHMARK_TEMPLATE(BM_Workload, uint64_t, uint64_t, 16384, Operation::kLookup)
+    ->Apply(VariantArgs);
+BENCHMARK_TEMPLATE(BM_Workload, uint64_t, uint64_t, 16384, Operation::kInsert)
+    ->Apply(VariantArgs);
+
+BENCHMARK_TEMPLATE(BM_HashIndexWorkload, Operation::kLookup)
+    ->Apply(WorkloadArgs);
+BENCHMARK_TEMPLATE(BM_HashIndexWorkload, Operation::kInsert)
+    ->Apply(WorkloadArgs);
+BENCHMARK_TEMPLATE(BM_HashIndexWorkload, Operation::kErase)
+    ->Apply(WorkloadArgs);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,308 @@
+#include <gtest/gtest.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "buffer/buffer_manager.h"
+#include "storage/file.h"
+#include "storage/test_segment_directory.h"
+
+using buzzdb::BufferFrame;
+using buzzdb::BufferManager;
+
+namespace {
+
+/// Writes `value` to the start of a page.
+void set_value(BufferFrame& page, uint64_t value) {
+  std::memcpy(page.get_data(), &value, sizeof(value));
+}
+
+/// Reads the value at the start of a page.
+uint64_t get_value(BufferFrame& page) {
+  uint64_t value;
+  std::memcpy(&value, page.get_data(), sizeof(value));
+  return value;
+}
+
+/// Holds back the writes of `GatedFile`s until it is opened.
+class WriteGate {
+ public:
+  /// Blocks until the gate is open.
+  void pass() {
+    std::unique_lock<std::mutex> guard(latch);
+    ++waiting_count;
+    changed.notify_all();
+    changed.wait(guard, [&] { return is_open; });
+  }
+
+  /// Blocks until a write waits at the gate.
+  void wait_for_write() {
+    std::unique_lock<std::mutex> guard(latch);
+    changed.wait(guard, [&] { return waiting_count > 0; });
+  }
+
+  /// Lets all writes pass.
+  void open() {
+    std::unique_lock<std::mutex> guard(latch);
+    is_open = true;
+    changed.notify_all();
+  }
+
+ private:
+  std::mutex latch;
+  std::condition_variable changed;
+  size_t waiting_count = 0;
+  bool is_open = false;
+};
+
+/// A file whose writes wait at a `WriteGate`.
+class GatedFile : public buzzdb::File {
+ public:
+  GatedFile(std::unique_ptr<File> file, WriteGate& gate)
+      : file(std::move(file)), gate(gate) {}
+
+  Mode get_mode() const override { return file->get_mode(); }
+
+  size_t size() const override { return file->size(); }
+
+  void resize(size_t new_size) override { file->resize(new_size); }
+
+  void read_block(size_t offset, size_t size, char* block) override {
+    file->read_block(offset, size, block);
+  }
+
+  void write_block(const char* block, size_t offset, size_t size) override {
+    gate.pass();
+    file->write_block(block, offset, size);
+  }
+
+ private:
+  std::unique_ptr<File> file;
+  WriteGate& gate;
+};
+
+TEST(BufferManagerTest, FixUnfix) {
+  BufferManager buffer_manager(1024, 10);
+  auto& page = buffer_manager.fix_page(1, true);
+  ASSERT_EQ(get_value(page), 0u) << "new pages are not zeroed";
+  set_value(page, 42);
+  buffer_manager.unfix_page(page, true);
+  auto& same_page = buffer_manager.fix_page(1, false);
+  ASSERT_EQ(&same_page, &page);
+  ASSERT_EQ(get_value(same_page), 42u);
+  buffer_manager.unfix_page(same_page, false);
+  ASSERT_EQ(buffer_manager.get_fix_count(), 2u);
+  ASSERT_EQ(buffer_manager.get_read_count(), 0u);
+}
+
+TEST(BufferManagerTest, FifoAndLru) {
+  BufferManager buffer_manager(1024, 10);
+  for (uint64_t page_id : {3, 1, 2, 1, 3, 4}) {
+    auto& page = buffer_manager.fix_page(page_id, false);
+    buffer_manager.unfix_page(page, false);
+  }
+  ASSERT_EQ(buffer_manager.get_fifo_list(), (std::vector<uint64_t>{2, 4}));
+  ASSERT_EQ(buffer_manager.get_lru_list(), (std::vector<uint64_t>{1, 3}));
+
+  // Unfixed pages are evicted from the FIFO list first.
+  for (uint64_t page_id = 10; page_id < 20; ++page_id) {
+    auto& page = buffer_manager.fix_page(page_id, false);
+    buffer_manager.unfix_page(page, false);
+  }
+  ASSERT_EQ(buffer_manager.get_lru_list(), (std::vector<uint64_t>{1, 3}));
+  ASSERT_EQ(buffer_manager.get_fifo_list().size(), 8u);
+  ASSERT_EQ(buffer_manager.get_fifo_list().front(), 12u);
+}
+
+TEST(BufferManagerTest, EvictDirtyPages) {
+  BufferManager buffer_manager(1024, 10);
+  for (uint64_t page_id = 0; page_id < 100; ++page_id) {
+    auto segment_page_id = BufferManager::get_overall_page_id(
+        static_cast<uint16_t>(page_id % 3), page_id);
+    auto& page = buffer_manager.fix_page(segment_page_id, true);
+    set_value(page, page_id * 7);
+    buffer_manager.unfix_page(page, true);
+  }
+  ASSERT_GE(buffer_manager.get_write_count(), 90u);
+  for (uint64_t page_id = 0; page_id < 100; ++page_id) {
+    auto segment_page_id = BufferManager::get_overall_page_id(
+        static_cast<uint16_t>(page_id % 3), page_id);
+    auto& page = buffer_manager.fix_page(segment_page_id, false);
+    ASSERT_EQ(get_value(page), page_id * 7) << "page " << page_id;
+    buffer_manager.unfix_page(page, false);
+  }
+  ASSERT_GE(buffer_manager.get_read_count(), 90u);
+}
+
+TEST(BufferManagerTest, WriteBackWithoutLatch) {
+  WriteGate gate;
+  BufferManager buffer_manager(1024, 2, [&](uint16_t /*segment_id*/) {
+    return std::make_unique<GatedFile>(buzzdb::File::make_temporary_file(),
+                                       gate);
+  });
+  auto& dirty_page = buffer_manager.fix_page(0, true);
+  set_value(dirty_page, 42);
+  buffer_manager.unfix_page(dirty_page, true);
+  for (int i = 0; i < 2; ++i) {
+    auto& page = buffer_manager.fix_page(1, false);
+    buffer_manager.unfix_page(page, false);
+  }
+
+  // Fixing page 2 evicts page 0, whose write-back waits at the gate.
+  std::thread evicting([&] {
+    auto& page = buffer_manager.fix_page(2, false);
+    buffer_manager.unfix_page(page, false);
+  });
+  gate.wait_for_write();
+
+  // Other pages can be fixed in the meantime.
+  auto hit = std::async(std::launch::async, [&] {
+    auto& page = buffer_manager.fix_page(1, false);
+    buffer_manager.unfix_page(page, false);
+  });
+  EXPECT_EQ(hit.wait_for(std::chrono::seconds(10)), std::future_status::ready)
+      << "a fix waited for the write-back of another page";
+
+  // The evicted page is read again only once it was written.
+  std::atomic<bool> is_fixed{false};
+  std::thread fixing([&] {
+    auto& page = buffer_manager.fix_page(0, false);
+    is_fixed = true;
+    EXPECT_EQ(get_value(page), 42u);
+    buffer_manager.unfix_page(page, false);
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  EXPECT_FALSE(is_fixed.load());
+  gate.open();
+  evicting.join();
+  fixing.join();
+  EXPECT_TRUE(is_fixed.load());
+}
+
+TEST(BufferManagerTest, BufferFull) {
+  BufferManager buffer_manager(1024, 10);
+  std::vector<BufferFrame*> pages;
+  for (uint64_t page_id = 0; page_id < 10; ++page_id) {
+    pages.push_back(&buffer_manager.fix_page(page_id, false));
+  }
+  ASSERT_THROW(buffer_manager.fix_page(10, false), buzzdb::buffer_full_error);
+  buffer_manager.unfix_page(*pages[4], false);
+  auto& page = buffer_manager.fix_page(10, false);
+  ASSERT_EQ(&page, pages[4]) << "the only unfixed page was not evicted";
+  pages[4] = &page;
+  for (auto* fixed_page : pages) {
+    buffer_manager.unfix_page(*fixed_page, false);
+  }
+}
+
+TEST(BufferManagerTest, Prefetch) {
+  BufferManager buffer_manager(1024, 4);
+  for (uint64_t page_id = 0; page_id < 8; ++page_id) {
+    auto& page = buffer_manager.fix_page(page_id, true);
+    set_value(page, page_id + 1);
+    buffer_manager.unfix_page(page, true);
+  }
+  // Reading pages 0 to 3 writes back the dirty pages 4 to 7.
+  for (uint64_t page_id = 0; page_id < 4; ++page_id) {
+    auto& page = buffer_manager.fix_page(page_id, false);
+    buffer_manager.unfix_page(page, false);
+  }
+  ASSERT_EQ(buffer_manager.get_read_count(), 4u);
+
+  // Prefetched pages replace the unfixed clean pages of the FIFO list.
+  buffer_manager.prefetch_pages(4, 4);
+  buffer_manager.wait_for_prefetches();
+  ASSERT_EQ(buffer_manager.get_fifo_list(),
+            (std::vector<uint64_t>{4, 5, 6, 7}));
+  ASSERT_EQ(buffer_manager.get_read_count(), 8u);
+  auto& page = buffer_manager.fix_page(4, false);
+  EXPECT_EQ(get_value(page), 5u);
+  ASSERT_EQ(buffer_manager.get_read_count(), 8u);
+
+  // Neither the fixed page nor the prefetched pages that were not fixed yet
+  // are replaced.
+  buffer_manager.prefetch_pages(0, 4);
+  buffer_manager.wait_for_prefetches();
+  ASSERT_EQ(buffer_manager.get_fifo_list(), (std::vector<uint64_t>{5, 6, 7}));
+  buffer_manager.unfix_page(page, false);
+  for (uint64_t page_id = 5; page_id < 8; ++page_id) {
+    auto& prefetched_page = buffer_manager.fix_page(page_id, false);
+    EXPECT_EQ(get_value(prefetched_page), page_id + 1) << "page " << page_id;
+    buffer_manager.unfix_page(prefetched_page, false);
+  }
+
+  // Pages of the LRU list are not replaced either.
+  buffer_manager.prefetch_pages(0, 1);
+  buffer_manager.wait_for_prefetches();
+  ASSERT_TRUE(buffer_manager.get_fifo_list().empty());
+  ASSERT_EQ(buffer_manager.get_read_count(), 8u);
+}
+
+TEST(BufferManagerTest, PersistentSegments) {
+  buzzdb::TestSegmentDirectory segment_directory("buffer_manager_test");
+  auto open_segment_file = segment_directory.get_opener();
+  {
+    BufferManager buffer_manager(1024, 10, open_segment_file);
+    for (uint64_t page_id = 0; page_id < 20; ++page_id) {
+      auto& page = buffer_manager.fix_page(page_id, true);
+      set_value(page, page_id + 1);
+      buffer_manager.unfix_page(page, true);
+    }
+  }
+  {
+    BufferManager buffer_manager(1024, 10, open_segment_file);
+    for (uint64_t page_id = 0; page_id < 20; ++page_id) {
+      auto& page = buffer_manager.fix_page(page_id, false);
+      EXPECT_EQ(get_value(page), page_id + 1) << "page " << page_id;
+      buffer_manager.unfix_page(page, false);
+    }
+  }
+}
+
+TEST(BufferManagerTest, Concurrent) {
+  BufferManager buffer_manager(1024, 16);
+  // Every thread increments counters on shared pages and owns one slot on
+  // each page.
+  std::vector<std::thread> threads;
+  for (uint64_t t = 0; t < 4; ++t) {
+    threads.emplace_back([&, t] {
+      std::mt19937_64 engine(t);
+      std::uniform_int_distribution<uint64_t> distr(0, 63);
+      for (int i = 0; i < 5000; ++i) {
+        auto& page = buffer_manager.fix_page(distr(engine), true);
+        auto slots = reinterpret_cast<uint64_t*>(page.get_data());
+        ++slots[t];
+        buffer_manager.unfix_page(page, true);
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  for (uint64_t t = 0; t < 4; ++t) {
+    uint64_t count = 0;
+    for (uint64_t page_id = 0; page_id < 64; ++page_id) {
+      auto& page = buffer_manager.fix_page(page_id, false);
+      count += reinterpret_cast<uint64_t*>(page.get_data())[t];
+      buffer_manager.unfix_page(page, false);
+    }
+    ASSERT_EQ(count, 5000u) << "thread " << t << " lost updates";
+  }
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -1,14 +1,24 @@
 #include <gtest/gtest.h>
 #include <algorithm>
+#include <atomic>
 #include <cstddef>
+#include <cstdlib>
+#include <functional>
+#include <new>
+#include <map>
 #include <numeric>
+#include <optional>
 #include <random>
 #include <sstream>
+#include <stdexcept>
+#include <utility>
 #include <vector>
 #include <thread>
 
 #include "common/defer.h"
 #include "index/btree.h"
+#include "index/key_search.h"
+#include "storage/test_segment_directory.h"
 
 using BufferFrame = buzzdb::BufferFrame;
 using BufferManager = buzzdb::BufferManager;
@@ -16,6 +26,25 @@ using Defer = buzzdb::Defer;
 using BTree =
     buzzdb::BTree<uint64_t, uint64_t, std::less<uint64_t>, 1024>;  // NOLINT
 
+/// Number of calls to the global `operator new`.
+std::atomic<size_t> allocation_count{0};
+
+void* operator new(size_t size) {
+  allocation_count++;
+  if (void* p = std::malloc(size ? size : 1)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+// GCC does not see that `operator new` above is implemented with `malloc()`.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+void operator delete(void* p) noexcept { std::free(p); }
+
+void operator delete(void* p, size_t /*size*/) noexcept { std::free(p); }
+#pragma GCC diagnostic pop
+
 namespace {
 
 TEST(BTreeTest, InsertEmptyTree) {
@@ -28,9 +57,10 @@ TEST(BTreeTest, InsertEmptyTree) {
   auto test = "inserting an element into an empty B-Tree";
   ASSERT_TRUE(tree.root) << test << " does not create a node.";
 
-  auto root_page = buffer_manager.fix_page(*tree.root, false);
-  auto root_node = reinterpret_cast<BTree::Node*>(root_page.get_data());
-  Defer root_page_unfix([&]() { buffer_manager.unfix_page(root_page, false); });
+  auto* root_page = &buffer_manager.fix_page(*tree.root, false);
+  auto root_node = reinterpret_cast<BTree::Node*>(root_page->get_data());
+  Defer root_page_unfix(
+      [&]() { buffer_manager.unfix_page(*root_page, false); });
 
   ASSERT_TRUE(root_node->is_leaf()) << test << " does not create a leaf node.";
   ASSERT_TRUE(root_node->count)
@@ -51,10 +81,11 @@ TEST(BTreeTest, InsertLeafNode) {
       "inserting BTree::LeafNode::kCapacity elements into an empty B-Tree";
   ASSERT_TRUE(tree.root);
 
-  auto root_page = buffer_manager.fix_page(*tree.root, false);
-  auto root_node = reinterpret_cast<BTree::Node*>(root_page.get_data());
+  auto* root_page = &buffer_manager.fix_page(*tree.root, false);
+  auto root_node = reinterpret_cast<BTree::Node*>(root_page->get_data());
   auto root_inner_node = static_cast<BTree::InnerNode*>(root_node);
-  Defer root_page_unfix([&]() { buffer_manager.unfix_page(root_page, false); });
+  Defer root_page_unfix(
+      [&]() { buffer_manager.unfix_page(*root_page, false); });
 
   ASSERT_TRUE(root_node->is_leaf())
       << test << " creates an inner node as root.";
@@ -73,10 +104,11 @@ TEST(BTreeTest, InsertLeafNodeSplit) {
   }
 
   ASSERT_TRUE(tree.root);
-  auto root_page = buffer_manager.fix_page(*tree.root, false);
-  auto root_node = reinterpret_cast<BTree::Node*>(root_page.get_data());
+  auto* root_page = &buffer_manager.fix_page(*tree.root, false);
+  auto root_node = reinterpret_cast<BTree::Node*>(root_page->get_data());
   auto root_inner_node = static_cast<BTree::InnerNode*>(root_node);
-  Defer root_page_unfix([&]() { buffer_manager.unfix_page(root_page, false); });
+  Defer root_page_unfix(
+      [&]() { buffer_manager.unfix_page(*root_page, false); });
   ASSERT_TRUE(root_inner_node->is_leaf());
   ASSERT_EQ(root_inner_node->count, BTree::LeafNode::kCapacity);
   root_page_unfix.run();
@@ -89,12 +121,12 @@ TEST(BTreeTest, InsertLeafNodeSplit) {
 
   ASSERT_TRUE(tree.root) << test << " removes the root :-O";
 
-  root_page = buffer_manager.fix_page(*tree.root, false);
+  root_page = &buffer_manager.fix_page(*tree.root, false);
 
-  root_node = reinterpret_cast<BTree::Node*>(root_page.get_data());
+  root_node = reinterpret_cast<BTree::Node*>(root_page->get_data());
   root_inner_node = static_cast<BTree::InnerNode*>(root_node);
-  root_page_unfix =
-      Defer([&]() { buffer_manager.unfix_page(root_page, false); });
+  // Assigning a `Defer` would run the destructor of the temporary.
+  root_page_unfix.fn = [&]() { buffer_manager.unfix_page(*root_page, false); };
 
   ASSERT_FALSE(root_inner_node->is_leaf())
       << test << " does not create a root inner node";
@@ -254,6 +286,641 @@ TEST(BTreeTest, LookupRandomRepeating) {
   }
 }
 
+template <typename KeyT>
+void check_key_search(std::vector<KeyT> keys, const std::vector<KeyT> &probes) {
+  std::sort(keys.begin(), keys.end());
+  for (uint32_t count = 0; count <= keys.size(); ++count) {
+    for (auto probe : probes) {
+      uint32_t expected =
+          std::lower_bound(keys.begin(), keys.begin() + count, probe) -
+          keys.begin();
+      ASSERT_EQ(expected,
+                (buzzdb::key_search::lower_bound<KeyT, std::less<KeyT>>(
+                    keys.data(), count, probe)))
+          << "count=" << count << " probe=" << probe;
+      ASSERT_EQ(expected,
+                (buzzdb::key_search::scalar_lower_bound<KeyT, std::less<KeyT>>(
+                    keys.data(), count, probe)))
+          << "count=" << count << " probe=" << probe;
+    }
+  }
+}
+
+TEST(BTreeTest, KeySearch) {
+  std::mt19937_64 engine(0);
+  std::vector<uint64_t> unsigned_keys;
+  std::vector<int32_t> signed_keys;
+  for (auto i = 0; i < 100; ++i) {
+    // Keys with the highest bit set must not be treated as negative.
+    unsigned_keys.push_back(engine() >> (i % 2));
+    signed_keys.push_back(static_cast<int32_t>(engine()) / 2);
+  }
+  auto unsigned_probes = unsigned_keys;
+  unsigned_probes.insert(unsigned_probes.end(), {0, 1, ~0ull, 1ull << 63});
+  auto signed_probes = signed_keys;
+  signed_probes.insert(signed_probes.end(), {0, -1, INT32_MIN, INT32_MAX});
+  for (auto i = 0; i < 100; ++i) {
+    unsigned_probes.push_back(unsigned_keys[i] + 1);
+    signed_probes.push_back(signed_keys[i] - 1);
+  }
+  check_key_search(unsigned_keys, unsigned_probes);
+  check_key_search(signed_keys, signed_probes);
+}
+
+/// A key that is too wide for the vector compares of `key_search`.
+struct WideKey {
+  uint64_t high;
+  uint64_t low;
+
+  bool operator<(const WideKey& other) const {
+    return high != other.high ? high < other.high : low < other.low;
+  }
+};
+
+TEST(BTreeTest, Fingerprints) {
+  using FingerprintBTree =
+      buzzdb::BTree<WideKey, uint64_t, std::less<WideKey>, 1024, true>;
+  using LeafNode = FingerprintBTree::LeafNode;
+  BufferManager buffer_manager(1024, 100);
+  FingerprintBTree tree(0, buffer_manager);
+  // All keys of a leaf must have the fingerprint of the key in their slot.
+  auto check_leaves = [&] {
+    uint64_t version;
+    auto page_id = tree.find_leaf(WideKey{0, 0}, version).get_page_id();
+    while (true) {
+      FingerprintBTree::FixedPage page(buffer_manager, page_id);
+      auto leaf_node = page.get_node<LeafNode>();
+      for (uint32_t i = 0; i < leaf_node->count; ++i) {
+        ASSERT_EQ(leaf_node->fingerprints[i],
+                  buzzdb::key_search::get_fingerprint(leaf_node->keys[i]));
+      }
+      if (!leaf_node->next_leaf) {
+        break;
+      }
+      page_id = *leaf_node->next_leaf;
+    }
+  };
+
+  std::mt19937_64 engine(0);
+  std::map<uint64_t, uint64_t> expected;
+  uint64_t n = 50 * LeafNode::kCapacity;
+  for (auto round = 0; round < 3; ++round) {
+    for (uint64_t i = 0; i < n; ++i) {
+      uint64_t key = engine() % (2 * n);
+      if (engine() % 3 == 0) {
+        tree.erase(WideKey{key >> 4, key});
+        expected.erase(key);
+      } else {
+        tree.insert(WideKey{key >> 4, key}, i);
+        expected[key] = i;
+      }
+    }
+    check_leaves();
+    for (uint64_t key = 0; key < 2 * n; ++key) {
+      auto it = expected.find(key);
+      ASSERT_EQ(tree.lookup(WideKey{key >> 4, key}),
+                it == expected.end() ? std::nullopt : std::optional(it->second))
+          << "k=" << key;
+    }
+  }
+  std::vector<std::pair<WideKey, uint64_t>> entries;
+  for (auto [key, value] : expected) {
+    entries.push_back({WideKey{key >> 4, key}, value});
+  }
+  FingerprintBTree other_tree(1, buffer_manager);
+  other_tree.bulk_load(entries.begin(), entries.end(), 0.8);
+  for (auto& [key, value] : entries) {
+    ASSERT_EQ(other_tree.lookup(key), value);
+  }
+
+  // Matching fingerprints are checked in order until one matches.
+  std::vector<uint8_t> fingerprints(100, 7);
+  fingerprints[50] = 8;
+  auto find = [&](uint8_t fingerprint, uint32_t match) {
+    return buzzdb::key_search::find_fingerprint(
+        fingerprints.data(), fingerprints.size(), fingerprint,
+        [&](uint32_t i) { return i >= match; });
+  };
+  ASSERT_EQ(find(7, 0), 0u);
+  ASSERT_EQ(find(7, 49), 49u);
+  ASSERT_EQ(find(7, 50), 51u);
+  ASSERT_EQ(find(7, 99), 99u);
+  ASSERT_EQ(find(7, 100), 100u);
+  ASSERT_EQ(find(8, 0), 50u);
+  ASSERT_EQ(find(9, 0), 100u);
+}
+
+TEST(BTreeTest, EntryCounts) {
+  using CountingBTree =
+      buzzdb::BTree<uint64_t, uint64_t, std::less<uint64_t>, 1024, false,
+                    true>;
+  using InnerNode = CountingBTree::InnerNode;
+  BufferManager buffer_manager(1024, 100);
+  CountingBTree tree(0, buffer_manager);
+  ASSERT_EQ(tree.count_range(0, 100), 0u);
+  ASSERT_FALSE(tree.select(0));
+
+  // Every count must match the entries that its subtree really holds.
+  std::function<uint64_t(uint64_t)> check_counts = [&](uint64_t page_id) {
+    CountingBTree::FixedPage page(buffer_manager, page_id);
+    auto node = page.get_node();
+    if (node->is_leaf()) {
+      return uint64_t{node->count};
+    }
+    auto inner_node = page.get_node<InnerNode>();
+    uint64_t entry_count = 0;
+    for (uint32_t i = 0; i < inner_node->count; ++i) {
+      uint64_t child_count = check_counts(inner_node->children[i]);
+      EXPECT_EQ(inner_node->counts[i], child_count) << "page " << page_id;
+      entry_count += child_count;
+    }
+    return entry_count;
+  };
+  auto check = [&](CountingBTree& tree, std::map<uint64_t, uint64_t>& map) {
+    ASSERT_EQ(check_counts(*tree.root), map.size());
+    std::vector<std::pair<uint64_t, uint64_t>> entries(map.begin(), map.end());
+    for (uint64_t i = 0; i < entries.size(); i += 7) {
+      ASSERT_EQ(tree.select(i), entries[i]) << "position " << i;
+    }
+    ASSERT_FALSE(tree.select(entries.size()));
+    std::mt19937_64 engine(0);
+    for (int i = 0; i < 1000; ++i) {
+      uint64_t lower = engine() % 20000;
+      uint64_t upper = lower + engine() % 5000;
+      auto expected = std::distance(map.lower_bound(lower),
+                                    map.upper_bound(upper));
+      ASSERT_EQ(tree.count_range(lower, upper), uint64_t(expected))
+          << "[" << lower << ", " << upper << "]";
+    }
+    ASSERT_EQ(tree.count_range(0, ~uint64_t{0}), map.size());
+    ASSERT_EQ(tree.count_range(10, 9), 0u);
+  };
+
+  // Random inserts and erases split, merge and balance nodes of all levels.
+  std::mt19937_64 engine(0);
+  std::map<uint64_t, uint64_t> expected;
+  for (int round = 0; round < 3; ++round) {
+    for (uint64_t i = 0; i < 20000; ++i) {
+      uint64_t key = engine() % 20000;
+      if (engine() % 3 == 0) {
+        tree.erase(key);
+        expected.erase(key);
+      } else {
+        tree.insert(key, i);
+        expected[key] = i;
+      }
+    }
+    ASSERT_GE(tree.get_height(), 3);
+    check(tree, expected);
+  }
+  // Increasing inserts take the same path as all others.
+  for (uint64_t key = 20000; key < 30000; ++key) {
+    tree.insert(key, key);
+    expected[key] = key;
+  }
+  check(tree, expected);
+  for (uint64_t key = 0; key < 30000; ++key) {
+    tree.erase(key);
+  }
+  ASSERT_EQ(tree.count_range(0, 30000), 0u);
+
+  CountingBTree other_tree(1, buffer_manager);
+  other_tree.bulk_load(expected.begin(), expected.end(), 0.7);
+  check(other_tree, expected);
+}
+
+TEST(BTreeTest, EntryCountsConcurrent) {
+  using CountingBTree =
+      buzzdb::BTree<uint64_t, uint64_t, std::less<uint64_t>, 1024, false,
+                    true>;
+  BufferManager buffer_manager(1024, 100);
+  CountingBTree tree(0, buffer_manager);
+  // Every thread inserts its own keys and erases every third of them, while
+  // counting and selecting entries of the others.
+  constexpr uint64_t kThreadCount = 4;
+  constexpr uint64_t kKeyCount = 20000;
+  std::vector<std::thread> threads;
+  for (uint64_t t = 0; t < kThreadCount; ++t) {
+    threads.emplace_back([&, t] {
+      for (uint64_t i = 0; i < kKeyCount; ++i) {
+        tree.insert(i * kThreadCount + t, i);
+        if (i % 3 == 2) {
+          tree.erase((i - 1) * kThreadCount + t);
+        }
+        uint64_t lower = i * kThreadCount / 2;
+        ASSERT_LE(tree.count_range(lower, lower + 100), 101u);
+        if (auto entry = tree.select(i)) {
+          ASSERT_EQ(entry->second, entry->first / kThreadCount);
+        }
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  uint64_t entry_count = kThreadCount * (kKeyCount - 6666);
+  ASSERT_EQ(tree.count_range(0, ~uint64_t{0}), entry_count);
+  ASSERT_EQ(tree.select(entry_count - 1)->first, kKeyCount * kThreadCount - 1);
+  ASSERT_FALSE(tree.select(entry_count));
+}
+
+TEST(BTreeTest, Upsert) {
+  BufferManager buffer_manager(1024, 100);
+  BTree tree(0, buffer_manager);
+  auto increment = [](uint64_t& count) { ++count; };
+  ASSERT_TRUE(tree.upsert(42, increment));
+  ASSERT_FALSE(tree.upsert(42, increment));
+  ASSERT_EQ(tree.lookup(42), 2u);
+  tree.erase(42);
+
+  // Count random keys, which splits leaves for new keys on the way.
+  std::mt19937_64 engine(0);
+  std::map<uint64_t, uint64_t> expected;
+  for (int i = 0; i < 100000; ++i) {
+    uint64_t key = engine() % 20000;
+    uint32_t call_count = 0;
+    bool is_inserted = tree.upsert(key, [&](uint64_t& count) {
+      ++call_count;
+      count += 1;
+    });
+    ASSERT_EQ(call_count, 1u);
+    ASSERT_EQ(is_inserted, ++expected[key] == 1) << "k=" << key;
+  }
+  ASSERT_GT(tree.get_height(), 2);
+  ASSERT_EQ(tree.get_entry_count(), expected.size());
+  for (auto [key, count] : expected) {
+    ASSERT_EQ(tree.lookup(key), count) << "k=" << key;
+  }
+
+  // An update fixes only its leaf once, a lookup and an insert fix it twice.
+  auto fix_count = buffer_manager.get_fix_count();
+  for (auto [key, count] : expected) {
+    tree.upsert(key, increment);
+  }
+  ASSERT_EQ(buffer_manager.get_fix_count() - fix_count, expected.size());
+
+  // Trees with entry counts count the new keys only.
+  buzzdb::BTree<uint64_t, uint64_t, std::less<uint64_t>, 1024, false, true>
+      counting_tree(1, buffer_manager);
+  for (uint64_t i = 0; i < 30000; ++i) {
+    counting_tree.upsert(i % 10000, increment);
+  }
+  ASSERT_EQ(counting_tree.count_range(0, 20000), 10000u);
+  ASSERT_EQ(counting_tree.select(9999), std::make_pair(uint64_t{9999}, uint64_t{3}));
+
+  // Concurrent increments of the same keys are not lost.
+  BTree shared_tree(2, buffer_manager);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back([&] {
+      for (uint64_t i = 0; i < 20000; ++i) {
+        shared_tree.upsert(i % 1000, increment);
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  for (uint64_t key = 0; key < 1000; ++key) {
+    ASSERT_EQ(shared_tree.lookup(key), 80u) << "k=" << key;
+  }
+}
+
+TEST(BTreeTest, LookupMissingKeys) {
+  BufferManager buffer_manager(1024, 100);
+  BTree tree(0, buffer_manager);
+  auto n = 100 * BTree::LeafNode::kCapacity;
+
+  for (auto i = 1ul; i <= n; ++i) {
+    tree.insert(2 * i, i);
+  }
+
+  // Probe the gaps and both ends of a tree with multiple inner levels
+  for (auto i = 0ul; i <= n + 1; ++i) {
+    ASSERT_FALSE(tree.lookup(2 * i + 1)) << "k=" << (2 * i + 1) << " was found";
+  }
+  ASSERT_FALSE(tree.lookup(0));
+  ASSERT_FALSE(tree.lookup(4 * n));
+}
+
+TEST(BTreeTest, LookupBatch) {
+  BufferManager buffer_manager(1024, 100);
+  BTree tree(0, buffer_manager);
+  std::vector<uint64_t> probes(1000);
+  std::iota(probes.begin(), probes.end(), 0);
+  std::vector<std::optional<uint64_t>> results(probes.size(), 42);
+  tree.lookup_batch(probes.data(), probes.size(), results.data());
+  for (auto& result : results) {
+    ASSERT_FALSE(result) << "the empty tree returns something";
+  }
+
+  auto n = 100 * BTree::LeafNode::kCapacity;
+  for (auto i = 0ul; i < n; ++i) {
+    tree.insert(2 * i, i);
+  }
+  std::mt19937_64 engine(0);
+  std::uniform_int_distribution<uint64_t> distr(0, 2 * n + 10);
+  for (auto count : {0ul, 1ul, 15ul, 17ul, 1000ul}) {
+    probes.resize(count);
+    for (auto& probe : probes) {
+      probe = distr(engine);
+    }
+    for (auto is_sorted : {false, true}) {
+      if (is_sorted) {
+        std::sort(probes.begin(), probes.end());
+      }
+      results.assign(count, std::nullopt);
+      tree.lookup_batch(probes.data(), count, results.data());
+      for (auto i = 0ul; i < count; ++i) {
+        auto expected = tree.lookup(probes[i]);
+        ASSERT_EQ(results[i], expected)
+            << "looking up " << count << " keys yields the wrong result for k="
+            << probes[i];
+      }
+    }
+  }
+}
+
+TEST(BTreeTest, LookupBatchSmallBuffer) {
+  // A group of keys must not fix more pages than the buffer holds.
+  BufferManager buffer_manager(1024, 16);
+  BTree tree(0, buffer_manager);
+  auto n = 100 * BTree::LeafNode::kCapacity;
+  for (auto i = 0ul; i < n; ++i) {
+    tree.insert(2 * i, i);
+  }
+  // The probes are spread over the tree, so that every key of a group needs
+  // another leaf.
+  std::vector<uint64_t> probes(64);
+  for (auto i = 0ul; i < probes.size(); ++i) {
+    probes[i] = i * (2 * n / probes.size());
+  }
+  std::vector<std::optional<uint64_t>> results(probes.size());
+  tree.lookup_batch(probes.data(), probes.size(), results.data());
+  for (auto i = 0ul; i < probes.size(); ++i) {
+    ASSERT_EQ(results[i], tree.lookup(probes[i])) << "k=" << probes[i];
+  }
+}
+
+TEST(BTreeTest, InsertWithoutAllocations) {
+  std::vector<std::byte> leaf_page(1024);
+  auto leaf_node = new (leaf_page.data()) BTree::LeafNode();
+  std::vector<std::byte> inner_page(1024);
+  auto inner_node = new (inner_page.data()) BTree::InnerNode();
+  inner_node->level = 1;
+  inner_node->count = 1;
+  inner_node->children[0] = 0;
+
+  std::vector<uint64_t> keys(BTree::LeafNode::kCapacity);
+  std::iota(keys.begin(), keys.end(), 1);
+  std::mt19937_64 engine(0);
+  std::shuffle(keys.begin(), keys.end(), engine);
+
+  auto allocations = allocation_count.load();
+  for (auto key : keys) {
+    leaf_node->insert(key, 2 * key);
+  }
+  for (auto i = 0ul; i + 1 < BTree::InnerNode::kCapacity; ++i) {
+    inner_node->insert(keys[i], keys[i]);
+  }
+  ASSERT_EQ(allocation_count.load(), allocations)
+      << "inserting into a node allocates memory";
+
+  ASSERT_EQ(leaf_node->count, keys.size());
+  ASSERT_TRUE(std::is_sorted(leaf_node->keys, leaf_node->keys + keys.size()));
+  for (auto i = 0ul; i < keys.size(); ++i) {
+    ASSERT_EQ(leaf_node->values[i], 2 * leaf_node->keys[i]);
+  }
+  ASSERT_EQ(inner_node->count, BTree::InnerNode::kCapacity);
+  ASSERT_TRUE(std::is_sorted(inner_node->keys,
+                             inner_node->keys + inner_node->count - 1));
+  // Every separator is followed by the page that was split off at it.
+  for (auto i = 0ul; i + 1 < inner_node->count; ++i) {
+    ASSERT_EQ(inner_node->children[i + 1], inner_node->keys[i]);
+  }
+
+  // Overwriting keys in a tree does not allocate either.
+  BufferManager buffer_manager(1024, 100);
+  BTree tree(0, buffer_manager);
+  for (auto i = 0ul; i < 10 * BTree::LeafNode::kCapacity; ++i) {
+    tree.insert(i, i);
+  }
+  allocations = allocation_count.load();
+  for (auto i = 0ul; i < 10 * BTree::LeafNode::kCapacity; ++i) {
+    tree.insert(i, 2 * i);
+  }
+  ASSERT_EQ(allocation_count.load(), allocations)
+      << "inserting into a tree without splits allocates memory";
+}
+
+TEST(BTreeTest, Scan) {
+  BufferManager buffer_manager(1024, 100);
+  BTree tree(0, buffer_manager);
+  ASSERT_FALSE(tree.scan(0, 100).next()) << "scanning an empty B-Tree";
+
+  auto n = 20 * BTree::LeafNode::kCapacity;
+  std::vector<uint64_t> keys(n);
+  std::iota(keys.begin(), keys.end(), 0);
+  std::mt19937_64 engine(0);
+  std::shuffle(keys.begin(), keys.end(), engine);
+  std::map<uint64_t, uint64_t> expected;
+  for (auto key : keys) {
+    tree.insert(3 * key, key);
+    expected[3 * key] = key;
+  }
+  for (auto i = 0ul; i < n; i += 4) {
+    tree.erase(3 * keys[i]);
+    expected.erase(3 * keys[i]);
+  }
+
+  std::uniform_int_distribution<uint64_t> bound_distr(0, 3 * n + 3);
+  for (auto i = 0; i < 100; ++i) {
+    uint64_t lower = bound_distr(engine);
+    uint64_t upper = i == 0 ? 3 * n + 3 : lower + bound_distr(engine) / 8;
+    auto it = expected.lower_bound(lower);
+    auto end = expected.upper_bound(upper);
+    auto scan = tree.scan(lower, upper);
+    for (; it != end; ++it) {
+      ASSERT_TRUE(scan.next()) << "scanning [" << lower << ", " << upper
+                               << "] misses k=" << it->first;
+      ASSERT_EQ(scan.key(), it->first);
+      ASSERT_EQ(scan.value(), it->second);
+    }
+    ASSERT_FALSE(scan.next()) << "scanning [" << lower << ", " << upper
+                              << "] yields keys past the range";
+  }
+}
+
+TEST(BTreeTest, BulkLoad) {
+  uint64_t capacity = BTree::LeafNode::kCapacity;
+  for (auto n : {0ul, 1ul, 3ul, capacity, capacity + 1, 1000 * capacity + 7}) {
+    for (auto fill_factor : {1.0, 0.7, 0.01}) {
+      BufferManager buffer_manager(1024, 100);
+      BTree tree(0, buffer_manager);
+      std::vector<std::pair<uint64_t, uint64_t>> entries;
+      for (auto i = 0ul; i < n; ++i) {
+        entries.emplace_back(2 * i, i);
+      }
+      tree.bulk_load(entries.begin(), entries.end(), fill_factor);
+      auto test = "bulk loading n=" + std::to_string(n) +
+                  " keys with fill factor " + std::to_string(fill_factor);
+
+      // Every inner node must have at least two children.
+      std::function<void(uint64_t)> check_children = [&](uint64_t page_id) {
+        BTree::FixedPage page(buffer_manager, page_id);
+        if (page.get_node()->is_leaf()) {
+          return;
+        }
+        auto inner_node = page.get_node<BTree::InnerNode>();
+        ASSERT_GE(inner_node->count, 2u) << test << ", page " << page_id;
+        for (uint32_t i = 0; i < inner_node->count; ++i) {
+          check_children(inner_node->children[i]);
+        }
+      };
+      if (tree.root) {
+        check_children(*tree.root);
+      }
+
+      for (auto i = 0ul; i < n; ++i) {
+        auto v = tree.lookup(2 * i);
+        ASSERT_TRUE(v) << test << " loses k=" << 2 * i;
+        ASSERT_EQ(*v, i) << test;
+        ASSERT_FALSE(tree.lookup(2 * i + 1)) << test;
+      }
+      auto scan = tree.scan(0, 2 * n);
+      for (auto i = 0ul; i < n; ++i) {
+        ASSERT_TRUE(scan.next()) << test << " breaks the leaf chain";
+        ASSERT_EQ(scan.key(), 2 * i) << test;
+      }
+      ASSERT_FALSE(scan.next()) << test;
+
+      // The loaded tree must accept regular inserts.
+      for (auto i = 0ul; i < n; ++i) {
+        tree.insert(2 * i + 1, i);
+      }
+      for (auto i = 0ul; i < 2 * n; ++i) {
+        ASSERT_TRUE(tree.lookup(i)) << test << " and inserting misses k=" << i;
+      }
+    }
+  }
+}
+
+TEST(BTreeTest, BulkLoadInvalidInput) {
+  BufferManager buffer_manager(1024, 100);
+  BTree tree(0, buffer_manager);
+  std::vector<std::pair<uint64_t, uint64_t>> entries{{1, 1}, {3, 3}, {2, 2}};
+  ASSERT_THROW(tree.bulk_load(entries.begin(), entries.end()),
+               std::logic_error);
+  entries = {{1, 1}, {1, 2}};
+  ASSERT_THROW(tree.bulk_load(entries.begin(), entries.end()),
+               std::logic_error);
+  ASSERT_FALSE(tree.root);
+
+  tree.insert(42, 21);
+  entries = {{1, 1}};
+  ASSERT_THROW(tree.bulk_load(entries.begin(), entries.end()),
+               std::logic_error);
+}
+
+TEST(BTreeTest, BulkLoadErasedTree) {
+  BufferManager buffer_manager(1024, 100);
+  BTree tree(0, buffer_manager);
+  uint64_t n = 10 * BTree::LeafNode::kCapacity;
+  for (auto i = 0ul; i < n; ++i) {
+    tree.insert(i, i);
+  }
+  for (auto i = 0ul; i < n; ++i) {
+    tree.erase(i);
+  }
+  ASSERT_EQ(tree.get_entry_count(), 0u);
+
+  // The pages of the erased tree are reused by later inserts.
+  std::vector<std::pair<uint64_t, uint64_t>> entries;
+  for (auto i = 0ul; i < n; ++i) {
+    entries.emplace_back(2 * i, i);
+  }
+  tree.bulk_load(entries.begin(), entries.end());
+  uint64_t free_page_count = tree.metadata->free_page_count;
+  ASSERT_GT(free_page_count, 0u);
+  for (auto i = 0ul; i < n; ++i) {
+    ASSERT_EQ(tree.lookup(2 * i), i);
+    ASSERT_FALSE(tree.lookup(2 * i + 1));
+    tree.insert(2 * i + 1, i);
+  }
+  ASSERT_EQ(tree.get_entry_count(), 2 * n);
+  ASSERT_LT(tree.metadata->free_page_count, free_page_count);
+}
+
+TEST(BTreeTest, ConcurrentStress) {
+  BufferManager buffer_manager(1024, 100);
+  BTree tree(0, buffer_manager);
+  constexpr uint64_t kThreads = 4;
+  uint64_t n = 200 * BTree::LeafNode::kCapacity;
+
+  // Every thread inserts its own shuffled keys, checks them right away and
+  // erases every third one again, while another thread keeps scanning.
+  std::atomic<bool> done{false};
+  std::atomic<bool> scan_ordered{true};
+  std::thread scanner([&] {
+    while (!done.load()) {
+      auto scan = tree.scan(0, kThreads * n);
+      bool has_previous = false;
+      uint64_t previous = 0;
+      while (scan.next()) {
+        if ((has_previous && scan.key() <= previous) ||
+            scan.value() != 2 * scan.key()) {
+          scan_ordered = false;
+        }
+        has_previous = true;
+        previous = scan.key();
+      }
+    }
+  });
+  std::vector<std::thread> threads;
+  std::atomic<uint64_t> failures{0};
+  for (uint64_t t = 0; t < kThreads; ++t) {
+    threads.emplace_back([&, t] {
+      std::vector<uint64_t> keys(n);
+      for (uint64_t i = 0; i < n; ++i) {
+        keys[i] = i * kThreads + t;
+      }
+      std::mt19937_64 engine(t);
+      std::shuffle(keys.begin(), keys.end(), engine);
+      for (auto key : keys) {
+        tree.insert(key, 2 * key);
+        if (tree.lookup(key) != 2 * key) {
+          ++failures;
+        }
+      }
+      for (auto key : keys) {
+        if (key % 3 == 0) {
+          tree.erase(key);
+          if (tree.lookup(key)) {
+            ++failures;
+          }
+        }
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  done = true;
+  scanner.join();
+
+  ASSERT_EQ(failures.load(), 0u) << "concurrent inserts or erases got lost";
+  ASSERT_TRUE(scan_ordered.load()) << "concurrent scans returned bad entries";
+  for (uint64_t key = 0; key < kThreads * n; ++key) {
+    auto v = tree.lookup(key);
+    if (key % 3 == 0) {
+      ASSERT_FALSE(v) << "k=" << key << " was not erased";
+    } else {
+      ASSERT_TRUE(v) << "k=" << key << " is missing";
+      ASSERT_EQ(*v, 2 * key);
+    }
+  }
+}
+
 TEST(BTreeTest, Erase) {
   BufferManager buffer_manager(1024, 100);
   BTree tree(0, buffer_manager);
@@ -272,6 +939,348 @@ TEST(BTreeTest, Erase) {
   }
 }
 
+TEST(BTreeTest, EraseMergesNodes) {
+  BufferManager buffer_manager(1024, 100);
+  BTree tree(0, buffer_manager);
+  auto n = 100 * BTree::LeafNode::kCapacity;
+  std::vector<uint64_t> keys(n);
+  std::iota(keys.begin(), keys.end(), 0);
+  std::mt19937_64 engine(0);
+
+  for (auto round = 0; round < 3; ++round) {
+    std::shuffle(keys.begin(), keys.end(), engine);
+    for (auto key : keys) {
+      tree.insert(key, key + round);
+    }
+    auto page_count = tree.get_page_count();
+
+    // Erase all keys in random order, the rest must stay reachable.
+    std::shuffle(keys.begin(), keys.end(), engine);
+    for (auto i = 0ul; i < n; ++i) {
+      tree.erase(keys[i]);
+      ASSERT_FALSE(tree.lookup(keys[i])) << "k=" << keys[i] << " was found";
+      if (i % 97 == 0) {
+        for (auto j = i + 1; j < n; j += 13) {
+          ASSERT_EQ(tree.lookup(keys[j]), keys[j] + round)
+              << "erasing " << i + 1 << " keys lost k=" << keys[j];
+        }
+        uint64_t count = 0;
+        auto scan = tree.scan(0, n);
+        while (scan.next()) {
+          ++count;
+        }
+        ASSERT_EQ(count, n - i - 1);
+      }
+    }
+
+    // The root collapsed back into an empty leaf.
+    auto& root_page = buffer_manager.fix_page(*tree.root, false);
+    auto root_node = reinterpret_cast<BTree::Node*>(root_page.get_data());
+    ASSERT_TRUE(root_node->is_leaf()) << "the root did not collapse";
+    ASSERT_EQ(root_node->count, 0);
+    buffer_manager.unfix_page(root_page, false);
+    ASSERT_EQ(tree.get_free_page_count(), page_count - 2)
+        << "erasing all keys did not free all pages";
+  }
+  ASSERT_LE(tree.get_page_count(), 100 * 2 + 10)
+      << "pages of merged nodes are not reused";
+}
+
+TEST(BTreeTest, InsertSplitsOnlyWhenNeeded) {
+  BufferManager buffer_manager(1024, 100);
+  BTree tree(0, buffer_manager);
+  // Full leaves below a full root.
+  uint64_t n = BTree::LeafNode::kCapacity * BTree::InnerNode::kCapacity;
+  std::vector<std::pair<uint64_t, uint64_t>> entries;
+  for (auto i = 0ul; i < n; ++i) {
+    entries.emplace_back(2 * i, 2 * i);
+  }
+  tree.bulk_load(entries.begin(), entries.end());
+  auto page_count = tree.get_page_count();
+  ASSERT_EQ(tree.get_height(), 2);
+
+  // The first leaf has room again, so the full root must stay as it is.
+  tree.erase(0);
+  tree.insert(1, 1);
+  ASSERT_EQ(tree.get_page_count(), page_count)
+      << "inserting into a leaf with room split a full ancestor";
+  ASSERT_EQ(tree.get_height(), 2);
+
+  // Splitting the leaf propagates to the root.
+  tree.insert(3, 3);
+  ASSERT_EQ(tree.get_page_count(), page_count + 3);
+  ASSERT_EQ(tree.get_height(), 3);
+  for (auto i = 1ul; i < 2 * n; ++i) {
+    ASSERT_EQ(tree.lookup(i), i % 2 == 0 || i <= 3 ? std::optional(i)
+                                                   : std::nullopt)
+        << "k=" << i;
+  }
+}
+
+TEST(BTreeTest, InsertIncreasingKeepsNodesFull) {
+  BufferManager buffer_manager(1024, 100);
+  BTree tree(0, buffer_manager);
+  uint64_t n = 40 * BTree::LeafNode::kCapacity;
+  for (auto i = 0ul; i < n; ++i) {
+    tree.insert(2 * i, i);
+  }
+  // Midpoint splits would leave every leaf but the last half full.
+  uint64_t leaf_count = n / BTree::LeafNode::kCapacity;
+  ASSERT_LT(tree.get_page_count(), 2 + leaf_count * 10 / 8)
+      << "appending keys leaves half-empty nodes behind";
+  ASSERT_NE(tree.rightmost_leaf.load(), 0u)
+      << "the rightmost leaf is not remembered";
+
+  // Inserts that do not append descend the tree again.
+  tree.insert(1, 1);
+  ASSERT_EQ(tree.rightmost_leaf.load(), 0u);
+  tree.insert(2 * n, n);
+  ASSERT_NE(tree.rightmost_leaf.load(), 0u);
+
+  // The remembered leaf may be merged away.
+  for (auto i = n / 2; i <= n; ++i) {
+    tree.erase(2 * i);
+  }
+  ASSERT_EQ(tree.get_entry_count(), n / 2 + 1);
+  for (auto i = n / 2; i <= n; ++i) {
+    tree.insert(2 * i, i);
+  }
+  ASSERT_EQ(tree.get_entry_count(), n + 2);
+  ASSERT_EQ(tree.lookup(1), 1u);
+  for (auto i = 0ul; i <= n; ++i) {
+    ASSERT_EQ(tree.lookup(2 * i), i) << "k=" << 2 * i;
+    ASSERT_FALSE(tree.lookup(2 * i + 3)) << "k=" << 2 * i + 3;
+  }
+}
+
+TEST(BTreeTest, Reopen) {
+  buzzdb::TestSegmentDirectory segment_directory("btree_test");
+  auto open_segment_file = segment_directory.get_opener();
+  uint64_t n = 20 * BTree::LeafNode::kCapacity;
+  uint64_t page_count;
+  uint64_t free_page_count;
+  uint16_t height;
+  {
+    BufferManager buffer_manager(1024, 100, open_segment_file);
+    BTree tree(0, buffer_manager);
+    for (auto i = 0ul; i < n; ++i) {
+      tree.insert(i, i);
+      tree.insert(i, 2 * i);
+    }
+    ASSERT_EQ(tree.get_entry_count(), n) << "overwrites were counted";
+    for (auto i = 0ul; i < n; i += 2) {
+      tree.erase(i);
+      tree.erase(i);
+    }
+    ASSERT_EQ(tree.get_entry_count(), n / 2);
+    page_count = tree.get_page_count();
+    free_page_count = tree.get_free_page_count();
+    height = tree.get_height();
+    ASSERT_GT(free_page_count, 0u);
+  }
+
+  // A new buffer manager only sees what was written to the files.
+  BufferManager buffer_manager(1024, 100, open_segment_file);
+  {
+    BTree tree(0, buffer_manager);
+    auto test = "reopening a B-Tree";
+    ASSERT_TRUE(tree.root) << test << " loses the root";
+    ASSERT_EQ(tree.get_entry_count(), n / 2) << test;
+    ASSERT_EQ(tree.get_page_count(), page_count) << test;
+    ASSERT_EQ(tree.get_free_page_count(), free_page_count) << test;
+    ASSERT_EQ(tree.get_height(), height) << test;
+    for (auto i = 0ul; i < n; ++i) {
+      ASSERT_EQ(tree.lookup(i), i % 2 ? std::optional(2 * i) : std::nullopt)
+          << test << " loses k=" << i;
+    }
+
+    // New nodes take the free pages that were left behind first.
+    for (auto i = n; i < 2 * n; ++i) {
+      tree.insert(i, 2 * i);
+    }
+    ASSERT_EQ(tree.get_free_page_count(), 0u) << test << " loses free pages";
+    ASSERT_EQ(tree.get_entry_count(), n / 2 + n);
+  }
+
+  // Trees in other segments start out empty.
+  BTree other_tree(1, buffer_manager);
+  ASSERT_FALSE(other_tree.root);
+  other_tree.insert(1, 1);
+  ASSERT_NE(*other_tree.root, BTree(0, buffer_manager).root);
+
+  using SmallBTree =
+      buzzdb::BTree<uint64_t, uint64_t, std::less<uint64_t>, 512>;
+  ASSERT_THROW(SmallBTree(0, buffer_manager), std::logic_error);
+}
+
+TEST(BTreeTest, ConcurrentErase) {
+  BufferManager buffer_manager(1024, 100);
+  BTree tree(0, buffer_manager);
+  constexpr uint64_t kThreads = 4;
+  uint64_t n = 100 * BTree::LeafNode::kCapacity;
+
+  // Odd keys stay in the tree while the even keys are inserted and erased
+  // again, which merges and splits the nodes around them all the time.
+  for (uint64_t key = 1; key < 2 * n; key += 2) {
+    tree.insert(key, key);
+  }
+  std::atomic<uint64_t> failures{0};
+  std::vector<std::thread> threads;
+  for (uint64_t t = 0; t < kThreads; ++t) {
+    threads.emplace_back([&, t] {
+      std::mt19937_64 engine(t);
+      std::uniform_int_distribution<uint64_t> key_distr(0, n - 1);
+      for (auto i = 0; i < 3; ++i) {
+        for (uint64_t key = 2 * t; key < 2 * n; key += 2 * kThreads) {
+          tree.insert(key, key);
+        }
+        for (uint64_t key = 2 * t; key < 2 * n; key += 2 * kThreads) {
+          tree.erase(key);
+          uint64_t probe = 2 * key_distr(engine) + 1;
+          if (tree.lookup(probe) != probe) {
+            ++failures;
+          }
+        }
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  ASSERT_EQ(failures.load(), 0u) << "lookups missed keys during merges";
+  for (uint64_t key = 0; key < 2 * n; ++key) {
+    if (key % 2 == 0) {
+      ASSERT_FALSE(tree.lookup(key)) << "k=" << key << " was not erased";
+    } else {
+      ASSERT_EQ(tree.lookup(key), key) << "k=" << key << " is missing";
+    }
+  }
+}
+
+TEST(BTreeTest, PinnedInnerNodes) {
+  BufferManager buffer_manager(1024, 100);
+  BTree tree(0, buffer_manager);
+  uint64_t n = 200 * BTree::LeafNode::kCapacity;
+  std::vector<uint64_t> keys(n);
+  std::iota(keys.begin(), keys.end(), 0);
+  std::mt19937_64 engine(0);
+  std::shuffle(keys.begin(), keys.end(), engine);
+  for (auto key : keys) {
+    tree.insert(key, key);
+  }
+  ASSERT_GT(tree.get_height(), 2);
+  auto pinned_count = tree.pinned_pages.get_count();
+  ASSERT_GT(pinned_count, 1u) << "the inner nodes are not pinned";
+  ASSERT_LE(pinned_count, buffer_manager.get_page_count() / 4);
+
+  auto fix_count = buffer_manager.get_fix_count();
+  for (auto key : keys) {
+    ASSERT_EQ(tree.lookup(key), key);
+  }
+  ASSERT_EQ(buffer_manager.get_fix_count() - fix_count, n)
+      << "lookups fix more pages than their leaf";
+  ASSERT_EQ(tree.pinned_pages.get_count(), pinned_count);
+
+  // Inner nodes that are merged and reused stay pinned and are found again.
+  for (uint64_t key = 0; key < n; ++key) {
+    if (key % 16 != 0) {
+      tree.erase(key);
+    }
+  }
+  for (uint64_t key = n; key < 2 * n; ++key) {
+    tree.insert(key, key);
+  }
+  for (uint64_t key = 0; key < 2 * n; ++key) {
+    auto expected = key >= n || key % 16 == 0 ? std::optional(key)
+                                              : std::nullopt;
+    ASSERT_EQ(tree.lookup(key), expected) << "k=" << key;
+  }
+}
+
+TEST(BTreeTest, UnchangedPinnedPagesStayClean) {
+  BufferManager buffer_manager(1024, 100);
+  uint64_t n = 200 * BTree::LeafNode::kCapacity;
+  {
+    BTree tree(0, buffer_manager);
+    for (uint64_t key = 0; key < n; ++key) {
+      tree.insert(key, key);
+    }
+  }
+  // Fixing as many new pages of another segment twice as the buffer holds
+  // moves them to the LRU list and evicts the whole tree.
+  uint64_t next_page_id = 0;
+  auto evict_tree = [&] {
+    for (size_t i = 0; i < buffer_manager.get_page_count(); ++i) {
+      auto page_id = BufferManager::get_overall_page_id(1, next_page_id++);
+      for (int j = 0; j < 2; ++j) {
+        auto &page = buffer_manager.fix_page(page_id, false);
+        buffer_manager.unfix_page(page, false);
+      }
+    }
+  };
+  evict_tree();
+
+  auto write_count = buffer_manager.get_write_count();
+  {
+    BTree tree(0, buffer_manager);
+    for (uint64_t key = 0; key < n; key += 7) {
+      ASSERT_EQ(tree.lookup(key), key);
+    }
+    ASSERT_GT(tree.pinned_pages.get_count(), 1u);
+  }
+  evict_tree();
+  ASSERT_EQ(buffer_manager.get_write_count() - write_count, 1u)
+      << "lookups dirty more pages than the metadata";
+}
+
+TEST(BTreeTest, LargerThanBuffer) {
+  // Lookup batches fix up to two pages per key.
+  BufferManager buffer_manager(1024, 64);
+  BTree tree(0, buffer_manager);
+  uint64_t n = 200 * BTree::LeafNode::kCapacity;
+  std::vector<uint64_t> keys(n);
+  std::iota(keys.begin(), keys.end(), 0);
+  std::mt19937_64 engine(0);
+  std::shuffle(keys.begin(), keys.end(), engine);
+  for (auto key : keys) {
+    tree.insert(key, 2 * key);
+  }
+  ASSERT_GT(tree.get_page_count(), 4 * buffer_manager.get_page_count());
+  ASSERT_GT(buffer_manager.get_write_count(), 0u) << "no page was evicted";
+
+  std::vector<std::thread> threads;
+  std::atomic<uint64_t> failures{0};
+  for (uint64_t t = 0; t < 4; ++t) {
+    threads.emplace_back([&, t] {
+      for (uint64_t key = t; key < n; key += 4) {
+        if (key % 8 < 4) {
+          tree.erase(key);
+        } else if (tree.lookup(key) != 2 * key) {
+          ++failures;
+        }
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  ASSERT_EQ(failures.load(), 0u) << "lookups missed evicted keys";
+
+  std::vector<std::optional<uint64_t>> results(n);
+  tree.lookup_batch(keys.data(), n, results.data());
+  for (auto i = 0ul; i < n; ++i) {
+    auto expected = keys[i] % 8 < 4 ? std::nullopt : std::optional(2 * keys[i]);
+    ASSERT_EQ(results[i], expected) << "k=" << keys[i];
+  }
+  auto scan = tree.scan(0, n);
+  for (uint64_t key = 4; key < n; key += key % 8 == 7 ? 5 : 1) {
+    ASSERT_TRUE(scan.next()) << "the scan ends before k=" << key;
+    ASSERT_EQ(scan.key(), key);
+  }
+  ASSERT_FALSE(scan.next());
+}
+
 }  // namespace
 
 int main(int argc, char* argv[]) {
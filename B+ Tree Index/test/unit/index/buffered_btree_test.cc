@@ -0,0 +1,219 @@
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "index/btree.h"
+#include "index/buffered_btree.h"
+#include "storage/test_segment_directory.h"
+
+using BufferManager = buzzdb::BufferManager;
+using BufferedBTree =
+    buzzdb::BufferedBTree<uint64_t, uint64_t, std::less<uint64_t>, 1024>;
+using InnerNode = BufferedBTree::InnerNode;
+using LeafNode = BufferedBTree::LeafNode;
+
+namespace {
+
+TEST(BufferedBTreeTest, LookupEmptyTree) {
+  BufferManager buffer_manager(1024, 100);
+  BufferedBTree tree(0, buffer_manager);
+  ASSERT_FALSE(tree.lookup(42));
+  tree.erase(42);
+  ASSERT_FALSE(tree.lookup(42));
+  ASSERT_EQ(tree.get_height(), 1u);
+}
+
+TEST(BufferedBTreeTest, InsertLookupErase) {
+  BufferManager buffer_manager(1024, 100);
+  BufferedBTree tree(0, buffer_manager);
+  std::map<uint64_t, uint64_t> expected;
+  std::mt19937_64 engine(0);
+  std::uniform_int_distribution<uint64_t> key_distr(0, 50000);
+  for (int round = 0; round < 3; ++round) {
+    for (uint64_t i = 0; i < 50000; ++i) {
+      uint64_t key = key_distr(engine);
+      if (i % 3 == 2) {
+        tree.erase(key);
+        expected.erase(key);
+      } else {
+        tree.insert(key, key + i);
+        expected[key] = key + i;
+      }
+    }
+    for (uint64_t key = 0; key <= 50000; ++key) {
+      auto it = expected.find(key);
+      ASSERT_EQ(tree.lookup(key), it == expected.end()
+                                      ? std::nullopt
+                                      : std::optional(it->second))
+          << "k=" << key;
+    }
+  }
+  ASSERT_GE(tree.get_height(), 4u);
+}
+
+TEST(BufferedBTreeTest, MessagesWaitInBuffers) {
+  BufferManager buffer_manager(1024, 100);
+  BufferedBTree tree(0, buffer_manager);
+  uint64_t key = 0;
+  while (tree.get_height() < 2) {
+    tree.insert(key, key);
+    ++key;
+  }
+  // The insert that split the leaf already went to the new root. Inserts
+  // and erases only reach the root until its buffer is full.
+  BufferedBTree::FixedPage root_page(buffer_manager, tree.metadata->root);
+  auto root_node = root_page.get_node<InnerNode>();
+  ASSERT_EQ(root_node->message_count, 1u);
+  tree.insert(key, 7);
+  tree.erase(0);
+  tree.insert(1, 8);
+  tree.erase(1);
+  ASSERT_EQ(root_node->message_count, 4u);
+  ASSERT_EQ(tree.lookup(key), 7u);
+  ASSERT_FALSE(tree.lookup(0));
+  ASSERT_FALSE(tree.lookup(1));
+  ASSERT_EQ(tree.lookup(2), 2u);
+
+  // A full buffer moves the messages of the fullest child down at once.
+  uint64_t first_key = key;
+  for (uint32_t i = 5; i <= InnerNode::kBufferCapacity; ++i) {
+    ++key;
+    tree.insert(key, key);
+    ASSERT_EQ(root_node->message_count, i);
+  }
+  ++key;
+  tree.insert(key, key);
+  ASSERT_LT(root_node->message_count, InnerNode::kBufferCapacity / 2);
+  for (uint64_t k = first_key + 1; k <= key; ++k) {
+    ASSERT_EQ(tree.lookup(k), k) << "k=" << k;
+  }
+  ASSERT_FALSE(tree.lookup(0));
+}
+
+TEST(BufferedBTreeTest, FewerWritesThanBTree) {
+  // Random inserts into trees of about 10 times the size of the buffer.
+  constexpr uint64_t kKeyCount = 100000;
+  std::vector<uint64_t> keys(kKeyCount);
+  std::mt19937_64 engine(0);
+  for (auto& key : keys) {
+    key = engine();
+  }
+
+  uint64_t btree_write_count;
+  {
+    BufferManager buffer_manager(4096, 64);
+    buzzdb::BTree<uint64_t, uint64_t, std::less<uint64_t>, 4096> tree(
+        0, buffer_manager);
+    for (uint64_t key : keys) {
+      tree.insert(key, key);
+    }
+    btree_write_count = buffer_manager.get_write_count();
+  }
+  uint64_t buffered_write_count;
+  {
+    BufferManager buffer_manager(4096, 64);
+    buzzdb::BufferedBTree<uint64_t, uint64_t, std::less<uint64_t>, 4096> tree(
+        0, buffer_manager);
+    for (uint64_t key : keys) {
+      tree.insert(key, key);
+    }
+    buffered_write_count = buffer_manager.get_write_count();
+    for (uint64_t key : keys) {
+      ASSERT_EQ(tree.lookup(key), key);
+    }
+  }
+  ASSERT_LT(buffered_write_count * 10, btree_write_count)
+      << buffered_write_count << " writes with buffers, " << btree_write_count
+      << " without";
+}
+
+TEST(BufferedBTreeTest, Reopen) {
+  buzzdb::TestSegmentDirectory segment_directory("buffered_btree_test");
+  auto open_segment_file = segment_directory.get_opener();
+  {
+    BufferManager buffer_manager(1024, 100, open_segment_file);
+    BufferedBTree tree(3, buffer_manager);
+    for (uint64_t key = 0; key < 20000; ++key) {
+      tree.insert(key * 7 % 20000, key);
+    }
+    tree.erase(5);
+  }
+  // A new buffer manager only sees what was written to the files. Messages
+  // that still wait in the buffers must have been written with their nodes.
+  BufferManager buffer_manager(1024, 100, open_segment_file);
+  {
+    BufferedBTree tree(3, buffer_manager);
+    for (uint64_t key = 0; key < 20000; ++key) {
+      uint64_t k = key * 7 % 20000;
+      ASSERT_EQ(tree.lookup(k), k == 5 ? std::nullopt : std::optional(key))
+          << "k=" << k;
+    }
+  }
+  ASSERT_THROW(
+      (buzzdb::BufferedBTree<uint64_t, uint64_t, std::less<uint64_t>, 512>(
+          3, buffer_manager)),
+      std::logic_error);
+}
+
+TEST(BufferedBTreeTest, LookupsDuringFlushes) {
+  BufferManager buffer_manager(1024, 100);
+  BufferedBTree tree(0, buffer_manager);
+  // A writer inserts the even keys in random order, so that full buffers
+  // keep flushing and splitting children on all levels. Readers look up
+  // keys that were inserted before, which may sit in any buffer or leaf on
+  // their way down, and odd keys, which must never be found. The readers
+  // yield after every lookup and stop after a while, since the tree latch
+  // lets a steady stream of lookups starve the writer.
+  constexpr uint64_t kKeyCount = 60000;
+  constexpr uint64_t kLookupCount = 20000;
+  std::vector<uint64_t> keys(kKeyCount);
+  for (uint64_t i = 0; i < kKeyCount; ++i) {
+    keys[i] = 2 * i;
+  }
+  std::shuffle(keys.begin(), keys.end(), std::mt19937_64(0));
+  std::atomic<uint64_t> inserted_count{0};
+  std::vector<std::thread> readers;
+  for (uint64_t t = 0; t < 3; ++t) {
+    readers.emplace_back([&, t] {
+      std::mt19937_64 engine(t);
+      for (uint64_t i = 0; i < kLookupCount; ++i) {
+        uint64_t count;
+        while ((count = inserted_count.load()) == 0) {
+          std::this_thread::yield();
+        }
+        uint64_t key = keys[engine() % count];
+        ASSERT_EQ(tree.lookup(key), key / 2) << "k=" << key;
+        ASSERT_FALSE(tree.lookup(engine() % kKeyCount * 2 + 1));
+        std::this_thread::yield();
+      }
+    });
+  }
+  for (uint64_t i = 0; i < kKeyCount; ++i) {
+    tree.insert(keys[i], keys[i] / 2);
+    inserted_count.store(i + 1);
+  }
+  for (auto& reader : readers) {
+    reader.join();
+  }
+  ASSERT_GE(tree.get_height(), 4u);
+  for (uint64_t key = 0; key < 2 * kKeyCount; ++key) {
+    ASSERT_EQ(tree.lookup(key),
+              key % 2 == 0 ? std::optional(key / 2) : std::nullopt)
+        << "k=" << key;
+  }
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,231 @@
+#include <gtest/gtest.h>
+#include <cstdint>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "index/hash_index.h"
+#include "storage/test_segment_directory.h"
+
+using BufferManager = buzzdb::BufferManager;
+using HashIndex = buzzdb::HashIndex<uint64_t, uint64_t, 1024>;  // NOLINT
+
+namespace {
+
+/// A hash that maps all keys to the same bucket.
+struct ConstantHash {
+  size_t operator()(uint64_t /*key*/) const { return 42; }
+};
+
+/// A hash under which the keys of every group of `kGroupSize` consecutive
+/// keys collide.
+struct GroupHash {
+  static constexpr uint64_t kGroupSize = 200;
+
+  size_t operator()(uint64_t key) const { return key / kGroupSize; }
+};
+
+TEST(HashIndexTest, LookupEmptyIndex) {
+  BufferManager buffer_manager(1024, 100);
+  HashIndex index(0, buffer_manager);
+  ASSERT_FALSE(index.lookup(0)) << "the empty index returns something";
+  ASSERT_FALSE(index.lookup(42));
+  ASSERT_FALSE(index.erase(42));
+  ASSERT_EQ(index.get_entry_count(), 0u);
+  ASSERT_EQ(index.get_global_depth(), 0);
+}
+
+TEST(HashIndexTest, InsertLookupErase) {
+  BufferManager buffer_manager(1024, 100);
+  HashIndex index(0, buffer_manager);
+  std::unordered_map<uint64_t, uint64_t> expected;
+  std::mt19937_64 engine(0);
+  std::uniform_int_distribution<uint64_t> key_distr(0, 20000);
+  for (int round = 0; round < 3; ++round) {
+    for (int i = 0; i < 20000; ++i) {
+      uint64_t key = key_distr(engine);
+      if (i % 3 == 2) {
+        ASSERT_EQ(index.erase(key), expected.erase(key) == 1) << "k=" << key;
+      } else {
+        index.insert(key, key + i);
+        expected[key] = key + i;
+      }
+    }
+    ASSERT_EQ(index.get_entry_count(), expected.size());
+    for (uint64_t key = 0; key <= 20000; ++key) {
+      auto value = index.lookup(key);
+      auto it = expected.find(key);
+      if (it == expected.end()) {
+        ASSERT_FALSE(value) << "k=" << key << " was erased";
+      } else {
+        ASSERT_TRUE(value) << "k=" << key << " is missing";
+        ASSERT_EQ(*value, it->second) << "k=" << key;
+      }
+    }
+  }
+}
+
+TEST(HashIndexTest, GrowsOneBucketAtATime) {
+  BufferManager buffer_manager(1024, 1000);
+  HashIndex index(0, buffer_manager);
+  uint64_t page_count = index.metadata->next_page_id;
+  uint16_t global_depth = 0;
+  for (uint64_t key = 0; key < 50000; ++key) {
+    index.insert(key * 1024, key);
+    // Unless the directory doubles, an insert allocates at most the page of
+    // one new bucket.
+    uint64_t new_page_count = index.metadata->next_page_id;
+    if (index.get_global_depth() == global_depth) {
+      ASSERT_LE(new_page_count, page_count + 1) << "k=" << key;
+    }
+    page_count = new_page_count;
+    global_depth = index.get_global_depth();
+  }
+  ASSERT_GE(global_depth, 9) << "the directory does not grow";
+
+  // Strided keys spread over the buckets, no bucket overflows.
+  for (uint64_t slot = 0; slot < (uint64_t{1} << global_depth); ++slot) {
+    HashIndex::FixedPage bucket_page(buffer_manager,
+                                     index.get_directory_slot(slot));
+    ASSERT_EQ(bucket_page.get_node()->next_page, 0u) << "slot " << slot;
+  }
+
+  // A lookup fixes only its bucket.
+  uint64_t fix_count = buffer_manager.get_fix_count();
+  for (uint64_t key = 0; key < 1000; ++key) {
+    ASSERT_EQ(index.lookup(key * 1024), key) << "k=" << key * 1024;
+  }
+  ASSERT_EQ(buffer_manager.get_fix_count() - fix_count, 1000u);
+}
+
+TEST(HashIndexTest, OverflowChains) {
+  BufferManager buffer_manager(1024, 100);
+  buzzdb::HashIndex<uint64_t, uint64_t, 1024, ConstantHash> index(
+      0, buffer_manager);
+  using Bucket = decltype(index)::Bucket;
+  uint64_t count = 5 * Bucket::kCapacity + 3;
+  for (uint64_t key = 0; key < count; ++key) {
+    index.insert(key, key * 2);
+  }
+  ASSERT_EQ(index.get_global_depth(), 0) << "colliding keys split a bucket";
+  ASSERT_EQ(index.get_entry_count(), count);
+  ASSERT_EQ(index.metadata->next_page_id, 2u + 6u);
+  for (uint64_t key = 0; key < count; ++key) {
+    ASSERT_EQ(index.lookup(key), key * 2) << "k=" << key;
+  }
+  ASSERT_FALSE(index.lookup(count));
+
+  // Erasing frees the overflow pages, which later inserts reuse.
+  for (uint64_t key = 0; key < count; key += 2) {
+    ASSERT_TRUE(index.erase(key));
+  }
+  ASSERT_NE(index.metadata->first_free_page, 0u);
+  for (uint64_t key = 0; key < count; ++key) {
+    ASSERT_EQ(index.lookup(key).has_value(), key % 2 == 1) << "k=" << key;
+  }
+  for (uint64_t key = 0; key < count; key += 2) {
+    index.insert(key, key * 2);
+  }
+  ASSERT_EQ(index.metadata->next_page_id, 2u + 6u) << "pages are not reused";
+  ASSERT_EQ(index.get_entry_count(), count);
+}
+
+TEST(HashIndexTest, Reopen) {
+  buzzdb::TestSegmentDirectory segment_directory("hash_index_test");
+  auto open_segment_file = segment_directory.get_opener();
+  {
+    BufferManager buffer_manager(1024, 100, open_segment_file);
+    HashIndex index(3, buffer_manager);
+    for (uint64_t key = 0; key < 20000; ++key) {
+      index.insert(key, key + 1);
+    }
+  }
+  // A new buffer manager only sees what was written to the files.
+  BufferManager buffer_manager(1024, 100, open_segment_file);
+  {
+    HashIndex index(3, buffer_manager);
+    ASSERT_EQ(index.get_entry_count(), 20000u);
+    for (uint64_t key = 0; key < 20000; ++key) {
+      ASSERT_EQ(index.lookup(key), key + 1) << "k=" << key;
+    }
+  }
+  ASSERT_THROW((buzzdb::HashIndex<uint64_t, uint64_t, 512>(3, buffer_manager)),
+               std::logic_error);
+}
+
+TEST(HashIndexTest, ConcurrentSplitsAndOverflowChains) {
+  using GroupHashIndex = buzzdb::HashIndex<uint64_t, uint64_t, 1024, GroupHash>;
+  static_assert(GroupHash::kGroupSize > 2 * GroupHashIndex::Bucket::kCapacity,
+                "every group needs an overflow chain");
+  BufferManager buffer_manager(1024, 2000);
+  GroupHashIndex index(0, buffer_manager);
+  // The threads take turns with the keys, and consecutive keys go to all
+  // groups before they come back to the first one. So buckets split, the
+  // directory doubles and overflow chains grow while the other threads
+  // insert into them. Every thread erases every other key of its own a
+  // while after inserting it, which shrinks the chains again.
+  constexpr uint64_t kThreadCount = 4;
+  constexpr uint64_t kGroupCount = 256;
+  constexpr uint64_t kKeyCount = kGroupCount * GroupHash::kGroupSize;
+  constexpr uint64_t kEraseLag = 250 * kThreadCount;
+  auto get_key = [](uint64_t i) {
+    return i % kGroupCount * GroupHash::kGroupSize + i / kGroupCount;
+  };
+  auto is_erased = [](uint64_t i) {
+    return i / kThreadCount % 2 == 1 && i + kEraseLag < kKeyCount;
+  };
+  std::vector<std::thread> threads;
+  for (uint64_t t = 0; t < kThreadCount; ++t) {
+    threads.emplace_back([&, t] {
+      std::mt19937_64 engine(t);
+      for (uint64_t i = t; i < kKeyCount; i += kThreadCount) {
+        uint64_t key = get_key(i);
+        index.insert(key, ~key);
+        ASSERT_EQ(index.lookup(key), ~key) << "k=" << key;
+        if (i >= kEraseLag && is_erased(i - kEraseLag)) {
+          uint64_t erased_key = get_key(i - kEraseLag);
+          ASSERT_TRUE(index.erase(erased_key)) << "k=" << erased_key;
+          ASSERT_FALSE(index.lookup(erased_key)) << "k=" << erased_key;
+        }
+        uint64_t other_key = get_key(engine() % kKeyCount);
+        if (auto value = index.lookup(other_key)) {
+          ASSERT_EQ(*value, ~other_key) << "k=" << other_key;
+        }
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  uint64_t entry_count = 0;
+  for (uint64_t i = 0; i < kKeyCount; ++i) {
+    uint64_t key = get_key(i);
+    if (is_erased(i)) {
+      ASSERT_FALSE(index.lookup(key)) << "k=" << key;
+    } else {
+      ASSERT_EQ(index.lookup(key), ~key) << "k=" << key;
+      ++entry_count;
+    }
+  }
+  ASSERT_EQ(index.get_entry_count(), entry_count);
+  ASSERT_GE(index.get_global_depth(), 8) << "the directory does not grow";
+  uint64_t chain_count = 0;
+  for (uint64_t slot = 0; slot < (uint64_t{1} << index.get_global_depth());
+       ++slot) {
+    GroupHashIndex::FixedPage bucket_page(buffer_manager,
+                                          index.get_directory_slot(slot));
+    chain_count += bucket_page.get_node()->next_page != 0;
+  }
+  ASSERT_GT(chain_count, 0u) << "no bucket overflows";
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
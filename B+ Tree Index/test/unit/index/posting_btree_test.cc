@@ -0,0 +1,197 @@
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <map>
+#include <numeric>
+#include <random>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include "index/posting_btree.h"
+
+using BufferManager = buzzdb::BufferManager;
+using PostingBTree =
+    buzzdb::PostingBTree<uint64_t, std::less<uint64_t>, 1024>;  // NOLINT
+using PostingPage = PostingBTree::PostingPage;
+
+namespace {
+
+/// Encodes values into a page and decodes them again.
+/// @return             The number of values that fit and the decoded values.
+std::pair<size_t, std::vector<uint64_t>> round_trip(
+    const std::vector<uint64_t>& values) {
+  alignas(PostingPage) char buffer[1024];
+  auto page = reinterpret_cast<PostingPage*>(buffer);
+  size_t count = page->encode(values.data(), values.size());
+  std::vector<uint64_t> decoded;
+  page->decode(decoded);
+  return {count, decoded};
+}
+
+TEST(PostingBTreeTest, Encoding) {
+  constexpr uint64_t kMax = std::numeric_limits<uint64_t>::max();
+  std::vector<std::vector<uint64_t>> lists = {
+      {42},
+      {0, 1, 2, 3},
+      {0, kMax},
+      {1, 2, 4, 8, 1000, 1u << 20, 1ull << 40, kMax - 1, kMax},
+  };
+  std::mt19937_64 engine(0);
+  for (uint32_t width = 1; width <= 64; ++width) {
+    std::vector<uint64_t> values = {0};
+    uint64_t max_delta = std::min(kMax >> (64 - width), kMax / 400);
+    for (int i = 0; i < 200; ++i) {
+      values.push_back(values.back() + 1 + engine() % (max_delta + 1) / 2);
+    }
+    lists.push_back(values);
+  }
+  for (auto& values : lists) {
+    auto [count, decoded] = round_trip(values);
+    ASSERT_GE(count, 1u);
+    values.resize(count);
+    ASSERT_EQ(decoded, values);
+  }
+
+  // Dense values take one bit each, random 64-bit values most bits.
+  std::vector<uint64_t> dense(100000);
+  std::iota(dense.begin(), dense.end(), 7);
+  ASSERT_EQ(round_trip(dense).first, PostingPage::kBitCount + 1);
+  std::vector<uint64_t> sparse(1000);
+  for (auto& value : sparse) {
+    value = engine();
+  }
+  std::sort(sparse.begin(), sparse.end());
+  ASSERT_LT(round_trip(sparse).first, PostingPage::kBitCount / 48);
+}
+
+TEST(PostingBTreeTest, InlineAndSpill) {
+  BufferManager buffer_manager(1024, 100);
+  PostingBTree tree(0, buffer_manager);
+  ASSERT_TRUE(tree.lookup(1).empty());
+  ASSERT_FALSE(tree.erase(1, 10));
+
+  for (uint64_t value : {30, 10, 20}) {
+    ASSERT_TRUE(tree.insert(1, value));
+  }
+  ASSERT_FALSE(tree.insert(1, 20)) << "a duplicate value was added";
+  uint64_t page_count = tree.tree.get_page_count();
+  ASSERT_EQ(tree.lookup(1), (std::vector<uint64_t>{10, 20, 30}));
+
+  // The fourth value spills the list to an overflow page.
+  ASSERT_TRUE(tree.insert(1, 15));
+  ASSERT_EQ(tree.tree.get_page_count(), page_count + 1);
+  ASSERT_EQ(tree.lookup(1), (std::vector<uint64_t>{10, 15, 20, 30}));
+  ASSERT_EQ(tree.get_value_count(1), 4u);
+  ASSERT_FALSE(tree.insert(1, 15));
+
+  // Shrinking back to three values moves them inline again.
+  ASSERT_TRUE(tree.erase(1, 20));
+  ASSERT_EQ(tree.tree.get_free_page_count(), 1u);
+  ASSERT_EQ(tree.lookup(1), (std::vector<uint64_t>{10, 15, 30}));
+  for (uint64_t value : {10, 15, 30}) {
+    ASSERT_TRUE(tree.erase(1, value));
+  }
+  ASSERT_TRUE(tree.lookup(1).empty());
+  ASSERT_EQ(tree.get_key_count(), 0u) << "the empty list was kept";
+}
+
+TEST(PostingBTreeTest, LowCardinality) {
+  BufferManager buffer_manager(1024, 100);
+  PostingBTree tree(0, buffer_manager);
+  // Tuple ids of a column with 4 distinct values.
+  constexpr uint64_t kTupleCount = 200000;
+  for (uint64_t tid = 0; tid < kTupleCount; ++tid) {
+    tree.insert(tid % 4, tid);
+  }
+  ASSERT_EQ(tree.get_key_count(), 4u);
+  // Every list takes about 2 bits per tuple id.
+  ASSERT_LT(tree.tree.get_page_count(), 4 * (kTupleCount / 4 * 2 / 8000 + 3));
+  for (uint64_t key = 0; key < 4; ++key) {
+    auto values = tree.lookup(key);
+    ASSERT_EQ(values.size(), kTupleCount / 4);
+    for (uint64_t i = 0; i < values.size(); ++i) {
+      ASSERT_EQ(values[i], 4 * i + key) << "key " << key << ", value " << i;
+    }
+  }
+}
+
+TEST(PostingBTreeTest, RandomInsertErase) {
+  BufferManager buffer_manager(1024, 100);
+  PostingBTree tree(0, buffer_manager);
+  std::map<uint64_t, std::set<uint64_t>> expected;
+  std::mt19937_64 engine(0);
+  // Keys have lists of all sizes, values gaps of all widths.
+  std::geometric_distribution<uint64_t> key_distr(0.01);
+  for (int round = 0; round < 4; ++round) {
+    for (int i = 0; i < 30000; ++i) {
+      uint64_t key = key_distr(engine) % 500;
+      uint64_t value = engine() >> (engine() % 64);
+      if (i % 3 == 2 && !expected[key].empty()) {
+        // Erase a value that exists, and one that likely does not.
+        auto it = expected[key].lower_bound(value);
+        if (it == expected[key].end()) {
+          it = expected[key].begin();
+        }
+        ASSERT_TRUE(tree.erase(key, *it));
+        expected[key].erase(it);
+        ASSERT_EQ(tree.erase(key, value), expected[key].erase(value) == 1);
+      } else {
+        ASSERT_EQ(tree.insert(key, value), expected[key].insert(value).second);
+      }
+    }
+    for (auto& [key, values] : expected) {
+      auto result = tree.lookup(key);
+      ASSERT_TRUE(std::equal(result.begin(), result.end(), values.begin(),
+                             values.end()))
+          << "key " << key << " has the wrong values";
+      ASSERT_EQ(tree.get_value_count(key), values.size());
+    }
+  }
+
+  // Erasing all values frees all overflow pages.
+  for (auto& [key, values] : expected) {
+    for (uint64_t value : values) {
+      ASSERT_TRUE(tree.erase(key, value));
+    }
+  }
+  ASSERT_EQ(tree.get_key_count(), 0u);
+  ASSERT_GT(tree.tree.get_free_page_count(), 0u);
+}
+
+TEST(PostingBTreeTest, Concurrent) {
+  BufferManager buffer_manager(1024, 100);
+  PostingBTree tree(0, buffer_manager);
+  // Every thread adds its own values to the lists of all keys and reads the
+  // lists while the other threads write them.
+  constexpr uint64_t kThreadCount = 4;
+  constexpr uint64_t kValueCount = 10000;
+  std::vector<std::thread> threads;
+  for (uint64_t t = 0; t < kThreadCount; ++t) {
+    threads.emplace_back([&, t] {
+      for (uint64_t i = 0; i < kValueCount; ++i) {
+        ASSERT_TRUE(tree.insert(i % 10, i * kThreadCount + t));
+        auto values = tree.lookup(i % 10);
+        ASSERT_TRUE(std::is_sorted(values.begin(), values.end()));
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  for (uint64_t key = 0; key < 10; ++key) {
+    auto values = tree.lookup(key);
+    ASSERT_EQ(values.size(), kValueCount / 10 * kThreadCount);
+    for (uint64_t value : values) {
+      ASSERT_EQ(value / kThreadCount % 10, key);
+    }
+  }
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
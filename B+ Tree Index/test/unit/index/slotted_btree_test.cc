@@ -0,0 +1,263 @@
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "index/slotted_btree.h"
+#include "storage/test_segment_directory.h"
+
+using BufferManager = buzzdb::BufferManager;
+using SlottedBTree = buzzdb::SlottedBTree<2048>;  // NOLINT
+
+namespace {
+
+/// Returns `count` distinct URL-like keys with long shared prefixes.
+std::vector<std::string> get_keys(size_t count, uint64_t seed) {
+  std::mt19937_64 engine(seed);
+  std::uniform_int_distribution<int> host_distr(0, 9);
+  std::uniform_int_distribution<int> length_distr(0, 60);
+  std::vector<std::string> keys;
+  for (size_t i = 0; i < count; ++i) {
+    auto key = "https://www.host" + std::to_string(host_distr(engine)) +
+               ".com/" + std::to_string(i * 7919 % count);
+    key.append(length_distr(engine), 'x');
+    keys.push_back(std::move(key));
+  }
+  return keys;
+}
+
+TEST(SlottedBTreeTest, LookupEmptyTree) {
+  BufferManager buffer_manager(2048, 100);
+  SlottedBTree tree(0, buffer_manager);
+  ASSERT_FALSE(tree.lookup("")) << "the empty tree returns something";
+  ASSERT_FALSE(tree.lookup("key"));
+  ASSERT_FALSE(tree.erase("key"));
+  ASSERT_EQ(tree.get_entry_count(), 0u);
+  ASSERT_EQ(tree.get_height(), 1);
+  auto scan = tree.scan("", "\xff");
+  ASSERT_FALSE(scan.next());
+}
+
+TEST(SlottedBTreeTest, Separator) {
+  using Node = SlottedBTree::Node;
+  ASSERT_EQ(Node::get_separator("apple", "banana"), "b");
+  ASSERT_EQ(Node::get_separator("https://a/1", "https://a/22"), "https://a/2");
+  ASSERT_EQ(Node::get_separator("ab", "abc"), "ab");
+  ASSERT_EQ(Node::get_separator("abc", "abd"), "abc");
+  ASSERT_EQ(Node::get_separator("", "a"), "");
+  ASSERT_EQ(Node::get_separator("a\x7f", "a\x80z"), "a\x80");
+}
+
+TEST(SlottedBTreeTest, InsertLookupScan) {
+  BufferManager buffer_manager(2048, 100);
+  SlottedBTree tree(0, buffer_manager);
+  auto keys = get_keys(5000, 0);
+  std::map<std::string, std::string> expected;
+  for (auto& key : keys) {
+    auto value = std::to_string(key.size()) + key.substr(0, key.size() % 50);
+    tree.insert(key, value);
+    expected[key] = value;
+  }
+  ASSERT_GT(tree.get_height(), 2) << "the tree does not grow";
+  ASSERT_EQ(tree.get_entry_count(), expected.size());
+
+  // Overwrite with values of other lengths.
+  for (size_t i = 0; i < keys.size(); i += 3) {
+    auto value = std::string(i % 100, 'v');
+    tree.insert(keys[i], value);
+    expected[keys[i]] = value;
+  }
+  ASSERT_EQ(tree.get_entry_count(), expected.size()) << "overwrites count";
+
+  for (auto& [key, value] : expected) {
+    auto result = tree.lookup(key);
+    ASSERT_TRUE(result) << "k=" << key << " is missing";
+    ASSERT_EQ(*result, value) << "k=" << key << " has the wrong value";
+    ASSERT_FALSE(tree.lookup(key + "!")) << "k=" << key << "! was found";
+  }
+
+  auto scan = tree.scan("", "\xff");
+  for (auto& [key, value] : expected) {
+    ASSERT_TRUE(scan.next()) << "the scan ends before k=" << key;
+    ASSERT_EQ(scan.key(), key);
+    ASSERT_EQ(scan.value(), value);
+  }
+  ASSERT_FALSE(scan.next());
+
+  auto lower = expected.lower_bound("https://www.host3");
+  auto upper = expected.upper_bound("https://www.host5");
+  auto range_scan = tree.scan("https://www.host3", "https://www.host5");
+  for (auto it = lower; it != upper; ++it) {
+    ASSERT_TRUE(range_scan.next());
+    ASSERT_EQ(range_scan.key(), it->first);
+  }
+  ASSERT_FALSE(range_scan.next()) << "the scan yields keys past the range";
+}
+
+TEST(SlottedBTreeTest, PrefixCompression) {
+  BufferManager buffer_manager(2048, 100);
+  SlottedBTree tree(0, buffer_manager);
+  std::string prefix = "2024-06-01T12:00:00/customer/" + std::string(60, 'c');
+  std::vector<std::string> keys;
+  for (int i = 0; i < 5000; ++i) {
+    keys.push_back(prefix + std::to_string(i * 7919 % 5000));
+    tree.insert(keys.back(), "v");
+  }
+  // Stored in full, the shared prefixes alone would fill more pages.
+  ASSERT_LT(tree.metadata->next_page_id * 2048, keys.size() * prefix.size())
+      << "the nodes do not store the shared prefix once";
+
+  SlottedBTree::FixedPage page(buffer_manager, tree.get_page_id(1));
+  while (!page.get_node()->is_leaf()) {
+    auto node = page.get_node();
+    page = SlottedBTree::FixedPage(buffer_manager, node->get_child(1));
+  }
+  auto node = page.get_node();
+  ASSERT_TRUE(node->get_upper_fence());
+  ASSERT_LT(node->get_lower_fence(), *node->get_upper_fence());
+  ASSERT_GE(node->get_prefix().size(), prefix.size());
+  for (uint32_t i = 0; i < node->count; ++i) {
+    auto key = node->get_full_key(i);
+    ASSERT_LT(node->get_lower_fence(), key) << "k=" << key << " is too small";
+    ASSERT_LE(key, *node->get_upper_fence()) << "k=" << key << " is too large";
+  }
+  page.release();
+
+  ASSERT_FALSE(tree.lookup(prefix)) << "the shared prefix was found";
+  ASSERT_FALSE(tree.lookup("2024")) << "a part of the prefix was found";
+  ASSERT_FALSE(tree.lookup(prefix + "x"));
+  for (auto& key : keys) {
+    ASSERT_EQ(tree.lookup(key), "v") << "k=" << key << " is missing";
+  }
+  for (size_t i = 0; i < keys.size(); i += 2) {
+    ASSERT_TRUE(tree.erase(keys[i]));
+  }
+  auto scan = tree.scan(prefix, prefix + "\xff");
+  size_t scanned = 0;
+  while (scan.next()) {
+    ASSERT_EQ(scan.key().substr(0, prefix.size()), prefix);
+    ++scanned;
+  }
+  ASSERT_EQ(scanned, keys.size() / 2);
+}
+
+TEST(SlottedBTreeTest, EntryTooLarge) {
+  BufferManager buffer_manager(2048, 100);
+  SlottedBTree tree(0, buffer_manager);
+  std::string key(SlottedBTree::kMaxEntrySize - 8, 'k');
+  tree.insert(key, "");
+  ASSERT_EQ(tree.lookup(key), "");
+  ASSERT_THROW(tree.insert(key + "k", ""), std::length_error);
+  std::string value(SlottedBTree::kMaxEntrySize, 'v');
+  ASSERT_THROW(tree.insert("k", value), std::length_error);
+
+  // Nodes of entries with the maximum size still split.
+  for (int i = 0; i < 100; ++i) {
+    tree.insert(std::to_string(i),
+                std::string(SlottedBTree::kMaxEntrySize - 2, 'v'));
+  }
+  for (int i = 0; i < 100; ++i) {
+    ASSERT_TRUE(tree.lookup(std::to_string(i)));
+  }
+}
+
+TEST(SlottedBTreeTest, Erase) {
+  BufferManager buffer_manager(2048, 100);
+  SlottedBTree tree(0, buffer_manager);
+  auto keys = get_keys(5000, 1);
+  std::mt19937_64 engine(0);
+  uint64_t page_count = 0;
+
+  for (auto round = 0; round < 2; ++round) {
+    for (auto& key : keys) {
+      tree.insert(key, key);
+    }
+    std::shuffle(keys.begin(), keys.end(), engine);
+    for (size_t i = 0; i < keys.size(); ++i) {
+      ASSERT_TRUE(tree.erase(keys[i])) << "k=" << keys[i] << " is missing";
+      ASSERT_FALSE(tree.erase(keys[i]));
+      if (i % 97 == 0) {
+        for (size_t j = i + 1; j < keys.size(); j += 13) {
+          ASSERT_EQ(tree.lookup(keys[j]), keys[j])
+              << "erasing " << i + 1 << " keys lost k=" << keys[j];
+        }
+      }
+    }
+    ASSERT_EQ(tree.get_entry_count(), 0u);
+    ASSERT_EQ(tree.get_height(), 1) << "the root did not collapse";
+    if (round == 0) {
+      page_count = tree.metadata->next_page_id;
+    }
+  }
+  ASSERT_LE(tree.metadata->next_page_id, page_count + page_count / 10)
+      << "the pages of merged nodes are not reused";
+}
+
+TEST(SlottedBTreeTest, Reopen) {
+  buzzdb::TestSegmentDirectory segment_directory("slotted_btree_test");
+  auto open_segment_file = segment_directory.get_opener();
+  auto keys = get_keys(2000, 2);
+  uint16_t height;
+  {
+    BufferManager buffer_manager(2048, 100, open_segment_file);
+    SlottedBTree tree(0, buffer_manager);
+    for (auto& key : keys) {
+      tree.insert(key, key);
+    }
+    height = tree.get_height();
+  }
+  // A new buffer manager only sees what was written to the files.
+  BufferManager buffer_manager(2048, 100, open_segment_file);
+  SlottedBTree tree(0, buffer_manager);
+  ASSERT_EQ(tree.get_entry_count(), keys.size());
+  ASSERT_EQ(tree.get_height(), height);
+  for (auto& key : keys) {
+    ASSERT_EQ(tree.lookup(key), key) << "reopening the tree lost k=" << key;
+  }
+  ASSERT_THROW(buzzdb::SlottedBTree<512>(0, buffer_manager), std::logic_error);
+}
+
+TEST(SlottedBTreeTest, Concurrent) {
+  BufferManager buffer_manager(2048, 100);
+  SlottedBTree tree(0, buffer_manager);
+  auto keys = get_keys(4000, 3);
+  for (size_t i = 1; i < keys.size(); i += 2) {
+    tree.insert(keys[i], keys[i]);
+  }
+
+  // Writers insert and erase the even keys while readers look for the odd
+  // ones.
+  std::atomic<uint64_t> failures{0};
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < 4; ++t) {
+    threads.emplace_back([&, t] {
+      for (size_t i = 2 * t; i < keys.size(); i += 8) {
+        if (t % 2 == 0) {
+          tree.insert(keys[i], keys[i]);
+          tree.erase(keys[i]);
+        }
+        if (tree.lookup(keys[i + 1]) != keys[i + 1]) {
+          ++failures;
+        }
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  ASSERT_EQ(failures.load(), 0u);
+  ASSERT_EQ(tree.get_entry_count(), keys.size() / 2);
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -7,9 +7,11 @@
 #include <mutex>
 #include <shared_mutex>
 #include <string>
+#include <utility>
 
 #include "common/macros.h"
 #include "storage/file.h"
+#include "storage/segment_space_manager.h"
 
 #define UNUSED(p) ((void)(p))
 
@@ -29,34 +31,48 @@ char* BufferFrame::get_data() {
 }
 
 BufferManager::BufferManager(size_t page_size, size_t page_count)
-    : page_size(page_size), page_count(page_count) {}
+    : BufferManager(page_size, page_count, [](uint16_t segment_id) {
+        return File::open_file(std::to_string(segment_id).c_str(),
+                               File::WRITE);
+      }) {}
+
+BufferManager::BufferManager(size_t page_size, size_t page_count,
+                             SegmentFileOpener open_segment_file)
+    : page_size(page_size),
+      page_count(page_count),
+      segments(std::move(open_segment_file)) {}
 
 BufferManager::~BufferManager() {
   /// Write dirty pages in fifo buffer to file
 
   for (auto page : fifoBuffer) {
     if (page.getDirty()) {
-      std::string file_name =
-          std::to_string(BufferManager::get_segment_id(page.getPageID()));
-      auto file = File::open_file(file_name.c_str(), File::WRITE);
+      uint16_t segment_id = get_segment_id(page.getPageID());
+      auto& file = segments.get_file(segment_id);
       uint64_t offSet = get_segment_page_id(page.getPageID()) * page_size;
-      file->write_block(page.get_data(), offSet, page_size);
+      segments.prepare_write(segment_id, offSet + page_size);
+      file.write_block(page.get_data(), offSet, page_size);
     }
   }
 
   /// Write dirty pages in lru buffer to file
   for (auto page : lruBuffer) {
     if (page.getDirty()) {
-      std::string file_name =
-          std::to_string(BufferManager::get_segment_id(page.getPageID()));
-      auto file = File::open_file(file_name.c_str(), File::WRITE);
+      uint16_t segment_id = get_segment_id(page.getPageID());
+      auto& file = segments.get_file(segment_id);
       uint64_t offSet = get_segment_page_id(page.getPageID()) * page_size;
-      file->write_block(page.get_data(), offSet, page_size);
+      segments.prepare_write(segment_id, offSet + page_size);
+      file.write_block(page.get_data(), offSet, page_size);
     }
   }
 }
 
 BufferFrame& BufferManager::fix_page(uint64_t page_id, bool exclusive) {
+  if (trace) {
+    trace->record(page_id, exclusive ? PageTraceRecord::FIX_EXCLUSIVE
+                                     : PageTraceRecord::FIX_SHARED);
+  }
+
   bool pageFoundInLRUorFIFO = false;
 
   // // Check if page exists in either LRU or FIFO
@@ -89,11 +105,10 @@ BufferFrame& BufferManager::fix_page(uint64_t page_id, bool exclusive) {
   // If page is not in LRU or FIFO Buffer
   if (!pageFoundInLRUorFIFO) {
     data.resize(page_size / sizeof(uint64_t), 0);
-    std::string file_name =
-        std::to_string(BufferManager::get_segment_id(page_id));
-    auto file = File::open_file(file_name.c_str(), File::WRITE);
+    uint16_t segment_id = get_segment_id(page_id);
+    auto& file = segments.get_file(segment_id);
     uint64_t offSet = BufferManager::get_segment_page_id(page_id) * page_size;
-    file->read_block(offSet, page_size, reinterpret_cast<char*>(data.data()));
+    file.read_block(offSet, page_size, reinterpret_cast<char*>(data.data()));
   }
 
   if (exclusive) {
@@ -139,10 +154,10 @@ BufferFrame& BufferManager::fix_page(uint64_t page_id, bool exclusive) {
   // Find page in FIFO Buffer
   for (size_t i = 0; i < fifoBuffer.size(); i++) {
     if (fifoBuffer[i].get_page_id() == page_id) {
+      newPage.setDirty(fifoBuffer[i].getDirty());
+      newPage.set_data(fifoBuffer[i].get_vector_data());
       // Move the page from FIFO to LRU if there is space
       if (lruBuffer.size() + fifoBuffer.size() < page_count) {
-        newPage.setDirty(fifoBuffer[i].getDirty());
-        newPage.set_data(fifoBuffer[i].get_vector_data());
         qLock.lock();
         fifoBuffer.erase(fifoBuffer.begin() + i);
         lruBuffer.push_back(newPage);
@@ -154,13 +169,14 @@ BufferFrame& BufferManager::fix_page(uint64_t page_id, bool exclusive) {
         return lruBuffer.back();
       }
 
-      for (size_t i = 0; i < lruBuffer.size(); i++) {
+      for (size_t j = 0; j < lruBuffer.size(); j++) {
         // If the page is unfixed
-        if (lruBuffer[i].getCount() == 0) {
+        if (lruBuffer[j].getCount() == 0) {
           // If the page is not dirty
-          if (!lruBuffer[i].getDirty()) {
+          if (!lruBuffer[j].getDirty()) {
             qLock.lock();
-            lruBuffer.erase(lruBuffer.begin() + i);
+            fifoBuffer.erase(fifoBuffer.begin() + i);
+            lruBuffer.erase(lruBuffer.begin() + j);
             lruBuffer.push_back(newPage);
             qLock.unlock();
             if (!exclusive) {
@@ -168,11 +184,12 @@ BufferFrame& BufferManager::fix_page(uint64_t page_id, bool exclusive) {
             }
           } else {
             qLock.lock();
-            uint64_t foundPageId = lruBuffer[i].get_page_id();
+            uint64_t foundPageId = lruBuffer[j].get_page_id();
             std::vector<uint64_t> foundPageData =
-                lruBuffer[i].get_vector_data();
+                lruBuffer[j].get_vector_data();
 
-            lruBuffer.erase(lruBuffer.begin() + i);
+            fifoBuffer.erase(fifoBuffer.begin() + i);
+            lruBuffer.erase(lruBuffer.begin() + j);
             lruBuffer.push_back(newPage);
             qLock.unlock();
 
@@ -184,12 +201,12 @@ BufferFrame& BufferManager::fix_page(uint64_t page_id, bool exclusive) {
 
             // Write back the dirty page to disk
 
-            std::string file_name =
-                std::to_string(BufferManager::get_segment_id(foundPageId));
-            auto file = File::open_file(file_name.c_str(), File::WRITE);
+            uint16_t segment_id = get_segment_id(foundPageId);
+            auto& file = segments.get_file(segment_id);
             uint64_t offSet = get_segment_page_id(foundPageId) * page_size;
-            file->write_block(reinterpret_cast<char*>(foundPageData.data()),
-                              offSet, page_size);
+            segments.prepare_write(segment_id, offSet + page_size);
+            file.write_block(reinterpret_cast<char*>(foundPageData.data()),
+                             offSet, page_size);
             if (exclusive) {
               page_lock.lock();
             }
@@ -197,6 +214,17 @@ BufferFrame& BufferManager::fix_page(uint64_t page_id, bool exclusive) {
           return lruBuffer.back();
         }
       }
+
+      // No page of the LRU list can make room, the page stays in the FIFO
+      // list.
+      qLock.lock();
+      fifoBuffer[i].setCount(1);
+      fifoBuffer[i].setExclusive(exclusive);
+      qLock.unlock();
+      if (!exclusive) {
+        page_lock.unlock_shared();
+      }
+      return fifoBuffer[i];
     }
   }
 
@@ -247,12 +275,12 @@ BufferFrame& BufferManager::fix_page(uint64_t page_id, bool exclusive) {
             page_lock.unlock_shared();
           }
 
-          std::string file_name =
-              std::to_string(BufferManager::get_segment_id(foundPageId));
-          auto file = File::open_file(file_name.c_str(), File::WRITE);
+          uint16_t segment_id = get_segment_id(foundPageId);
+          auto& file = segments.get_file(segment_id);
           uint64_t offSet = get_segment_page_id(foundPageId) * page_size;
-          file->write_block(reinterpret_cast<char*>(foundPageData.data()),
-                            offSet, page_size);
+          segments.prepare_write(segment_id, offSet + page_size);
+          file.write_block(reinterpret_cast<char*>(foundPageData.data()),
+                           offSet, page_size);
           if (exclusive) {
             page_lock.lock();
           }
@@ -273,6 +301,11 @@ BufferFrame& BufferManager::fix_page(uint64_t page_id, bool exclusive) {
 }
 
 void BufferManager::unfix_page(BufferFrame& page, bool is_dirty) {
+  if (trace) {
+    trace->record(page.get_page_id(), is_dirty ? PageTraceRecord::UNFIX_DIRTY
+                                               : PageTraceRecord::UNFIX_CLEAN);
+  }
+
   qLock.lock();
   for (size_t i = 0; i < fifoBuffer.size(); i++) {
     if (fifoBuffer[i].get_page_id() == page.get_page_id()) {
@@ -299,6 +332,101 @@ void BufferManager::unfix_page(BufferFrame& page, bool is_dirty) {
   qLock.unlock();
 }
 
+void BufferManager::prefetch_pages(uint64_t first_page_id, size_t count) {
+  // A prefetch may replace cold pages that can be dropped without a write,
+  // but never the pages it is prefetching.
+  auto is_evictable = [first_page_id, count](BufferFrame& frame) {
+    return frame.getCount() == 0 && !frame.getDirty() &&
+           (frame.get_page_id() < first_page_id ||
+            frame.get_page_id() - first_page_id >= count);
+  };
+  // The lists hold the frames themselves, so erasing from them or growing
+  // them moves the frames that callers refer to. A prefetch does neither
+  // while a frame is fixed.
+  auto has_fixed_frames = [this] {
+    auto is_fixed = [](BufferFrame& frame) { return frame.getCount() > 0; };
+    return std::any_of(fifoBuffer.begin(), fifoBuffer.end(), is_fixed) ||
+           std::any_of(lruBuffer.begin(), lruBuffer.end(), is_fixed);
+  };
+
+  // Find the pages that are not buffered yet, as long as there is room.
+  std::vector<uint64_t> missing;
+  {
+    std::unique_lock<std::mutex> guard(qLock);
+    size_t free_frames = page_count - fifoBuffer.size() - lruBuffer.size();
+    if (!has_fixed_frames()) {
+      free_frames += std::count_if(fifoBuffer.begin(), fifoBuffer.end(),
+                                   is_evictable);
+    } else {
+      free_frames = std::min(free_frames,
+                             fifoBuffer.capacity() - fifoBuffer.size());
+    }
+    for (uint64_t page_id = first_page_id;
+         page_id < first_page_id + count && missing.size() < free_frames;
+         ++page_id) {
+      auto has_page = [page_id](BufferFrame& frame) {
+        return frame.get_page_id() == page_id;
+      };
+      if (std::none_of(fifoBuffer.begin(), fifoBuffer.end(), has_page) &&
+          std::none_of(lruBuffer.begin(), lruBuffer.end(), has_page)) {
+        missing.push_back(page_id);
+      }
+    }
+  }
+  if (missing.empty()) {
+    return;
+  }
+
+  std::vector<BufferFrame> frames;
+  frames.reserve(missing.size());
+  for (uint64_t page_id : missing) {
+    frames.emplace_back(page_id, false, page_size);
+    // Prefetched pages are not fixed.
+    frames.back().setCount(0);
+    frames.back().setExclusive(false);
+  }
+
+  // Read every run of consecutive page ids with one system call.
+  auto& file = segments.get_file(get_segment_id(first_page_id));
+  std::vector<iovec> iovecs;
+  for (size_t begin = 0, end; begin < frames.size(); begin = end) {
+    iovecs.clear();
+    end = begin;
+    do {
+      iovecs.push_back({frames[end].get_data(), page_size});
+      ++end;
+    } while (end < frames.size() && missing[end] == missing[end - 1] + 1);
+    file.read_blocks_vectored(get_segment_page_id(missing[begin]) * page_size,
+                              iovecs);
+  }
+
+  std::unique_lock<std::mutex> guard(qLock);
+  for (auto& frame : frames) {
+    // Pages may have been fixed or dirtied since they were counted.
+    bool is_pinned = has_fixed_frames();
+    if (fifoBuffer.size() + lruBuffer.size() >= page_count) {
+      auto victim =
+          std::find_if(fifoBuffer.begin(), fifoBuffer.end(), is_evictable);
+      if (is_pinned || victim == fifoBuffer.end()) {
+        break;
+      }
+      fifoBuffer.erase(victim);
+    } else if (is_pinned && fifoBuffer.size() == fifoBuffer.capacity()) {
+      break;
+    }
+    uint64_t page_id = frame.get_page_id();
+    auto has_page = [page_id](BufferFrame& buffered) {
+      return buffered.get_page_id() == page_id;
+    };
+    // Another thread may have loaded the page in the meantime.
+    if (std::none_of(fifoBuffer.begin(), fifoBuffer.end(), has_page) &&
+        std::none_of(lruBuffer.begin(), lruBuffer.end(), has_page)) {
+      // Moving keeps the page data where it was read to.
+      fifoBuffer.push_back(std::move(frame));
+    }
+  }
+}
+
 std::vector<uint64_t> BufferManager::get_fifo_list() const {
   std::vector<uint64_t> fifo_list;
   qLock.lock();
@@ -317,4 +445,12 @@ std::vector<uint64_t> BufferManager::get_lru_list() const {
   return lru_list;
 }
 
+void BufferManager::start_trace(const char* filename) {
+  stop_trace();
+  trace = std::make_unique<PageTraceWriter>(
+      File::open_file(filename, File::WRITE));
+}
+
+void BufferManager::stop_trace() { trace.reset(); }
+
 }  // namespace buzzdb
@@ -0,0 +1,75 @@
+#include "buffer/page_trace.h"
+
+#include <atomic>
+#include <utility>
+
+namespace buzzdb {
+
+namespace {
+
+uint32_t get_thread_id() {
+  static std::atomic<uint32_t> next_thread_id{0};
+  thread_local uint32_t thread_id = next_thread_id.fetch_add(1);
+  return thread_id;
+}
+
+}  // namespace
+
+PageTraceWriter::PageTraceWriter(std::unique_ptr<File> file)
+    : file(std::move(file)), start(std::chrono::steady_clock::now()) {
+  this->file->resize(0);
+  buffer.reserve(kBatchSize);
+}
+
+PageTraceWriter::~PageTraceWriter() { flush(); }
+
+void PageTraceWriter::record(uint64_t page_id, PageTraceRecord::Mode mode) {
+  PageTraceRecord record{};
+  record.page_id = page_id;
+  record.timestamp = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+  record.thread_id = get_thread_id();
+  record.mode = mode;
+
+  {
+    std::unique_lock<std::mutex> guard(latch);
+    buffer.push_back(record);
+    if (buffer.size() < kBatchSize) {
+      return;
+    }
+  }
+  flush();
+}
+
+void PageTraceWriter::flush() {
+  std::vector<PageTraceRecord> batch;
+  size_t offset;
+  {
+    std::unique_lock<std::mutex> guard(latch);
+    if (buffer.empty()) {
+      return;
+    }
+    batch.swap(buffer);
+    buffer.reserve(kBatchSize);
+    offset = file_size;
+    file_size += batch.size() * sizeof(PageTraceRecord);
+    file->resize(file_size);
+  }
+  write_batch(batch, offset);
+}
+
+void PageTraceWriter::write_batch(const std::vector<PageTraceRecord>& batch,
+                                  size_t offset) {
+  file->write_block(reinterpret_cast<const char*>(batch.data()), offset,
+                    batch.size() * sizeof(PageTraceRecord));
+}
+
+std::vector<PageTraceRecord> read_page_trace(File& file) {
+  std::vector<PageTraceRecord> records(file.size() / sizeof(PageTraceRecord));
+  file.read_block(0, records.size() * sizeof(PageTraceRecord),
+                  reinterpret_cast<char*>(records.data()));
+  return records;
+}
+
+}  // namespace buzzdb
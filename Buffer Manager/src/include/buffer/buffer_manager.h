@@ -5,12 +5,16 @@
 #include <deque>
 #include <exception>
 #include <iostream>
+#include <memory>
 #include <mutex>
 #include <shared_mutex>
 #include <unordered_map>
 #include <vector>
 
+#include "buffer/page_trace.h"
 #include "common/macros.h"
+#include "storage/file.h"
+#include "storage/segment_space_manager.h"
 
 namespace buzzdb {
 
@@ -50,13 +54,19 @@ class buffer_full_error : public std::exception {
 };
 
 class BufferManager {
+ public:
+  /// Opens the file that stores the pages of the segment `segment_id`.
+  using SegmentFileOpener = SegmentSpaceManager::SegmentFileOpener;
+
  private:
   size_t page_size;
   size_t page_count;
+  SegmentSpaceManager segments;  // Open segment files, grown in extents
   std::vector<BufferFrame> lruBuffer;    // LRU Buffer Queue
   std::vector<BufferFrame> fifoBuffer;   // FIFO Buffer Queue
   mutable std::shared_mutex page_lock;  // Lock used for BufferFrames(pages)
-  std::mutex qLock;                     // Lock used for FIFO/LRU Queue
+  mutable std::mutex qLock;             // Lock used for FIFO/LRU Queue
+  std::unique_ptr<PageTraceWriter> trace;  // Set while a trace is recorded
 
  public:
   /// Constructor.
@@ -65,6 +75,16 @@ class BufferManager {
   //                        memory at the same time.
   BufferManager(size_t page_size, size_t page_count);
 
+  /// Constructor that reads and writes pages through `open_segment_file`
+  /// instead of the file named after the segment id. Used to run the buffer
+  /// manager on a `SimulatedFile`.
+  /// @param[in] page_size          Size in bytes that all pages will have.
+  /// @param[in] page_count         Maximum number of pages that should reside
+  ///                               in memory at the same time.
+  /// @param[in] open_segment_file  Opens the file of a segment.
+  BufferManager(size_t page_size, size_t page_count,
+                SegmentFileOpener open_segment_file);
+
   /// Destructor. Writes all dirty pages to disk.
   ~BufferManager();
 
@@ -86,6 +106,19 @@ class BufferManager {
   /// written back to disk eventually.
   void unfix_page(BufferFrame& page, bool is_dirty);
 
+  /// Loads the pages `first_page_id`, ..., `first_page_id + count - 1` into
+  /// the buffer without fixing them. All pages must belong to the same
+  /// segment. Runs of consecutive pages that are not in the buffer are read
+  /// with a single vectored read directly into their frames. When the buffer
+  /// is full, unfixed clean pages of the FIFO list make room for the
+  /// prefetched pages. Dirty pages are never evicted for a prefetch, and
+  /// pages that do not fit are skipped. While any page is fixed, a prefetch
+  /// neither evicts pages nor grows the FIFO list beyond its capacity, since
+  /// either would move the fixed frames.
+  /// Is thread-safe w.r.t. other concurrent calls to `fix_page()` and
+  /// `unfix_page()`.
+  void prefetch_pages(uint64_t first_page_id, size_t count);
+
   /// Returns the page ids of all pages (fixed and unfixed) that are in the
   /// FIFO list in FIFO order.
   /// Is not thread-safe.
@@ -96,6 +129,16 @@ class BufferManager {
   /// Is not thread-safe.
   std::vector<uint64_t> get_lru_list() const;
 
+  /// Starts recording every call to `fix_page()` and `unfix_page()` into the
+  /// file `filename`. The file is truncated first. A trace that is already
+  /// being recorded is stopped.
+  /// Is not thread-safe.
+  void start_trace(const char* filename);
+
+  /// Stops recording and writes all outstanding records to the trace file.
+  /// Is not thread-safe.
+  void stop_trace();
+
   /// Returns the segment id for a given page id which is contained in the 16
   /// most significant bits of the page id.
   static constexpr uint16_t get_segment_id(uint64_t page_id) {
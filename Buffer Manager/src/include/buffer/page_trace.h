@@ -0,0 +1,91 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "storage/file.h"
+
+namespace buzzdb {
+
+/// One page access as it is stored in a trace file. Records are written in
+/// native byte order without any header, so a trace file is just an array of
+/// `PageTraceRecord`s.
+struct PageTraceRecord {
+  /// The kind of access.
+  enum Mode : uint8_t { FIX_SHARED, FIX_EXCLUSIVE, UNFIX_CLEAN, UNFIX_DIRTY };
+
+  /// The page id that was passed to `fix_page()` or `unfix_page()`.
+  uint64_t page_id;
+
+  /// Nanoseconds since the trace was started.
+  uint64_t timestamp;
+
+  /// Dense id of the accessing thread. Ids are assigned in the order in which
+  /// threads record their first access.
+  uint32_t thread_id;
+
+  /// The kind of access.
+  Mode mode;
+
+  /// Padding so that records have a fixed size on every platform.
+  uint8_t reserved[3];
+
+  /// Is this a call to `fix_page()`?
+  bool is_fix() const { return mode == FIX_SHARED || mode == FIX_EXCLUSIVE; }
+};
+
+static_assert(sizeof(PageTraceRecord) == 24,
+              "trace records must have a fixed on-disk size");
+
+/// Appends `PageTraceRecord`s to a file. Records are collected in memory and
+/// written in batches, so recording an access never does I/O while holding a
+/// latch of the buffer manager.
+class PageTraceWriter {
+ public:
+  /// Number of records that are buffered before they are written.
+  static constexpr size_t kBatchSize = 4096;
+
+  /// Constructor. Truncates `file`.
+  /// @param[in] file  The file the trace is written to.
+  explicit PageTraceWriter(std::unique_ptr<File> file);
+
+  /// Destructor. Writes all buffered records.
+  ~PageTraceWriter();
+
+  /// Records an access of the calling thread.
+  /// Is thread-safe.
+  void record(uint64_t page_id, PageTraceRecord::Mode mode);
+
+  /// Writes all buffered records to the file.
+  /// Is thread-safe.
+  void flush();
+
+ private:
+  /// Writes `batch` at `offset`. The caller must have reserved the space in
+  /// the file and must not hold `latch`.
+  void write_batch(const std::vector<PageTraceRecord>& batch, size_t offset);
+
+  /// The trace file.
+  std::unique_ptr<File> file;
+
+  /// Point in time the timestamps are relative to.
+  std::chrono::steady_clock::time_point start;
+
+  /// Protects `buffer` and `file_size`.
+  std::mutex latch;
+
+  /// Records that have not been written yet.
+  std::vector<PageTraceRecord> buffer;
+
+  /// Size of the file including all space reserved by in-flight writes.
+  size_t file_size = 0;
+};
+
+/// Reads all records of a trace file that was written by `PageTraceWriter`.
+std::vector<PageTraceRecord> read_page_trace(File& file);
+
+}  // namespace buzzdb
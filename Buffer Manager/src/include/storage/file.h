@@ -1,7 +1,10 @@
 #pragma once
 
+#include <sys/uio.h>
 #include <cstdint>
 #include <memory>
+#include <system_error>
+#include <vector>
 
 namespace buzzdb {
 
@@ -28,6 +31,18 @@ class File {
   /// Is not thread-safe.
   virtual void resize(size_t new_size) = 0;
 
+  /// Reserves disk space for the range [`offset`, `offset + size`) so that
+  /// later writes to it do not need to allocate. When the range ends past
+  /// the end of the file, the file grows and the new bytes read as zero.
+  /// Never shrinks the file, so it may run concurrently with `write_block()`.
+  /// Throws `std::errc::operation_not_supported` if the file cannot
+  /// preallocate, which is what the default implementation does.
+  /// Is not thread-safe w.r.t concurrent calls to `resize()` and `allocate()`.
+  virtual void allocate(size_t /*offset*/, size_t /*size*/) {
+    throw std::system_error{
+        std::make_error_code(std::errc::operation_not_supported)};
+  }
+
   /// Reads a block of the file. `offset + size` must not be larger than
   /// `size()`.
   /// Is thread-safe w.r.t concurrent calls to `read_block()` and
@@ -46,6 +61,24 @@ class File {
     return block;
   }
 
+  /// Reads consecutive blocks of the file that start at `offset` into
+  /// separate buffers: the first `iovecs[0].iov_len` bytes go to
+  /// `iovecs[0].iov_base`, the following bytes to `iovecs[1].iov_base`, and so
+  /// on. Buffers behind the end of the file are left untouched.
+  /// The default implementation issues one `read_block()` per buffer.
+  /// Is thread-safe w.r.t concurrent calls to `read_block()` and
+  /// `write_block()`.
+  virtual void read_blocks_vectored(size_t offset,
+                                    const std::vector<iovec>& iovecs) {
+    for (auto& iov : iovecs) {
+      if (offset + iov.iov_len > size()) {
+        return;
+      }
+      read_block(offset, iov.iov_len, static_cast<char*>(iov.iov_base));
+      offset += iov.iov_len;
+    }
+  }
+
   /// Writes a block to the file. `offset + size` must not be larger than
   /// `size()`. If you want to write past the end of the file, use
   /// `resize()` first.
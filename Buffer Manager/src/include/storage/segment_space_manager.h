@@ -0,0 +1,113 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+#include "storage/file.h"
+
+namespace buzzdb {
+
+///
+/// Keeps the files of all segments open and grows them ahead of the writes
+/// of the buffer manager.
+///
+/// Segment files are grown in extents with `File::allocate()` by a
+/// background thread. Extents start at `kMinExtentSize` and double with the
+/// file up to `kMaxExtentSize`, so small segments stay small while large
+/// segments are laid out in few, large extents. A write that is announced
+/// with `prepare_write()` never waits for an allocation: when it lands past
+/// the preallocated space the file system allocates implicitly, exactly as
+/// without a space manager. Segments whose file cannot preallocate are
+/// simply never grown.
+///
+class SegmentSpaceManager {
+ public:
+  /// Opens the file that stores the pages of the segment `segment_id`.
+  using SegmentFileOpener =
+      std::function<std::unique_ptr<File>(uint16_t segment_id)>;
+
+  /// Size of the first extent of a segment.
+  static constexpr size_t kMinExtentSize = 1ull << 20;
+
+  /// Size of the extents of large segments.
+  static constexpr size_t kMaxExtentSize = 64ull << 20;
+
+  /// Writes further than this past the preallocated space are treated as
+  /// holes in a sparse segment and do not cause any preallocation.
+  static constexpr size_t kMaxGap = 16 * kMaxExtentSize;
+
+  /// Constructor. Starts the background thread.
+  /// @param[in] open_segment_file  Opens the file of a segment.
+  explicit SegmentSpaceManager(SegmentFileOpener open_segment_file);
+
+  /// Destructor. Stops the background thread, outstanding growth requests
+  /// are dropped.
+  ~SegmentSpaceManager();
+
+  /// Returns the file of the segment `segment_id`. The file is opened on
+  /// first use and stays open until the space manager is destroyed.
+  /// Is thread-safe.
+  File& get_file(uint16_t segment_id);
+
+  /// Announces a write to the segment `segment_id` that ends at byte `end`.
+  /// Schedules the growth of the segment when the write comes close to the
+  /// end of the preallocated space. Never blocks on I/O.
+  /// Is thread-safe.
+  void prepare_write(uint16_t segment_id, size_t end);
+
+  /// Returns the number of bytes that are preallocated for a segment.
+  /// Is thread-safe.
+  size_t get_allocated_size(uint16_t segment_id);
+
+  /// Blocks until all scheduled growth has been done.
+  /// Is thread-safe.
+  void wait_idle();
+
+ private:
+  struct Segment {
+    /// The open segment file.
+    std::unique_ptr<File> file;
+    /// Bytes at the beginning of the file that are preallocated.
+    std::atomic<size_t> allocated;
+    /// Bytes that should be preallocated. Protected by `latch`.
+    size_t requested;
+    /// Is the segment in `pending`? Protected by `latch`.
+    bool queued = false;
+    /// Did preallocation fail, e.g. because the disk is full or the file
+    /// system does not support it? Protected by `latch`.
+    bool failed = false;
+  };
+
+  /// Returns the segment, opening its file if necessary.
+  Segment& get_segment(uint16_t segment_id);
+
+  /// Main loop of the background thread.
+  void grow_segments();
+
+  SegmentFileOpener open_segment_file;
+
+  /// Protects `segments`, `pending`, `busy`, `stopped` and the members of
+  /// `Segment` that are documented as such.
+  std::mutex latch;
+  /// Signalled when a segment is added to `pending` or on shutdown.
+  std::condition_variable work_available;
+  /// Signalled when the background thread finished growing a segment.
+  std::condition_variable work_done;
+  std::unordered_map<uint16_t, std::unique_ptr<Segment>> segments;
+  /// Segments that should be grown, in request order.
+  std::deque<Segment*> pending;
+  /// Is the background thread currently growing a segment?
+  bool busy = false;
+  bool stopped = false;
+  std::thread grower;
+};
+
+}  // namespace buzzdb
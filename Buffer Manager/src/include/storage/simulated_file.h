@@ -0,0 +1,125 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <vector>
+
+#include "storage/file.h"
+
+namespace buzzdb {
+
+///
+/// Cost model of a storage device that is shared by all `SimulatedFile`s
+/// that are placed on it.
+///
+/// Every request waits for a free slot of the device queue, then transfers
+/// its bytes with the device bandwidth (transfers of concurrent requests are
+/// serialized) and finally pays the access latency. The access latency is
+/// drawn from a log-normal distribution; with a small probability it is
+/// multiplied by `tail_factor` to model garbage collection pauses or seeks
+/// across the whole platter.
+///
+class SimulatedDevice {
+ public:
+  struct Profile {
+    /// Median latency of a read request.
+    std::chrono::nanoseconds read_latency;
+    /// Median latency of a write request.
+    std::chrono::nanoseconds write_latency;
+    /// Shape of the log-normal latency distribution. 0 disables jitter.
+    double latency_sigma;
+    /// Probability that a request hits the tail.
+    double tail_probability;
+    /// Factor by which the latency of a tail request is multiplied.
+    double tail_factor;
+    /// Bandwidth in bytes per second. 0 disables the bandwidth limit.
+    uint64_t bandwidth;
+    /// Number of requests the device serves concurrently. 0 disables the
+    /// queue limit.
+    size_t queue_depth;
+    /// Seed for the latency distribution.
+    uint64_t seed;
+  };
+
+  /// A NVMe SSD: ~80us reads, ~20us (cached) writes, 2 GB/s, deep queue.
+  static Profile ssd();
+
+  /// A 7200 rpm HDD: ~8ms per request, 150 MB/s, one request at a time.
+  static Profile hdd();
+
+  /// Constructor.
+  explicit SimulatedDevice(const Profile& profile);
+
+  /// Blocks the calling thread for as long as the device needs to serve a
+  /// request of `size` bytes.
+  /// Is thread-safe.
+  void serve(size_t size, bool is_write);
+
+  /// Returns the number of requests served so far.
+  uint64_t get_request_count();
+
+ private:
+  Profile profile;
+
+  /// Protects all members below.
+  std::mutex latch;
+  /// Signalled whenever a queue slot becomes free.
+  std::condition_variable slot_freed;
+  /// Number of requests that are currently served.
+  size_t in_flight = 0;
+  /// Point in time at which the transfer channel becomes idle.
+  std::chrono::steady_clock::time_point channel_free;
+  uint64_t request_count = 0;
+  std::mt19937_64 engine;
+  /// Only set if `latency_sigma` is positive, which the distribution
+  /// requires.
+  std::optional<std::lognormal_distribution<double>> jitter;
+  std::bernoulli_distribution tail;
+};
+
+///
+/// Decorator that delays every `read_block()` and `write_block()` of another
+/// `File` according to a `SimulatedDevice`. Used to benchmark the buffer
+/// manager against a reproducible SSD- or HDD-like device, independent of the
+/// disk of the machine the benchmark runs on.
+///
+class SimulatedFile : public File {
+ public:
+  /// Constructor.
+  /// @param[in] file    The file that actually stores the data.
+  /// @param[in] device  The device the file lives on. Must outlive the file.
+  SimulatedFile(std::unique_ptr<File> file, SimulatedDevice& device)
+      : file(std::move(file)), device(device) {}
+
+  ~SimulatedFile() override = default;
+
+  Mode get_mode() const override { return file->get_mode(); }
+
+  size_t size() const override { return file->size(); }
+
+  void resize(size_t new_size) override { file->resize(new_size); }
+
+  void allocate(size_t offset, size_t size) override {
+    file->allocate(offset, size);
+  }
+
+  void read_block(size_t offset, size_t size, char* block) override;
+
+  /// Charged as a single request of the combined size.
+  void read_blocks_vectored(size_t offset,
+                            const std::vector<iovec>& iovecs) override;
+
+  void write_block(const char* block, size_t offset, size_t size) override;
+
+ private:
+  std::unique_ptr<File> file;
+  SimulatedDevice& device;
+};
+
+}  // namespace buzzdb
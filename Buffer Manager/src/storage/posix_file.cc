@@ -3,10 +3,14 @@
 #include <stdlib.h>  // NOLINT
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
+#include <algorithm>
 #include <cerrno>
+#include <climits>
 #include <memory>
 #include <system_error>
+#include <vector>
 
 #include "storage/file.h"
 
@@ -73,6 +77,16 @@ class PosixFile : public File {
     cached_size = new_size;
   }
 
+  void allocate(size_t offset, size_t size) override {
+    // There is no fallback when the file system cannot preallocate. Growing
+    // the file with `ftruncate()` would only create a hole, and could cut off
+    // blocks that were written past `cached_size` in the meantime.
+    if (::fallocate(fd, 0, offset, size) < 0) {
+      throw_errno();
+    }
+    cached_size = std::max(cached_size, offset + size);
+  }
+
   void read_block(size_t offset, size_t size, char* block) override {
     size_t total_bytes_read = 0;
     while (total_bytes_read < size) {
@@ -91,6 +105,38 @@ class PosixFile : public File {
     }
   }
 
+  void read_blocks_vectored(size_t offset,
+                            const std::vector<iovec>& iovecs) override {
+    // `preadv()` may read less than requested, so we keep our own copy of the
+    // vector that can be advanced past the bytes that were already read.
+    std::vector<iovec> remaining = iovecs;
+    size_t first = 0;
+    while (first < remaining.size()) {
+      int count = static_cast<int>(
+          std::min<size_t>(remaining.size() - first, IOV_MAX));
+      ssize_t bytes_read = ::preadv(fd, remaining.data() + first, count,
+                                    static_cast<off_t>(offset));
+      if (bytes_read == 0) {
+        // end of file
+        return;
+      }
+      if (bytes_read < 0) {
+        throw_errno();
+      }
+      offset += static_cast<size_t>(bytes_read);
+      size_t bytes_left = static_cast<size_t>(bytes_read);
+      while (bytes_left > 0 && bytes_left >= remaining[first].iov_len) {
+        bytes_left -= remaining[first].iov_len;
+        ++first;
+      }
+      if (bytes_left > 0) {
+        remaining[first].iov_base =
+            static_cast<char*>(remaining[first].iov_base) + bytes_left;
+        remaining[first].iov_len -= bytes_left;
+      }
+    }
+  }
+
   void write_block(const char* block, size_t offset, size_t size) override {
     size_t total_bytes_written = 0;
     while (total_bytes_written < size) {
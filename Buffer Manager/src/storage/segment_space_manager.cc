@@ -0,0 +1,119 @@
+#include "storage/segment_space_manager.h"
+
+#include <algorithm>
+#include <system_error>
+#include <utility>
+
+namespace buzzdb {
+
+namespace {
+
+/// Returns the size of the next extent of a file that has `allocated` bytes
+/// preallocated.
+size_t get_extent_size(size_t allocated) {
+  return std::clamp(allocated, SegmentSpaceManager::kMinExtentSize,
+                    SegmentSpaceManager::kMaxExtentSize);
+}
+
+}  // namespace
+
+SegmentSpaceManager::SegmentSpaceManager(SegmentFileOpener open_segment_file)
+    : open_segment_file(std::move(open_segment_file)),
+      grower([this] { grow_segments(); }) {}
+
+SegmentSpaceManager::~SegmentSpaceManager() {
+  {
+    std::unique_lock<std::mutex> guard(latch);
+    stopped = true;
+  }
+  work_available.notify_one();
+  grower.join();
+}
+
+SegmentSpaceManager::Segment& SegmentSpaceManager::get_segment(
+    uint16_t segment_id) {
+  std::unique_lock<std::mutex> guard(latch);
+  auto& segment = segments[segment_id];
+  if (!segment) {
+    segment = std::make_unique<Segment>();
+    segment->file = open_segment_file(segment_id);
+    segment->allocated = segment->file->size();
+    segment->requested = segment->allocated;
+  }
+  return *segment;
+}
+
+File& SegmentSpaceManager::get_file(uint16_t segment_id) {
+  return *get_segment(segment_id).file;
+}
+
+void SegmentSpaceManager::prepare_write(uint16_t segment_id, size_t end) {
+  auto& segment = get_segment(segment_id);
+  size_t allocated = segment.allocated.load();
+  size_t extent_size = get_extent_size(allocated);
+  // Keep at least half an extent of headroom in front of the writes.
+  if (end + extent_size / 2 <= allocated || end > allocated + kMaxGap) {
+    return;
+  }
+  size_t target = (end + extent_size - 1) / extent_size * extent_size;
+  if (target - end < extent_size / 2) {
+    target += extent_size;
+  }
+
+  {
+    std::unique_lock<std::mutex> guard(latch);
+    if (segment.failed || target <= segment.requested) {
+      return;
+    }
+    segment.requested = target;
+    if (segment.queued) {
+      return;
+    }
+    segment.queued = true;
+    pending.push_back(&segment);
+  }
+  work_available.notify_one();
+}
+
+size_t SegmentSpaceManager::get_allocated_size(uint16_t segment_id) {
+  return get_segment(segment_id).allocated.load();
+}
+
+void SegmentSpaceManager::wait_idle() {
+  std::unique_lock<std::mutex> guard(latch);
+  work_done.wait(guard, [this] { return pending.empty() && !busy; });
+}
+
+void SegmentSpaceManager::grow_segments() {
+  std::unique_lock<std::mutex> guard(latch);
+  while (true) {
+    work_available.wait(guard, [this] { return stopped || !pending.empty(); });
+    if (stopped) {
+      return;
+    }
+    Segment* segment = pending.front();
+    pending.pop_front();
+    segment->queued = false;
+    size_t allocated = segment->allocated.load();
+    size_t target = segment->requested;
+    busy = true;
+
+    // Allocate without holding the latch, `prepare_write()` must never wait
+    // for the file system.
+    guard.unlock();
+    bool failed = false;
+    try {
+      segment->file->allocate(allocated, target - allocated);
+      segment->allocated.store(target);
+    } catch (const std::system_error&) {
+      failed = true;
+    }
+    guard.lock();
+
+    segment->failed = segment->failed || failed;
+    busy = false;
+    work_done.notify_all();
+  }
+}
+
+}  // namespace buzzdb
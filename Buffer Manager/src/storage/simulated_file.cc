@@ -0,0 +1,110 @@
+#include "storage/simulated_file.h"
+
+#include <algorithm>
+#include <thread>
+
+namespace buzzdb {
+
+SimulatedDevice::Profile SimulatedDevice::ssd() {
+  Profile profile{};
+  profile.read_latency = std::chrono::microseconds(80);
+  profile.write_latency = std::chrono::microseconds(20);
+  profile.latency_sigma = 0.25;
+  profile.tail_probability = 0.001;
+  profile.tail_factor = 20.0;
+  profile.bandwidth = 2000ull * 1000 * 1000;
+  profile.queue_depth = 32;
+  profile.seed = 42;
+  return profile;
+}
+
+SimulatedDevice::Profile SimulatedDevice::hdd() {
+  Profile profile{};
+  profile.read_latency = std::chrono::microseconds(8000);
+  profile.write_latency = std::chrono::microseconds(8000);
+  profile.latency_sigma = 0.5;
+  profile.tail_probability = 0.01;
+  profile.tail_factor = 4.0;
+  profile.bandwidth = 150ull * 1000 * 1000;
+  profile.queue_depth = 1;
+  profile.seed = 42;
+  return profile;
+}
+
+SimulatedDevice::SimulatedDevice(const Profile& profile)
+    : profile(profile),
+      channel_free(std::chrono::steady_clock::now()),
+      engine(profile.seed),
+      tail(profile.tail_probability) {
+  if (profile.latency_sigma > 0) {
+    jitter.emplace(0.0, profile.latency_sigma);
+  }
+}
+
+void SimulatedDevice::serve(size_t size, bool is_write) {
+  std::chrono::steady_clock::time_point done;
+  {
+    std::unique_lock<std::mutex> guard(latch);
+    slot_freed.wait(guard, [&] {
+      return profile.queue_depth == 0 || in_flight < profile.queue_depth;
+    });
+    ++in_flight;
+    ++request_count;
+
+    auto now = std::chrono::steady_clock::now();
+    auto transfer_start = std::max(now, channel_free);
+    std::chrono::nanoseconds transfer_time{0};
+    if (profile.bandwidth > 0) {
+      transfer_time = std::chrono::nanoseconds(size * 1000000000ull /
+                                               profile.bandwidth);
+    }
+    channel_free = transfer_start + transfer_time;
+
+    double latency = (is_write ? profile.write_latency : profile.read_latency)
+                         .count();
+    if (jitter) {
+      latency *= (*jitter)(engine);
+    }
+    if (tail(engine)) {
+      latency *= profile.tail_factor;
+    }
+    done = channel_free +
+           std::chrono::nanoseconds(static_cast<int64_t>(latency));
+  }
+
+  std::this_thread::sleep_until(done);
+
+  {
+    std::unique_lock<std::mutex> guard(latch);
+    --in_flight;
+  }
+  slot_freed.notify_one();
+}
+
+uint64_t SimulatedDevice::get_request_count() {
+  std::unique_lock<std::mutex> guard(latch);
+  return request_count;
+}
+
+void SimulatedFile::read_block(size_t offset, size_t size, char* block) {
+  device.serve(size, false);
+  file->read_block(offset, size, block);
+}
+
+void SimulatedFile::read_blocks_vectored(size_t offset,
+                                         const std::vector<iovec>& iovecs) {
+  size_t size = 0;
+  for (auto& iov : iovecs) {
+    size += iov.iov_len;
+  }
+  device.serve(size, false);
+  file->read_blocks_vectored(offset, iovecs);
+}
+
+void SimulatedFile::write_block(const char* block, size_t offset,
+                                size_t size) {
+  device.serve(size, true);
+  file->write_block(block, offset, size);
+}
+
+}  // namespace buzzdb
@@ -0,0 +1,111 @@
+#include <benchmark/benchmark.h>
+#include <cstdint>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "buffer/buffer_manager.h"
+#include "storage/simulated_file.h"
+#include "storage/test_file.h"
+
+namespace {
+
+using SimulatedDevice = buzzdb::SimulatedDevice;
+
+constexpr size_t kPageSize = 1024;
+constexpr uint64_t kPages = 1000;
+
+/// Gives the buffer manager its own handle to a segment that is shared by all
+/// handles, so that opening a segment does not copy it.
+class SegmentHandle : public buzzdb::File {
+ private:
+  buzzdb::TestFile& segment;
+
+ public:
+  explicit SegmentHandle(buzzdb::TestFile& segment) : segment(segment) {}
+
+  Mode get_mode() const override { return segment.get_mode(); }
+
+  size_t size() const override { return segment.size(); }
+
+  void resize(size_t new_size) override { segment.resize(new_size); }
+
+  /// The segment is allocated up front. Growing the shared vector would race
+  /// with concurrent reads.
+  void allocate(size_t /*offset*/, size_t /*size*/) override {}
+
+  void read_block(size_t offset, size_t size, char* block) override {
+    segment.read_block(offset, size, block);
+  }
+
+  void write_block(const char* block, size_t offset, size_t size) override {
+    segment.write_block(block, offset, size);
+  }
+};
+
+/// Fixes uniformly distributed pages of one segment on a simulated device.
+/// `state.range(0)` is the buffer size in pages.
+void run_random_fix(benchmark::State& state,
+                    const SimulatedDevice::Profile& profile) {
+  SimulatedDevice device{profile};
+  // All pages live in memory behind the simulated device, so the disk of the
+  // benchmark machine does not influence the result.
+  buzzdb::TestFile segment{std::vector<char>(kPages * kPageSize),
+                           buzzdb::File::WRITE};
+  buzzdb::BufferManager buffer_manager{
+      kPageSize, static_cast<size_t>(state.range(0)),
+      [&](uint16_t /*segment_id*/) {
+        return std::make_unique<buzzdb::SimulatedFile>(
+            std::make_unique<SegmentHandle>(segment), device);
+      }};
+  std::mt19937_64 engine{0};
+  std::uniform_int_distribution<uint64_t> page_distr{0, kPages - 1};
+  for (auto _ : state) {
+    auto& page = buffer_manager.fix_page(page_distr(engine), false);
+    buffer_manager.unfix_page(page, false);
+  }
+  state.SetItemsProcessed(state.iterations());
+  state.counters["device_requests"] = device.get_request_count();
+}
+
+void BM_RandomFixSSD(benchmark::State& state) {
+  run_random_fix(state, SimulatedDevice::ssd());
+}
+
+void BM_RandomFixHDD(benchmark::State& state) {
+  run_random_fix(state, SimulatedDevice::hdd());
+}
+
+/// Scans all pages of a segment through a cold buffer that can hold all of
+/// them. With `state.range(0) > 0`, runs of that many pages are prefetched
+/// before they are fixed.
+void BM_ColdScanSSD(benchmark::State& state) {
+  SimulatedDevice device{SimulatedDevice::ssd()};
+  buzzdb::TestFile segment{std::vector<char>(kPages * kPageSize),
+                           buzzdb::File::WRITE};
+  size_t prefetch = state.range(0);
+  for (auto _ : state) {
+    buzzdb::BufferManager buffer_manager{
+        kPageSize, kPages, [&](uint16_t /*segment_id*/) {
+          return std::make_unique<buzzdb::SimulatedFile>(
+              std::make_unique<SegmentHandle>(segment), device);
+        }};
+    for (uint64_t page_id = 0; page_id < kPages; ++page_id) {
+      if (prefetch > 0 && page_id % prefetch == 0) {
+        buffer_manager.prefetch_pages(page_id, prefetch);
+      }
+      auto& page = buffer_manager.fix_page(page_id, false);
+      buffer_manager.unfix_page(page, false);
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * kPages);
+  state.counters["device_requests"] = device.get_request_count();
+}
+
+}  // namespace
+
+BENCHMARK(BM_ColdScanSSD)->Arg(0)->Arg(8)->Arg(64)->UseRealTime();
+BENCHMARK(BM_RandomFixSSD)->Arg(10)->Arg(100)->Arg(500)->UseRealTime();
+BENCHMARK(BM_RandomFixHDD)->Arg(10)->Arg(100)->Arg(500)->UseRealTime();
+
+BENCHMARK_MAIN();
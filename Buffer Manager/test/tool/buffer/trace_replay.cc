@@ -0,0 +1,322 @@
+// Replays a page-access trace recorded by `BufferManager::start_trace()`
+// against several replacement policies and prints the hit rate of every
+// policy for a range of buffer pool sizes.
+//
+// Usage: trace_replay <trace file> [pool size ...]
+//
+// When no pool sizes are given, powers of two up to the number of distinct
+// pages in the trace are used. Only `fix_page()` calls count as accesses.
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iterator>
+#include <list>
+#include <memory>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "buffer/page_trace.h"
+#include "storage/file.h"
+
+namespace {
+
+/// A buffer pool that only keeps track of which pages are resident.
+class ReplacementPolicy {
+ public:
+  virtual ~ReplacementPolicy() = default;
+
+  /// Accesses `page_id`, evicting a page if necessary. Returns true on a hit.
+  virtual bool access(uint64_t page_id) = 0;
+};
+
+/// Ordered list with O(1) lookup, removal and move to the back.
+class PageList {
+ private:
+  std::list<uint64_t> pages;
+  std::unordered_map<uint64_t, std::list<uint64_t>::iterator> positions;
+
+ public:
+  size_t size() const { return pages.size(); }
+
+  bool empty() const { return pages.empty(); }
+
+  bool contains(uint64_t page_id) const {
+    return positions.find(page_id) != positions.end();
+  }
+
+  void push_back(uint64_t page_id) {
+    positions[page_id] = pages.insert(pages.end(), page_id);
+  }
+
+  void erase(uint64_t page_id) {
+    auto it = positions.find(page_id);
+    pages.erase(it->second);
+    positions.erase(it);
+  }
+
+  uint64_t pop_front() {
+    uint64_t page_id = pages.front();
+    erase(page_id);
+    return page_id;
+  }
+};
+
+/// The 2Q variant implemented by `BufferManager`: pages enter a FIFO queue and
+/// move to an LRU queue on their second access. Victims are taken from the
+/// FIFO queue first.
+class TwoQPolicy : public ReplacementPolicy {
+ private:
+  size_t capacity;
+  PageList fifo;
+  PageList lru;
+
+ public:
+  explicit TwoQPolicy(size_t capacity) : capacity(capacity) {}
+
+  bool access(uint64_t page_id) override {
+    if (lru.contains(page_id)) {
+      lru.erase(page_id);
+      lru.push_back(page_id);
+      return true;
+    }
+    if (fifo.contains(page_id)) {
+      fifo.erase(page_id);
+      lru.push_back(page_id);
+      return true;
+    }
+    if (fifo.size() + lru.size() == capacity) {
+      if (!fifo.empty()) {
+        fifo.pop_front();
+      } else {
+        lru.pop_front();
+      }
+    }
+    fifo.push_back(page_id);
+    return false;
+  }
+};
+
+class LRUPolicy : public ReplacementPolicy {
+ private:
+  size_t capacity;
+  PageList lru;
+
+ public:
+  explicit LRUPolicy(size_t capacity) : capacity(capacity) {}
+
+  bool access(uint64_t page_id) override {
+    bool hit = lru.contains(page_id);
+    if (hit) {
+      lru.erase(page_id);
+    } else if (lru.size() == capacity) {
+      lru.pop_front();
+    }
+    lru.push_back(page_id);
+    return hit;
+  }
+};
+
+/// Second-chance CLOCK.
+class ClockPolicy : public ReplacementPolicy {
+ private:
+  size_t capacity;
+  std::vector<uint64_t> frames;
+  std::vector<bool> referenced;
+  std::unordered_map<uint64_t, size_t> frame_of_page;
+  size_t hand = 0;
+
+ public:
+  explicit ClockPolicy(size_t capacity) : capacity(capacity) {}
+
+  bool access(uint64_t page_id) override {
+    auto it = frame_of_page.find(page_id);
+    if (it != frame_of_page.end()) {
+      referenced[it->second] = true;
+      return true;
+    }
+    if (frames.size() < capacity) {
+      frame_of_page[page_id] = frames.size();
+      frames.push_back(page_id);
+      referenced.push_back(false);
+      return false;
+    }
+    while (referenced[hand]) {
+      referenced[hand] = false;
+      hand = (hand + 1) % frames.size();
+    }
+    frame_of_page.erase(frames[hand]);
+    frame_of_page[page_id] = hand;
+    frames[hand] = page_id;
+    hand = (hand + 1) % frames.size();
+    return false;
+  }
+};
+
+/// Adaptive Replacement Cache (Megiddo and Modha, FAST 2003).
+class ARCPolicy : public ReplacementPolicy {
+ private:
+  size_t capacity;
+  /// Target size of `t1`.
+  size_t p = 0;
+  /// Resident pages that were accessed once / at least twice.
+  PageList t1, t2;
+  /// Ghost entries of pages recently evicted from `t1` / `t2`.
+  PageList b1, b2;
+
+  void replace(bool in_b2) {
+    if (!t1.empty() && (t1.size() > p || (in_b2 && t1.size() == p))) {
+      b1.push_back(t1.pop_front());
+    } else {
+      b2.push_back(t2.pop_front());
+    }
+  }
+
+ public:
+  explicit ARCPolicy(size_t capacity) : capacity(capacity) {}
+
+  bool access(uint64_t page_id) override {
+    if (t1.contains(page_id) || t2.contains(page_id)) {
+      if (t1.contains(page_id)) {
+        t1.erase(page_id);
+      } else {
+        t2.erase(page_id);
+      }
+      t2.push_back(page_id);
+      return true;
+    }
+    if (b1.contains(page_id)) {
+      p = std::min(capacity, p + std::max<size_t>(b2.size() / b1.size(), 1));
+      replace(false);
+      b1.erase(page_id);
+      t2.push_back(page_id);
+      return false;
+    }
+    if (b2.contains(page_id)) {
+      size_t delta = std::max<size_t>(b1.size() / b2.size(), 1);
+      p = p > delta ? p - delta : 0;
+      replace(true);
+      b2.erase(page_id);
+      t2.push_back(page_id);
+      return false;
+    }
+    if (t1.size() + b1.size() == capacity) {
+      if (t1.size() < capacity) {
+        b1.pop_front();
+        replace(false);
+      } else {
+        t1.pop_front();
+      }
+    } else if (t1.size() + t2.size() + b1.size() + b2.size() >= capacity) {
+      if (t1.size() + t2.size() + b1.size() + b2.size() == 2 * capacity) {
+        b2.pop_front();
+      }
+      if (t1.size() + t2.size() == capacity) {
+        replace(false);
+      }
+    }
+    t1.push_back(page_id);
+    return false;
+  }
+};
+
+/// Belady's optimal policy: evicts the page whose next access is furthest in
+/// the future. Needs to know the whole trace in advance.
+size_t count_optimal_hits(const std::vector<uint64_t>& accesses,
+                          size_t capacity) {
+  constexpr size_t kNever = SIZE_MAX;
+  std::vector<size_t> next_use(accesses.size());
+  std::unordered_map<uint64_t, size_t> upcoming;
+  for (size_t i = accesses.size(); i-- > 0;) {
+    auto it = upcoming.find(accesses[i]);
+    next_use[i] = it == upcoming.end() ? kNever : it->second;
+    upcoming[accesses[i]] = i;
+  }
+
+  size_t hits = 0;
+  // Resident pages ordered by their next access.
+  std::set<std::pair<size_t, uint64_t>> resident;
+  std::unordered_map<uint64_t, size_t> next_use_of_page;
+  for (size_t i = 0; i < accesses.size(); ++i) {
+    uint64_t page_id = accesses[i];
+    auto it = next_use_of_page.find(page_id);
+    if (it != next_use_of_page.end()) {
+      ++hits;
+      resident.erase({it->second, page_id});
+    } else if (resident.size() == capacity) {
+      auto victim = std::prev(resident.end());
+      next_use_of_page.erase(victim->second);
+      resident.erase(victim);
+    }
+    resident.insert({next_use[i], page_id});
+    next_use_of_page[page_id] = next_use[i];
+  }
+  return hits;
+}
+
+size_t count_hits(ReplacementPolicy& policy,
+                  const std::vector<uint64_t>& accesses) {
+  size_t hits = 0;
+  for (uint64_t page_id : accesses) {
+    hits += policy.access(page_id);
+  }
+  return hits;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  if (argc < 2) {
+    std::fprintf(stderr, "usage: %s <trace file> [pool size ...]\n", argv[0]);
+    return 1;
+  }
+
+  auto file = buzzdb::File::open_file(argv[1], buzzdb::File::READ);
+  std::vector<uint64_t> accesses;
+  for (auto& record : buzzdb::read_page_trace(*file)) {
+    if (record.is_fix()) {
+      accesses.push_back(record.page_id);
+    }
+  }
+  size_t distinct_pages =
+      std::unordered_set<uint64_t>(accesses.begin(), accesses.end()).size();
+
+  std::vector<size_t> pool_sizes;
+  for (int i = 2; i < argc; ++i) {
+    pool_sizes.push_back(std::strtoull(argv[i], nullptr, 10));
+  }
+  if (pool_sizes.empty()) {
+    for (size_t size = 1; size < distinct_pages; size *= 2) {
+      pool_sizes.push_back(size);
+    }
+    pool_sizes.push_back(std::max<size_t>(distinct_pages, 1));
+  }
+
+  std::printf("# %zu accesses, %zu distinct pages\n", accesses.size(),
+              distinct_pages);
+  std::printf("%10s %8s %8s %8s %8s %8s\n", "pool_size", "2Q", "LRU", "CLOCK",
+              "ARC", "OPT");
+  for (size_t pool_size : pool_sizes) {
+    if (pool_size == 0) {
+      continue;
+    }
+    std::vector<std::unique_ptr<ReplacementPolicy>> policies;
+    policies.push_back(std::make_unique<TwoQPolicy>(pool_size));
+    policies.push_back(std::make_unique<LRUPolicy>(pool_size));
+    policies.push_back(std::make_unique<ClockPolicy>(pool_size));
+    policies.push_back(std::make_unique<ARCPolicy>(pool_size));
+
+    double total = std::max<size_t>(accesses.size(), 1);
+    std::printf("%10zu", pool_size);
+    for (auto& policy : policies) {
+      std::printf(" %8.4f", count_hits(*policy, accesses) / total);
+    }
+    std::printf(" %8.4f\n", count_optimal_hits(accesses, pool_size) / total);
+  }
+  return 0;
+}
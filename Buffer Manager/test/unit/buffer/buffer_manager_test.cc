@@ -2,12 +2,20 @@
 #include <algorithm>
 #include <atomic>
 #include <cstring>
+#include <filesystem>
 #include <memory>
 #include <random>
+#include <string>
 #include <thread>
 #include <vector>
 
+#include <unistd.h>
+
 #include "buffer/buffer_manager.h"
+#include "buffer/page_trace.h"
+#include "common/defer.h"
+#include "storage/file.h"
+#include "storage/simulated_file.h"
 
 namespace {
 
@@ -361,6 +369,126 @@ TEST(BufferManagerTest, MultithreadReaderWriter) {
   EXPECT_LT(aborts.load(), 20);
 }
 
+TEST(BufferManagerTest, TraceFixUnfix) {
+  auto trace_path =
+      (std::filesystem::temp_directory_path() /
+       ("buzzdb_page_trace_" + std::to_string(::getpid())))
+          .string();
+  buzzdb::Defer remove_trace{[&] { std::filesystem::remove(trace_path); }};
+  buzzdb::BufferManager buffer_manager{1024, 10};
+  buffer_manager.start_trace(trace_path.c_str());
+  for (uint64_t i = 1; i < 4; ++i) {
+    auto& page = buffer_manager.fix_page(i, false);
+    buffer_manager.unfix_page(page, i == 2);
+  }
+  buffer_manager.stop_trace();
+  // Accesses after stopping the trace are not recorded.
+  auto& page = buffer_manager.fix_page(1, false);
+  buffer_manager.unfix_page(page, false);
+
+  auto file = buzzdb::File::open_file(trace_path.c_str(), buzzdb::File::READ);
+  auto trace = buzzdb::read_page_trace(*file);
+  ASSERT_EQ(6, trace.size());
+  std::vector<buzzdb::PageTraceRecord::Mode> expected_modes{
+      buzzdb::PageTraceRecord::FIX_SHARED, buzzdb::PageTraceRecord::UNFIX_CLEAN,
+      buzzdb::PageTraceRecord::FIX_SHARED, buzzdb::PageTraceRecord::UNFIX_DIRTY,
+      buzzdb::PageTraceRecord::FIX_SHARED,
+      buzzdb::PageTraceRecord::UNFIX_CLEAN};
+  for (size_t i = 0; i < trace.size(); ++i) {
+    EXPECT_EQ(i / 2 + 1, trace[i].page_id);
+    EXPECT_EQ(expected_modes[i], trace[i].mode);
+    EXPECT_EQ(trace[0].thread_id, trace[i].thread_id);
+    if (i > 0) {
+      EXPECT_LE(trace[i - 1].timestamp, trace[i].timestamp);
+    }
+  }
+}
+
+TEST(BufferManagerTest, PrefetchCoalescesReads) {
+  {
+    buzzdb::BufferManager buffer_manager{1024, 10};
+    for (uint64_t i = 0; i < 6; ++i) {
+      auto& page = buffer_manager.fix_page(i, true);
+      *reinterpret_cast<uint64_t*>(page.get_data()) = 100 + i;
+      buffer_manager.unfix_page(page, true);
+    }
+  }
+  buzzdb::SimulatedDevice::Profile profile{};
+  profile.queue_depth = 1;
+  buzzdb::SimulatedDevice device{profile};
+  buzzdb::BufferManager buffer_manager{
+      1024, 10, [&](uint16_t segment_id) {
+        return std::make_unique<buzzdb::SimulatedFile>(
+            buzzdb::File::open_file(std::to_string(segment_id).c_str(),
+                                    buzzdb::File::WRITE),
+            device);
+      }};
+  auto& page = buffer_manager.fix_page(3, false);
+  buffer_manager.unfix_page(page, false);
+  ASSERT_EQ(1, device.get_request_count());
+
+  // Pages 1-2 and 4-5 are missing, page 3 is already buffered.
+  buffer_manager.prefetch_pages(1, 5);
+  EXPECT_EQ(3, device.get_request_count());
+  EXPECT_EQ((std::vector<uint64_t>{3, 1, 2, 4, 5}),
+            buffer_manager.get_fifo_list());
+  for (uint64_t i = 1; i < 6; ++i) {
+    auto& page = buffer_manager.fix_page(i, false);
+    EXPECT_EQ(100 + i, *reinterpret_cast<uint64_t*>(page.get_data()));
+    buffer_manager.unfix_page(page, false);
+  }
+  EXPECT_EQ(3, device.get_request_count());
+}
+
+TEST(BufferManagerTest, PrefetchEvictsCleanPages) {
+  {
+    buzzdb::BufferManager buffer_manager{1024, 10};
+    for (uint64_t i = 0; i < 6; ++i) {
+      auto& page = buffer_manager.fix_page(i, true);
+      *reinterpret_cast<uint64_t*>(page.get_data()) = 100 + i;
+      buffer_manager.unfix_page(page, true);
+    }
+  }
+  buzzdb::SimulatedDevice::Profile profile{};
+  profile.queue_depth = 1;
+  buzzdb::SimulatedDevice device{profile};
+  buzzdb::BufferManager buffer_manager{
+      1024, 4, [&](uint16_t segment_id) {
+        return std::make_unique<buzzdb::SimulatedFile>(
+            buzzdb::File::open_file(std::to_string(segment_id).c_str(),
+                                    buzzdb::File::WRITE),
+            device);
+      }};
+  // Page 0 is dirty, pages 1 and 2 are clean.
+  for (uint64_t i = 0; i < 3; ++i) {
+    auto& page = buffer_manager.fix_page(i, false);
+    buffer_manager.unfix_page(page, i == 0);
+  }
+  ASSERT_EQ(3, device.get_request_count());
+
+  // One free frame and the two clean pages make room for the three pages,
+  // which are read with one request.
+  buffer_manager.prefetch_pages(3, 3);
+  EXPECT_EQ(4, device.get_request_count());
+  EXPECT_EQ((std::vector<uint64_t>{0, 3, 4, 5}),
+            buffer_manager.get_fifo_list());
+
+  // Nothing is evicted while a page is fixed.
+  auto& fixed_page = buffer_manager.fix_page(3, false);
+  buffer_manager.prefetch_pages(6, 1);
+  EXPECT_EQ(4, device.get_request_count());
+  EXPECT_EQ((std::vector<uint64_t>{0, 3, 4, 5}),
+            buffer_manager.get_fifo_list());
+  EXPECT_EQ(103, *reinterpret_cast<uint64_t*>(fixed_page.get_data()));
+  buffer_manager.unfix_page(fixed_page, false);
+  for (uint64_t i = 4; i < 6; ++i) {
+    auto& page = buffer_manager.fix_page(i, false);
+    EXPECT_EQ(100 + i, *reinterpret_cast<uint64_t*>(page.get_data()));
+    buffer_manager.unfix_page(page, false);
+  }
+  EXPECT_EQ(4, device.get_request_count());
+}
+
 }  // namespace
 
 int main(int argc, char* argv[]) {
@@ -0,0 +1,114 @@
+#include <gtest/gtest.h>
+#include <cstring>
+#include <memory>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include "storage/file.h"
+#include "storage/segment_space_manager.h"
+
+using File = buzzdb::File;
+using SegmentSpaceManager = buzzdb::SegmentSpaceManager;
+
+namespace {
+
+/// A file on a file system that cannot preallocate. Uses the default
+/// `File::allocate()`.
+class NoAllocateFile : public File {
+ public:
+  explicit NoAllocateFile(std::unique_ptr<File> file) : file(std::move(file)) {}
+
+  Mode get_mode() const override { return file->get_mode(); }
+
+  size_t size() const override { return file->size(); }
+
+  void resize(size_t new_size) override { file->resize(new_size); }
+
+  void read_block(size_t offset, size_t size, char* block) override {
+    file->read_block(offset, size, block);
+  }
+
+  void write_block(const char* block, size_t offset, size_t size) override {
+    file->write_block(block, offset, size);
+  }
+
+ private:
+  std::unique_ptr<File> file;
+};
+
+TEST(SegmentSpaceManagerTest, AllocateGrowsWithZeros) {
+  auto file = File::make_temporary_file();
+  file->resize(4);
+  file->write_block("abcd", 0, 4);
+  file->allocate(0, 4096);
+  ASSERT_EQ(4096, file->size());
+  auto block = file->read_block(0, 4096);
+  EXPECT_EQ(0, std::memcmp(block.get(), "abcd", 4));
+  std::vector<char> zeros(4092, 0);
+  EXPECT_EQ(0, std::memcmp(block.get() + 4, zeros.data(), zeros.size()));
+  // Allocating a range that is already part of the file keeps the size.
+  file->allocate(0, 1024);
+  EXPECT_EQ(4096, file->size());
+}
+
+TEST(SegmentSpaceManagerTest, GrowsAheadOfWrites) {
+  SegmentSpaceManager segments{
+      [](uint16_t /*segment_id*/) { return File::make_temporary_file(); }};
+  EXPECT_EQ(0, segments.get_allocated_size(3));
+
+  segments.prepare_write(3, 1024);
+  segments.wait_idle();
+  EXPECT_EQ(SegmentSpaceManager::kMinExtentSize,
+            segments.get_allocated_size(3));
+  EXPECT_EQ(SegmentSpaceManager::kMinExtentSize, segments.get_file(3).size());
+
+  // Writes well inside the preallocated space do not grow the file.
+  segments.prepare_write(3, SegmentSpaceManager::kMinExtentSize / 4);
+  segments.wait_idle();
+  EXPECT_EQ(SegmentSpaceManager::kMinExtentSize,
+            segments.get_allocated_size(3));
+
+  // Writes close to the end do, and the extent doubles.
+  segments.prepare_write(3, SegmentSpaceManager::kMinExtentSize - 1024);
+  segments.wait_idle();
+  EXPECT_EQ(2 * SegmentSpaceManager::kMinExtentSize,
+            segments.get_allocated_size(3));
+
+  // Other segments are not affected, and holes are not filled.
+  segments.prepare_write(4, SegmentSpaceManager::kMaxGap + 1);
+  segments.wait_idle();
+  EXPECT_EQ(0, segments.get_allocated_size(4));
+}
+
+TEST(SegmentSpaceManagerTest, SkipsFilesThatCannotAllocate) {
+  ASSERT_THROW(NoAllocateFile(File::make_temporary_file()).allocate(0, 4096),
+               std::system_error);
+
+  SegmentSpaceManager segments{[](uint16_t /*segment_id*/) {
+    return std::make_unique<NoAllocateFile>(File::make_temporary_file());
+  }};
+  // A write that outruns the requested growth must survive the failed
+  // preallocation.
+  constexpr size_t kOffset = 2 * SegmentSpaceManager::kMinExtentSize;
+  segments.prepare_write(3, 1024);
+  segments.get_file(3).write_block("abcd", kOffset, 4);
+  segments.wait_idle();
+  EXPECT_EQ(0, segments.get_allocated_size(3));
+  auto block = segments.get_file(3).read_block(kOffset, 4);
+  EXPECT_EQ(0, std::memcmp(block.get(), "abcd", 4));
+
+  // The segment is not grown again.
+  segments.prepare_write(3, kOffset + 4);
+  segments.wait_idle();
+  EXPECT_EQ(0, segments.get_allocated_size(3));
+  block = segments.get_file(3).read_block(kOffset, 4);
+  EXPECT_EQ(0, std::memcmp(block.get(), "abcd", 4));
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,85 @@
+#include <gtest/gtest.h>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "storage/simulated_file.h"
+#include "storage/test_file.h"
+
+using SimulatedDevice = buzzdb::SimulatedDevice;
+using SimulatedFile = buzzdb::SimulatedFile;
+using TestFile = buzzdb::TestFile;
+
+namespace {
+
+SimulatedDevice::Profile fixed_latency(std::chrono::nanoseconds latency,
+                                       size_t queue_depth) {
+  SimulatedDevice::Profile profile{};
+  profile.read_latency = latency;
+  profile.write_latency = latency;
+  profile.queue_depth = queue_depth;
+  return profile;
+}
+
+TEST(SimulatedFileTest, PassesThroughData) {
+  SimulatedDevice device{SimulatedDevice::ssd()};
+  SimulatedFile file{std::make_unique<TestFile>(), device};
+  file.resize(16);
+  file.write_block("0123456789abcdef", 0, 16);
+  char block[8];
+  file.read_block(4, 8, block);
+  EXPECT_EQ(std::string("456789ab"), std::string(block, 8));
+  EXPECT_EQ(16, file.size());
+  EXPECT_EQ(2, device.get_request_count());
+}
+
+TEST(SimulatedFileTest, QueueDepthSerializesRequests) {
+  auto latency = std::chrono::milliseconds(5);
+  SimulatedDevice device{fixed_latency(latency, 1)};
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < 4; ++i) {
+    threads.emplace_back([&device] {
+      SimulatedFile file{std::make_unique<TestFile>(), device};
+      file.resize(8);
+      char block[8];
+      file.read_block(0, 8, block);
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  EXPECT_GE(std::chrono::steady_clock::now() - start, 4 * latency);
+}
+
+TEST(SimulatedFileTest, DefaultProfileIsUnlimited) {
+  SimulatedDevice device{SimulatedDevice::Profile{}};
+  SimulatedFile file{std::make_unique<TestFile>(), device};
+  file.resize(8);
+  char block[8];
+  file.read_block(0, 8, block);
+  EXPECT_EQ(1, device.get_request_count());
+}
+
+TEST(SimulatedFileTest, BandwidthLimit) {
+  auto profile = fixed_latency(std::chrono::nanoseconds(0), 1);
+  // 1 MB/s, so 10 KB take 10ms.
+  profile.bandwidth = 1000 * 1000;
+  SimulatedDevice device{profile};
+  SimulatedFile file{std::make_unique<TestFile>(), device};
+  std::vector<char> block(10 * 1000);
+  file.resize(block.size());
+  auto start = std::chrono::steady_clock::now();
+  file.write_block(block.data(), 0, block.size());
+  EXPECT_GE(std::chrono::steady_clock::now() - start,
+            std::chrono::milliseconds(10));
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}